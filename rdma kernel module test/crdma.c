@@ -8,16 +8,46 @@
 #include <linux/inet.h>
 #include <linux/wait.h>
 #include <linux/string.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/mutex.h>
+#include <linux/miscdevice.h>
+#include <linux/completion.h>
+#include <linux/scatterlist.h>
+#include <linux/version.h>
 //#include <linux/jiffies.h>
+#include <net/net_namespace.h>
 
 #include <rdma/ib_verbs.h>
 #include <rdma/rdma_cm.h>
 
+#include "crdma.h"
+
 MODULE_AUTHOR("Austin Pohlmann");
 MODULE_LICENSE("GPL v2");
 
 static int mode = -1;
 module_param(mode, int, S_IRUGO);
+static char *ip = "192.168.13.1";
+module_param(ip, charp, S_IRUGO);
+static int port = 1234;
+module_param(port, int, S_IRUGO);
+static int pool_size = 32;
+module_param(pool_size, int, S_IRUGO);
+static int poll_budget = 64;
+module_param(poll_budget, int, S_IRUGO);
+
+#define CRDMA_POLL_BATCH 16
+#define CRDMA_CQ_DEPTH 16
+#define CRDMA_TABLE_SIZE 4096
+#define CRDMA_RECVS 8
+#define CRDMA_RECV_SIZE 4096
+#define CRDMA_IO_WRID 0xc0ffee
+// The opcode a v2 client sends to leave (DISCONNECT in rdma_cs.h)
+#define CRDMA_V2_DISCONNECT 1
 
 const char* cma_event[] = {
 	"RDMA_CM_EVENT_ADDR_RESOLVED",
@@ -57,6 +87,38 @@ enum crdma_state {
 	ERROR
 };
 
+/*
+ * A pre-allocated fast-reg MR and what it is registered from: a page list
+ * before 4.4, a scatterlist with an entry per page for ib_map_mr_sg()
+ * since. Once registered,
+ * it stays valid until the next registration, which invalidates it in the
+ * same post.
+ */
+struct crdma_frwr {
+	struct ib_mr *mr;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	struct scatterlist *sgl;
+	struct ib_reg_wr reg_wr;
+#else
+	struct ib_fast_reg_page_list *frpl;
+	struct ib_send_wr reg_wr;
+#endif
+	struct ib_send_wr inv_wr;
+	struct list_head list;
+	u8 key;
+	u8 valid;
+};
+
+struct crdma_pool {
+	struct crdma_frwr *frwrs;
+	struct list_head free;
+	spinlock_t lock;
+	unsigned int size;
+	unsigned int max_pages;
+	unsigned long regs;
+	unsigned long invs;
+};
+
 struct crdma_cb {
 	u8 addr[4];
 	uint16_t port;
@@ -65,20 +127,51 @@ struct crdma_cb {
 	struct ib_pd *pd;
 	struct ib_qp *qp;
 	struct ib_mr *mr;
-	struct ib_mr *frmr;
-	struct ib_fast_reg_page_list *frpl;
 	struct ib_send_wr send_wr;
 	struct ib_send_wr fast_wr;
-	struct ib_recv_wr recv_wr;
+	struct ib_recv_wr recv_wr[CRDMA_RECVS];
+	struct ib_sge recv_sge[CRDMA_RECVS];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	const struct ib_send_wr *bad_send;
+	const struct ib_recv_wr *bad_recv;
+#else
 	struct ib_send_wr *bad_send;
 	struct ib_recv_wr *bad_recv;
-	struct ib_sge test_sge[2];	// 0 is recieve, 1 is send
-	void *buffs[3];				// 0 is recieve, 1 is send, 2 is the fast reg region
+#endif
+	struct ib_sge test_sge[2];	// 0 is the receive slots, 1 is send
+	void *buffs[3];				// 0 is the receive slots, 1 is send, 2 is the fast reg region
 	u64 dma[3];
 	//unsigned long times[2];
 	uint32_t remote_rkey;
 	uint64_t remote_addr;
-	uint32_t remote_len;
+	uint64_t remote_len;
+	struct crdma_pool pool;
+	struct workqueue_struct *wq;
+	struct work_struct cq_work;
+	unsigned long completions;
+	unsigned long cq_runs;
+	unsigned long cq_rearms;
+	ktime_t cq_start;
+	struct dentry *debug_dir;
+	struct mutex bench_lock;
+	char *table;
+	size_t table_len;
+	struct mutex io_lock;
+	struct completion io_done;
+	int io_status;
+	struct crdma_frwr *io_frwr;
+	void *io_buf;
+	u64 io_dma;
+	unsigned long ios;
+	unsigned long batches;
+	u8 connected;
+	spinlock_t recv_lock;
+	u8 want_imm;
+	u32 want_data;
+	u32 want_len;
+	u8 ready[CRDMA_RECVS];
+	unsigned int ready_head;
+	unsigned int ready_count;
 	wait_queue_head_t wqueue;
 };
 
@@ -139,74 +232,196 @@ static int crdma_cma_event_handler(struct rdma_cm_id *cma_id, struct rdma_cm_eve
 	return 0;
 }
 
-static void crdma_cq_event_handler(struct ib_cq *cq, void *ctx) {
-	struct crdma_cb *cb = ctx;
-	struct ib_wc wc;
-	struct ib_recv_wr *bad_wr;
+static int crdma_post_recv(struct crdma_cb *cb, unsigned int slot) {
+	int ret = ib_post_recv(cb->qp, &cb->recv_wr[slot], &cb->bad_recv);
+	if (ret)
+		pr_err("Post recv error: %d\n", ret);
+	return ret;
+}
+
+/*
+ * Set what the next replies look like: a send with or without immediate
+ * data, of exactly len bytes. Replies already queued for the last
+ * expectation are dropped.
+ */
+static void crdma_expect(struct crdma_cb *cb, u8 imm, u32 data, u32 len) {
+	unsigned int slot;
+	spin_lock_bh(&cb->recv_lock);
+	cb->want_imm = imm;
+	cb->want_data = data;
+	cb->want_len = len;
+	while (cb->ready_count) {
+		slot = cb->ready[cb->ready_head];
+		cb->ready_head = (cb->ready_head + 1) % CRDMA_RECVS;
+		cb->ready_count--;
+		crdma_post_recv(cb, slot);
+	}
+	spin_unlock_bh(&cb->recv_lock);
+}
+
+/*
+ * Wait for the oldest reply crdma_expect() asked for and copy up to size
+ * bytes of it to dest, then give its slot back to the receive queue.
+ * Returns the reply's length, or a negative errno if the wait was cut short.
+ */
+static int crdma_reply(struct crdma_cb *cb, void *dest, size_t size, long timeout) {
+	unsigned int slot;
+	long left;
 	int ret;
-	ib_req_notify_cq(cb->cq, IB_CQ_NEXT_COMP);
-	while ((ret = ib_poll_cq(cb->cq, 1, &wc)) == 1) {
-		if (wc.status) {
-			if (wc.status == IB_WC_WR_FLUSH_ERR) {
-				pr_info("cq flushed\n");
-				continue;
-			} else {
-				pr_err("cq completion failed with "
-				       "wr_id %Lx status %d opcode %d vender_err %x\n",
-					wc.wr_id, wc.status, wc.opcode, wc.vendor_err);
-				goto error;
-			}
+	left = wait_event_interruptible_timeout(cb->wqueue, cb->ready_count || state >= DISCONNECT, timeout);
+	if (left < 0)
+		return left;
+	spin_lock_bh(&cb->recv_lock);
+	if (!cb->ready_count) {
+		spin_unlock_bh(&cb->recv_lock);
+		return left ? -ENOTCONN : -ETIMEDOUT;
+	}
+	slot = cb->ready[cb->ready_head];
+	cb->ready_head = (cb->ready_head + 1) % CRDMA_RECVS;
+	cb->ready_count--;
+	memcpy(dest, cb->buffs[0] + slot * CRDMA_RECV_SIZE, min_t(size_t, size, cb->want_len));
+	ret = crdma_post_recv(cb, slot) ? -EIO : cb->want_len;
+	spin_unlock_bh(&cb->recv_lock);
+	return ret;
+}
+
+static int crdma_post_recvs(struct crdma_cb *cb) {
+	int i;
+	for (i = 0; i < CRDMA_RECVS; i++)
+		if (crdma_post_recv(cb, i))
+			return -EIO;
+	return 0;
+}
+
+/*
+ * A receive that looks like the expected reply stays in its slot until
+ * crdma_reply() takes it. Anything else (the ADD_CLIENT updates and other
+ * messages a v2 server sends on its own) is posted again right away.
+ */
+static int crdma_handle_recv(struct crdma_cb *cb, struct ib_wc *wc) {
+	unsigned int slot = wc->wr_id;
+	u8 imm = !!(wc->wc_flags & IB_WC_WITH_IMM);
+	int ret = 0;
+	spin_lock_bh(&cb->recv_lock);
+	if (imm == cb->want_imm && wc->byte_len == cb->want_len &&
+	    (!imm || be32_to_cpu(wc->ex.imm_data) == cb->want_data)) {
+		cb->ready[(cb->ready_head + cb->ready_count) % CRDMA_RECVS] = slot;
+		cb->ready_count++;
+		wake_up_interruptible(&cb->wqueue);
+	} else {
+		ret = crdma_post_recv(cb, slot);
+	}
+	spin_unlock_bh(&cb->recv_lock);
+	return ret;
+}
+
+static int crdma_handle_wc(struct crdma_cb *cb, struct ib_wc *wc) {
+	// Only the last operation of a batch is signaled
+	if (wc->wr_id == CRDMA_IO_WRID) {
+		cb->io_status = wc->status;
+		complete(&cb->io_done);
+		return 0;
+	}
+	if (wc->status) {
+		if (wc->status == IB_WC_WR_FLUSH_ERR) {
+			pr_info("cq flushed\n");
+			return 0;
 		}
+		pr_err("cq completion failed with "
+		       "wr_id %Lx status %d opcode %d vender_err %x\n",
+			wc->wr_id, wc->status, wc->opcode, wc->vendor_err);
+		return -EIO;
+	}
 
-		switch (wc.opcode) {
-		case IB_WC_SEND:
-			pr_info("Send completion\n");
-			//state = RDMA_SEND_COMPLETE;
-			//wake_up_interruptible(&cb->wqueue);
-			break;
+	switch (wc->opcode) {
+	case IB_WC_SEND:
+		pr_debug("Send completion\n");
+		//state = RDMA_SEND_COMPLETE;
+		//wake_up_interruptible(&cb->wqueue);
+		break;
 
-		case IB_WC_RDMA_WRITE:
-			pr_info("Rdma write completion\n");
-			state = RDMA_WRITE_COMPLETE;
-			wake_up_interruptible(&cb->wqueue);
-			break;
+	case IB_WC_RDMA_WRITE:
+		pr_debug("Rdma write completion\n");
+		state = RDMA_WRITE_COMPLETE;
+		wake_up_interruptible(&cb->wqueue);
+		break;
 
-		case IB_WC_RDMA_READ:
-			pr_info("Rdma read completion\n");
-			state = RDMA_READ_COMPLETE;
-			wake_up_interruptible(&cb->wqueue);
-			break;
+	case IB_WC_RDMA_READ:
+		pr_debug("Rdma read completion\n");
+		state = RDMA_READ_COMPLETE;
+		wake_up_interruptible(&cb->wqueue);
+		break;
 
-		case IB_WC_RECV:
-			pr_info("Recv completion\n");
-			state = RDMA_RECV_COMPLETE;
-			ret = ib_post_recv(cb->qp, &cb->recv_wr, &bad_wr);
-			if (ret) {
-				pr_err("Post recv error: %d\n",
-				       ret);
-				goto error;
-			}
-			wake_up_interruptible(&cb->wqueue);
-			break;
-		case IB_WC_FAST_REG_MR:
-			pr_info("Fast reg mr complete\n");
-			state = FRMR_COMPLETE;
-			wake_up_interruptible(&cb->wqueue);
-			break;
-		default:
-			pr_err("%s:%d Unexpected opcode %d, Shutting down\n",
-			       __func__, __LINE__, wc.opcode);
+	case IB_WC_RECV:
+		pr_debug("Recv completion\n");
+		return crdma_handle_recv(cb, wc);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	case IB_WC_REG_MR:
+#else
+	case IB_WC_FAST_REG_MR:
+#endif
+		pr_debug("Fast reg mr complete\n");
+		state = FRMR_COMPLETE;
+		wake_up_interruptible(&cb->wqueue);
+		break;
+	default:
+		pr_err("%s:%d Unexpected opcode %d, Shutting down\n",
+		       __func__, __LINE__, wc->opcode);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Runs in process context. Pulls completions in batches until the CQ is
+ * empty or the budget is used up; in the latter case the work requeues
+ * itself so other work gets the CPU in between. Otherwise notification is
+ * re-armed, after a failed completion too, and a completion that raced
+ * with re-arming is picked up by polling again.
+ */
+static void crdma_cq_work(struct work_struct *work) {
+	struct crdma_cb *cb = container_of(work, struct crdma_cb, cq_work);
+	struct ib_wc wc[CRDMA_POLL_BATCH];
+	int budget = poll_budget, ret, i;
+	cb->cq_runs++;
+	while (budget > 0) {
+		ret = ib_poll_cq(cb->cq, min(budget, CRDMA_POLL_BATCH), wc);
+		if (ret < 0) {
+			pr_err("poll error %d\n", ret);
 			goto error;
 		}
+		for (i = 0; i < ret; i++)
+			if (crdma_handle_wc(cb, &wc[i]))
+				goto error;
+		cb->completions += ret;
+		budget -= ret;
+		if (ret < CRDMA_POLL_BATCH)
+			break;
 	}
-	if (ret) {
-		pr_err("poll error %d\n", ret);
-		goto error;
+	if (budget <= 0) {
+		queue_work(cb->wq, &cb->cq_work);
+		return;
 	}
-	return;
-	error:
+	goto rearm;
+error:
 	state = ERROR;
 	wake_up_interruptible(&cb->wqueue);
+rearm:
+	cb->cq_rearms++;
+	if (ib_req_notify_cq(cb->cq, IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS) > 0)
+		queue_work(cb->wq, &cb->cq_work);
+}
+
+static void crdma_cq_event_handler(struct ib_cq *cq, void *ctx) {
+	struct crdma_cb *cb = ctx;
+	queue_work(cb->wq, &cb->cq_work);
+}
+
+static void crdma_cq_stats(struct crdma_cb *cb) {
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), cb->cq_start));
+	pr_info("CQ: %lu completions in %lu runs (%lu re-arms), %lld completions/s\n",
+		cb->completions, cb->cq_runs, cb->cq_rearms,
+		us > 0 ? (long long)cb->completions * 1000000 / us : 0);
 }
 
 static int crdma_connect(struct crdma_cb *cb){
@@ -217,6 +432,7 @@ static int crdma_connect(struct crdma_cb *cb){
 	conn_param.responder_resources = 5;
 	conn_param.initiator_depth = 5;
 	conn_param.retry_count = 10;
+	conn_param.rnr_retry_count = 7;
 
 	ret = rdma_connect(cb->cmid, &conn_param);
 	if (ret) {
@@ -262,14 +478,17 @@ static int crdma_create_qp(struct crdma_cb *cb) {
 	int ret;
 	memset(&init_attr, 0, sizeof(init_attr));
 	init_attr.cap.max_send_wr = 8;
-	init_attr.cap.max_recv_wr = 2;
+	init_attr.cap.max_recv_wr = CRDMA_RECVS;
 	init_attr.cap.max_recv_sge = 2;
 	init_attr.cap.max_send_sge = 2;
 	init_attr.qp_type = IB_QPT_RC;
 	init_attr.send_cq = cb->cq;
 	init_attr.recv_cq = cb->cq;
 	init_attr.sq_sig_type = IB_SIGNAL_REQ_WR;
-	if (!mode) {
+	if (mode == 2) {
+		cb->qp = ib_create_qp(cb->pd, &init_attr);
+		ret = IS_ERR(cb->qp) ? PTR_ERR(cb->qp) : 0;
+	} else if (!mode) {
 		ret = rdma_create_qp(cb->child, cb->pd, &init_attr);
 		if (!ret)
 			cb->qp = cb->child->qp;
@@ -283,21 +502,34 @@ static int crdma_create_qp(struct crdma_cb *cb) {
 
 static void crdma_free_qp(struct crdma_cb *cb) {
 	ib_destroy_qp(cb->qp);
+	cancel_work_sync(&cb->cq_work);
+	crdma_cq_stats(cb);
 	ib_destroy_cq(cb->cq);
 	ib_dealloc_pd(cb->pd);
 }
 
 static int crdma_make_qp(struct crdma_cb *cb, struct rdma_cm_id *cmid) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+	struct ib_cq_init_attr cq_attr = { .cqe = CRDMA_CQ_DEPTH };
+#endif
 	int ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+	cb->pd = ib_alloc_pd(cmid->device, 0);
+#else
 	cb->pd = ib_alloc_pd(cmid->device);
+#endif
 	if (IS_ERR(cb->pd)) {
 		pr_err( "Failed to allocate pd!!!\n");
 		return PTR_ERR(cb->pd);
 	}
 	pr_info("Created pd %p\n", cb->pd);
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+	cb->cq = ib_create_cq(cmid->device, crdma_cq_event_handler, NULL, cb, &cq_attr);
+#else
 	cb->cq = ib_create_cq(cmid->device, crdma_cq_event_handler, NULL,
-	                      cb, 4, 0);
+	                      cb, CRDMA_CQ_DEPTH, 0);
+#endif
 	if (IS_ERR(cb->cq)) {
 		pr_err( "Failed to create cq!!!\n");
 		ret = PTR_ERR(cb->cq);
@@ -309,6 +541,8 @@ static int crdma_make_qp(struct crdma_cb *cb, struct rdma_cm_id *cmid) {
 		goto err2;
 	}
 	pr_info("Created cq %p\n", cb->cq);
+	cb->completions = cb->cq_runs = cb->cq_rearms = 0;
+	cb->cq_start = ktime_get();
 	ret = crdma_create_qp(cb);
 	if (ret) {
 		pr_err( "crdma_create_qp failed: %d\n", ret);
@@ -327,10 +561,10 @@ static int crdma_bind(struct crdma_cb *cb) {
 	int ret = 0;
 	struct sockaddr_in * sock = kzalloc(sizeof(*sock), GFP_KERNEL);
 	sock->sin_family = AF_INET;
-	sock->sin_port = 1234;
+	sock->sin_port = htons(port);
 	memcpy((void *)&sock->sin_addr.s_addr, cb->addr, 4);
 	pr_info("Socket successfully created!!!\n");
-	if (mode) {
+	if (mode == 1 || mode == 3) {
 		if ((ret = rdma_resolve_addr(cb->cmid, NULL, (struct sockaddr *)sock, 2000))) {
 			pr_err( "Failed to resolve address!!!\n");
 			goto done;
@@ -352,22 +586,223 @@ done:
 	return ret;
 }
 
+static void crdma_pool_destroy(struct crdma_cb *cb) {
+	struct crdma_pool *pool = &cb->pool;
+	int i;
+	for (i = 0; i < pool->size; i++) {
+		if (pool->frwrs[i].mr)
+			ib_dereg_mr(pool->frwrs[i].mr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+		kfree(pool->frwrs[i].sgl);
+#else
+		if (pool->frwrs[i].frpl)
+			ib_free_fast_reg_page_list(pool->frwrs[i].frpl);
+#endif
+	}
+	kfree(pool->frwrs);
+	pool->frwrs = NULL;
+	pool->size = 0;
+}
+
+static int crdma_pool_init(struct crdma_cb *cb, int size) {
+	struct crdma_pool *pool = &cb->pool;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,5,0)
+	struct ib_device_attr attr;
+#endif
+	struct crdma_frwr *f;
+	int ret, i;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+	pool->max_pages = cb->pd->device->attrs.max_fast_reg_page_list_len;
+#else
+	ret = ib_query_device(cb->pd->device, &attr);
+	if (ret) {
+		pr_err("Failed to query the device!!!\n");
+		return ret;
+	}
+	pool->max_pages = attr.max_fast_reg_page_list_len;
+#endif
+	if (size < 1 || !pool->max_pages) {
+		pr_err("No fast reg support or bad pool size %d\n", size);
+		return -EINVAL;
+	}
+	INIT_LIST_HEAD(&pool->free);
+	spin_lock_init(&pool->lock);
+	pool->regs = pool->invs = 0;
+	pool->frwrs = kcalloc(size, sizeof(*pool->frwrs), GFP_KERNEL);
+	if (!pool->frwrs)
+		return -ENOMEM;
+	pool->size = size;
+	for (i = 0; i < size; i++) {
+		f = &pool->frwrs[i];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+		f->sgl = kcalloc(pool->max_pages, sizeof(*f->sgl), GFP_KERNEL);
+		if (!f->sgl) {
+			ret = -ENOMEM;
+			goto error;
+		}
+		f->mr = ib_alloc_mr(cb->pd, IB_MR_TYPE_MEM_REG, pool->max_pages);
+#else
+		f->frpl = ib_alloc_fast_reg_page_list(cb->pd->device, pool->max_pages);
+		if (IS_ERR(f->frpl)) {
+			pr_err("Failed to allocate the page list!!!\n");
+			ret = PTR_ERR(f->frpl);
+			f->frpl = NULL;
+			goto error;
+		}
+		f->mr = ib_alloc_fast_reg_mr(cb->pd, pool->max_pages);
+#endif
+		if (IS_ERR(f->mr)) {
+			pr_err("fast_reg_mr failed\n");
+			ret = PTR_ERR(f->mr);
+			f->mr = NULL;
+			goto error;
+		}
+		f->key = f->mr->rkey & 0xff;
+		list_add_tail(&f->list, &pool->free);
+	}
+	pr_info("FRWR pool: %d MRs of up to %u pages\n", size, pool->max_pages);
+	return 0;
+error:
+	crdma_pool_destroy(cb);
+	return ret;
+}
+
+static struct crdma_frwr *crdma_frwr_get(struct crdma_pool *pool) {
+	struct crdma_frwr *f = NULL;
+	unsigned long flags;
+	spin_lock_irqsave(&pool->lock, flags);
+	if (!list_empty(&pool->free)) {
+		f = list_first_entry(&pool->free, struct crdma_frwr, list);
+		list_del(&f->list);
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+	return f;
+}
+
+/*
+ * The registration stays valid until the MR is registered again, so a
+ * peer holding the rkey keeps access until then.
+ */
+static void crdma_frwr_put(struct crdma_pool *pool, struct crdma_frwr *f) {
+	unsigned long flags;
+	spin_lock_irqsave(&pool->lock, flags);
+	list_add_tail(&f->list, &pool->free);
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+/*
+ * Register a page list on a pooled MR. If the MR still holds an earlier
+ * registration, a local invalidate is chained in front of the fast reg, so
+ * reusing the MR costs one post and only the fast reg is signaled. The key
+ * is bumped every time, so the old rkey stops working.
+ *
+ * Since 4.4 there are no page lists: every page goes in as a scatterlist
+ * entry of 1 << page_shift bytes, the first one starting at iova and the
+ * last one cut short at length, and ib_map_mr_sg() has to take all of them.
+ */
+static int crdma_frwr_post(struct crdma_cb *cb, struct crdma_frwr *f, u64 *pages,
+			   int npages, u64 iova, u32 length, int access, int page_shift) {
+	struct ib_send_wr *first;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	u64 start, end = iova + length;
+#endif
+	int i;
+	if (npages > cb->pool.max_pages) {
+		pr_err("Page list of %d is longer than %u\n", npages, cb->pool.max_pages);
+		return -EINVAL;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	sg_init_table(f->sgl, npages);
+	for (i = 0; i < npages; i++) {
+		start = i ? pages[i] : iova;
+		sg_dma_address(&f->sgl[i]) = start;
+		sg_dma_len(&f->sgl[i]) = min(pages[i] + (1ull << page_shift), end) - start;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+	i = ib_map_mr_sg(f->mr, f->sgl, npages, NULL, 1u << page_shift);
+#else
+	i = ib_map_mr_sg(f->mr, f->sgl, npages, 1u << page_shift);
+#endif
+	if (i != npages) {
+		pr_err("Mapped %d of %d pages of %u bytes\n", i, npages, 1u << page_shift);
+		return i < 0 ? i : -EINVAL;
+	}
+	first = &f->reg_wr.wr;
+#else
+	for (i = 0; i < npages; i++)
+		f->frpl->page_list[i] = pages[i];
+	first = &f->reg_wr;
+#endif
+	if (f->valid) {
+		memset(&f->inv_wr, 0, sizeof(f->inv_wr));
+		f->inv_wr.opcode = IB_WR_LOCAL_INV;
+		f->inv_wr.ex.invalidate_rkey = f->mr->rkey;
+		f->inv_wr.next = first;
+		first = &f->inv_wr;
+		cb->pool.invs++;
+	}
+	ib_update_fast_reg_key(f->mr, ++f->key);
+	memset(&f->reg_wr, 0, sizeof(f->reg_wr));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	f->reg_wr.wr.wr_id = (u64)(unsigned long)f;
+	f->reg_wr.wr.opcode = IB_WR_REG_MR;
+	f->reg_wr.wr.send_flags = IB_SEND_SIGNALED;
+	f->reg_wr.mr = f->mr;
+	f->reg_wr.key = f->mr->rkey;
+	f->reg_wr.access = access;
+#else
+	f->reg_wr.wr_id = (u64)(unsigned long)f;
+	f->reg_wr.opcode = IB_WR_FAST_REG_MR;
+	f->reg_wr.send_flags = IB_SEND_SIGNALED;
+	f->reg_wr.wr.fast_reg.access_flags = access;
+	f->reg_wr.wr.fast_reg.page_list = f->frpl;
+	f->reg_wr.wr.fast_reg.rkey = f->mr->rkey;
+	f->reg_wr.wr.fast_reg.page_shift = page_shift;
+	f->reg_wr.wr.fast_reg.page_list_len = npages;
+	f->reg_wr.wr.fast_reg.iova_start = iova;
+	f->reg_wr.wr.fast_reg.length = length;
+#endif
+	f->valid = 1;
+	cb->pool.regs++;
+	return ib_post_send(cb->qp, first, &cb->bad_send);
+}
+
+static int crdma_frwr_map(struct crdma_cb *cb, struct crdma_frwr *f, u64 *pages,
+			  int npages, u64 iova, u32 length, int access, int page_shift) {
+	state = WAITING;
+	if (crdma_frwr_post(cb, f, pages, npages, iova, length, access, page_shift)) {
+		pr_err("Failed to post work request to send queue!!!\n");
+		return -EIO;
+	}
+	if (wait_event_interruptible(cb->wqueue, state >= FRMR_COMPLETE)) {
+		pr_info("Interrupted\n");
+		return -EINTR;
+	}
+	return state >= DISCONNECT ? -EIO : 0;
+}
+
+/*
+ * The lkey for plain DMA addresses. Since 4.9 there is no DMA MR, only the
+ * PD's local key, and nothing remote can reach a DMA address without a
+ * fast-reg MR.
+ */
+static u32 crdma_dma_lkey(struct crdma_cb *cb) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+	return cb->pd->local_dma_lkey;
+#else
+	return cb->mr->lkey;
+#endif
+}
+
 static int crdma_fr(struct crdma_cb *cb){
 	int ret=0,i;
-	cb->frpl = ib_alloc_fast_reg_page_list(cb->pd->device, 8);
-	pr_info("Page list: %p\nMax page list length: %u\n", cb->frpl, cb->frpl->max_page_list_len);
-	if(IS_ERR(cb->frpl)){
-		pr_err("Failed to allocate the page list!!!\n");
-		return PTR_ERR(cb->frpl);
-	}
-	cb->frmr = ib_alloc_fast_reg_mr(cb->pd, 
-					cb->frpl->max_page_list_len);
-	if (IS_ERR(cb->frmr)) {
-		pr_err("fast_reg_mr failed\n");
-		ret = PTR_ERR(cb->frmr);
-		goto error0;
-	}
-	pr_info("Fast_reg rkey: %lu\n", (long unsigned)cb->frmr->rkey);
+	struct crdma_frwr *f;
+	u64 pages[8];
+	ret = crdma_pool_init(cb, pool_size);
+	if (ret)
+		return ret;
+	f = crdma_frwr_get(&cb->pool);
+	pr_info("Fast_reg rkey: %lu\n", (long unsigned)f->mr->rkey);
 	cb->buffs[2] = kmalloc(8*4096, GFP_KERNEL);
 	cb->dma[2] = ib_dma_map_single(cb->pd->device, cb->buffs[2], 8*4096, DMA_BIDIRECTIONAL);
 	if(ib_dma_mapping_error(cb->pd->device, cb->dma[2])){
@@ -375,49 +810,26 @@ static int crdma_fr(struct crdma_cb *cb){
 		ret = 1;
 		goto error1;
 	}
-	for(i=0; i<7; i++){
-		cb->frpl->page_list[i] = (cb->dma[2] + i*4096) & PAGE_MASK;
+	for(i=0; i<8; i++){
+		pages[i] = (cb->dma[2] + i*4096) & PAGE_MASK;
 	}
 	pr_info("Page mask: %llx\n", PAGE_MASK);
-	cb->send_wr.opcode = IB_WR_FAST_REG_MR;
-	cb->send_wr.num_sge = 0;
-	cb->send_wr.sg_list =NULL;
-	cb->send_wr.next = NULL;
-	cb->send_wr.send_flags = IB_SEND_SIGNALED;
-	cb->send_wr.wr.fast_reg.access_flags = 
-		IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_READ | IB_ACCESS_REMOTE_WRITE;
-	cb->send_wr.wr.fast_reg.page_list = cb->frpl;
-	cb->send_wr.wr.fast_reg.rkey = cb->frmr->rkey;
-	cb->send_wr.wr.fast_reg.page_shift = PAGE_SHIFT;
-	cb->send_wr.wr.fast_reg.page_list_len = 8;
-	cb->send_wr.wr.fast_reg.iova_start=cb->dma[2];
-	cb->send_wr.wr.fast_reg.length = 8*4096;
-	//cb->times[0] = jiffies;
-	state = WAITING;
-	if(ib_post_send(cb->qp, &cb->send_wr, &cb->bad_send)){
-		pr_err("Failed to post work request to send queue!!!\n");
-		goto error2;
+	// The second registration goes through the invalidate-and-reuse path
+	for(i=0; i<2; i++){
+		ret = crdma_frwr_map(cb, f, pages, 8, cb->dma[2], 8*4096,
+			IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_READ | IB_ACCESS_REMOTE_WRITE, PAGE_SHIFT);
+		if(ret)
+			goto error2;
 	}
-	if(wait_event_interruptible(cb->wqueue, state >=FRMR_COMPLETE)){
-		pr_info("Interrupted\n");
-	}
-	pr_info("State after wakikng: %u\n", state);
-	if(state >= DISCONNECT)
-		goto error2;
-	cb->dma[0] = cb->test_sge[0].addr;
+	pr_info("State after wakikng: %u\nRegistrations: %lu, invalidates: %lu\n",
+		state, cb->pool.regs, cb->pool.invs);
 	cb->dma[1] = cb->test_sge[1].addr;
 	state = WAITING;
-	cb->test_sge[0].lkey = cb->frmr->lkey;
-	cb->test_sge[1].lkey = cb->frmr->lkey;
-	cb->test_sge[0].addr = cb->dma[2];
+	cb->test_sge[1].lkey = f->mr->lkey;
 	cb->test_sge[1].addr = cb->dma[2] + 4096;
-	cb->test_sge[0].length = 4*1024;
 	cb->test_sge[1].length = 4*1024;
-	cb->recv_wr.next = NULL;
-	cb->recv_wr.num_sge = 1;
-	cb->recv_wr.sg_list = cb->test_sge;
 	memcpy(cb->buffs[2] + 4096, &cb->dma[2], sizeof(cb->dma[2]));
-	memcpy(cb->buffs[2] + 4096+sizeof(cb->dma[2]), &cb->frmr->rkey, sizeof(cb->frmr->rkey));
+	memcpy(cb->buffs[2] + 4096+sizeof(cb->dma[2]), &f->mr->rkey, sizeof(f->mr->rkey));
 	pr_info("Address: %llx\n",(long long unsigned)cb->dma[2]);
 	cb->send_wr.next = NULL;
 	cb->send_wr.sg_list = &cb->test_sge[1];
@@ -432,26 +844,26 @@ static int crdma_fr(struct crdma_cb *cb){
 		pr_info("Interrupted\n");
 	}
 	//return 0;
-	cb->test_sge[0].addr = cb->dma[0];
 	cb->test_sge[1].addr = cb->dma[1];
+	cb->test_sge[1].lkey = crdma_dma_lkey(cb);
 error2:
 	ib_dma_unmap_single(cb->pd->device, cb->dma[2], 8*4*1024, DMA_BIDIRECTIONAL);
 error1:
-	ib_dereg_mr(cb->frmr);
-error0:
-	ib_free_fast_reg_page_list(cb->frpl);
+	kfree(cb->buffs[2]);
+	crdma_frwr_put(&cb->pool, f);
+	crdma_pool_destroy(cb);
 
 	return ret;
 
 }
 static int crdma_mr(struct crdma_cb *cb){
-	int ret = 0;
-	cb->buffs[0] = kmalloc(4*1024, GFP_KERNEL);	
+	int ret = 0, i;
+	cb->buffs[0] = kmalloc(CRDMA_RECVS*CRDMA_RECV_SIZE, GFP_KERNEL);
 	cb->buffs[1] = kmalloc(4*1024, GFP_KERNEL);
 
 	cb->test_sge[0].addr = 
-		ib_dma_map_single(cb->pd->device, cb->buffs[0], 4*1024, DMA_BIDIRECTIONAL);
-	cb->test_sge[0].length = 4*1024;
+		ib_dma_map_single(cb->pd->device, cb->buffs[0], CRDMA_RECVS*CRDMA_RECV_SIZE, DMA_BIDIRECTIONAL);
+	cb->test_sge[0].length = CRDMA_RECVS*CRDMA_RECV_SIZE;
 
 	cb->test_sge[1].addr = 
 		ib_dma_map_single(cb->pd->device, cb->buffs[1], 4*1024, DMA_BIDIRECTIONAL);
@@ -467,6 +879,9 @@ static int crdma_mr(struct crdma_cb *cb){
 		ret = 1;
 		goto error1;
 	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+	cb->mr = NULL;
+#else
 	cb->mr = ib_get_dma_mr(cb->pd, 
 		IB_ACCESS_LOCAL_WRITE|IB_ACCESS_REMOTE_READ|IB_ACCESS_REMOTE_WRITE);
 	if (IS_ERR(cb->mr)) {
@@ -475,11 +890,20 @@ static int crdma_mr(struct crdma_cb *cb){
 		goto error1;
 	}
 	pr_info("Dma rkey: %llu\n", (long long unsigned)cb->mr->rkey);
-	cb->test_sge[0].lkey = cb->mr->lkey;
-	cb->test_sge[1].lkey = cb->mr->lkey;
-	cb->recv_wr.next = NULL;
-	cb->recv_wr.num_sge = 1;
-	cb->recv_wr.sg_list = cb->test_sge;
+#endif
+	cb->test_sge[0].lkey = crdma_dma_lkey(cb);
+	cb->test_sge[1].lkey = crdma_dma_lkey(cb);
+	// Every receive gets its own slot, and the slot goes in wr_id
+	for (i = 0; i < CRDMA_RECVS; i++) {
+		cb->recv_sge[i].addr = cb->test_sge[0].addr + i * CRDMA_RECV_SIZE;
+		cb->recv_sge[i].length = CRDMA_RECV_SIZE;
+		cb->recv_sge[i].lkey = cb->test_sge[0].lkey;
+		memset(&cb->recv_wr[i], 0, sizeof(cb->recv_wr[i]));
+		cb->recv_wr[i].wr_id = i;
+		cb->recv_wr[i].num_sge = 1;
+		cb->recv_wr[i].sg_list = &cb->recv_sge[i];
+	}
+	cb->ready_head = cb->ready_count = 0;
 
 	cb->send_wr.next = NULL;
 	cb->send_wr.sg_list = &cb->test_sge[1];
@@ -488,7 +912,7 @@ static int crdma_mr(struct crdma_cb *cb){
 	cb->send_wr.send_flags = IB_SEND_SIGNALED;
 	return ret;
 error1:
-	ib_dma_unmap_single(cb->pd->device, cb->test_sge[0].addr, 4*1024, DMA_BIDIRECTIONAL);
+	ib_dma_unmap_single(cb->pd->device, cb->test_sge[0].addr, CRDMA_RECVS*CRDMA_RECV_SIZE, DMA_BIDIRECTIONAL);
 	ib_dma_unmap_single(cb->pd->device, cb->test_sge[1].addr, 4*1024, DMA_BIDIRECTIONAL);
 	kfree(cb->buffs[0]);
 	kfree(cb->buffs[1]);
@@ -496,11 +920,12 @@ error1:
 
 }
 static void crdma_free_mr(struct crdma_cb *cb){
-	ib_dma_unmap_single(cb->pd->device, cb->test_sge[0].addr, 4*1024, DMA_BIDIRECTIONAL);
+	ib_dma_unmap_single(cb->pd->device, cb->test_sge[0].addr, CRDMA_RECVS*CRDMA_RECV_SIZE, DMA_BIDIRECTIONAL);
 	ib_dma_unmap_single(cb->pd->device, cb->test_sge[1].addr, 4*1024, DMA_BIDIRECTIONAL);
 	kfree(cb->buffs[0]);
 	kfree(cb->buffs[1]);
-	ib_dereg_mr(cb->mr);
+	if (cb->mr)
+		ib_dereg_mr(cb->mr);
 	return;
 	/*ib_dma_unmap_single(cb->pd->device, cb->test_sge[0].addr, 4*1024, DMA_BIDIRECTIONAL);
 	ib_dma_unmap_single(cb->pd->device, cb->test_sge[1].addr, 4*1024, DMA_BIDIRECTIONAL);
@@ -512,7 +937,561 @@ static void crdma_free_mr(struct crdma_cb *cb){
 	ib_query_device(cb->pd->device,&attr);
 	pr_info("Max mr size: %llu\nMax frpl length: %u\n",attr.max_mr_size, attr.max_fast_reg_page_list_len);
 }*/
+static int crdma_query_gid(struct ib_device *device, u8 port, union ib_gid *gid) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	return rdma_query_gid(device, port, 0, gid);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+	return ib_query_gid(device, port, 0, gid, NULL);
+#else
+	return ib_query_gid(device, port, 0, gid);
+#endif
+}
+
+/*
+ * Connect the QP to itself, so registrations can be posted without a peer.
+ */
+static int crdma_loopback(struct crdma_cb *cb) {
+	struct ib_device *device = cb->cmid->device;
+	u8 port = cb->cmid->port_num;
+	struct ib_port_attr port_attr;
+	struct ib_qp_attr attr;
+	union ib_gid gid;
+	int ret;
+	if ((ret = ib_query_port(device, port, &port_attr)) || (ret = crdma_query_gid(device, port, &gid))) {
+		pr_err("Failed to query port %u!!!\n", port);
+		return ret;
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IB_QPS_INIT;
+	attr.port_num = port;
+	attr.qp_access_flags = IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_READ | IB_ACCESS_REMOTE_WRITE;
+	ret = ib_modify_qp(cb->qp, &attr, IB_QP_STATE | IB_QP_PKEY_INDEX | IB_QP_PORT | IB_QP_ACCESS_FLAGS);
+	if (ret)
+		goto error;
+	attr.qp_state = IB_QPS_RTR;
+	attr.path_mtu = port_attr.active_mtu;
+	attr.dest_qp_num = cb->qp->qp_num;
+	attr.max_dest_rd_atomic = 1;
+	attr.min_rnr_timer = 12;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+	attr.ah_attr.type = rdma_ah_find_type(device, port);
+	rdma_ah_set_dlid(&attr.ah_attr, port_attr.lid);
+	rdma_ah_set_port_num(&attr.ah_attr, port);
+	if (rdma_port_get_link_layer(device, port) == IB_LINK_LAYER_ETHERNET)
+		rdma_ah_set_grh(&attr.ah_attr, &gid, 0, 0, 1, 0);
+#else
+	attr.ah_attr.dlid = port_attr.lid;
+	attr.ah_attr.port_num = port;
+	if (rdma_port_get_link_layer(device, port) == IB_LINK_LAYER_ETHERNET) {
+		attr.ah_attr.ah_flags = IB_AH_GRH;
+		attr.ah_attr.grh.dgid = gid;
+		attr.ah_attr.grh.hop_limit = 1;
+	}
+#endif
+	ret = ib_modify_qp(cb->qp, &attr, IB_QP_STATE | IB_QP_AV | IB_QP_PATH_MTU | IB_QP_DEST_QPN |
+			   IB_QP_RQ_PSN | IB_QP_MAX_DEST_RD_ATOMIC | IB_QP_MIN_RNR_TIMER);
+	if (ret)
+		goto error;
+	attr.qp_state = IB_QPS_RTS;
+	attr.timeout = 14;
+	attr.retry_cnt = 7;
+	attr.rnr_retry = 7;
+	attr.max_rd_atomic = 1;
+	ret = ib_modify_qp(cb->qp, &attr, IB_QP_STATE | IB_QP_TIMEOUT | IB_QP_RETRY_CNT |
+			   IB_QP_RNR_RETRY | IB_QP_SQ_PSN | IB_QP_MAX_QP_RD_ATOMIC);
+	if (ret)
+		goto error;
+	pr_info("Loopback qp %u ready\n", cb->qp->qp_num);
+	return 0;
+error:
+	pr_err("Failed to move qp to state %d: %d\n", attr.qp_state, ret);
+	return ret;
+}
+
+/*
+ * A registration from scratch, the way crdma_fr() used to do it: allocate
+ * the MR (and before 4.4 its page list), register, wait, and tear it all
+ * down again.
+ */
+static int crdma_fresh_reg(struct crdma_cb *cb, u64 *pages, int npages, u64 iova,
+			   u32 length, int page_shift) {
+	struct crdma_frwr f;
+	int ret;
+	memset(&f, 0, sizeof(f));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	f.sgl = kcalloc(npages, sizeof(*f.sgl), GFP_KERNEL);
+	if (!f.sgl)
+		return -ENOMEM;
+	f.mr = ib_alloc_mr(cb->pd, IB_MR_TYPE_MEM_REG, npages);
+	if (IS_ERR(f.mr)) {
+		kfree(f.sgl);
+		return PTR_ERR(f.mr);
+	}
+#else
+	f.frpl = ib_alloc_fast_reg_page_list(cb->pd->device, npages);
+	if (IS_ERR(f.frpl))
+		return PTR_ERR(f.frpl);
+	f.mr = ib_alloc_fast_reg_mr(cb->pd, npages);
+	if (IS_ERR(f.mr)) {
+		ib_free_fast_reg_page_list(f.frpl);
+		return PTR_ERR(f.mr);
+	}
+#endif
+	f.key = f.mr->rkey & 0xff;
+	ret = crdma_frwr_map(cb, &f, pages, npages, iova, length, IB_ACCESS_LOCAL_WRITE, page_shift);
+	ib_dereg_mr(f.mr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	kfree(f.sgl);
+#else
+	ib_free_fast_reg_page_list(f.frpl);
+#endif
+	return ret;
+}
+
+/*
+ * Buffers from 4 KB to 1 MB, each registered with 4 KB, 16 KB and 64 KB pages
+ * (as long as a page fits), so the page list length varies separately from
+ * the size. Each registration is timed three ways, including the mapping:
+ * with the DMA MR only the mapping is needed, the pooled MR is invalidated
+ * and registered in one post, and the fresh one is set up from scratch.
+ */
+static const unsigned int crdma_bench_orders[] = {0, 2, 4, 6, 8};
+static const unsigned int crdma_bench_shifts[] = {0, 2, 4};
+
+static int crdma_bench(struct crdma_cb *cb, unsigned int iters) {
+	struct crdma_frwr *f;
+	u64 *pages, dma, size, t[3];
+	ktime_t start;
+	void *buf;
+	size_t len = 0;
+	int ret = 0, o, k, npages, shift, i, j;
+	pages = kmalloc_array(cb->pool.max_pages, sizeof(*pages), GFP_KERNEL);
+	f = crdma_frwr_get(&cb->pool);
+	if (!pages || !f) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	len += scnprintf(cb->table + len, CRDMA_TABLE_SIZE - len, "%10s %6s %8s %10s %10s %10s\n",
+			 "bytes", "pages", "page", "dma(us)", "pool(us)", "fresh(us)");
+	for (o = 0; o < ARRAY_SIZE(crdma_bench_orders); o++) {
+		size = PAGE_SIZE << crdma_bench_orders[o];
+		buf = (void *)__get_free_pages(GFP_KERNEL, crdma_bench_orders[o]);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto done;
+		}
+		for (k = 0; k < ARRAY_SIZE(crdma_bench_shifts); k++) {
+			if (crdma_bench_shifts[k] > crdma_bench_orders[o])
+				break;
+			shift = PAGE_SHIFT + crdma_bench_shifts[k];
+			npages = size >> shift;
+			if (npages > cb->pool.max_pages)
+				continue;
+			t[0] = t[1] = t[2] = 0;
+			for (i = 0; i < iters && !ret; i++) {
+				start = ktime_get();
+				dma = ib_dma_map_single(cb->pd->device, buf, size, DMA_BIDIRECTIONAL);
+				if (ib_dma_mapping_error(cb->pd->device, dma)) {
+					ret = -ENOMEM;
+					break;
+				}
+				ib_dma_unmap_single(cb->pd->device, dma, size, DMA_BIDIRECTIONAL);
+				t[0] += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+				start = ktime_get();
+				dma = ib_dma_map_single(cb->pd->device, buf, size, DMA_BIDIRECTIONAL);
+				for (j = 0; j < npages; j++)
+					pages[j] = dma + ((u64)j << shift);
+				ret = crdma_frwr_map(cb, f, pages, npages, dma, size, IB_ACCESS_LOCAL_WRITE, shift);
+				ib_dma_unmap_single(cb->pd->device, dma, size, DMA_BIDIRECTIONAL);
+				t[1] += ktime_to_ns(ktime_sub(ktime_get(), start));
+				if (ret)
+					break;
+
+				start = ktime_get();
+				dma = ib_dma_map_single(cb->pd->device, buf, size, DMA_BIDIRECTIONAL);
+				for (j = 0; j < npages; j++)
+					pages[j] = dma + ((u64)j << shift);
+				ret = crdma_fresh_reg(cb, pages, npages, dma, size, shift);
+				ib_dma_unmap_single(cb->pd->device, dma, size, DMA_BIDIRECTIONAL);
+				t[2] += ktime_to_ns(ktime_sub(ktime_get(), start));
+			}
+			if (ret)
+				break;
+			len += scnprintf(cb->table + len, CRDMA_TABLE_SIZE - len,
+					 "%10llu %6d %8lu %10llu.%02llu %10llu.%02llu %10llu.%02llu\n",
+					 (unsigned long long)size, npages, 1ul << shift,
+					 t[0] / iters / 1000, t[0] / iters / 10 % 100,
+					 t[1] / iters / 1000, t[1] / iters / 10 % 100,
+					 t[2] / iters / 1000, t[2] / iters / 10 % 100);
+		}
+		free_pages((unsigned long)buf, crdma_bench_orders[o]);
+		if (ret)
+			break;
+	}
+	if (!ret)
+		len += scnprintf(cb->table + len, CRDMA_TABLE_SIZE - len,
+				 "%u iterations, %lu registrations, %lu invalidates so far\n",
+				 iters, cb->pool.regs, cb->pool.invs);
+done:
+	if (ret)
+		len = scnprintf(cb->table, CRDMA_TABLE_SIZE, "Benchmark failed: %d\n", ret);
+	cb->table_len = len;
+	if (f)
+		crdma_frwr_put(&cb->pool, f);
+	kfree(pages);
+	return ret;
+}
+
+static ssize_t crdma_bench_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+	struct crdma_cb *cb = file->private_data;
+	ssize_t ret;
+	mutex_lock(&cb->bench_lock);
+	ret = simple_read_from_buffer(buf, count, ppos, cb->table, cb->table_len);
+	mutex_unlock(&cb->bench_lock);
+	return ret;
+}
+
+/*
+ * Writing runs the benchmark again, an optional number sets the iterations.
+ */
+static ssize_t crdma_bench_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+	struct crdma_cb *cb = file->private_data;
+	unsigned int iters = 100;
+	char tmp[16];
+	int ret;
+	if (count >= sizeof(tmp))
+		return -EINVAL;
+	if (copy_from_user(tmp, buf, count))
+		return -EFAULT;
+	tmp[count] = '\0';
+	if (*strim(tmp) && (kstrtouint(strim(tmp), 0, &iters) || !iters))
+		return -EINVAL;
+	mutex_lock(&cb->bench_lock);
+	ret = crdma_bench(cb, iters);
+	mutex_unlock(&cb->bench_lock);
+	return ret ? ret : count;
+}
+
+static const struct file_operations crdma_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = crdma_bench_read,
+	.write = crdma_bench_write,
+	.llseek = default_llseek,
+};
+
+static struct crdma_cb *loaded_cb;
+
+static void crdma_bench_stop(struct crdma_cb *cb) {
+	debugfs_remove_recursive(cb->debug_dir);
+	if (cb->pool.frwrs)
+		crdma_pool_destroy(cb);
+	if (cb->mr && !IS_ERR(cb->mr))
+		ib_dereg_mr(cb->mr);
+	if (cb->qp && !IS_ERR(cb->qp))
+		crdma_free_qp(cb);
+	kfree(cb->table);
+}
+
+static int crdma_bench_start(struct crdma_cb *cb) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,9,0)
+	ktime_t start;
+#endif
+	int ret;
+	mutex_init(&cb->bench_lock);
+	cb->table = kzalloc(CRDMA_TABLE_SIZE, GFP_KERNEL);
+	if (!cb->table)
+		return -ENOMEM;
+	if ((ret = crdma_bind(cb)))
+		return ret;
+	if (!cb->cmid->device) {
+		pr_err("The address doesn't belong to an rdma device!!!\n");
+		return -ENODEV;
+	}
+	if ((ret = crdma_make_qp(cb, cb->cmid))) {
+		cb->qp = NULL;
+		return ret;
+	}
+	if ((ret = crdma_loopback(cb)))
+		return ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+	cb->table_len = scnprintf(cb->table, CRDMA_TABLE_SIZE,
+				  "DMA addresses use the PD's local key. Write an iteration count (or nothing for 100) to run.\n");
+#else
+	start = ktime_get();
+	cb->mr = ib_get_dma_mr(cb->pd, IB_ACCESS_LOCAL_WRITE);
+	if (IS_ERR(cb->mr)) {
+		pr_err("get_dma_mr failed\n");
+		return PTR_ERR(cb->mr);
+	}
+	cb->table_len = scnprintf(cb->table, CRDMA_TABLE_SIZE,
+				  "DMA MR set up once in %lld us. Write an iteration count (or nothing for 100) to run.\n",
+				  (long long)ktime_to_us(ktime_sub(ktime_get(), start)));
+#endif
+	if ((ret = crdma_pool_init(cb, pool_size)))
+		return ret;
+	cb->debug_dir = debugfs_create_dir("crdma", NULL);
+	if (IS_ERR_OR_NULL(cb->debug_dir) ||
+	    !debugfs_create_file("bench", S_IRUSR | S_IWUSR, cb->debug_dir, cb, &crdma_bench_fops)) {
+		pr_err("Failed to create debugfs files!!!\n");
+		return -ENOMEM;
+	}
+	pr_info("Registration benchmark ready in debugfs crdma/bench\n");
+	return 0;
+}
+
+static struct crdma_cb *service_cb;
+
+/*
+ * Stop a chain that didn't complete in time. Moving the QP to the error
+ * state flushes whatever is still queued, and only the flush of the
+ * signaled last operation shows that the device is done with the staging
+ * buffer. The CQ work stops polling after an error completion, so it is
+ * queued again to pick that flush up. If even the flush doesn't come, the
+ * buffer is left to the device instead of being unmapped and freed.
+ */
+static void crdma_io_abort(struct crdma_cb *cb) {
+	struct ib_qp_attr attr;
+	state = ERROR;
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IB_QPS_ERR;
+	if (ib_modify_qp(cb->qp, &attr, IB_QP_STATE))
+		pr_err("Failed to move qp to the error state!!!\n");
+	queue_work(cb->wq, &cb->cq_work);
+	if (wait_for_completion_timeout(&cb->io_done, 10 * HZ))
+		return;
+	pr_err("The batch was never flushed, leaking the staging buffer\n");
+	cb->io_buf = NULL;
+	cb->io_dma = 0;
+}
+
+/*
+ * Copy a batch into the staging buffer, post it as one chain and copy the
+ * reads back out once the last operation completed.
+ */
+static long crdma_submit(struct crdma_cb *cb, struct crdma_batch __user *ubatch) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	struct ib_rdma_wr wr[CRDMA_BATCH_MAX];
+#else
+	struct ib_send_wr wr[CRDMA_BATCH_MAX];
+#endif
+	struct ib_send_wr *first = NULL, *last = NULL, *w;
+	struct ib_sge sge[CRDMA_BATCH_MAX];
+	struct crdma_io io[CRDMA_BATCH_MAX];
+	struct crdma_batch batch;
+	u32 off = 0;
+	int i;
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count < 1 || batch.count > CRDMA_BATCH_MAX)
+		return -EINVAL;
+	if (copy_from_user(io, (void __user *)(unsigned long)batch.ios, batch.count * sizeof(*io)))
+		return -EFAULT;
+	if (state >= DISCONNECT)
+		return -ENOTCONN;
+	memset(wr, 0, batch.count * sizeof(*wr));
+	for (i = 0; i < batch.count; i++) {
+		if (!io[i].length || io[i].length > CRDMA_IO_MAX - off ||
+		    io[i].offset > cb->remote_len || io[i].length > cb->remote_len - io[i].offset)
+			return -EINVAL;
+		if (io[i].write && copy_from_user(cb->io_buf + off,
+						  (void __user *)(unsigned long)io[i].buf, io[i].length))
+			return -EFAULT;
+		sge[i].addr = cb->io_dma + off;
+		sge[i].length = io[i].length;
+		sge[i].lkey = cb->io_frwr->mr->lkey;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+		w = &wr[i].wr;
+		wr[i].remote_addr = cb->remote_addr + io[i].offset;
+		wr[i].rkey = cb->remote_rkey;
+#else
+		w = &wr[i];
+		w->wr.rdma.remote_addr = cb->remote_addr + io[i].offset;
+		w->wr.rdma.rkey = cb->remote_rkey;
+#endif
+		w->sg_list = &sge[i];
+		w->num_sge = 1;
+		w->opcode = io[i].write ? IB_WR_RDMA_WRITE : IB_WR_RDMA_READ;
+		if (last)
+			last->next = w;
+		else
+			first = w;
+		last = w;
+		off += io[i].length;
+	}
+	last->wr_id = CRDMA_IO_WRID;
+	last->send_flags = IB_SEND_SIGNALED;
+	ib_dma_sync_single_for_device(cb->pd->device, cb->io_dma, off, DMA_BIDIRECTIONAL);
+	init_completion(&cb->io_done);
+	if (ib_post_send(cb->qp, first, &cb->bad_send)) {
+		pr_err("Failed to post work request to send queue!!!\n");
+		return -EIO;
+	}
+	// The staging buffer is in use until the chain completes, so this can't be interrupted
+	if (!wait_for_completion_timeout(&cb->io_done, 10 * HZ)) {
+		pr_err("Batch timed out, giving up on the connection\n");
+		crdma_io_abort(cb);
+		return -ETIMEDOUT;
+	}
+	if (cb->io_status) {
+		pr_err("Batch failed with status %d\n", cb->io_status);
+		return -EIO;
+	}
+	ib_dma_sync_single_for_cpu(cb->pd->device, cb->io_dma, off, DMA_BIDIRECTIONAL);
+	for (i = 0, off = 0; i < batch.count; off += io[i].length, i++)
+		if (!io[i].write && copy_to_user((void __user *)(unsigned long)io[i].buf,
+						 cb->io_buf + off, io[i].length))
+			return -EFAULT;
+	cb->ios += batch.count;
+	cb->batches++;
+	batch.done = batch.count;
+	return copy_to_user(ubatch, &batch, sizeof(batch)) ? -EFAULT : 0;
+}
+
+static long crdma_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+	struct crdma_cb *cb = service_cb;
+	struct crdma_info info;
+	long ret;
+	switch (cmd) {
+	case CRDMA_IOC_INFO:
+		info.length = cb->remote_len;
+		info.io_max = CRDMA_IO_MAX;
+		info.batch_max = CRDMA_BATCH_MAX;
+		return copy_to_user((void __user *)arg, &info, sizeof(info)) ? -EFAULT : 0;
+	case CRDMA_IOC_SUBMIT:
+		mutex_lock(&cb->io_lock);
+		ret = crdma_submit(cb, (struct crdma_batch __user *)arg);
+		mutex_unlock(&cb->io_lock);
+		return ret;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations crdma_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = crdma_ioctl,
+};
+
+static struct miscdevice crdma_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "crdma",
+	.fops = &crdma_fops,
+	.mode = 0666,
+};
+
+static void crdma_service_stop(struct crdma_cb *cb) {
+	struct ib_send_wr wr;
+	if (service_cb) {
+		misc_deregister(&crdma_misc);
+		service_cb = NULL;
+		pr_info("Served %lu operations in %lu batches\n", cb->ios, cb->batches);
+	}
+	// Leave the way a v2 client does, so the server frees the region right away
+	if (cb->connected && cb->remote_rkey && state < DISCONNECT) {
+		memset(&wr, 0, sizeof(wr));
+		wr.opcode = IB_WR_SEND_WITH_IMM;
+		wr.send_flags = IB_SEND_SIGNALED;
+		wr.ex.imm_data = htonl(CRDMA_V2_DISCONNECT);
+		// The server acknowledges with an empty message carrying a 0
+		crdma_expect(cb, 1, 0, 0);
+		if (!ib_post_send(cb->qp, &wr, &cb->bad_send))
+			crdma_reply(cb, NULL, 0, 2 * HZ);
+	}
+	if (cb->connected && state < DISCONNECT) {
+		rdma_disconnect(cb->cmid);
+		wait_event_interruptible_timeout(cb->wqueue, state >= DISCONNECT, 2 * HZ);
+	}
+	if (cb->io_dma)
+		ib_dma_unmap_single(cb->pd->device, cb->io_dma, CRDMA_IO_MAX, DMA_BIDIRECTIONAL);
+	if (cb->io_buf)
+		free_pages((unsigned long)cb->io_buf, get_order(CRDMA_IO_MAX));
+	if (cb->io_frwr)
+		crdma_frwr_put(&cb->pool, cb->io_frwr);
+	if (cb->pool.frwrs)
+		crdma_pool_destroy(cb);
+	if (cb->buffs[0])
+		crdma_free_mr(cb);
+	if (cb->qp && !IS_ERR(cb->qp))
+		crdma_free_qp(cb);
+}
+
+/*
+ * Connect to a v2 server as a client with a region, the same way
+ * connect_four() and swap_info() do it, and register /dev/crdma.
+ */
+static int crdma_service_start(struct crdma_cb *cb) {
+	u64 pages[CRDMA_IO_MAX / PAGE_SIZE], len = CRDMA_IO_MAX;
+	u8 reply[30];
+	int ret, i;
+	mutex_init(&cb->io_lock);
+	if ((ret = crdma_bind(cb)))
+		return ret;
+	if ((ret = crdma_make_qp(cb, cb->cmid))) {
+		cb->qp = NULL;
+		return ret;
+	}
+	if (crdma_mr(cb)) {
+		cb->buffs[0] = NULL;
+		return -ENOMEM;
+	}
+	// Only the swap_info() reply: ADD_CLIENT updates follow the connect right away
+	crdma_expect(cb, 0, 0, 30);
+	if (crdma_post_recvs(cb)) {
+		pr_err("Failed to post work request to receive queue!!!\n");
+		return -EIO;
+	}
+	if ((ret = crdma_connect(cb)))
+		return ret;
+	cb->connected = 1;
+	if ((ret = crdma_pool_init(cb, pool_size)))
+		return ret;
+	cb->io_frwr = crdma_frwr_get(&cb->pool);
+	cb->io_buf = (void *)__get_free_pages(GFP_KERNEL, get_order(CRDMA_IO_MAX));
+	if (!cb->io_buf)
+		return -ENOMEM;
+	cb->io_dma = ib_dma_map_single(cb->pd->device, cb->io_buf, CRDMA_IO_MAX, DMA_BIDIRECTIONAL);
+	if (ib_dma_mapping_error(cb->pd->device, cb->io_dma)) {
+		cb->io_dma = 0;
+		return -ENOMEM;
+	}
+	for (i = 0; i < CRDMA_IO_MAX / PAGE_SIZE; i++)
+		pages[i] = cb->io_dma + i * PAGE_SIZE;
+	ret = crdma_frwr_map(cb, cb->io_frwr, pages, CRDMA_IO_MAX / PAGE_SIZE, cb->io_dma, CRDMA_IO_MAX,
+			     IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_READ | IB_ACCESS_REMOTE_WRITE, PAGE_SHIFT);
+	if (ret)
+		return ret;
+	// swap_info() sends the address, rkey and length in a 30 byte message
+	memset(cb->buffs[1], 0, 30);
+	memcpy(cb->buffs[1], &cb->io_dma, sizeof(cb->io_dma));
+	memcpy(cb->buffs[1] + 8, &cb->io_frwr->mr->rkey, sizeof(cb->io_frwr->mr->rkey));
+	memcpy(cb->buffs[1] + 12, &len, sizeof(len));
+	cb->test_sge[1].length = 30;
+	ret = ib_post_send(cb->qp, &cb->send_wr, &cb->bad_send);
+	cb->test_sge[1].length = 4*1024;
+	if (ret) {
+		pr_err("Failed to post work request to send queue!!!\n");
+		return ret;
+	}
+	if ((ret = crdma_reply(cb, reply, sizeof(reply), MAX_SCHEDULE_TIMEOUT)) < 0)
+		return ret;
+	memcpy(&cb->remote_addr, reply, 8);
+	memcpy(&cb->remote_rkey, reply + 8, 4);
+	memcpy(&cb->remote_len, reply + 12, 8);
+	pr_info("Remote rkey: %lu\nAddress: %llx\nLength: %llu\n", (long unsigned)cb->remote_rkey,
+		(long long unsigned)cb->remote_addr, (long long unsigned)cb->remote_len);
+	service_cb = cb;
+	if ((ret = misc_register(&crdma_misc))) {
+		service_cb = NULL;
+		return ret;
+	}
+	pr_info("Serving /dev/crdma\n");
+	return 0;
+}
+
 static void server(struct crdma_cb *cb) {
+	u32 reply[1];
 	if (crdma_bind(cb))
 		return;
 
@@ -534,24 +1513,26 @@ static void server(struct crdma_cb *cb) {
 		goto error0;
 	}
 
-	if(ib_post_recv(cb->qp, &cb->recv_wr, &cb->bad_recv)){
+	// The other module sends its rkey in a whole buffer, without immediate data
+	crdma_expect(cb, 0, 0, 4*1024);
+	if(crdma_post_recvs(cb)){
 		pr_err("Failed to post work request to receive queue!!!\n");
 		goto error1;
 	}
 
 	crdma_accept(cb);
-	memcpy(cb->buffs[1],&cb->mr->rkey, sizeof(cb->mr->rkey));
+	*(u32 *)cb->buffs[1] = cb->mr ? cb->mr->rkey : 0;
 	if(ib_post_send(cb->qp, &cb->send_wr, &cb->bad_send)){
 		pr_err("Failed to post work request to send queue!!!\n");
 		goto error1;
 	}
 	pr_info("State before wakikng: %u\n", state);
-	if(wait_event_interruptible(cb->wqueue, state >= RDMA_RECV_COMPLETE)){
+	if(crdma_reply(cb, reply, sizeof(reply), MAX_SCHEDULE_TIMEOUT) < 0){
 		pr_info("Interrupted\n");
 		goto error1;
 	}
 	pr_info("State after wakikng: %u\n", state);
-	cb->remote_rkey = *(u32 *)(cb->buffs[0]);
+	cb->remote_rkey = reply[0];
 	pr_info("Remote rkey: %lu\n", (long unsigned)cb->remote_rkey);
 
 	if(crdma_fr(cb)){
@@ -570,6 +1551,11 @@ error0:
 }
 
 static void client(struct crdma_cb *cb) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	struct ib_rdma_wr write_wr;
+#endif
+	struct ib_send_wr *write = &cb->send_wr;
+	u64 reply[2];
 	if (crdma_bind(cb))
 		return;
 
@@ -583,7 +1569,9 @@ static void client(struct crdma_cb *cb) {
 		goto error0;
 	}
 
-	if(ib_post_recv(cb->qp, &cb->recv_wr, &cb->bad_recv)){
+	// Both of the server's messages are whole buffers without immediate data
+	crdma_expect(cb, 0, 0, 4*1024);
+	if(crdma_post_recvs(cb)){
 		pr_err("Failed to post work request to receive queue!!!\n");
 		goto error1;
 	}
@@ -592,28 +1580,36 @@ static void client(struct crdma_cb *cb) {
 		pr_err( "Falied to connect client!!!\n");
 		goto error1;
 	}
-	memcpy(cb->buffs[1],&cb->mr->rkey, sizeof(cb->mr->rkey));
+	*(u32 *)cb->buffs[1] = cb->mr ? cb->mr->rkey : 0;
 	if(ib_post_send(cb->qp, &cb->send_wr, &cb->bad_send)){
 		pr_err("Failed to post work request to send queue!!!\n");
 		goto error1;
 	}
-	if(wait_event_interruptible(cb->wqueue, state >= RDMA_RECV_COMPLETE)){
+	if(crdma_reply(cb, reply, sizeof(reply), MAX_SCHEDULE_TIMEOUT) < 0){
 		pr_info("Interrupted\n");
+		goto error1;
 	}
-	state = WAITING;
-	cb->remote_rkey = *(u32 *)(cb->buffs[0]);
+	cb->remote_rkey = *(u32 *)reply;
 	pr_info("Remote rkey: %lu\n", (long unsigned)cb->remote_rkey);
-	if(wait_event_interruptible(cb->wqueue, state >= RDMA_RECV_COMPLETE)){
+	if(crdma_reply(cb, reply, sizeof(reply), MAX_SCHEDULE_TIMEOUT) < 0){
 		pr_info("Interrupted\n");
+		goto error1;
 	}
-	cb->remote_rkey = *(u32 *)(cb->buffs[0] + sizeof(cb->dma[2]));
-	cb->dma[2] = *(u64 *)(cb->buffs[0]);
+	cb->remote_rkey = *(u32 *)&reply[1];
+	cb->dma[2] = reply[0];
 	pr_info("Remote rkey: %lu\nAddress: %llx\n", (long unsigned)cb->remote_rkey, (long long unsigned)cb->dma[2]);
 
 	cb->send_wr.opcode = IB_WR_RDMA_WRITE;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	write_wr.wr = cb->send_wr;
+	write_wr.rkey = cb->remote_rkey;
+	write_wr.remote_addr = cb->dma[2];
+	write = &write_wr.wr;
+#else
 	cb->send_wr.wr.rdma.rkey = cb->remote_rkey;
 	cb->send_wr.wr.rdma.remote_addr = cb->dma[2];
-	if(ib_post_send(cb->qp, &cb->send_wr, &cb->bad_send)){
+#endif
+	if(ib_post_send(cb->qp, write, &cb->bad_send)){
 		pr_err("Failed to post work request to send queue!!!\n");
 		goto error1;
 	}
@@ -631,34 +1627,82 @@ static int __init initialize(void) {
 	struct crdma_cb *cb;
 	pr_info("CRDMA initialize function\n");
 
-	if (mode == -1) {
-		pr_err( "ERROR: Mode not specified, 0 for server and 1 for client\n");
+	if (mode < 0 || mode > 3) {
+		pr_err( "ERROR: Mode not specified, 0 for server, 1 for client, 2 for the registration benchmark "
+		       "and 3 to serve /dev/crdma\n");
 		return -1;
 	}
 
 	cb = kzalloc(sizeof(*cb), GFP_KERNEL);
-	in4_pton("192.168.13.1", -1, cb->addr, -1, NULL);
+	if (!in4_pton(ip, -1, cb->addr, -1, NULL)) {
+		pr_err( "ERROR: Invalid ip %s\n", ip);
+		kfree(cb);
+		return -1;
+	}
 	init_waitqueue_head(&cb->wqueue);
+	spin_lock_init(&cb->recv_lock);
+	if (poll_budget < 1) {
+		pr_err( "ERROR: poll_budget must be at least 1\n");
+		kfree(cb);
+		return -1;
+	}
+	cb->wq = alloc_workqueue("crdma_cq", WQ_HIGHPRI | WQ_MEM_RECLAIM, 1);
+	if (!cb->wq) {
+		pr_err( "Failed to allocate workqueue!!!\n");
+		kfree(cb);
+		return -1;
+	}
+	INIT_WORK(&cb->cq_work, crdma_cq_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	cb->cmid = rdma_create_id(&init_net, crdma_cma_event_handler, cb, RDMA_PS_TCP, IB_QPT_RC);
+#else
 	cb->cmid = rdma_create_id(crdma_cma_event_handler, cb, RDMA_PS_TCP, IB_QPT_RC);
+#endif
 	if (IS_ERR(cb->cmid)) {
 		pr_err( "rdma_create_id error %ld\n", PTR_ERR(cb->cmid));
+		destroy_workqueue(cb->wq);
+		kfree(cb);
 		return -1;
 	}
 	pr_info("Created cm_id %p\n",  cb->cmid);
 
-	if (mode)
+	// The benchmark and the service stay loaded
+	if (mode == 2) {
+		if (!crdma_bench_start(cb)) {
+			loaded_cb = cb;
+			return 0;
+		}
+		crdma_bench_stop(cb);
+	} else if (mode == 3) {
+		if (!crdma_service_start(cb)) {
+			loaded_cb = cb;
+			return 0;
+		}
+		crdma_service_stop(cb);
+	} else if (mode)
 		client(cb);
 	else
 		server(cb);
 
 	rdma_destroy_id(cb->cmid);
+	destroy_workqueue(cb->wq);
 	kfree(cb);
 	pr_info("Returning a nonzero number to avoid having to remove the module (work is already done)\n");
 	return -1;
 }
 
 static void __exit escape(void) {
+	struct crdma_cb *cb = loaded_cb;
 	pr_info("CRDMA exit function\n\n");
+	if (cb) {
+		if (mode == 3)
+			crdma_service_stop(cb);
+		else
+			crdma_bench_stop(cb);
+		rdma_destroy_id(cb->cmid);
+		destroy_workqueue(cb->wq);
+		kfree(cb);
+	}
 }
 
 module_init(initialize);
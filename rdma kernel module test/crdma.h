@@ -0,0 +1,41 @@
+/*
+ * The interface of /dev/crdma, shared by the module and userspace.
+ *
+ * In mode 3 the module connects to a v2 server and takes reads and writes
+ * against the client's region on it through ioctl. Each batch is copied
+ * through a staging buffer registered once with a pooled fast-reg MR, and
+ * goes out as one chain of work requests with only the last one signaled.
+ */
+#ifndef CRDMA_H
+#define CRDMA_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CRDMA_IO_MAX (64 * 1024)
+#define CRDMA_BATCH_MAX 8
+
+struct crdma_info {
+	__u64 length;		/* the length of the remote region */
+	__u32 io_max;		/* the most bytes one batch can move */
+	__u32 batch_max;	/* the most operations in one batch */
+};
+
+struct crdma_io {
+	__u64 buf;		/* the user buffer */
+	__u64 offset;		/* the offset into the remote region */
+	__u32 length;
+	__u32 write;		/* 1 to write the buffer, 0 to read into it */
+};
+
+struct crdma_batch {
+	__u64 ios;		/* an array of struct crdma_io */
+	__u32 count;
+	__u32 done;		/* set to count once the batch completed */
+};
+
+#define CRDMA_MAGIC 'R'
+#define CRDMA_IOC_INFO _IOR(CRDMA_MAGIC, 0, struct crdma_info)
+#define CRDMA_IOC_SUBMIT _IOWR(CRDMA_MAGIC, 1, struct crdma_batch)
+
+#endif
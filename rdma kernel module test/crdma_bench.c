@@ -0,0 +1,151 @@
+/*
+ * Times reads and writes through /dev/crdma (the module loaded with mode=3).
+ *
+ * The tables line up with bench -t lat and bench -t bw from rdma v2, so
+ * running both against the same server compares the in-kernel path with
+ * the libibverbs one. Here -d operations go out in one ioctl.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "crdma.h"
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void submit(int fd, struct crdma_io *io, unsigned int count) {
+	struct crdma_batch batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.ios = (uint64_t)(uintptr_t)io;
+	batch.count = count;
+	if (ioctl(fd, CRDMA_IOC_SUBMIT, &batch)) {
+		fprintf(stderr, "CRDMA_IOC_SUBMIT: %s\n", strerror(errno));
+		exit(-1);
+	}
+}
+
+/*
+ * One operation per ioctl, for every power of two size up to -s.
+ */
+static void test_lat(int fd, struct crdma_info *info, char *buf, size_t max, unsigned long iters) {
+	uint64_t *lat = malloc(iters * sizeof(*lat));
+	uint64_t start, total;
+	struct crdma_io io;
+	unsigned long i;
+	size_t size;
+	int op;
+	printf("%-6s %10s %10s %10s %10s %10s\n", "op", "bytes", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+	for (op = 0; op < 2; op++) {
+		for (size = 8; size <= max; size *= 2) {
+			total = 0;
+			for (i = 0; i < iters; i++) {
+				io.buf = (uint64_t)(uintptr_t)buf;
+				io.offset = (i * size) % (info->length - size + 1);
+				io.length = size;
+				io.write = !op;
+				start = now_ns();
+				submit(fd, &io, 1);
+				lat[i] = now_ns() - start;
+				total += lat[i];
+			}
+			qsort(lat, iters, sizeof(*lat), cmp_u64);
+			printf("%-6s %10zu %10.2f %10.2f %10.2f %10.2f\n", op ? "read" : "write", size,
+				total / 1000.0 / iters, lat[iters / 2] / 1000.0,
+				lat[iters * 99 / 100] / 1000.0, lat[iters - 1] / 1000.0);
+		}
+	}
+	free(lat);
+}
+
+/*
+ * -d operations per ioctl, posted as one chain by the module.
+ */
+static void test_bw(int fd, struct crdma_info *info, char *buf, size_t size, unsigned long iters,
+		    unsigned int depth) {
+	struct crdma_io io[CRDMA_BATCH_MAX];
+	unsigned long done;
+	uint64_t start, elapsed;
+	unsigned int n, i;
+	int op;
+	printf("%-6s %10s %6s %10s %10s %10s\n", "op", "bytes", "depth", "ops", "MB/s", "Mops/s");
+	for (op = 0; op < 2; op++) {
+		start = now_ns();
+		for (done = 0; done < iters; done += n) {
+			n = iters - done < depth ? iters - done : depth;
+			for (i = 0; i < n; i++) {
+				io[i].buf = (uint64_t)(uintptr_t)(buf + i * size);
+				io[i].offset = ((done + i) * size) % (info->length - size + 1);
+				io[i].length = size;
+				io[i].write = !op;
+			}
+			submit(fd, io, n);
+		}
+		elapsed = now_ns() - start;
+		printf("%-6s %10zu %6u %10lu %10.1f %10.3f\n", op ? "read" : "write", size, depth,
+			iters, (double)iters * size * 1000.0 / elapsed, (double)iters * 1000.0 / elapsed);
+	}
+}
+
+int main(int argc, char **argv) {
+	struct crdma_info info;
+	unsigned long iters = 10000;
+	unsigned int depth = CRDMA_BATCH_MAX;
+	size_t size = 64;
+	char *buf;
+	int fd, opt;
+	while ((opt = getopt(argc, argv, "s:n:d:")) != -1) {
+		switch (opt) {
+		case 's':
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		default:
+			printf("Usage: %s [-s size] [-n iterations] [-d depth]\n", argv[0]);
+			return -1;
+		}
+	}
+	fd = open("/dev/crdma", O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "/dev/crdma: %s (is the module loaded with mode=3?)\n", strerror(errno));
+		return -1;
+	}
+	if (ioctl(fd, CRDMA_IOC_INFO, &info)) {
+		fprintf(stderr, "CRDMA_IOC_INFO: %s\n", strerror(errno));
+		return -1;
+	}
+	if (depth < 1 || depth > info.batch_max) {
+		printf("Depth must be between 1 and %u.\n", info.batch_max);
+		return -1;
+	}
+	if (size < 8 || size > info.length || size * depth > info.io_max || iters < 1) {
+		printf("Invalid size and/or iteration count (at most %u bytes per batch).\n", info.io_max);
+		return -1;
+	}
+	buf = calloc(depth, size);
+	printf("Running against a %llu byte region\n", (unsigned long long)info.length);
+	test_lat(fd, &info, buf, size, iters);
+	test_bw(fd, &info, buf, size, iters, depth);
+	free(buf);
+	close(fd);
+	return 0;
+}
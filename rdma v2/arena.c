@@ -0,0 +1,400 @@
+/**
+ * @file arena.c
+ * @brief Allocating remote memory out of large pre-registered arenas
+ *
+ * Clients that need many small objects ask for them with @c ALLOC and give them back with @c FREE
+ * instead of carving up their own memory region. Each arena is registered once when it is created,
+ * so allocations never call ibv_reg_mr(); blocks are handed out by a buddy allocator. Each block is
+ * reached through a type 2 memory window bound on its owner's queue pair that only covers what was
+ * asked for, so a client can't touch anyone else's blocks, and freeing a block takes the window
+ * away. Devices without memory windows (and arenas registered on demand) fall back to the arena's
+ * rkey, which only keeps well-behaved clients apart. Every block a client holds is charged against
+ * its quota, rounded up to the block size.
+ *
+ * Windows go away with the queue pair they are bound on. A client that detaches keeps its blocks,
+ * and after resuming gets them back through new windows with an @c ALLOC of length 0 for the address.
+ *
+ * Everything in here must be called with the client list semaphore held.
+ */
+#include "server.h"
+
+/**
+ * @brief The size of the smallest block, as a power of two (64 bytes)
+ */
+#define ARENA_MIN_ORDER	6
+/**
+ * @brief The size of the largest possible arena, as a power of two
+ */
+#define ARENA_MAX_ORDER	48
+
+/**
+ * @brief Linked list node for a free block
+ */
+struct block {
+	uint64_t offset;		/**< The offset of the block into the arena */
+	struct block *next;		/**< A pointer to the next node in the list */
+};
+
+/**
+ * @brief A large registered buffer allocations are made from
+ */
+struct arena {
+	struct ibv_mr *mr;							/**< The memory region covering the whole arena */
+	struct placement *place;					/**< Where the arena was allocated */
+	int order;									/**< The size of the arena, as a power of two */
+	uint8_t windows;							/**< 1 if blocks are reached through memory windows */
+	struct block *free[ARENA_MAX_ORDER + 1];	/**< The free blocks of each size */
+};
+
+/**
+ * @brief Linked list node for a block handed out to a client
+ */
+struct alloc {
+	struct arena *arena;	/**< The arena the block came from */
+	uint64_t offset;		/**< The offset of the block into the arena */
+	int order;				/**< The size of the block, as a power of two */
+	uint64_t length;		/**< The length the client asked for */
+	struct cnode *owner;	/**< The client holding the block */
+	struct ibv_mw *mw;		/**< The memory window bound on the owner's queue pair (@c NULL without one) */
+	uint32_t rkey;			/**< The rkey the owner reaches the block with */
+	struct alloc *next;		/**< A pointer to the next node in the list */
+};
+
+/**
+ * @brief The arenas made so far
+ */
+static struct arena arenas[MAX_ARENAS];
+/**
+ * @brief The number of entries used in @c arenas
+ */
+static int narenas = 0;
+/**
+ * @brief The head of the list of blocks handed out
+ */
+static struct alloc *alist_head = NULL;
+
+/**
+ * @brief Find the smallest block size that fits a length
+ *
+ * @return the block size, as a power of two
+ * @param length the length to fit
+ */
+static int order_of(uint64_t length){
+	int order = ARENA_MIN_ORDER;
+	while(order < ARENA_MAX_ORDER && ((uint64_t)1 << order) < length)
+		order++;
+	return order;
+}
+
+/**
+ * @brief Take a free block out of an arena, splitting a larger one if needed
+ *
+ * @return 0 on success, -1 if the arena has no room
+ * @param a the arena
+ * @param order the size of the block
+ * @param offset the location to store the offset of the block
+ */
+static int take_block(struct arena *a, int order, uint64_t *offset){
+	struct block *b;
+	int k;
+	for(k = order; k <= a->order && a->free[k] == NULL; k++);
+	if(k > a->order)
+		return -1;
+	b = a->free[k];
+	a->free[k] = b->next;
+	*offset = b->offset;
+	free(b);
+	// Hand the upper halves back until the block is the right size
+	while(k > order){
+		k--;
+		b = malloc(sizeof(*b));
+		b->offset = *offset + ((uint64_t)1 << k);
+		b->next = a->free[k];
+		a->free[k] = b;
+	}
+	return 0;
+}
+
+/**
+ * @brief Give a block back to an arena, merging it with its buddy while the buddy is free too
+ *
+ * @return @c NULL
+ * @param a the arena
+ * @param offset the offset of the block
+ * @param order the size of the block
+ */
+static void put_block(struct arena *a, uint64_t offset, int order){
+	struct block **bp, *b;
+	while(order < a->order){
+		for(bp = &a->free[order]; *bp != NULL; bp = &(*bp)->next)
+			if((*bp)->offset == (offset ^ ((uint64_t)1 << order)))
+				break;
+		if(*bp == NULL)
+			break;
+		b = *bp;
+		*bp = b->next;
+		free(b);
+		offset &= ~((uint64_t)1 << order);
+		order++;
+	}
+	b = malloc(sizeof(*b));
+	b->offset = offset;
+	b->next = a->free[order];
+	a->free[order] = b;
+}
+
+/**
+ * @brief Allocate and register a new arena
+ *
+ * @return the arena, or @c NULL if there is no room for another one or it couldn't be registered
+ * @param pd the protection domain to register with
+ * @param place where to allocate the arena
+ */
+static struct arena *arena_create(struct ibv_pd *pd, struct placement *place){
+	struct arena *a;
+	void *buf;
+	int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE |
+	 mw_access(pd->context);
+	if(narenas == MAX_ARENAS)
+		return NULL;
+	a = &arenas[narenas];
+	memset(a, 0, sizeof(*a));
+	a->order = order_of(arena_size);
+	buf = place_alloc(place, (size_t)1 << a->order);
+	if(buf == NULL)
+		return NULL;
+	a->mr = reg_region(pd, buf, (size_t)1 << a->order, &access);
+	if(a->mr == NULL){
+		fprintf(log_p, "Failed to register arena %d: %s\n", narenas, strerror(errno));
+		place_free(place, buf, (size_t)1 << a->order);
+		return NULL;
+	}
+	a->place = place;
+	a->windows = (access & IBV_ACCESS_MW_BIND) != 0;
+	put_block(a, 0, a->order);
+	fprintf(log_p, "Created arena %d: %llu bytes at 0x%llx (rkey 0x%x), blocks are reached through %s.\n",
+		narenas, (unsigned long long)1 << a->order, (unsigned long long)a->mr->addr, (unsigned int)a->mr->rkey,
+		a->windows ? "memory windows" : "the arena's rkey");
+	narenas++;
+	return a;
+}
+
+/**
+ * @brief Give the owner of a block access to it, and only it
+ *
+ * @return 0 on success, -1 if the memory window couldn't be bound
+ * @param al the block
+ */
+static int alloc_bind(struct alloc *al){
+	struct ibv_send_wr bind;
+	struct rdma_cm_id *id = al->owner->id;
+	if(!al->arena->windows){
+		al->rkey = al->arena->mr->rkey;
+		return 0;
+	}
+	al->mw = ibv_alloc_mw(id->qp->pd, IBV_MW_TYPE_2);
+	if(al->mw == NULL){
+		fprintf(log_p, "ibv_alloc_mw() failed: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(&bind, 0, sizeof(bind));
+	bind.opcode = IBV_WR_BIND_MW;
+	bind.send_flags = IBV_SEND_SIGNALED;
+	bind.bind_mw.mw = al->mw;
+	bind.bind_mw.rkey = ibv_inc_rkey(al->mw->rkey);
+	bind.bind_mw.bind_info.mr = al->arena->mr;
+	bind.bind_mw.bind_info.addr = (uint64_t)al->arena->mr->addr + al->offset;
+	bind.bind_mw.bind_info.length = al->length;
+	bind.bind_mw.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+	if(send_wait(id, &bind, log_p)){
+		ibv_dealloc_mw(al->mw);
+		al->mw = NULL;
+		return -1;
+	}
+	al->rkey = bind.bind_mw.rkey;
+	return 0;
+}
+
+/**
+ * @brief Take away the memory window of a block, if it has one
+ *
+ * @return @c NULL
+ * @param al the block
+ */
+static void alloc_unbind(struct alloc *al){
+	if(al->mw != NULL && ibv_dealloc_mw(al->mw))
+		fprintf(log_p, "ibv_dealloc_mw() failed: %s\n", strerror(errno));
+	al->mw = NULL;
+}
+
+/**
+ * @brief Find a block a client holds
+ *
+ * @return the location of the pointer to the block in the list, pointing to @c NULL if there is none
+ * @param node the client
+ * @param remote_addr the address of the block
+ */
+static struct alloc **alloc_find(struct cnode *node, uint64_t remote_addr){
+	struct alloc **ap;
+	for(ap = &alist_head; *ap != NULL; ap = &(*ap)->next)
+		if((*ap)->owner == node && (uint64_t)(*ap)->arena->mr->addr + (*ap)->offset == remote_addr)
+			break;
+	return ap;
+}
+
+/**
+ * @brief Handle a client's @c ALLOC of length 0, which finds a block it already holds
+ *
+ * After a session is resumed the blocks have no memory windows, this binds new ones.
+ * @return 0 on success, an errno value otherwise (also stored in @p req)
+ * @param node the client
+ * @param req the request, holding the address; filled in with the allocation
+ */
+static int arena_lookup(struct cnode *node, struct allocation *req){
+	struct alloc *al = *alloc_find(node, req->remote_addr);
+	req->status = 0;
+	if(al == NULL)
+		req->status = EINVAL;
+	else if(al->arena->windows && al->mw == NULL && alloc_bind(al))
+		req->status = EIO;
+	req->length = al != NULL ? al->length : 0;
+	req->rkey = req->status ? 0 : al->rkey;
+	fprintf(log_p, "Client %lu looked up 0x%llx: %s (rkey 0x%x).\n", node->cid,
+		(unsigned long long)req->remote_addr, req->status ? strerror(req->status) : "ok",
+		(unsigned int)req->rkey);
+	return req->status;
+}
+
+/**
+ * @brief Handle a client's @c ALLOC
+ *
+ * A new arena is made when none of the existing ones have room, up to @c MAX_ARENAS. A length of 0
+ * with the address of a block the client holds returns that block again (see arena_lookup()).
+ * @return 0 on success, an errno value otherwise (also stored in @p req)
+ * @param node the client
+ * @param pd the protection domain to register new arenas with
+ * @param req the request, holding the length; filled in with the allocation
+ */
+int arena_alloc(struct cnode *node, struct ibv_pd *pd, struct allocation *req){
+	struct arena *a = NULL;
+	struct alloc *al;
+	uint64_t offset, size;
+	int i, order = order_of(req->length);
+	if(req->length == 0 && req->remote_addr != 0)
+		return arena_lookup(node, req);
+	size = (uint64_t)1 << order;
+	req->remote_addr = 0;
+	req->rkey = 0;
+	req->status = 0;
+	if(req->length == 0 || order > order_of(arena_size))
+		req->status = EINVAL;
+	else if(node->allocated + size > node->quota)
+		req->status = EDQUOT;
+	if(req->status)
+		goto done;
+	for(i = 0; i < narenas; i++){
+		if(!take_block(&arenas[i], order, &offset)){
+			a = &arenas[i];
+			break;
+		}
+	}
+	if(a == NULL){
+		a = arena_create(pd, node->place);
+		if(a == NULL || take_block(a, order, &offset)){
+			req->status = ENOMEM;
+			goto done;
+		}
+	}
+	// Don't hand out what the last owner left behind
+	memset(a->mr->addr + offset, 0, size);
+	al = malloc(sizeof(*al));
+	al->arena = a;
+	al->offset = offset;
+	al->order = order;
+	al->length = req->length;
+	al->owner = node;
+	al->mw = NULL;
+	if(alloc_bind(al)){
+		put_block(a, offset, order);
+		free(al);
+		req->status = EIO;
+		goto done;
+	}
+	al->next = alist_head;
+	alist_head = al;
+	node->allocated += size;
+	req->remote_addr = (uint64_t)a->mr->addr + offset;
+	req->rkey = al->rkey;
+	done:
+	fprintf(log_p, "Client %lu allocated %llu bytes: %s (0x%llx, %llu of %llu bytes used).\n", node->cid,
+		(unsigned long long)req->length, req->status ? strerror(req->status) : "ok",
+		(unsigned long long)req->remote_addr, (unsigned long long)node->allocated,
+		(unsigned long long)node->quota);
+	return req->status;
+}
+
+/**
+ * @brief Handle a client's @c FREE
+ *
+ * @return 0 on success, an errno value otherwise (also stored in @p req)
+ * @param node the client
+ * @param req the request, holding the address of the allocation; filled in with what was freed
+ */
+int arena_free(struct cnode *node, struct allocation *req){
+	struct alloc **ap = alloc_find(node, req->remote_addr), *al;
+	if(*ap == NULL){
+		req->status = EINVAL;
+		fprintf(log_p, "Client %lu tried to free 0x%llx, which it doesn't hold.\n", node->cid,
+			(unsigned long long)req->remote_addr);
+		return req->status;
+	}
+	al = *ap;
+	*ap = al->next;
+	// The window goes first, so nothing reaches the block once someone else can get it
+	req->rkey = al->rkey;
+	alloc_unbind(al);
+	put_block(al->arena, al->offset, al->order);
+	node->allocated -= (uint64_t)1 << al->order;
+	req->length = al->length;
+	req->status = 0;
+	free(al);
+	fprintf(log_p, "Client %lu freed 0x%llx (%llu of %llu bytes used).\n", node->cid,
+		(unsigned long long)req->remote_addr, (unsigned long long)node->allocated,
+		(unsigned long long)node->quota);
+	return 0;
+}
+
+/**
+ * @brief Free everything a client still holds, for when its session ends
+ *
+ * @return @c NULL
+ * @param node the client
+ */
+void arena_release(struct cnode *node){
+	struct alloc **ap = &alist_head, *al;
+	while((al = *ap) != NULL){
+		if(al->owner == node){
+			alloc_unbind(al);
+			put_block(al->arena, al->offset, al->order);
+			*ap = al->next;
+			free(al);
+		} else {
+			ap = &al->next;
+		}
+	}
+	node->allocated = 0;
+}
+
+/**
+ * @brief Drop the memory windows of a client's blocks, for when its queue pair goes away
+ *
+ * The blocks stay the client's, arena_lookup() binds new windows once it resumes.
+ * @return @c NULL
+ * @param node the client
+ */
+void arena_detach(struct cnode *node){
+	struct alloc *al;
+	for(al = alist_head; al != NULL; al = al->next)
+		if(al->owner == node)
+			alloc_unbind(al);
+}
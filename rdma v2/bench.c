@@ -0,0 +1,978 @@
+/**
+ * @file bench.c
+ * @brief A benchmarking client for the RDMA server.
+ *
+ * Connects to the server the same way the regular client does and then runs timed rdma operations
+ * against its own server-side memory region. Running the same test against servers started with
+ * different options (e.g. @c -P @c local and @c -P @c remote) gives a direct comparison.
+ * Backup servers given with @c -b are only written to by the @c repl test.
+ */
+#include "rdma_cs.h"
+#include "mirror.h"
+#include "rpc.h"
+#include "submit.h"
+#include "regcache.h"
+#include <time.h>
+
+/**
+ * @brief Everything a test needs to know about the connection
+ */
+struct bench {
+	struct rdma_cm_id *id;		/**< The connection to the server */
+	struct ibv_mr *mr;			/**< The local memory region used as the source/destination */
+	uint64_t remote_addr;		/**< The address of the server-side memory region */
+	uint32_t rkey;				/**< The rkey of the server-side memory region */
+	size_t remote_len;			/**< The length of the server-side memory region */
+	size_t size;				/**< The size of each operation */
+	unsigned long iters;		/**< How many operations to time */
+	unsigned int depth;			/**< How many operations may be outstanding at once */
+	unsigned int every;			/**< How often a windowed operation is signaled */
+	uint32_t inline_data;		/**< The most bytes the connection's queue pair was created to send inline */
+	unsigned long cqes;			/**< The amount of completions the last windowed run polled */
+	struct mirror_set mirrors;	/**< The backup servers writes are replicated to */
+	struct rpc_client rpc;		/**< The calls made to the server */
+};
+
+/**
+ * @brief A single named benchmark
+ */
+struct bench_test {
+	const char *name;				/**< The name used to select the test */
+	const char *desc;				/**< A short description for the usage message */
+	void (*run)(struct bench *);	/**< The function running the test */
+};
+
+static void test_lat(struct bench *);
+static void test_bw(struct bench *);
+static void test_touch(struct bench *);
+static void test_alloc(struct bench *);
+static void test_repl(struct bench *);
+static void test_flush(struct bench *);
+static void test_csum(struct bench *);
+static void test_copy(struct bench *);
+static void test_rpc(struct bench *);
+static void test_mt(struct bench *);
+static void test_signal(struct bench *);
+static void test_reg(struct bench *);
+
+/**
+ * @brief All of the available tests
+ */
+static struct bench_test tests[] = {
+	{"lat", "read/write latency, one operation at a time, for sizes up to -s", test_lat},
+	{"bw", "read/write throughput with -d operations in flight", test_bw},
+	{"touch", "first touch vs. steady state writes across the whole region (for -O odp servers)", test_touch},
+	{"alloc", "ALLOC/write/FREE round trips of -s bytes against the server's arenas", test_alloc},
+	{"repl", "writes to the primary alone vs. replicated to the -b backups, at depth 1 and -d", test_repl},
+	{"flush", "write latency alone, followed by FLUSH, and while a SNAPSHOT runs (for -f servers)", test_flush},
+	{"csum", "verifying -s bytes by reading them back vs. a server-side CHECKSUM", test_csum},
+	{"copy", "moving -s bytes within the region by read+write vs. a server-side COPY", test_copy},
+	{"rpc", "PING calls one at a time vs. pipelined -d and more deep (the server batches answers)", test_rpc},
+	{"mt", "writes from 1 to 32 threads sharing the connection, behind a lock vs. a submission queue", test_mt},
+	{"signal", "writes and inline writes with every operation signaled vs. one in -d", test_signal},
+	{"reg", "reads of -s bytes into buffers registered for each read vs. through the registration cache", test_reg},
+	{NULL, NULL, NULL}
+};
+
+/**
+ * @brief Get a monotonic timestamp
+ *
+ * @return the current time in nanoseconds
+ */
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Comparison function for sorting latencies with qsort()
+ */
+static int cmp_u64(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Post a single rdma read or write from the local memory region
+ *
+ * @return @c NULL
+ * @param b the benchmark
+ * @param opcode either @c IBV_WR_RDMA_READ or @c IBV_WR_RDMA_WRITE
+ * @param offset the offset into the server-side memory region
+ * @param length the amount of bytes to transfer
+ */
+static void post_rdma(struct bench *b, enum ibv_wr_opcode opcode, uint64_t offset, uint32_t length){
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+	sge.addr = (uint64_t)b->mr->addr;
+	sge.length = length;
+	sge.lkey = b->mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = opcode;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.wr.rdma.remote_addr = b->remote_addr + offset;
+	wr.wr.rdma.rkey = b->rkey;
+	if(rdma_seterrno(ibv_post_send(b->id->qp, &wr, &bad)))
+		stop_it("ibv_post_send()", errno, stderr);
+}
+
+/**
+ * @brief Busy poll the send completion queue
+ *
+ * The function will call exit(-1) if any of the completions failed
+ * @return the amount of completions pulled (at least 1)
+ * @param b the benchmark
+ * @param max the max amount of completions to pull
+ */
+static int poll_some(struct bench *b, int max){
+	struct ibv_wc wc[16];
+	int i, n;
+	if(max > 16)
+		max = 16;
+	do {
+		n = ibv_poll_cq(b->id->send_cq, max, wc);
+	} while(n == 0);
+	if(n < 0)
+		stop_it("ibv_poll_cq()", errno, stderr);
+	for(i = 0; i < n; i++){
+		if(wc[i].status){
+			fprintf(stderr, "Operation failed: %s\n", ibv_wc_status_str(wc[i].status));
+			exit(-1);
+		}
+	}
+	return n;
+}
+
+/**
+ * @brief Post a numbered rdma read or write from the local memory region
+ *
+ * @return @c NULL
+ * @param b the benchmark
+ * @param opcode either @c IBV_WR_RDMA_READ or @c IBV_WR_RDMA_WRITE
+ * @param offset the offset into the server-side memory region
+ * @param length the amount of bytes to transfer
+ * @param flags the send flags, without @c IBV_SEND_SIGNALED the operation has no completion of its own
+ * @param seq the sequence number of the operation, returned by poll_seq() once it completed
+ */
+static void post_seq(struct bench *b, enum ibv_wr_opcode opcode, uint64_t offset, uint32_t length, int flags,
+	unsigned long seq){
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+	sge.addr = (uint64_t)b->mr->addr;
+	sge.length = length;
+	sge.lkey = b->mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = seq;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = opcode;
+	wr.send_flags = flags;
+	wr.wr.rdma.remote_addr = b->remote_addr + offset;
+	wr.wr.rdma.rkey = b->rkey;
+	if(rdma_seterrno(ibv_post_send(b->id->qp, &wr, &bad)))
+		stop_it("ibv_post_send()", errno, stderr);
+}
+
+/**
+ * @brief Busy poll the send completion queue for operations posted with post_seq()
+ *
+ * Operations complete in order, so a completion also stands for every unsignaled one posted
+ * before it. The function will call exit(-1) if any of the completions failed.
+ * @return the sequence number of the last operation completed
+ * @param b the benchmark
+ */
+static unsigned long poll_seq(struct bench *b){
+	struct ibv_wc wc[16];
+	int i, n;
+	do {
+		n = ibv_poll_cq(b->id->send_cq, 16, wc);
+	} while(n == 0);
+	if(n < 0)
+		stop_it("ibv_poll_cq()", errno, stderr);
+	for(i = 0; i < n; i++){
+		if(wc[i].status){
+			fprintf(stderr, "Operation failed: %s\n", ibv_wc_status_str(wc[i].status));
+			exit(-1);
+		}
+	}
+	b->cqes += n;
+	return wc[n - 1].wr_id;
+}
+
+/**
+ * @brief Decide whether a windowed operation gets signaled
+ *
+ * Besides every @p every th one, the operation that fills the window and the last one are
+ * signaled, so there is always a completion on its way when the caller stops to poll.
+ * @return @c IBV_SEND_SIGNALED or 0
+ * @param b the benchmark
+ * @param seq the sequence number of the operation, starting at 1
+ * @param done the sequence number of the last completed operation
+ * @param depth how many operations may be outstanding at once
+ * @param every how often to signal
+ */
+static int signal_at(struct bench *b, unsigned long seq, unsigned long done, unsigned int depth,
+	unsigned int every){
+	return seq % every == 0 || seq == b->iters || seq - done == depth ? IBV_SEND_SIGNALED : 0;
+}
+
+/**
+ * @brief Time -n operations of one kind, keeping up to -d of them in flight
+ *
+ * @return the time the operations took in nanoseconds, @c b->cqes holds the completions they needed
+ * @param b the benchmark
+ * @param opcode either @c IBV_WR_RDMA_READ or @c IBV_WR_RDMA_WRITE
+ * @param flags extra send flags
+ * @param size the size of each operation
+ * @param every how often to signal
+ */
+static uint64_t run_window(struct bench *b, enum ibv_wr_opcode opcode, int flags, size_t size, unsigned int every){
+	unsigned long posted = 0, done = 0;
+	uint64_t start = now_ns();
+	b->cqes = 0;
+	while(done < b->iters){
+		while(posted < b->iters && posted - done < b->depth){
+			posted++;
+			post_seq(b, opcode, ((posted - 1) * size) % (b->remote_len - size + 1), size,
+				flags | signal_at(b, posted, done, b->depth, every), posted);
+		}
+		done = poll_seq(b);
+	}
+	return now_ns() - start;
+}
+
+/**
+ * @brief Wait for a message from the server, skipping directory updates
+ *
+ * The receive buffer is reposted for every message pulled.
+ * @return @c NULL
+ * @param b the benchmark
+ * @param want the opcode to wait for
+ */
+static void wait_for(struct bench *b, uint32_t want){
+	uint32_t op;
+	void *msg;
+	while(!b->rpc.failed){
+		op = rpc_recv(&b->rpc, &msg);
+		rpc_repost(&b->rpc, msg);
+		if(op == want)
+			return;
+	}
+}
+
+/**
+ * @brief Measure the latency of single reads and writes
+ *
+ * Every power of two size from 8 bytes up to the chosen size is tested.
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_lat(struct bench *b){
+	enum ibv_wr_opcode ops[2] = {IBV_WR_RDMA_WRITE, IBV_WR_RDMA_READ};
+	uint64_t *lat = malloc(b->iters * sizeof(*lat));
+	uint64_t start, total;
+	unsigned long i;
+	size_t size;
+	int op;
+	printf("%-6s %10s %10s %10s %10s %10s\n", "op", "bytes", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+	for(op = 0; op < 2; op++){
+		for(size = 8; size <= b->size; size *= 2){
+			total = 0;
+			for(i = 0; i < b->iters; i++){
+				start = now_ns();
+				post_rdma(b, ops[op], (i * size) % (b->remote_len - size + 1), size);
+				poll_some(b, 1);
+				lat[i] = now_ns() - start;
+				total += lat[i];
+			}
+			qsort(lat, b->iters, sizeof(*lat), cmp_u64);
+			printf("%-6s %10zu %10.2f %10.2f %10.2f %10.2f\n", op ? "read" : "write", size,
+				total / 1000.0 / b->iters, lat[b->iters / 2] / 1000.0,
+				lat[b->iters * 99 / 100] / 1000.0, lat[b->iters - 1] / 1000.0);
+		}
+	}
+	free(lat);
+}
+
+/**
+ * @brief Measure the throughput of reads and writes with several operations in flight
+ *
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_bw(struct bench *b){
+	enum ibv_wr_opcode ops[2] = {IBV_WR_RDMA_WRITE, IBV_WR_RDMA_READ};
+	uint64_t elapsed;
+	int op;
+	printf("%-6s %10s %6s %10s %10s %10s %8s\n", "op", "bytes", "depth", "ops", "MB/s", "Mops/s", "cqe/op");
+	for(op = 0; op < 2; op++){
+		elapsed = run_window(b, ops[op], 0, b->size, b->every);
+		printf("%-6s %10zu %6u %10lu %10.1f %10.3f %8.3f\n", op ? "read" : "write", b->size, b->depth,
+			b->iters, (double)b->iters * b->size * 1000.0 / elapsed, (double)b->iters * 1000.0 / elapsed,
+			(double)b->cqes / b->iters);
+	}
+}
+
+/**
+ * @brief Measure what faulting in the server-side memory region costs
+ *
+ * The whole region is written twice in -s sized pieces. On a server with on-demand paging the first
+ * pass takes the page faults, the second one runs at full speed; on a pinned server both should match.
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_touch(struct bench *b){
+	unsigned long posted, done, count = (b->remote_len + b->size - 1) / b->size;
+	uint64_t start, elapsed, offset;
+	int pass;
+	printf("%-8s %14s %10s %10s %10s\n", "pass", "bytes", "ms", "MB/s", "us/op");
+	for(pass = 0; pass < 2; pass++){
+		posted = done = 0;
+		start = now_ns();
+		while(done < count){
+			while(posted < count && posted - done < b->depth){
+				offset = posted * b->size;
+				post_rdma(b, IBV_WR_RDMA_WRITE, offset,
+					offset + b->size > b->remote_len ? b->remote_len - offset : b->size);
+				posted++;
+			}
+			done += poll_some(b, posted - done);
+		}
+		elapsed = now_ns() - start;
+		printf("%-8s %14zu %10.3f %10.1f %10.2f\n", pass ? "steady" : "first", b->remote_len,
+			elapsed / 1e6, (double)b->remote_len * 1000.0 / elapsed, elapsed / 1000.0 / count);
+	}
+}
+
+/**
+ * @brief Measure remote allocation round trips
+ *
+ * Each iteration allocates -s bytes, writes them once and frees them again, so it shows what a
+ * client pays for an object compared to registering memory of its own.
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_alloc(struct bench *b){
+	struct allocation req;
+	uint64_t *lat[2], start;
+	unsigned long i, failed = 0;
+	int op, err;
+	lat[0] = malloc(b->iters * sizeof(*lat[0]));
+	lat[1] = malloc(b->iters * sizeof(*lat[1]));
+	for(i = 0; i < b->iters; i++){
+		memset(&req, 0, sizeof(req));
+		req.length = b->size;
+		start = now_ns();
+		err = rpc_call(&b->rpc, ALLOC, &req, sizeof(req), &req, sizeof(req));
+		lat[0][i] = now_ns() - start;
+		if(err){
+			if(!failed++)
+				printf("ALLOC failed: %s\n", strerror(err));
+			lat[1][i] = 0;
+			continue;
+		}
+		// Make sure the rkey really works before giving it back
+		b->remote_addr = req.remote_addr;
+		b->rkey = req.rkey;
+		post_rdma(b, IBV_WR_RDMA_WRITE, 0, b->size);
+		poll_some(b, 1);
+		start = now_ns();
+		rpc_call(&b->rpc, FREE, &req, sizeof(req), &req, sizeof(req));
+		lat[1][i] = now_ns() - start;
+	}
+	printf("%-6s %10s %10s %10s %10s %10s\n", "op", "bytes", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+	for(op = 0; op < 2; op++){
+		for(start = 0, i = 0; i < b->iters; i++)
+			start += lat[op][i];
+		qsort(lat[op], b->iters, sizeof(*lat[op]), cmp_u64);
+		printf("%-6s %10zu %10.2f %10.2f %10.2f %10.2f\n", op ? "free" : "alloc", b->size,
+			start / 1000.0 / b->iters, lat[op][b->iters / 2] / 1000.0,
+			lat[op][b->iters * 99 / 100] / 1000.0, lat[op][b->iters - 1] / 1000.0);
+		free(lat[op]);
+	}
+	if(failed)
+		printf("%lu of %lu allocations failed.\n", failed, b->iters);
+}
+
+/**
+ * @brief Call @c FLUSH or @c SNAPSHOT
+ *
+ * @return 0 on success, an errno value otherwise
+ * @param b the benchmark
+ * @param op either @c FLUSH or @c SNAPSHOT
+ * @param offset the start of the range
+ * @param length the length of the range
+ */
+static int persist_op(struct bench *b, uint32_t op, uint64_t offset, uint64_t length){
+	struct flush_request req;
+	memset(&req, 0, sizeof(req));
+	req.offset = offset;
+	req.length = length;
+	return rpc_call(&b->rpc, op, &req, sizeof(req), &req, sizeof(req));
+}
+
+/**
+ * @brief Measure what making writes durable costs, and that snapshots don't get in the way of writes
+ *
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_flush(struct bench *b){
+	const char *modes[3] = {"write", "write+flush", "w/snapshot"};
+	uint64_t *lat = malloc(b->iters * sizeof(*lat));
+	uint64_t start, total, offset;
+	unsigned long i;
+	int mode, err;
+	printf("%-12s %10s %10s %10s %10s %10s\n", "op", "bytes", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+	for(mode = 0; mode < 3; mode++){
+		if(mode == 2 && (err = persist_op(b, SNAPSHOT, 0, 0))){
+			printf("SNAPSHOT failed: %s\n", strerror(err));
+			break;
+		}
+		total = 0;
+		for(i = 0; i < b->iters; i++){
+			offset = (i * b->size) % (b->remote_len - b->size + 1);
+			start = now_ns();
+			post_rdma(b, IBV_WR_RDMA_WRITE, offset, b->size);
+			poll_some(b, 1);
+			if(mode == 1 && (err = persist_op(b, FLUSH, offset, b->size))){
+				printf("FLUSH failed: %s\n", strerror(err));
+				free(lat);
+				return;
+			}
+			lat[i] = now_ns() - start;
+			total += lat[i];
+		}
+		qsort(lat, b->iters, sizeof(*lat), cmp_u64);
+		printf("%-12s %10zu %10.2f %10.2f %10.2f %10.2f\n", modes[mode], b->size,
+			total / 1000.0 / b->iters, lat[b->iters / 2] / 1000.0,
+			lat[b->iters * 99 / 100] / 1000.0, lat[b->iters - 1] / 1000.0);
+	}
+	free(lat);
+}
+
+/**
+ * @brief Measure what verifying a range costs, reading it back vs. having the server checksum it
+ *
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_csum(struct bench *b){
+	const char *modes[2] = {"read+crc", "checksum"};
+	struct checksum_request req;
+	uint64_t *lat = malloc(b->iters * sizeof(*lat));
+	uint64_t start, total, offset;
+	uint32_t crc = 0;
+	unsigned long i;
+	int mode, err;
+	printf("CRC32C implementation: %s\n", crc32c_name());
+	printf("%-10s %10s %10s %10s %10s %10s\n", "op", "bytes", "avg(us)", "p50(us)", "p99(us)", "MB/s");
+	for(mode = 0; mode < 2; mode++){
+		total = 0;
+		for(i = 0; i < b->iters; i++){
+			offset = (i * b->size) % (b->remote_len - b->size + 1);
+			start = now_ns();
+			if(mode == 0){
+				post_rdma(b, IBV_WR_RDMA_READ, offset, b->size);
+				poll_some(b, 1);
+				crc = crc32c(0, b->mr->addr, b->size);
+			} else {
+				memset(&req, 0, sizeof(req));
+				req.offset = offset;
+				req.length = b->size;
+				if((err = rpc_call(&b->rpc, CHECKSUM, &req, sizeof(req), &req, sizeof(req)))){
+					printf("CHECKSUM failed: %s\n", strerror(err));
+					free(lat);
+					return;
+				}
+				crc = req.crc;
+			}
+			lat[i] = now_ns() - start;
+			total += lat[i];
+		}
+		qsort(lat, b->iters, sizeof(*lat), cmp_u64);
+		printf("%-10s %10zu %10.2f %10.2f %10.2f %10.1f\n", modes[mode], b->size, total / 1000.0 / b->iters,
+			lat[b->iters / 2] / 1000.0, lat[b->iters * 99 / 100] / 1000.0,
+			(double)b->iters * b->size * 1000.0 / total);
+	}
+	printf("Last digest: %08x\n", (unsigned int)crc);
+	free(lat);
+}
+
+/**
+ * @brief Measure moving data between two ranges, through the client vs. a server-side @c COPY
+ *
+ * The first half of the region is copied into the second half.
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_copy(struct bench *b){
+	const char *modes[2] = {"read+write", "copy"};
+	struct compute_request req;
+	uint64_t *lat = malloc(b->iters * sizeof(*lat));
+	uint64_t start, total, offset, half = b->remote_len / 2;
+	unsigned long i;
+	int mode, err;
+	if(b->size > half){
+		printf("Size must be at most half of the region (%llu bytes).\n", (unsigned long long)half);
+		free(lat);
+		return;
+	}
+	printf("%-10s %10s %10s %10s %10s %10s\n", "op", "bytes", "avg(us)", "p50(us)", "p99(us)", "MB/s");
+	for(mode = 0; mode < 2; mode++){
+		total = 0;
+		for(i = 0; i < b->iters; i++){
+			offset = (i * b->size) % (half - b->size + 1);
+			start = now_ns();
+			if(mode == 0){
+				post_rdma(b, IBV_WR_RDMA_READ, offset, b->size);
+				poll_some(b, 1);
+				post_rdma(b, IBV_WR_RDMA_WRITE, half + offset, b->size);
+				poll_some(b, 1);
+			} else {
+				memset(&req, 0, sizeof(req));
+				req.dst_offset = half + offset;
+				req.src_offset = offset;
+				req.length = b->size;
+				if((err = rpc_call(&b->rpc, COPY, &req, sizeof(req), &req, sizeof(req)))){
+					printf("COPY failed: %s\n", strerror(err));
+					free(lat);
+					return;
+				}
+			}
+			lat[i] = now_ns() - start;
+			total += lat[i];
+		}
+		qsort(lat, b->iters, sizeof(*lat), cmp_u64);
+		printf("%-10s %10zu %10.2f %10.2f %10.2f %10.1f\n", modes[mode], b->size, total / 1000.0 / b->iters,
+			lat[b->iters / 2] / 1000.0, lat[b->iters * 99 / 100] / 1000.0,
+			(double)b->iters * b->size * 1000.0 / total);
+	}
+	free(lat);
+}
+
+/**
+ * @brief Time writes to the primary, optionally replicated to every mirror
+ *
+ * A replicated write only counts as done once the primary and every live mirror completed it.
+ * @return the time the writes took in nanoseconds
+ * @param b the benchmark
+ * @param mirrored 1 to replicate the writes
+ * @param depth how many writes may be outstanding at once
+ */
+static uint64_t run_writes(struct bench *b, uint8_t mirrored, unsigned int depth){
+	unsigned long posted = 0, primary = 0, done = 0, base = b->mirrors.posted, mirrors;
+	uint64_t start = now_ns(), offset;
+	int flags;
+	while(done < b->iters){
+		while(posted < b->iters && posted - done < depth){
+			offset = (posted * b->size) % (b->remote_len - b->size + 1);
+			posted++;
+			flags = signal_at(b, posted, done, depth, b->every);
+			post_seq(b, IBV_WR_RDMA_WRITE, offset, b->size, flags, posted);
+			if(mirrored)
+				mirror_write(&b->mirrors, offset, b->mr->addr, b->size, flags, stdout);
+		}
+		if(primary < posted)
+			primary = poll_seq(b);
+		mirrors = mirrored ? mirror_done(&b->mirrors, stdout) - base : posted;
+		done = primary < mirrors ? primary : mirrors;
+	}
+	return now_ns() - start;
+}
+
+/**
+ * @brief Measure what replicating writes costs in latency and throughput
+ *
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_repl(struct bench *b){
+	unsigned int depths[2] = {1, b->depth};
+	uint64_t elapsed;
+	int d, mirrored;
+	if(b->mirrors.n == 0){
+		printf("No backup servers to replicate to, add some with -b address:port.\n");
+		return;
+	}
+	printf("%-12s %10s %6s %10s %10s %10s\n", "mode", "bytes", "depth", "us/op", "MB/s", "Mops/s");
+	for(d = 0; d < 2; d++){
+		for(mirrored = 0; mirrored < 2; mirrored++){
+			elapsed = run_writes(b, mirrored, depths[d]);
+			printf("%-12s %10zu %6u %10.2f %10.1f %10.3f\n", mirrored ? "replicated" : "primary",
+				b->size, depths[d], elapsed / 1000.0 / b->iters, (double)b->iters * b->size * 1000.0 / elapsed,
+				(double)b->iters * 1000.0 / elapsed);
+		}
+	}
+}
+
+/**
+ * @brief Measure the call path, with one call outstanding at a time and with several
+ *
+ * With several outstanding, calls go out together and the server answers the ones that finish
+ * close together in one message, so the cost per call drops.
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_rpc(struct bench *b){
+	unsigned int depths[3] = {1, b->depth, RPC_MAX_OUTSTANDING};
+	int handles[RPC_MAX_OUTSTANDING];
+	uint8_t args[RPC_MAX_ARGS], result[RPC_MAX_ARGS];
+	uint16_t len = b->size < RPC_MAX_ARGS ? b->size : RPC_MAX_ARGS;
+	unsigned long started, done;
+	uint64_t start, elapsed;
+	int d, err;
+	memset(args, 0xab, sizeof(args));
+	printf("%-8s %10s %6s %10s %10s\n", "op", "bytes", "depth", "us/call", "Kcalls/s");
+	for(d = 0; d < 3; d++){
+		started = done = 0;
+		start = now_ns();
+		while(done < b->iters){
+			while(started < b->iters && started - done < depths[d])
+				handles[started++ % depths[d]] = rpc_start(&b->rpc, PING, args, len, result, sizeof(result));
+			if((err = rpc_wait(&b->rpc, handles[done++ % depths[d]]))){
+				printf("PING failed: %s\n", strerror(err));
+				return;
+			}
+		}
+		elapsed = now_ns() - start;
+		printf("%-8s %10u %6u %10.2f %10.1f\n", "ping", (unsigned int)len, depths[d], elapsed / 1000.0 / b->iters,
+			(double)b->iters * 1e6 / elapsed);
+	}
+	printf("The server log shows how many messages the answers went out in.\n");
+}
+
+/**
+ * @brief The most threads the @c mt test runs
+ */
+#define MT_MAX_THREADS	32
+
+/**
+ * @brief One of the threads of the @c mt test
+ */
+struct mt_worker {
+	struct bench *b;			/**< The benchmark */
+	struct submit_queue *sq;	/**< The submission queue, @c NULL to take @c lock around each write */
+	pthread_mutex_t *lock;		/**< The lock serializing the connection */
+	struct ibv_mr *mr;			/**< The local memory region, each thread uses its own slice of it */
+	unsigned int index;			/**< The index of the thread */
+	unsigned int threads;		/**< The amount of threads */
+	unsigned long ops;			/**< The amount of writes to do */
+};
+
+/**
+ * @brief The function for the threads of the @c mt test
+ *
+ * @return @c NULL
+ * @param arg the @c struct @c mt_worker
+ */
+static void *mt_thread(void *arg){
+	struct mt_worker *w = arg;
+	struct bench *b = w->b;
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+	uint8_t *local = (uint8_t *)w->mr->addr + w->index * b->size;
+	uint64_t offset;
+	unsigned long i;
+	int status;
+	for(i = 0; i < w->ops; i++){
+		offset = ((w->index + i * w->threads) * b->size) % (b->remote_len - b->size + 1);
+		if(w->sq != NULL){
+			status = sq_rdma(w->sq, IBV_WR_RDMA_WRITE, local, w->mr->lkey, b->size, b->remote_addr + offset, b->rkey);
+			if(status){
+				fprintf(stderr, "Operation failed: %s\n", ibv_wc_status_str(status));
+				exit(-1);
+			}
+			continue;
+		}
+		sge.addr = (uint64_t)local;
+		sge.length = b->size;
+		sge.lkey = w->mr->lkey;
+		memset(&wr, 0, sizeof(wr));
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr.opcode = IBV_WR_RDMA_WRITE;
+		wr.send_flags = IBV_SEND_SIGNALED;
+		wr.wr.rdma.remote_addr = b->remote_addr + offset;
+		wr.wr.rdma.rkey = b->rkey;
+		pthread_mutex_lock(w->lock);
+		if(rdma_seterrno(ibv_post_send(b->id->qp, &wr, &bad)))
+			stop_it("ibv_post_send()", errno, stderr);
+		poll_some(b, 1);
+		pthread_mutex_unlock(w->lock);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Measure how writes from many threads scale on one connection
+ *
+ * Each thread does one write at a time. Behind a lock only one write is ever in flight, while
+ * the submission queue posts whatever the threads pushed in one go and keeps up to
+ * @c tune.send_wr in flight.
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_mt(struct bench *b){
+	struct mt_worker workers[MT_MAX_THREADS];
+	pthread_t threads[MT_MAX_THREADS];
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct submit_queue sq;
+	struct ibv_mr *mr;
+	unsigned long total, posts, cqes;
+	unsigned int n, i;
+	uint64_t start, elapsed;
+	int queued, err;
+	mr = ibv_reg_mr(b->id->qp->pd, malloc(MT_MAX_THREADS * b->size), MT_MAX_THREADS * b->size, IBV_ACCESS_LOCAL_WRITE);
+	if(mr == NULL)
+		stop_it("ibv_reg_mr()", errno, stderr);
+	memset(mr->addr, 0xab, MT_MAX_THREADS * b->size);
+	printf("%-8s %10s %8s %10s %10s %10s %10s\n", "mode", "bytes", "threads", "us/op", "Kops/s", "ops/post",
+		"ops/cqe");
+	for(queued = 0; queued < 2; queued++){
+		for(n = 1; n <= MT_MAX_THREADS; n *= 2){
+			if(queued)
+				sq_start(&sq, b->id, stderr);
+			total = 0;
+			start = now_ns();
+			for(i = 0; i < n; i++){
+				workers[i].b = b;
+				workers[i].sq = queued ? &sq : NULL;
+				workers[i].lock = &lock;
+				workers[i].mr = mr;
+				workers[i].index = i;
+				workers[i].threads = n;
+				workers[i].ops = b->iters / n + (i < b->iters % n);
+				total += workers[i].ops;
+				if((err = pthread_create(&threads[i], NULL, mt_thread, &workers[i])))
+					stop_it("pthread_create()", err, stderr);
+			}
+			for(i = 0; i < n; i++)
+				pthread_join(threads[i], NULL);
+			elapsed = now_ns() - start;
+			posts = cqes = total;
+			if(queued){
+				sq_stop(&sq);
+				posts = sq.posts;
+				cqes = sq.completions;
+			}
+			printf("%-8s %10zu %8u %10.2f %10.1f %10.2f %10.2f\n", queued ? "queued" : "locked", b->size, n,
+				elapsed / 1000.0 / total, (double)total * 1e6 / elapsed, (double)total / posts, (double)total / cqes);
+		}
+	}
+	void *buf = mr->addr;
+	ibv_dereg_mr(mr);
+	free(buf);
+}
+
+/**
+ * @brief Measure what signaling every operation costs, for regular and inline writes
+ *
+ * With one operation in -d signaled the completion queue sees that many times fewer entries, and
+ * the send queue slots of the unsignaled operations are freed by the completion behind them.
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_signal(struct bench *b){
+	unsigned int every[2] = {1, b->depth};
+	size_t inline_size = b->size < b->inline_data ? b->size : b->inline_data;
+	uint64_t elapsed[2];
+	int mode, e;
+	printf("%-8s %10s %6s %6s %8s %10s %8s\n", "op", "bytes", "depth", "every", "cqe/op", "Mops/s", "gain");
+	for(mode = 0; mode < 2; mode++){
+		for(e = 0; e < 2; e++){
+			elapsed[e] = run_window(b, IBV_WR_RDMA_WRITE, mode ? IBV_SEND_INLINE : 0, mode ? inline_size : b->size,
+				every[e]);
+			printf("%-8s %10zu %6u %6u %8.3f %10.3f", mode ? "inline" : "write", mode ? inline_size : b->size,
+				b->depth, every[e], (double)b->cqes / b->iters, (double)b->iters * 1000.0 / elapsed[e]);
+			if(e)
+				printf(" %7.1f%%\n", (double)elapsed[0] * 100.0 / elapsed[1] - 100.0);
+			else
+				printf(" %8s\n", "-");
+		}
+	}
+}
+
+/**
+ * @brief Measure what registering the destination of every read costs against reusing cached registrations
+ *
+ * Reads rotate over a few buffers, like a client reading into whatever buffer it was handed. One pass
+ * registers and deregisters each buffer around its read, the other gets it from the registration cache.
+ * @return @c NULL
+ * @param b the benchmark
+ */
+static void test_reg(struct bench *b){
+	struct ibv_mr *own = b->mr;
+	struct reg_cache regs;
+	void *bufs[4];
+	uint64_t *lat = malloc(b->iters * sizeof(*lat));
+	uint64_t start, total;
+	unsigned long i;
+	int mode;
+	for(i = 0; i < 4; i++)
+		if(posix_memalign(&bufs[i], sysconf(_SC_PAGESIZE), b->size))
+			stop_it("posix_memalign()", ENOMEM, stderr);
+	reg_cache_init(&regs, own->pd, 0, stderr);
+	printf("%-6s %10s %10s %10s %10s %10s\n", "reg", "bytes", "avg(us)", "p50(us)", "p99(us)", "hits");
+	for(mode = 0; mode < 2; mode++){
+		total = 0;
+		for(i = 0; i < b->iters; i++){
+			start = now_ns();
+			if(mode)
+				b->mr = reg_get(&regs, bufs[i % 4], b->size, IBV_ACCESS_LOCAL_WRITE);
+			else
+				b->mr = ibv_reg_mr(own->pd, bufs[i % 4], b->size, IBV_ACCESS_LOCAL_WRITE);
+			if(b->mr == NULL)
+				stop_it("registering", errno, stderr);
+			post_rdma(b, IBV_WR_RDMA_READ, (i * b->size) % (b->remote_len - b->size + 1), b->size);
+			poll_some(b, 1);
+			if(mode)
+				reg_put(&regs, b->mr);
+			else if(ibv_dereg_mr(b->mr))
+				stop_it("ibv_dereg_mr()", errno, stderr);
+			lat[i] = now_ns() - start;
+			total += lat[i];
+		}
+		qsort(lat, b->iters, sizeof(*lat), cmp_u64);
+		printf("%-6s %10zu %10.2f %10.2f %10.2f %10lu\n", mode ? "cached" : "each", b->size,
+			total / 1000.0 / b->iters, lat[b->iters / 2] / 1000.0, lat[b->iters * 99 / 100] / 1000.0,
+			mode ? regs.hits : 0);
+	}
+	b->mr = own;
+	for(i = 0; i < 4; i++)
+		reg_free(&regs, bufs[i]);
+	reg_cache_destroy(&regs);
+	free(lat);
+}
+
+int main(int argc, char **argv){
+	struct bench b;
+	struct bench_test *test = &tests[0];
+	char *backups[MAX_MIRRORS];
+	int nbackups = 0;
+	int opt;
+	memset(&b, 0, sizeof(b));
+	b.size = 64;
+	b.iters = 10000;
+	// The server's region size unless one is asked for
+	tune.server_mr_size = 0;
+	while((opt = getopt(argc, argv, "t:s:n:d:S:b:o:F:")) != -1){
+		switch(opt){
+			case 'o':
+				if(tune_set(&tune, optarg)){
+					printf("Invalid setting '%s'.\n", optarg);
+					return -1;
+				}
+				break;
+			case 'F':
+				if(tune_load(&tune, optarg, stdout))
+					return -1;
+				break;
+			case 't':
+				for(test = tests; test->name != NULL; test++)
+					if(!strcmp(test->name, optarg))
+						break;
+				if(test->name == NULL){
+					printf("Unknown test '%s'.\n", optarg);
+					return -1;
+				}
+				break;
+			case 's':
+				b.size = strtoull(optarg, NULL, 0);
+				break;
+			case 'n':
+				b.iters = strtoul(optarg, NULL, 0);
+				break;
+			case 'd':
+				b.depth = atoi(optarg);
+				break;
+			case 'S':
+				b.every = atoi(optarg);
+				break;
+			case 'b':
+				if(nbackups == MAX_MIRRORS){
+					printf("At most %d backup servers.\n", MAX_MIRRORS);
+					return -1;
+				}
+				backups[nbackups++] = optarg;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if(argc - optind != 2)
+		goto usage;
+	// As deep as the send queue unless asked otherwise
+	if(b.depth == 0)
+		b.depth = tune.send_wr;
+	if(b.depth < 1 || b.depth > tune.send_wr){
+		printf("Depth must be between 1 and %u (set send_wr for more).\n", tune.send_wr);
+		return -1;
+	}
+	// Signal once per window unless asked otherwise
+	if(b.every == 0)
+		b.every = b.depth;
+	if(b.size < 8 || b.iters < 1){
+		printf("Invalid size and/or iteration count.\n");
+		return -1;
+	}
+	// Connect the same way the client does
+	struct rdma_event_channel *event_channel = rdma_create_event_channel();
+	if(event_channel == NULL)
+		stop_it("rdma_create_event_channel()", errno, stderr);
+	if(rdma_create_id(event_channel, &b.id, NULL, RDMA_PS_TCP))
+		stop_it("rdma_create_id()", errno, stderr);
+	struct session session;
+	memset(&session, 0, sizeof(session));
+	session.credits = 1;
+	tune_ask(&session, &tune);
+	connect_four(b.id, event_channel, argv[optind], atoi(argv[optind + 1]), &session, sizeof(session));
+	tune_take(&tune, &session);
+	// The queue pair was just created with this, the backups' may lower the global after it
+	b.inline_data = tune.inline_data;
+	if(b.depth > tune.send_wr){
+		printf("The server granted a send queue of %u, running at that depth.\n", tune.send_wr);
+		b.depth = tune.send_wr;
+		if(b.every > b.depth)
+			b.every = b.depth;
+	}
+	// The buffer doubles as the swap_info() scratch space, so it needs room for that too, and the
+	// receive count the server reads for flow control goes at the end
+	size_t local_len = b.size < 64 ? 64 : b.size;
+	b.mr = ibv_reg_mr(b.id->qp->pd, calloc(1, local_len + FLOW_BYTES), local_len + FLOW_BYTES,
+	 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+	if(b.mr == NULL)
+		stop_it("ibv_reg_mr()", errno, stderr);
+	swap_info(b.id, b.mr, b.mr, &b.rkey, &b.remote_addr, &b.remote_len, stdout);
+	struct flow flow;
+	if(session.credits){
+		flow_init(&flow, b.id, b.mr, (uint64_t *)((uint8_t *)b.mr->addr + local_len));
+		flow_peer(&flow, session.credit_addr, session.credit_rkey);
+	}
+	if(b.size > b.remote_len){
+		printf("Size is larger than the server memory region (%zu bytes).\n", b.remote_len);
+		b.size = b.remote_len;
+	}
+	// The server may send directory updates at any time, give them somewhere to land
+	rpc_client_init(&b.rpc, b.id, 0, stdout);
+	for(opt = 0; opt < nbackups; opt++)
+		if(mirror_add(&b.mirrors, backups[opt], b.mr->addr, local_len, stdout))
+			return -1;
+	printf("Running '%s' against a %zu byte region\n", test->name, b.remote_len);
+	test->run(&b);
+	mirror_close(&b.mirrors, DISCONNECT, stdout);
+	// Tell the server we're leaving and wait for it to agree, skipping any directory updates
+	rdma_send_op(b.id, DISCONNECT, stdout);
+	wait_for(&b, 0);
+	obliterate(b.id, NULL, b.mr, event_channel, stdout);
+	return 0;
+	usage:
+	printf("Usage: %s <address> <port> [-t test] [-s size] [-n iterations] [-d depth] "
+		"[-S signal every] [-o key=value] [-F tunables file] [-b backup address:port]...\nTests:\n", argv[0]);
+	for(test = tests; test->name != NULL; test++)
+		printf("  %-8s %s\n", test->name, test->desc);
+	return -1;
+}
@@ -0,0 +1,261 @@
+/**
+ * @file broadcast.c
+ * @brief Announcing open memory regions to every client with one multicast datagram
+ *
+ * Sending @c ADD_CLIENT and @c REMOVE_CLIENT over each client's connection costs a post (and a
+ * memory window bind) per client. With a multicast group, the server joins it on a UD queue pair
+ * and an open or close is a single datagram, numbered so clients notice the ones they miss and
+ * fetch them with @c DIR_FETCH over their connection. The last @c DIR_LOG_SIZE updates are kept
+ * for that. An open memory region is reached through one type 1 memory window, which works on
+ * every queue pair of the protection domain, so everyone can share the rkey.
+ *
+ * Everything in here (except dir_open()) must be called with the client list semaphore held.
+ */
+#include "server.h"
+
+/**
+ * @brief The amount of directory updates kept for clients that missed them
+ */
+#define DIR_LOG_SIZE	1024
+
+/**
+ * @brief The UD connection that joined the multicast group
+ */
+static struct rdma_cm_id *dir_id = NULL;
+/**
+ * @brief The address handle of the multicast group (@c NULL if updates go over each connection)
+ */
+static struct ibv_ah *dir_ah = NULL;
+/**
+ * @brief The queue pair number and qkey to send to the multicast group with
+ */
+static uint32_t dir_qpn, dir_qkey;
+/**
+ * @brief 1 if the device supports type 1 memory windows
+ */
+static int dir_windows = 0;
+/**
+ * @brief The sequence number of the last update
+ */
+static uint64_t dir_seq = 0;
+/**
+ * @brief The last @c DIR_LOG_SIZE updates
+ */
+static struct dir_update dir_log[DIR_LOG_SIZE];
+
+/**
+ * @brief Join the multicast group
+ *
+ * Called by the listener thread for the first connection, so the group is joined on the same
+ * device as the clients. If joining fails, updates keep going over each connection.
+ * @return @c NULL
+ * @param conn the first client's connection
+ */
+void dir_open(struct rdma_cm_id *conn){
+	struct rdma_event_channel *ec;
+	struct rdma_cm_event *event;
+	struct ibv_qp_init_attr init_attr;
+	struct ibv_device_attr attr;
+	struct sockaddr_in src, group;
+	if(dir_group == NULL || dir_id != NULL)
+		return;
+	memset(&group, 0, sizeof(group));
+	group.sin_family = AF_INET;
+	if(!inet_aton(dir_group, &group.sin_addr)){
+		fprintf(log_p, "Invalid multicast group %s, directory updates go over each connection.\n", dir_group);
+		return;
+	}
+	memcpy(&src, rdma_get_local_addr(conn), sizeof(src));
+	src.sin_port = 0;
+	ec = rdma_create_event_channel();
+	if(ec == NULL)
+		stop_it("rdma_create_event_channel()", errno, log_p);
+	if(rdma_create_id(ec, &dir_id, NULL, RDMA_PS_UDP))
+		stop_it("rdma_create_id()", errno, log_p);
+	if(rdma_resolve_addr(dir_id, (struct sockaddr *)&src, (struct sockaddr *)&group, 2000))
+		stop_it("rdma_resolve_addr()", errno, log_p);
+	cm_event(ec, RDMA_CM_EVENT_ADDR_RESOLVED, NULL, 0, log_p);
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.qp_type = IBV_QPT_UD;
+	init_attr.cap.max_send_wr = MAX_SEND_WR;
+	init_attr.cap.max_recv_wr = 1;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.cap.max_inline_data = sizeof(struct dir_update);
+	if(rdma_create_qp(dir_id, NULL, &init_attr))
+		stop_it("rdma_create_qp()", errno, log_p);
+	if(rdma_join_multicast(dir_id, (struct sockaddr *)&group, NULL))
+		stop_it("rdma_join_multicast()", errno, log_p);
+	if(rdma_get_cm_event(ec, &event))
+		stop_it("rdma_get_cm_event()", errno, log_p);
+	if(event->event == RDMA_CM_EVENT_MULTICAST_JOIN){
+		dir_ah = ibv_create_ah(dir_id->qp->pd, &event->param.ud.ah_attr);
+		dir_qpn = event->param.ud.qp_num;
+		dir_qkey = event->param.ud.qkey;
+	}
+	if(dir_ah == NULL)
+		fprintf(log_p, "Couldn't join multicast group %s (%s), directory updates go over each connection.\n",
+			dir_group, rdma_event_str(event->event));
+	rdma_ack_cm_event(event);
+	if(dir_ah == NULL)
+		return;
+	if(ibv_query_device(conn->verbs, &attr))
+		stop_it("ibv_query_device()", errno, log_p);
+	dir_windows = (attr.device_cap_flags & IBV_DEVICE_MEM_WINDOW) != 0;
+	fprintf(log_p, "Directory updates are multicast to %s, open memory regions are shared through %s.\n",
+		dir_group, dir_windows ? "type 1 memory windows" : "their rkeys");
+}
+
+/**
+ * @brief Number, log and multicast a directory update
+ *
+ * @return @c NULL
+ * @param op @c ADD_CLIENT or @c REMOVE_CLIENT
+ * @param owner the client whose memory region opened or closed
+ */
+static void dir_post(uint32_t op, struct cnode *owner){
+	struct dir_update *u = &dir_log[++dir_seq % DIR_LOG_SIZE];
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+	memset(u, 0, sizeof(*u));
+	u->seq = dir_seq;
+	u->op = op;
+	u->cid = owner->cid;
+	u->writable = 1;
+	u->remote_addr = owner->remote_addr;
+	u->length = owner->length;
+	u->rkey = owner->open_rkey;
+	sge.addr = (uint64_t)u;
+	sge.length = sizeof(*u);
+	sge.lkey = 0;
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND;
+	wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+	wr.wr.ud.ah = dir_ah;
+	wr.wr.ud.remote_qpn = dir_qpn;
+	wr.wr.ud.remote_qkey = dir_qkey;
+	if(rdma_seterrno(ibv_post_send(dir_id->qp, &wr, &bad)))
+		stop_it("ibv_post_send()", errno, log_p);
+	get_completion(dir_id, SEND, 0, log_p);
+	fprintf(log_p, "Directory update %llu: client %lu's memory region %s.\n", (unsigned long long)dir_seq,
+		owner->cid, op == ADD_CLIENT ? "opened" : "closed");
+}
+
+/**
+ * @brief Announce a client's memory region to everyone
+ *
+ * @return 0 if it was announced, -1 if it has to be shared with each client on its own
+ * @param owner the client, which must be connected
+ */
+int dir_publish(struct cnode *owner){
+	struct ibv_mw_bind bind;
+	if(dir_ah == NULL || owner->mr == NULL)
+		return -1;
+	if(owner->windows){
+		// Type 2 windows only work on one queue pair, so without type 1 each client needs its own
+		if(!dir_windows)
+			return -1;
+		if(owner->open_mw == NULL){
+			owner->open_mw = ibv_alloc_mw(owner->id->qp->pd, IBV_MW_TYPE_1);
+			if(owner->open_mw == NULL){
+				fprintf(log_p, "ibv_alloc_mw() failed: %s\n", strerror(errno));
+				return -1;
+			}
+		}
+		memset(&bind, 0, sizeof(bind));
+		bind.bind_info.mr = owner->mr;
+		bind.bind_info.addr = owner->remote_addr;
+		bind.bind_info.length = owner->length;
+		bind.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+		if(bind_wait(owner->id, owner->open_mw, &bind, log_p)){
+			ibv_dealloc_mw(owner->open_mw);
+			owner->open_mw = NULL;
+			return -1;
+		}
+		owner->open_rkey = owner->open_mw->rkey;
+	} else {
+		owner->open_rkey = owner->rkey;
+	}
+	owner->published = 1;
+	dir_post(ADD_CLIENT, owner);
+	return 0;
+}
+
+/**
+ * @brief Announce that a client's memory region closed
+ *
+ * The memory window is deallocated first, so the rkey is useless by the time anyone hears about it.
+ * Does nothing if the memory region wasn't announced.
+ * @return @c NULL
+ * @param owner the client
+ */
+void dir_withdraw(struct cnode *owner){
+	if(!owner->published)
+		return;
+	if(owner->open_mw != NULL && ibv_dealloc_mw(owner->open_mw))
+		fprintf(log_p, "ibv_dealloc_mw() failed: %s\n", strerror(errno));
+	owner->open_mw = NULL;
+	owner->published = 0;
+	dir_post(REMOVE_CLIENT, owner);
+}
+
+/**
+ * @brief Tell a newly connected client about an announced memory region, over its connection
+ *
+ * @return 0 if the client was told, -1 if the memory region wasn't announced
+ * @param owner the client whose memory region is open
+ * @param client the client that connected
+ */
+int dir_resend(struct cnode *owner, struct cnode *client){
+	struct client data;
+	if(!owner->published)
+		return -1;
+	memset(&data, 0, sizeof(data));
+	data.cid = owner->cid;
+	data.rkey = owner->open_rkey;
+	data.remote_addr = owner->remote_addr;
+	data.length = owner->length;
+	data.writable = 1;
+	send_add(client->id, &data);
+	return 0;
+}
+
+/**
+ * @brief Get the sequence number of the last update
+ *
+ * @return the sequence number, 0 if there hasn't been one
+ */
+uint64_t dir_current(){
+	return dir_seq;
+}
+
+/**
+ * @brief Handle a @c DIR_FETCH call
+ *
+ * For sequence number 0 the client gets a @c struct @c dir_sync, otherwise the update itself.
+ * @return 0 on success, @c ENOENT if the update doesn't exist (yet or anymore)
+ * @param node the client
+ * @param args the @c struct @c dir_update, only the sequence number is used
+ * @param len the length of the arguments and results
+ */
+int dir_fetch(struct cnode *node, void *args, uint16_t *len){
+	uint64_t seq = ((struct dir_update *)args)->seq;
+	struct dir_sync *sync = args;
+	if(seq == 0){
+		memset(sync, 0, sizeof(*sync));
+		sync->base = node->dir_seq;
+		sync->current = dir_seq;
+		if(dir_ah != NULL)
+			snprintf(sync->group, sizeof(sync->group), "%s", dir_group);
+		*len = sizeof(*sync);
+		return 0;
+	}
+	*len = 0;
+	if(seq > dir_seq || dir_seq - seq >= DIR_LOG_SIZE)
+		return ENOENT;
+	memcpy(args, &dir_log[seq % DIR_LOG_SIZE], sizeof(struct dir_update));
+	*len = sizeof(struct dir_update);
+	return 0;
+}
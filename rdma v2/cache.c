@@ -0,0 +1,162 @@
+/**
+ * @file cache.c
+ * @brief File containing the definitions of the functions listed in cache.h
+ */
+#include "cache.h"
+
+/**
+ * @brief The bits of a version number that count writes, the client id goes above them
+ */
+#define CACHE_COUNTER_BITS	40
+
+/**
+ * @brief Find the slot a page goes in
+ *
+ * Consecutive pages of a memory region land in different slots.
+ * @return the index of the slot
+ * @param page the remote address of the page
+ * @param rkey the rkey of its memory region
+ */
+static unsigned int cache_slot(uint64_t page, uint32_t rkey){
+	return ((page / CACHE_PAGE) ^ rkey) % CACHE_SLOTS;
+}
+
+/**
+ * @brief Set up an empty cache
+ *
+ * @return @c NULL
+ * @param c the cache
+ * @param id the connection to the server, sends on it must be serialized with the cache's
+ * @param cid the id of this client, which keeps its version numbers apart from everyone else's
+ * @param largest the most bytes a single read will ask for (@c tune.region_length)
+ * @param file the file to print errors to
+ */
+void cache_init(struct page_cache *c, struct rdma_cm_id *id, unsigned long cid, size_t largest, FILE *file){
+	size_t len = CACHE_SLOTS * CACHE_PAGE + CACHE_SPAN(largest) * sizeof(uint64_t);
+	struct timeval tv;
+	memset(c, 0, sizeof(*c));
+	c->id = id;
+	c->span = CACHE_SPAN(largest);
+	c->file = file;
+	c->mr = ibv_reg_mr(id->qp->pd, malloc(len), len, IBV_ACCESS_LOCAL_WRITE);
+	if(c->mr == NULL)
+		stop_it("ibv_reg_mr()", errno, file);
+	// Every write takes more than a microsecond, so a later session never reuses an earlier number
+	gettimeofday(&tv, NULL);
+	c->stamp = ((uint64_t)cid << CACHE_COUNTER_BITS) |
+		(((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec) & ((1ull << CACHE_COUNTER_BITS) - 1));
+}
+
+/**
+ * @brief Get how much of a memory region is left for data
+ *
+ * @return the amount of bytes in front of the version numbers
+ * @param length the length of the memory region
+ */
+size_t cache_usable(size_t length){
+	size_t table = (length + CACHE_PAGE - 1) / CACHE_PAGE * sizeof(uint64_t);
+	return length > table ? length - table : 0;
+}
+
+/**
+ * @brief Read a range of a memory region, using the cached pages that are still current
+ *
+ * The version numbers of the pages are read first and the pages that changed after them, so a
+ * page written in between is cached with a version number that is already out of date.
+ * @return the amount of pages served from the cache, -1 if the range can't be cached
+ * @param c the cache
+ * @param remote_addr the address of the memory region
+ * @param rkey the rkey of the memory region
+ * @param length the length of the memory region
+ * @param offset where to start reading
+ * @param len the amount of bytes to read (at most what was given to cache_init())
+ * @param dest where to put the data
+ */
+int cache_read(struct page_cache *c, uint64_t remote_addr, uint32_t rkey, size_t length, uint64_t offset,
+	size_t len, void *dest){
+	uint64_t *versions = (uint64_t *)((uint8_t *)c->mr->addr + CACHE_SLOTS * CACHE_PAGE);
+	size_t usable = cache_usable(length), bytes;
+	uint64_t first, n, i, page, from, to;
+	struct cache_entry *e;
+	uint8_t *slot;
+	int served = 0, missed = 0;
+	if(len == 0 || offset + len > usable)
+		return -1;
+	first = offset / CACHE_PAGE;
+	n = (offset + len - 1) / CACHE_PAGE - first + 1;
+	if(n > c->span)
+		return -1;
+	if(rdma_post_read(c->id, NULL, versions, n * sizeof(uint64_t), c->mr, IBV_SEND_SIGNALED,
+		remote_addr + usable + first * sizeof(uint64_t), rkey))
+		stop_it("rdma_post_read()", errno, c->file);
+	get_completion(c->id, SEND, 0, c->file);
+	for(i = 0; i < n; i++){
+		page = remote_addr + (first + i) * CACHE_PAGE;
+		e = &c->entries[cache_slot(page, rkey)];
+		if(e->valid && e->page == page && e->rkey == rkey && e->version == versions[i]){
+			served++;
+			continue;
+		}
+		// The last page may be cut short by the version numbers
+		bytes = usable - (first + i) * CACHE_PAGE < CACHE_PAGE ? usable - (first + i) * CACHE_PAGE : CACHE_PAGE;
+		slot = (uint8_t *)c->mr->addr + cache_slot(page, rkey) * CACHE_PAGE;
+		if(rdma_post_read(c->id, NULL, slot, bytes, c->mr, IBV_SEND_SIGNALED, page, rkey))
+			stop_it("rdma_post_read()", errno, c->file);
+		e->valid = 1;
+		e->page = page;
+		e->rkey = rkey;
+		e->version = versions[i];
+		missed++;
+	}
+	while(missed-- > 0)
+		get_completion(c->id, SEND, 0, c->file);
+	for(i = 0; i < n; i++){
+		page = (first + i) * CACHE_PAGE;
+		from = offset > page ? offset : page;
+		to = offset + len < page + CACHE_PAGE ? offset + len : page + CACHE_PAGE;
+		slot = (uint8_t *)c->mr->addr + cache_slot(remote_addr + page, rkey) * CACHE_PAGE;
+		memcpy((uint8_t *)dest + (from - offset), slot + (from - page), to - from);
+	}
+	c->hits += served;
+	c->misses += n - served;
+	return served;
+}
+
+/**
+ * @brief Bump the version numbers of the pages a completed write touched
+ *
+ * Cached copies of those pages, here and on every other client, stop being current.
+ * @return 0 on success, -1 if the write reached into the version numbers
+ * @param c the cache
+ * @param remote_addr the address of the memory region
+ * @param rkey the rkey of the memory region
+ * @param length the length of the memory region
+ * @param offset where the write started
+ * @param len the amount of bytes written
+ */
+int cache_wrote(struct page_cache *c, uint64_t remote_addr, uint32_t rkey, size_t length, uint64_t offset,
+	size_t len){
+	uint64_t *versions = (uint64_t *)((uint8_t *)c->mr->addr + CACHE_SLOTS * CACHE_PAGE);
+	size_t usable = cache_usable(length);
+	uint64_t first, last, n, i;
+	struct cache_entry *e;
+	if(len == 0 || offset >= usable)
+		return offset + len > usable ? -1 : 0;
+	first = offset / CACHE_PAGE;
+	last = ((offset + len < usable ? offset + len : usable) - 1) / CACHE_PAGE;
+	c->stamp++;
+	for(; first <= last; first += n){
+		n = last - first + 1 < c->span ? last - first + 1 : c->span;
+		for(i = 0; i < n; i++){
+			versions[i] = c->stamp;
+			e = &c->entries[cache_slot(remote_addr + (first + i) * CACHE_PAGE, rkey)];
+			if(e->page == remote_addr + (first + i) * CACHE_PAGE && e->rkey == rkey)
+				e->valid = 0;
+		}
+		if(rdma_post_write(c->id, NULL, versions, n * sizeof(uint64_t), c->mr, IBV_SEND_SIGNALED,
+			remote_addr + usable + first * sizeof(uint64_t), rkey))
+			stop_it("rdma_post_write()", errno, c->file);
+		get_completion(c->id, SEND, 0, c->file);
+	}
+	return offset + len > usable ? -1 : 0;
+}
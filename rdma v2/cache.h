@@ -0,0 +1,57 @@
+/**
+ * @file cache.h
+ * @brief Caching pages of remote memory regions on the client
+ *
+ * The last bytes of a memory region hold a version number for every @c CACHE_PAGE bytes in front
+ * of them. A write bumps the version numbers of the pages it touched to a value no one else uses,
+ * so a cached page is still good as long as its version number didn't change, and checking that
+ * takes an 8 byte read instead of reading the page. Every client writing to the region has to use
+ * the cache (or bump the version numbers itself), and everyone has to see the whole region: a
+ * slice shared with @c GRANT has its own tail, so the owner's bumps are lost on it.
+ */
+#ifndef RDMA_CS_CACHE
+#define RDMA_CS_CACHE
+#include "rdma_cs.h"
+
+/**
+ * @brief The size of a cached page
+ */
+#define CACHE_PAGE		256
+/**
+ * @brief The amount of pages the cache holds
+ */
+#define CACHE_SLOTS		64
+/**
+ * @brief The most pages a read of @p len bytes can touch
+ */
+#define CACHE_SPAN(len)	((len) / CACHE_PAGE + 2)
+
+/**
+ * @brief A cached page
+ */
+struct cache_entry {
+	uint64_t page;		/**< The remote address of the page */
+	uint32_t rkey;		/**< The rkey of the memory region it belongs to */
+	uint8_t valid;		/**< 1 if the slot holds a page */
+	uint64_t version;	/**< The version number the page had when it was read */
+};
+
+/**
+ * @brief The cache of one client
+ */
+struct page_cache {
+	struct rdma_cm_id *id;						/**< The connection to the server */
+	struct ibv_mr *mr;							/**< @c CACHE_SLOTS pages, followed by @c span version numbers */
+	size_t span;								/**< The most pages a read can touch */
+	struct cache_entry entries[CACHE_SLOTS];	/**< What each slot holds */
+	uint64_t stamp;								/**< The last version number written, the client id in the upper half */
+	unsigned long hits;							/**< The amount of pages served from the cache */
+	unsigned long misses;						/**< The amount of pages that had to be read */
+	FILE *file;									/**< The file to print errors to */
+};
+
+void cache_init(struct page_cache *, struct rdma_cm_id *, unsigned long, size_t, FILE *);
+size_t cache_usable(size_t);
+int cache_read(struct page_cache *, uint64_t, uint32_t, size_t, uint64_t, size_t, void *);
+int cache_wrote(struct page_cache *, uint64_t, uint32_t, size_t, uint64_t, size_t);
+#endif
@@ -6,6 +6,12 @@
  * @author Austin Pohlmann 
  */
 #include "rdma_cs.h"
+#include "mirror.h"
+#include "rpc.h"
+#include "dirwatch.h"
+#include "cache.h"
+#include "regcache.h"
+#include "dump.h"
 /**
  * @brief The head of the list containing information on all open memory regions on the server
  */
@@ -40,33 +46,130 @@ char *menu2 = "----------------------\n"
  * @brief Allows the communication thread to know if the main thread is in the menu (for re-printing the menu, if necessary)
  */
 unsigned char in_menu;
+/**
+ * @brief The calls made to the server (the communication thread receives their responses)
+ */
+struct rpc_client rpc;
+/**
+ * @brief Held by the main thread except while it waits for input, so the directory watcher can make calls then
+ */
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * @brief Lock for the list of open memory regions, which the communication and directory threads both change
+ */
+pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * @brief The cache of remote pages, only used with @c -c
+ */
+struct page_cache cache;
+/**
+ * @brief 1 if reads go through the cache and writes bump version numbers
+ */
+uint8_t cached = 0;
+/**
+ * @brief The registrations of buffers used for reads to files
+ */
+struct reg_cache regs;
+/**
+ * @brief The buffer reads to files go through, grown as needed
+ */
+void *bulk = NULL;
+/**
+ * @brief The length of the buffer reads to files go through
+ */
+size_t bulk_length = 0;
+/**
+ * @brief The buffers and io_uring binary dumps go through
+ */
+struct dump dumper;
+/**
+ * @brief 1 if binary dumps write with @c O_DIRECT
+ */
+uint8_t direct = 0;
 
-void connect_four(struct rdma_cm_id *, struct rdma_event_channel *, char *, short int);
+void print_menu();
+uint8_t read_choice();
 void *server_com(void *);
 void add_client(struct client);
 void remove_client(unsigned long);
+void apply_update(struct dir_update *);
 struct client *get_client();
+int cached_read(uint64_t, uint32_t, size_t, uint64_t, size_t, void *);
+void cached_wrote(uint64_t, uint32_t, size_t, uint64_t, size_t);
+int read_to_file(struct rdma_cm_id *, uint64_t, uint32_t, uint64_t, size_t, FILE *);
+void dump_to_file(struct rdma_cm_id *, uint64_t, uint32_t, uint64_t, size_t, const char *);
 
 int main(int argc, char **argv){
-	// Get server address and port from arguments
-	if(argc != 3){
-		printf("Invalid arguements: %s <address> <port>\n", argv[0]);
+	// Get backup servers, then server address, port and optionally a session to resume from arguments
+	char *backups[MAX_MIRRORS];
+	int nbackups = 0, opt;
+	size_t pin_budget = REG_CACHE_BUDGET;
+	// The server's region size unless one is asked for
+	tune.server_mr_size = 0;
+	while((opt = getopt(argc, argv, "b:cDp:o:F:")) != -1){
+		if(opt == 'o'){
+			if(tune_set(&tune, optarg)){
+				printf("Invalid setting '%s'.\n", optarg);
+				return -1;
+			}
+			continue;
+		}
+		if(opt == 'F'){
+			if(tune_load(&tune, optarg, stdout))
+				return -1;
+			continue;
+		}
+		if(opt == 'c'){
+			cached = 1;
+			continue;
+		}
+		if(opt == 'D'){
+			direct = 1;
+			continue;
+		}
+		if(opt == 'p'){
+			pin_budget = strtoull(optarg, NULL, 0);
+			continue;
+		}
+		if(opt != 'b' || nbackups == MAX_MIRRORS){
+			printf("Invalid arguements: %s [-c] [-D] [-p pin budget] [-o key=value] [-F tunables file] [-b backup address:port]... <address> <port> [session token]\n", argv[0]);
+			return -1;
+		}
+		backups[nbackups++] = optarg;
+	}
+	if(argc - optind != 2 && argc - optind != 3){
+		printf("Invalid arguements: %s [-c] [-D] [-p pin budget] [-o key=value] [-F tunables file] [-b backup address:port]... <address> <port> [session token]\n", argv[0]);
 		return -1;
 	}
-	char *ip = argv[1];
-	short port = atoi(argv[2]);
+	char *ip = argv[optind];
+	char *port_str = argv[optind + 1];
+	short port = atoi(port_str);
+	struct session session;
+	memset(&session, 0, sizeof(session));
+	if(argc - optind == 3)
+		session.token = strtoull(argv[optind + 2], NULL, 16);
+	session.credits = 1;
+	tune_ask(&session, &tune);
 	// Create the event channel
 	struct rdma_event_channel *event_channel = rdma_create_event_channel();
 	if(event_channel == NULL)
 		stop_it("rdma_create_event_channel()", errno, stderr);
 	// Create the ID
 	struct rdma_cm_id *cm_id;
-	if(rdma_create_id(event_channel, &cm_id, "qwerty", RDMA_PS_TCP))
+	if(rdma_create_id(event_channel, &cm_id, NULL, RDMA_PS_TCP))
 		stop_it("rdma_create_id()", errno, stderr);
 	// Connect to the server
-	connect_four(cm_id, event_channel, ip, port);
+	connect_four(cm_id, event_channel, ip, port, &session, sizeof(session));
+	if(session.resumed)
+		printf("Resumed the session of client %lu.\n", (unsigned long)session.cid);
+	else
+		printf("Connected as client %lu, session token %016llx.\n", (unsigned long)session.cid,
+			(unsigned long long)session.token);
+	tune_take(&tune, &session);
+	tune_print(&tune, stdout);
 	// Register memory region
-	struct ibv_mr *mr = ibv_reg_mr(cm_id->qp->pd, malloc(REGION_LENGTH), REGION_LENGTH,
+	// The receive count the server reads for flow control goes at the end
+	struct ibv_mr *mr = ibv_reg_mr(cm_id->qp->pd, calloc(1, tune.region_length + FLOW_BYTES), tune.region_length + FLOW_BYTES,
 	 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
 	if(mr == NULL)
 		stop_it("ibv_reg_mr()", errno, stderr);
@@ -74,62 +177,94 @@ int main(int argc, char **argv){
 	uint32_t rkey;
 	uint64_t remote_addr;
 	size_t server_mr_length;
-	swap_info(cm_id, mr, &rkey, &remote_addr, &server_mr_length, stdout);
+	swap_info(cm_id, mr, mr, &rkey, &remote_addr, &server_mr_length, stdout);
+	reg_cache_init(&regs, cm_id->qp->pd, pin_budget, stderr);
+	dump_init(&dumper, &regs, stderr);
+	// From here on messages only go out when the server has a receive posted for them
+	struct flow flow;
+	if(session.credits){
+		flow_init(&flow, cm_id, mr, (uint64_t *)((uint8_t *)mr->addr + tune.region_length));
+		flow_peer(&flow, session.credit_addr, session.credit_rkey);
+	}
+	if(cached){
+		cache_init(&cache, cm_id, session.cid, tune.region_length, stderr);
+		printf("Caching reads, the last %zu bytes of every memory region hold version numbers.\n",
+			server_mr_length - cache_usable(server_mr_length));
+	}
+	// Writes to the server memory region are replicated to every backup server
+	struct mirror_set mirrors;
+	memset(&mirrors, 0, sizeof(mirrors));
+	for(opt = 0; opt < nbackups; opt++)
+		if(mirror_add(&mirrors, backups[opt], mr->addr, tune.region_length, stdout))
+			return -1;
 	// Create a file pointer for file output later
 	FILE *output_file;
 	char filename[50];
+	uint8_t dumping;
 	// Create some variables that are needed later
-	void *buffer = malloc(MAX_INLINE_DATA);
+	void *buffer = malloc(tune.inline_data);
 	uint8_t opcode;
 	unsigned long long length;
 	unsigned long long offset;
 	int i;
 	unsigned char *byte;
 	// Make the listener thread before the real good starts
+	rpc_client_init(&rpc, cm_id, 1, stderr);
 	pthread_t listen_thread;
 	if(pthread_create(&listen_thread, NULL, server_com, cm_id)){
 		stop_it("pthread_create()", errno, stderr);
 	}
+	// Open memory regions may be announced over multicast instead of the connection
+	struct dir_watch watch;
+	pthread_mutex_lock(&send_lock);
+	dir_watch(&watch, cm_id, &rpc, &send_lock, apply_update, stdout);
 	struct client* remote_id;
 	// The real good (RDMA operations!!!)
 	while(1){
 		// Print a menu and take user input
 		page1:
 		in_menu = 1;
-		printf("%s", menu1);
-		if(clients)
-			printf("7) Page 2            |\n");
+		print_menu();
 		printf("> ");
-		scanf("%c",&opcode);
-		opcode = opcode%48;
-		fgetc(stdin);
+		pthread_mutex_unlock(&send_lock);
+		opcode = read_choice();
+		pthread_mutex_lock(&send_lock);
 		in_menu = 0;
 		if(opcode == DISCONNECT){
 			// Send disconnect signal to server
+			mirror_close(&mirrors, DISCONNECT, stdout);
 			rdma_send_op(cm_id, opcode, stdout);
-			get_completion(cm_id, SEND, 0, stdout);
+			break;
+		} else if(opcode == DETACH){
+			// Disconnect, but let the server (and the backups) keep the session
+			mirror_close(&mirrors, DETACH, stdout);
+			rdma_send_op(cm_id, opcode, stdout);
+			printf("Detached, resume with: %s %s %s %016llx\n", argv[0], ip, port_str,
+				(unsigned long long)session.token);
 			break;
 		} else if(opcode == WRITE_INLINE){
 			// RDMA write inline
 			printf("Server memory region is %u bytes long. "
 				"Choosing a relative point (0 - %u) to start writing to.\n> ",
-				(unsigned int)server_mr_length, (unsigned int)server_mr_length-MAX_INLINE_DATA);
+				(unsigned int)server_mr_length, (unsigned int)server_mr_length-tune.inline_data);
 			scanf("%llu", &offset);fgetc(stdin);
-			if(offset+MAX_INLINE_DATA> server_mr_length){
+			if(offset+tune.inline_data> server_mr_length){
 				printf("Invalid offset.\n");
 				continue;
 			}
 			printf("Enter the data to be sent to the server. Max length is %u bytes.\n> ",
-				MAX_INLINE_DATA);
-			memset(buffer, 0, MAX_INLINE_DATA);
-			if(fgets(buffer, MAX_INLINE_DATA, stdin) == NULL){
+				tune.inline_data);
+			memset(buffer, 0, tune.inline_data);
+			if(fgets(buffer, tune.inline_data, stdin) == NULL){
 				printf("Unknow error occured.");
 				rdma_send_op(cm_id, DISCONNECT, stdout);
-				get_completion(cm_id, SEND, 0, stdout);
 				break;
 			}
 			rdma_write_inline(cm_id, buffer, remote_addr+offset, rkey, stdout);
+			mirror_write(&mirrors, offset, buffer, strlen(buffer), IBV_SEND_INLINE | IBV_SEND_SIGNALED, stdout);
 			get_completion(cm_id, SEND, 1, stdout);
+			cached_wrote(remote_addr, rkey, server_mr_length, offset, strlen(buffer));
+			mirror_wait(&mirrors, mirrors.posted, stdout);
 		} else if(opcode == WRITE){
 			// RDMA write
 			printf("Server memory region is %u bytes long. "
@@ -142,53 +277,244 @@ int main(int argc, char **argv){
 			}
 			printf("Enter the data to be sent to the server. Max length is %llu bytes.\n> ",
 				server_mr_length - offset);
-			if(fgets(mr->addr, MAX_INLINE_DATA, stdin) == NULL){
+			if(fgets(mr->addr, tune.region_length, stdin) == NULL){
 				printf("Unknow error occured.");
 				rdma_send_op(cm_id, DISCONNECT, stdout);
-				get_completion(cm_id, SEND, 0, stdout);
 				break;
 			}
 			rdma_post_write(cm_id, "qwerty", mr->addr, strlen(mr->addr),
 				mr, IBV_SEND_SIGNALED, remote_addr+offset, rkey);
+			mirror_write(&mirrors, offset, mr->addr, strlen(mr->addr), IBV_SEND_SIGNALED, stdout);
 			get_completion(cm_id, SEND, 1, stdout);
+			cached_wrote(remote_addr, rkey, server_mr_length, offset, strlen(mr->addr));
+			mirror_wait(&mirrors, mirrors.posted, stdout);
 		} else if(opcode == OPEN_MR){
 			rdma_send_op(cm_id, opcode, stdout);
-			get_completion(cm_id, SEND, 0, stdout);
 		} else if(opcode == CLOSE_MR){
 			rdma_send_op(cm_id, opcode, stdout);
-			get_completion(cm_id, SEND, 0, stdout);
 		}  else if(opcode == READ){
 			// RDMA read
-			printf("Would you like to print the data to console or write to a file? (p for print, w for write)\n> ");
+			printf("Would you like to print the data to console or write to a file? "
+				"(p for print, w for write, b for a binary dump)\n> ");
 			scanf("%c", &opcode);
-			if(opcode == 'w'){
+			dumping = opcode == 'b';
+			if(opcode == 'w' || dumping){
 				printf("Enter a filename: \n> ");
 				scanf("%s", filename);
-				output_file = fopen(filename, "w");
+				output_file = dumping ? NULL : fopen(filename, "w");
 			} else {
 				output_file = stdout;
 			}
 			printf("Server memory region is %u bytes long. "
 				"Choosing a relative point (0 - %u) to start reading from, followed by "
 				"how many bytes you wish to read (0-%u).\n> ", (unsigned int)server_mr_length,
-				(unsigned int)server_mr_length-1, REGION_LENGTH);
+				(unsigned int)server_mr_length-1, (unsigned int)(output_file == stdout ? tune.region_length : server_mr_length));
 			scanf("%llu", &offset);fgetc(stdin);
 			printf("> ");
 			scanf("%llu", &length);fgetc(stdin);
-			if(offset+length > server_mr_length || length > REGION_LENGTH){
+			if((output_file == NULL && !dumping) || offset+length > server_mr_length ||
+				(output_file == stdout && length > tune.region_length)){
 				printf("Invalid offset and/or length.\n");
+				if(output_file != NULL && output_file != stdout)
+					fclose(output_file);
 				continue;
 			}
-			if(rdma_post_read(cm_id, "qwerty", mr->addr, length, mr, IBV_SEND_SIGNALED,
-				remote_addr + offset, rkey))
-				stop_it("rdma_post_read()", errno, stderr);
-			get_completion(cm_id, SEND, 1, stdout);
+			if(dumping){
+				dump_to_file(cm_id, remote_addr, rkey, offset, length, filename);
+				continue;
+			}
+			if(output_file != stdout){
+				if(read_to_file(cm_id, remote_addr, rkey, offset, length, output_file))
+					printf("Couldn't read into a registered buffer: %s\n", strerror(errno));
+				fclose(output_file);
+				continue;
+			}
+			if(cached_read(remote_addr, rkey, server_mr_length, offset, length, mr->addr)){
+				if(rdma_post_read(cm_id, "qwerty", mr->addr, length, mr, IBV_SEND_SIGNALED,
+					remote_addr + offset, rkey))
+					stop_it("rdma_post_read()", errno, stderr);
+				get_completion(cm_id, SEND, 1, stdout);
+			}
 			// Print data in hex 1 byte at a time
 			fprintf(output_file, "Data: ");
 			byte = (unsigned char *)mr->addr;
 			for(i=0;i<length;i++)
 				fprintf(output_file, "%02x ", byte[i]);
 			printf("\n");
+		} else if(opcode == 9 || opcode == 10){
+			// Share a slice of the server memory region with one client, or stop sharing with it
+			struct grant_request req;
+			memset(&req, 0, sizeof(req));
+			printf("Enter the ID of the client to %s: ", opcode == 9 ? "share with" : "stop sharing with");
+			scanf("%llu", &offset);fgetc(stdin);
+			req.cid = offset;
+			if(opcode == 9){
+				printf("Server memory region is %u bytes long. "
+					"Enter the start of the slice (0 - %u), followed by its length, "
+					"followed by 1 if it may be written to or 0 if not.\n> ",
+					(unsigned int)server_mr_length, (unsigned int)server_mr_length-1);
+				scanf("%llu", &offset);fgetc(stdin);
+				printf("> ");
+				scanf("%llu", &length);fgetc(stdin);
+				printf("> ");
+				scanf("%u", &req.writable);fgetc(stdin);
+				if(length == 0 || offset+length > server_mr_length){
+					printf("Invalid offset and/or length.\n");
+					continue;
+				}
+				req.offset = offset;
+				req.length = length;
+			}
+			rdma_send_msg(cm_id, opcode == 9 ? GRANT : REVOKE, &req, sizeof(req), stdout);
+		} else if(opcode == 11 || opcode == 12){
+			// Allocate remote memory from the server's arenas, or give it back
+			struct allocation req, ans;
+			memset(&req, 0, sizeof(req));
+			if(opcode == 11){
+				printf("Enter the amount of bytes to allocate (0 to look up one you hold after resuming): ");
+				scanf("%llu", &length);fgetc(stdin);
+				req.length = length;
+				if(length == 0){
+					printf("Enter the address of the allocation (hex): ");
+					scanf("%llx", &offset);fgetc(stdin);
+					req.remote_addr = offset;
+				}
+			} else {
+				printf("Enter the address of the allocation to free (hex): ");
+				scanf("%llx", &offset);fgetc(stdin);
+				req.remote_addr = offset;
+			}
+			if((i = rpc_call(&rpc, opcode == 11 ? ALLOC : FREE, &req, sizeof(req), &ans, sizeof(ans))))
+				printf("The server refused: %s\n", strerror(i));
+			else
+				printf("%s %llu bytes at 0x%llx (rkey 0x%x).\n", opcode == 11 ? "Allocated" : "Freed",
+					(unsigned long long)ans.length, (unsigned long long)ans.remote_addr,
+					(unsigned int)ans.rkey);
+		} else if(opcode == 13 || opcode == 14){
+			// Make part of the server memory region durable, or snapshot all of it
+			struct flush_request req;
+			memset(&req, 0, sizeof(req));
+			if(opcode == 13){
+				printf("Server memory region is %u bytes long. "
+					"Enter the start of the range to flush (0 - %u), followed by its length.\n> ",
+					(unsigned int)server_mr_length, (unsigned int)server_mr_length-1);
+				scanf("%llu", &offset);fgetc(stdin);
+				printf("> ");
+				scanf("%llu", &length);fgetc(stdin);
+				req.offset = offset;
+				req.length = length;
+			}
+			if((i = rpc_call(&rpc, opcode == 13 ? FLUSH : SNAPSHOT, &req, sizeof(req), &req, sizeof(req))))
+				printf("The server refused: %s\n", strerror(i));
+			else
+				printf(opcode == 13 ? "The range is on disk.\n" : "The server is writing a snapshot.\n");
+		} else if(opcode == 15){
+			// Upload a file into the server memory region and have the server verify it
+			printf("Enter a filename: \n> ");
+			scanf("%49s", filename);fgetc(stdin);
+			printf("Server memory region is %u bytes long. "
+				"Choose a relative point (0 - %u) to upload to.\n> ",
+				(unsigned int)server_mr_length, (unsigned int)server_mr_length-1);
+			scanf("%llu", &offset);fgetc(stdin);
+			FILE *input_file = fopen(filename, "r");
+			if(input_file == NULL || offset >= server_mr_length){
+				printf("Invalid file and/or offset.\n");
+				if(input_file != NULL)
+					fclose(input_file);
+				continue;
+			}
+			uint32_t crc = 0;
+			size_t chunk;
+			length = 0;
+			while(offset + length < server_mr_length){
+				chunk = server_mr_length - offset - length;
+				chunk = fread(mr->addr, 1, chunk < tune.region_length ? chunk : tune.region_length, input_file);
+				if(chunk == 0)
+					break;
+				rdma_post_write(cm_id, "qwerty", mr->addr, chunk, mr, IBV_SEND_SIGNALED,
+					remote_addr + offset + length, rkey);
+				mirror_write(&mirrors, offset + length, mr->addr, chunk, IBV_SEND_SIGNALED, stdout);
+				// The buffer is only read while the write is in flight, so checksum it meanwhile
+				crc = crc32c(crc, mr->addr, chunk);
+				get_completion(cm_id, SEND, 0, stdout);
+				mirror_wait(&mirrors, mirrors.posted, stdout);
+				cached_wrote(remote_addr, rkey, server_mr_length, offset + length, chunk);
+				length += chunk;
+			}
+			if(!feof(input_file))
+				printf("The file doesn't fit, only the first %llu bytes were uploaded.\n", length);
+			fclose(input_file);
+			if(length == 0){
+				printf("The file is empty.\n");
+				continue;
+			}
+			// Only the digest comes back, not the data
+			struct checksum_request req;
+			memset(&req, 0, sizeof(req));
+			req.offset = offset;
+			req.length = length;
+			if((i = rpc_call(&rpc, CHECKSUM, &req, sizeof(req), &req, sizeof(req))))
+				printf("The server refused: %s\n", strerror(i));
+			else if(req.crc != crc)
+				printf("Uploaded %llu bytes, but the server has CRC32C %08x instead of %08x!\n", length,
+					(unsigned int)req.crc, (unsigned int)crc);
+			else
+				printf("Uploaded %llu bytes, CRC32C %08x verified by the server.\n", length, (unsigned int)crc);
+		} else if(opcode == 16){
+			// Have the server copy, fill or compare ranges without moving them over the network
+			struct compute_request req;
+			unsigned long long cid;
+			uint32_t op;
+			memset(&req, 0, sizeof(req));
+			printf("c to copy, f to fill, m to compare\n> ");
+			scanf("%c", &opcode);fgetc(stdin);
+			op = opcode == 'c' ? COPY : opcode == 'f' ? FILL : opcode == 'm' ? COMPARE : 0;
+			if(!op){
+				printf("Unknown operation.\n");
+				continue;
+			}
+			printf("Enter the client ID of the %s region (0 for your own), followed by the offset into it.\n> ",
+				op == COMPARE ? "first" : "destination");
+			scanf("%llu", &cid);fgetc(stdin);
+			req.dst_cid = cid;
+			printf("> ");
+			scanf("%llu", &offset);fgetc(stdin);
+			req.dst_offset = offset;
+			if(op != FILL){
+				printf("Enter the client ID of the %s region (0 for your own), followed by the offset into it.\n> ",
+					op == COMPARE ? "second" : "source");
+				scanf("%llu", &cid);fgetc(stdin);
+				req.src_cid = cid;
+				printf("> ");
+				scanf("%llu", &offset);fgetc(stdin);
+				req.src_offset = offset;
+			} else {
+				printf("Enter the byte to fill with (0 - 255): ");
+				scanf("%u", &req.pattern);fgetc(stdin);
+			}
+			printf("Enter the length: ");
+			scanf("%llu", &length);fgetc(stdin);
+			req.length = length;
+			if((i = rpc_call(&rpc, op, &req, sizeof(req), &req, sizeof(req))))
+				printf("The server refused: %s\n", strerror(i));
+			else if(op != COMPARE){
+				// The server wrote to the destination, which the version numbers have to show
+				if(req.dst_cid == 0){
+					cached_wrote(remote_addr, rkey, server_mr_length, req.dst_offset, length);
+				} else {
+					pthread_mutex_lock(&list_lock);
+					for(remote_id = clist_head; remote_id != NULL && remote_id->cid != req.dst_cid;
+						remote_id = remote_id->next);
+					if(remote_id != NULL)
+						cached_wrote(remote_id->remote_addr, remote_id->rkey, remote_id->length, req.dst_offset, length);
+					pthread_mutex_unlock(&list_lock);
+				}
+				printf("Done.\n");
+			}
+			else if(req.result == length)
+				printf("The ranges are equal.\n");
+			else
+				printf("The ranges first differ at byte %llu.\n", (unsigned long long)req.result);
 		} else if(opcode == 7 && clients) {
 			// Go to the second page IFF there are other memory regions open
 			goto page2;
@@ -202,9 +528,9 @@ int main(int argc, char **argv){
 		// Print menu and take use input
 		page2:
 		printf("%s> ", menu2);
-		scanf("%c",&opcode);
-		opcode = opcode%48;
-		fgetc(stdin);
+		pthread_mutex_unlock(&send_lock);
+		opcode = read_choice();
+		pthread_mutex_lock(&send_lock);
 		if(opcode == 4){
 			// Go back to the first page
 			goto page1;
@@ -214,28 +540,40 @@ int main(int argc, char **argv){
 			goto page1;
 		} else if(opcode == 1){
 			remote_id = get_client();
+			if(remote_id == NULL)
+				continue;
+			if(!remote_id->writable){
+				printf("That memory region is read only.\n");
+				continue;
+			}
 			// RDMA write inline
 			printf("Server memory region is %u bytes long. "
 				"Choosing a relative point (0 - %u) to start writing to.\n> ",
-				(unsigned int)remote_id->length, (unsigned int)remote_id->length-MAX_INLINE_DATA);
+				(unsigned int)remote_id->length, (unsigned int)remote_id->length-tune.inline_data);
 			scanf("%llu", &offset);fgetc(stdin);
-			if(offset+MAX_INLINE_DATA> remote_id->length){
+			if(offset+tune.inline_data> remote_id->length){
 				printf("Invalid offset.\n");
 				continue;
 			}
 			printf("Enter the data to be sent to the server. Max length is %u bytes.\n> ",
-				MAX_INLINE_DATA);
-			memset(buffer, 0, MAX_INLINE_DATA);
-			if(fgets(buffer, MAX_INLINE_DATA, stdin) == NULL){
+				tune.inline_data);
+			memset(buffer, 0, tune.inline_data);
+			if(fgets(buffer, tune.inline_data, stdin) == NULL){
 				printf("Unknow error occured.");
 				rdma_send_op(cm_id, DISCONNECT, stdout);
-				get_completion(cm_id, SEND, 0, stdout);
 				break;
 			}
 			rdma_write_inline(cm_id, buffer, (remote_id->remote_addr)+offset, remote_id->rkey, stdout);
 			get_completion(cm_id, SEND, 1, stdout);
+			cached_wrote(remote_id->remote_addr, remote_id->rkey, remote_id->length, offset, strlen(buffer));
 		} else if(opcode == 2){
 			remote_id = get_client();
+			if(remote_id == NULL)
+				continue;
+			if(!remote_id->writable){
+				printf("That memory region is read only.\n");
+				continue;
+			}
 			// RDMA write
 			printf("Server memory region is %u bytes long. "
 				"Choosing a relative point (0 - %u) to start writing to.\n> ",
@@ -247,42 +585,61 @@ int main(int argc, char **argv){
 			}
 			printf("Enter the data to be sent to the server. Max length is %llu bytes.\n> ",
 				remote_id->length - offset);
-			if(fgets(mr->addr, MAX_INLINE_DATA, stdin) == NULL){
+			if(fgets(mr->addr, tune.region_length, stdin) == NULL){
 				printf("Unknow error occured.");
 				rdma_send_op(cm_id, DISCONNECT, stdout);
-				get_completion(cm_id, SEND, 0, stdout);
 				break;
 			}
 			rdma_post_write(cm_id, "qwerty", mr->addr, strlen(mr->addr),
 				mr, IBV_SEND_SIGNALED, (remote_id->remote_addr)+offset, remote_id->rkey);
 			get_completion(cm_id, SEND, 1, stdout);
+			cached_wrote(remote_id->remote_addr, remote_id->rkey, remote_id->length, offset, strlen(mr->addr));
 		} else if(opcode == 3){
 			remote_id = get_client();
+			if(remote_id == NULL)
+				continue;
 			// RDMA read
-			printf("Would you like to print the data to console or write to a file? (p for print, w for write)\n> ");
+			printf("Would you like to print the data to console or write to a file? "
+				"(p for print, w for write, b for a binary dump)\n> ");
 			scanf("%c", &opcode);
-			if(opcode == 'w'){
+			dumping = opcode == 'b';
+			if(opcode == 'w' || dumping){
 				printf("Enter a filename: \n> ");
 				scanf("%s", filename);
-				output_file = fopen(filename, "w");
+				output_file = dumping ? NULL : fopen(filename, "w");
 			} else {
 				output_file = stdout;
 			}
 			printf("Server memory region is %u bytes long. "
 				"Choosing a relative point (0 - %u) to start reading from, followed by "
-				"how many bytes you wish to read (0-%u).\n> ", (unsigned int)server_mr_length,
-				(unsigned int)server_mr_length-1, REGION_LENGTH);
+				"how many bytes you wish to read (0-%u).\n> ", (unsigned int)remote_id->length,
+				(unsigned int)remote_id->length-1, (unsigned int)(output_file == stdout ? tune.region_length : remote_id->length));
 			scanf("%llu", &offset);fgetc(stdin);
 			printf("> ");
 			scanf("%llu", &length);fgetc(stdin);
-			if(offset+length > server_mr_length || length > REGION_LENGTH){
+			if((output_file == NULL && !dumping) || offset+length > remote_id->length ||
+				(output_file == stdout && length > tune.region_length)){
 				printf("Invalid offset and/or length.\n");
+				if(output_file != NULL && output_file != stdout)
+					fclose(output_file);
 				continue;
 			}
-			if(rdma_post_read(cm_id, "qwerty", mr->addr, length, mr, IBV_SEND_SIGNALED,
-				(remote_id->remote_addr)+offset, remote_id->rkey))
-				stop_it("rdma_post_read()", errno, stderr);
-			get_completion(cm_id, SEND, 1, stdout);
+			if(dumping){
+				dump_to_file(cm_id, remote_id->remote_addr, remote_id->rkey, offset, length, filename);
+				continue;
+			}
+			if(output_file != stdout){
+				if(read_to_file(cm_id, remote_id->remote_addr, remote_id->rkey, offset, length, output_file))
+					printf("Couldn't read into a registered buffer: %s\n", strerror(errno));
+				fclose(output_file);
+				continue;
+			}
+			if(cached_read(remote_id->remote_addr, remote_id->rkey, remote_id->length, offset, length, mr->addr)){
+				if(rdma_post_read(cm_id, "qwerty", mr->addr, length, mr, IBV_SEND_SIGNALED,
+					(remote_id->remote_addr)+offset, remote_id->rkey))
+					stop_it("rdma_post_read()", errno, stderr);
+				get_completion(cm_id, SEND, 1, stdout);
+			}
 			// Print data in hex 1 byte at a time
 			fprintf(output_file, "Data: ");
 			byte = (unsigned char *)mr->addr;
@@ -295,59 +652,43 @@ int main(int argc, char **argv){
 	}
 	// Disconnect
 	disconnect:
+	reg_free(&regs, bulk);
+	dump_destroy(&dumper);
+	reg_cache_destroy(&regs);
 	obliterate(cm_id, NULL, mr, event_channel, stdout);
 	return 0;
 }
 
 /**
- * @brief Connect to a server at the given ip and port.
+ * @brief Print the first menu, including the options that are only sometimes available
  *
  * @return @c NULL
- * @param cm_id the cm_id associated with this client
- * @param ec the event channel to use
- * @param ip the ip to connect to
- * @param port the port to connect to
  */
-void connect_four(struct rdma_cm_id *cm_id, struct rdma_event_channel *ec, char *ip, 
-	short int port){
-	struct sockaddr_in sin;
-	memset(&sin, 0, sizeof(struct sockaddr_in));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	inet_aton(ip, &(sin.sin_addr));
-	// Resolve the server's address
-	if(rdma_resolve_addr(cm_id, NULL, (struct sockaddr *)&sin, 10000))
-		stop_it("rdma_resolve_addr()", errno, stderr);
-	// Wait for the address to resolve
-	cm_event(ec, RDMA_CM_EVENT_ADDR_RESOLVED, stdout);
-	// Create queue pair
-	struct ibv_qp_init_attr *init_attr = malloc(sizeof(*init_attr));
-	memset(init_attr, 0, sizeof(*init_attr));
-	init_attr->qp_type = IBV_QPT_RC;
-	init_attr->cap.max_send_wr  = MAX_SEND_WR;
-	init_attr->cap.max_recv_wr  = MAX_RECV_WR;
-	init_attr->cap.max_send_sge = MAX_SEND_SGE;
-	init_attr->cap.max_recv_sge = MAX_RECV_SGE;
-	init_attr->cap.max_inline_data = MAX_INLINE_DATA;
-	if(rdma_create_qp(cm_id, NULL, init_attr))
-		stop_it("rdma_create_qp()", errno, stderr);
-	// Resolve the route to the server
-	if(rdma_resolve_route(cm_id, 10000))
-		stop_it("rdma_resolve_route()", errno, stderr);
-	// Wait for the route to resolve
-	cm_event(ec, RDMA_CM_EVENT_ROUTE_RESOLVED, stdout);
-	// Send a connection request to the server
-	struct rdma_conn_param *conn_params = malloc(sizeof(*conn_params));
-	printf("Connecting...\n");
-	memset(conn_params, 0, sizeof(*conn_params));
-	conn_params->retry_count = 8;
-	conn_params->rnr_retry_count = 8;
-	conn_params->responder_resources = 10;
-	conn_params->initiator_depth = 10;
-	if(rdma_connect(cm_id, conn_params))
-		stop_it("rdma_connect()", errno, stderr);
-	// Wait for the server to accept the connection
-	cm_event(ec, RDMA_CM_EVENT_ESTABLISHED, stdout);
+void print_menu(){
+	printf("%s", menu1);
+	if(clients)
+		printf("7) Page 2            |\n");
+	printf("8) Detach            |\n"
+		"9) Share a slice     |\n"
+		"10) Stop sharing     |\n"
+		"11) Allocate         |\n"
+		"12) Free             |\n"
+		"13) Flush            |\n"
+		"14) Snapshot         |\n"
+		"15) Upload a file    |\n"
+		"16) Copy/fill/compare|\n");
+}
+
+/**
+ * @brief Read a menu choice from stdin
+ *
+ * @return the number entered
+ */
+uint8_t read_choice(){
+	char line[16];
+	if(fgets(line, sizeof(line), stdin) == NULL)
+		return 0;
+	return atoi(line);
 }
 
 /**
@@ -361,47 +702,34 @@ void *server_com(void *info){
 	struct rdma_cm_id *cm_id = info;
 	int opcode;
 	struct client *client_data;
-	void *buffer = malloc(200);
-	memset(buffer, 0, 200);
-	struct ibv_mr *mr = ibv_reg_mr(cm_id->qp->pd, buffer, 200,
-	 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+	void *buffer;
 	while(1){
-		// Wait for signal from the server
-		rdma_post_recv(cm_id, " ", buffer, 200, mr);
-		opcode = get_completion(cm_id, RECV, 0, stderr);
+		// Wait for signal from the server, responses to calls are handed out by rpc_recv()
+		opcode = rpc_recv(&rpc, &buffer);
 		if(opcode == DISCONNECT){
 			// Send a disconnect signal to the server
 			fprintf(stdout, "\nServer issued a disconnect request.\n");
 			rdma_send_op(cm_id, opcode, stdout);
-			get_completion(cm_id, SEND, 0, stderr);
 			break;
 		} else if (opcode == 0){
 			return NULL;
-		} else if (opcode == ADD_CLIENT){
+		} else if (opcode == ADD_CLIENT && rpc.len >= sizeof(struct client)){
 			// A memory region has opened up and will be added to the local list
-			rdma_post_recv(cm_id, " ", buffer, 200, mr);
-			get_completion(cm_id, RECV, 0, stderr);
 			client_data = buffer;
 			add_client(*client_data);
 			printf("\nA remote memory region has opened.\n");
-			if(in_menu){
-				printf("%s", menu1);
-				if(clients)
-					printf("7) Page 2            |\n");
-			}
-		} else if (opcode == REMOVE_CLIENT){
+			if(in_menu)
+				print_menu();
+		} else if (opcode == REMOVE_CLIENT && rpc.len >= sizeof(uint64_t)){
 			// A memory region has closed and will be removed from the local list
-			rdma_post_recv(cm_id, " ", buffer, 100, mr);
-			remove_client(get_completion(cm_id, RECV, 0, stderr));
+			remove_client(*(uint64_t *)buffer);
 			printf("\nA remote memory region has closed.\n");
-			if(in_menu){
-				printf("%s", menu1);
-				if(clients)
-					printf("7) Page 2            |\n");
-			}
+			if(in_menu)
+				print_menu();
 		}
+		rpc_repost(&rpc, buffer);
 	}
-	obliterate(cm_id, NULL, mr, cm_id->channel, stdout);
+	obliterate(cm_id, NULL, rpc.in, cm_id->channel, stdout);
 	exit(0);
 	return NULL;
 }
@@ -414,6 +742,18 @@ void *server_com(void *info){
  */
 void add_client(struct client node){
 	struct client *current;
+	pthread_mutex_lock(&list_lock);
+	// Access to a memory region that is already known just changed
+	for(current = clist_head; current != NULL; current = current->next){
+		if(current->cid == node.cid){
+			current->rkey = node.rkey;
+			current->remote_addr = node.remote_addr;
+			current->length = node.length;
+			current->writable = node.writable;
+			pthread_mutex_unlock(&list_lock);
+			return;
+		}
+	}
 	clients++;
 	if(clist_head == NULL){
 		clist_head = malloc(sizeof(struct client));
@@ -430,7 +770,9 @@ void add_client(struct client node){
 	current->rkey = node.rkey;
 	current->remote_addr = node.remote_addr;
 	current->length = node.length;
+	current->writable = node.writable;
 	current->next = NULL;
+	pthread_mutex_unlock(&list_lock);
 }
 /**
  * @brief Remove information about an open memory region from the list
@@ -439,31 +781,43 @@ void add_client(struct client node){
  * @param id the client's id number associated with the memory region to be removed
  */
 void remove_client(unsigned long id){
-	struct client *ichi;
+	struct client **ichi;
 	struct client *ni;
-	ichi = clist_head;
-	if(clist_head->cid == id){
-		if(clist_head->next == NULL){
-			free(clist_head);
-			clist_head = NULL;
-		} else {
-			clist_head = clist_head->next;
-			free(ichi);
+	pthread_mutex_lock(&list_lock);
+	for(ichi = &clist_head; *ichi != NULL; ichi = &(*ichi)->next){
+		if((*ichi)->cid == id){
+			ni = *ichi;
+			*ichi = ni->next;
+			free(ni);
+			clients--;
+			break;
 		}
+	}
+	pthread_mutex_unlock(&list_lock);
+}
+/**
+ * @brief Apply a directory update that came in over multicast (or was fetched after being missed)
+ *
+ * @return @c NULL
+ * @param update the update
+ */
+void apply_update(struct dir_update *update){
+	struct client node;
+	if(update->op == ADD_CLIENT){
+		memset(&node, 0, sizeof(node));
+		node.cid = update->cid;
+		node.rkey = update->rkey;
+		node.remote_addr = update->remote_addr;
+		node.length = update->length;
+		node.writable = update->writable;
+		add_client(node);
+		printf("\nA remote memory region has opened.\n");
 	} else {
-		ni = ichi->next;
-		while(ni != NULL){
-			if(ni->cid == id){
-				ichi->next = ni->next;
-				free(ni);
-				break;
-			} else {
-				ichi = ni;
-				ni = ni->next;
-			}
-		}
+		remove_client(update->cid);
+		printf("\nA remote memory region has closed.\n");
 	}
-	clients--;
+	if(in_menu)
+		print_menu();
 }
 
 /**
@@ -490,3 +844,115 @@ struct client *get_client(){
 	printf("Client not found.\n");
 	return NULL;
 }
+
+/**
+ * @brief Read through the cache, if it is on
+ *
+ * @return 0 if the data was read, -1 if it has to be read directly
+ * @param remote_addr the address of the memory region
+ * @param rkey the rkey of the memory region
+ * @param length the length of the memory region
+ * @param offset where to start reading
+ * @param len the amount of bytes to read
+ * @param dest where to put the data
+ */
+int cached_read(uint64_t remote_addr, uint32_t rkey, size_t length, uint64_t offset, size_t len, void *dest){
+	int served;
+	if(!cached || len == 0 || len > tune.region_length)
+		return -1;
+	served = cache_read(&cache, remote_addr, rkey, length, offset, len, dest);
+	if(served < 0){
+		printf("The version numbers are in the way, reading without the cache.\n");
+		return -1;
+	}
+	printf("%d of %llu pages came from the cache.\n", served,
+		(unsigned long long)((offset + len - 1) / CACHE_PAGE - offset / CACHE_PAGE + 1));
+	return 0;
+}
+
+/**
+ * @brief Bump the version numbers of what a write touched, if the cache is on
+ *
+ * @return @c NULL
+ * @param remote_addr the address of the memory region
+ * @param rkey the rkey of the memory region
+ * @param length the length of the memory region
+ * @param offset where the write started
+ * @param len the amount of bytes written
+ */
+void cached_wrote(uint64_t remote_addr, uint32_t rkey, size_t length, uint64_t offset, size_t len){
+	if(cached && cache_wrote(&cache, remote_addr, rkey, length, offset, len))
+		printf("That write went over the cache's version numbers, cached reads of that region may be stale.\n");
+}
+
+/**
+ * @brief Read a range of a remote region straight into a buffer as long as the range, and print it to a file
+ *
+ * The buffer is kept for the next read and its registration is cached, so reading to files again costs no
+ * registration unless the buffer has to grow. The page cache isn't used for these reads.
+ * @return 0 on success, -1 with @c errno set if the buffer couldn't be allocated or registered
+ * @param cm_id the connection to read over
+ * @param remote_addr the address of the remote region
+ * @param rkey the rkey of the remote region
+ * @param offset the offset to read from
+ * @param len the amount of bytes to read
+ * @param file the file to print the bytes to
+ */
+int read_to_file(struct rdma_cm_id *cm_id, uint64_t remote_addr, uint32_t rkey, uint64_t offset, size_t len, FILE *file){
+	size_t page = sysconf(_SC_PAGESIZE), i;
+	unsigned char *byte;
+	struct ibv_mr *mr;
+	if(len > bulk_length){
+		// Growing moves the buffer, so its old registration has to go with it
+		reg_free(&regs, bulk);
+		bulk_length = (len + page - 1) & ~(page - 1);
+		if((errno = posix_memalign(&bulk, page, bulk_length))){
+			bulk = NULL;
+			bulk_length = 0;
+			return -1;
+		}
+	}
+	mr = reg_get(&regs, bulk, len ? len : 1, IBV_ACCESS_LOCAL_WRITE);
+	if(mr == NULL)
+		return -1;
+	if(len){
+		if(rdma_post_read(cm_id, "qwerty", bulk, len, mr, IBV_SEND_SIGNALED, remote_addr + offset, rkey))
+			stop_it("rdma_post_read()", errno, stderr);
+		get_completion(cm_id, SEND, 1, stdout);
+	}
+	reg_put(&regs, mr);
+	// Print data in hex 1 byte at a time
+	fprintf(file, "Data: ");
+	byte = bulk;
+	for(i = 0; i < len; i++)
+		fprintf(file, "%02x ", byte[i]);
+	fprintf(file, "\n");
+	printf("Read %zu bytes (%lu registration hits, %lu misses).\n", len, regs.hits, regs.misses);
+	return 0;
+}
+
+/**
+ * @brief Dump a range of a remote region to a file in binary, and print how long it took
+ *
+ * @return @c NULL
+ * @param cm_id the connection to read over
+ * @param remote_addr the address of the remote region
+ * @param rkey the rkey of the remote region
+ * @param offset the offset to read from
+ * @param len the amount of bytes to dump
+ * @param path the file to write
+ */
+void dump_to_file(struct rdma_cm_id *cm_id, uint64_t remote_addr, uint32_t rkey, uint64_t offset, size_t len,
+	const char *path){
+	struct timeval start, end;
+	double elapsed;
+	gettimeofday(&start, NULL);
+	if(dump_range(&dumper, cm_id, remote_addr, rkey, offset, len, path, direct)){
+		printf("Couldn't dump to %s: %s\n", path, strerror(errno));
+		return;
+	}
+	gettimeofday(&end, NULL);
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	printf("Dumped %zu bytes to %s in %.3f s (%.1f MB/s).\n", len, path, elapsed,
+		elapsed > 0 ? len / elapsed / 1000000.0 : 0.0);
+}
@@ -0,0 +1,158 @@
+/**
+ * @file compute.c
+ * @brief Operations the server carries out on memory regions on behalf of clients
+ *
+ * Lets clients work on data that is already on the server without pulling it over the network.
+ * A client can always use its own memory region, and other clients' memory regions within what
+ * has been shared with it.
+ *
+ * The client list semaphore is only held while the memory regions are looked up and checked. They
+ * are pinned with their owners' region locks, which keep them from being freed, and the work is
+ * done without the semaphore so it doesn't hold up the other clients. Access that is revoked while
+ * an operation is running ends with the operation, like a one-sided access already in flight.
+ */
+#include "server.h"
+#include <time.h>
+
+/**
+ * @brief Find the range of a memory region an operation works on, checking the client may use it
+ *
+ * Must be called with the client list semaphore held.
+ * @return a pointer to the start of the range, or @c NULL if the client can't use it
+ * @param node the client asking
+ * @param cid the client whose memory region is used, 0 for @p node's own
+ * @param offset the start of the range
+ * @param length the length of the range
+ * @param write 1 if the range is written to
+ * @param pin where to store the owner of the memory region, to be pinned by the caller
+ */
+static uint8_t *compute_span(struct cnode *node, uint64_t cid, uint64_t offset, uint64_t length, uint8_t write,
+	struct cnode **pin){
+	struct cnode *owner = node;
+	if(cid != 0 && cid != node->cid)
+		for(owner = clist_head; owner != NULL && owner->cid != cid; owner = owner->next);
+	if(owner == NULL || owner->mr == NULL || length == 0 || offset + length > owner->length ||
+		offset + length < offset)
+		return NULL;
+	if(owner != node && !grant_covers(owner, node, offset, length, write))
+		return NULL;
+	*pin = owner;
+	return (uint8_t *)owner->mr->addr + offset;
+}
+
+/**
+ * @brief Get the time elapsed since a timestamp
+ *
+ * @return the elapsed time in seconds
+ * @param start the timestamp
+ */
+static double elapsed(struct timespec *start){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Handle a client's @c CHECKSUM
+ *
+ * @return 0 on success, an errno value otherwise (also stored in @p req)
+ * @param node the client
+ * @param req the range; filled in with the digest
+ */
+int compute_checksum(struct cnode *node, struct checksum_request *req){
+	struct timespec start;
+	struct cnode *owner;
+	uint8_t *span;
+	sem_wait(&clist_sem);
+	span = compute_span(node, req->cid, req->offset, req->length, 0, &owner);
+	// Region locks are only taken with the semaphore held, so this never waits on a writer
+	if(span != NULL)
+		pthread_rwlock_rdlock(&owner->region_lock);
+	sem_post(&clist_sem);
+	req->crc = 0;
+	req->status = span == NULL ? EACCES : 0;
+	if(span != NULL){
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		req->crc = crc32c(0, span, req->length);
+		fprintf(log_p, "Client %lu checksummed [%llu, +%llu) of client %lu's memory region: %08x "
+			"(%s, %.1f MB/s)\n", node->cid, (unsigned long long)req->offset, (unsigned long long)req->length,
+			req->cid ? (unsigned long)req->cid : node->cid, (unsigned int)req->crc, crc32c_name(),
+			req->length / 1e6 / elapsed(&start));
+		pthread_rwlock_unlock(&owner->region_lock);
+	} else {
+		fprintf(log_p, "Client %lu can't checksum [%llu, +%llu) of client %lu's memory region.\n", node->cid,
+			(unsigned long long)req->offset, (unsigned long long)req->length,
+			req->cid ? (unsigned long)req->cid : node->cid);
+	}
+	return req->status;
+}
+
+/**
+ * @brief Find the first difference between two buffers
+ *
+ * Chunks are compared with memcmp(), which is vectorized, and only the chunk that differs is
+ * walked byte by byte.
+ * @return the offset of the first difference, @p length if there is none
+ * @param a the first buffer
+ * @param b the second buffer
+ * @param length the length of both buffers
+ */
+static uint64_t first_difference(const uint8_t *a, const uint8_t *b, uint64_t length){
+	uint64_t done = 0, chunk;
+	while(done < length){
+		chunk = length - done < 4096 ? length - done : 4096;
+		if(memcmp(a + done, b + done, chunk)){
+			while(a[done] == b[done])
+				done++;
+			return done;
+		}
+		done += chunk;
+	}
+	return length;
+}
+
+/**
+ * @brief Handle a client's @c COPY, @c FILL or @c COMPARE
+ *
+ * The work is done with the C library's memmove(), memset() and memcmp(), which already pick
+ * vector implementations for the processor. Copies between overlapping ranges are safe.
+ * @return 0 on success, an errno value otherwise (also stored in @p req)
+ * @param node the client
+ * @param op the opcode
+ * @param req the ranges; filled in with the result
+ */
+int compute_op(struct cnode *node, uint32_t op, struct compute_request *req){
+	static const char *names[3] = {"copied", "filled", "compared"};
+	struct timespec start;
+	struct cnode *dst_owner, *src_owner;
+	uint8_t *dst, *src;
+	sem_wait(&clist_sem);
+	dst = compute_span(node, req->dst_cid, req->dst_offset, req->length, op != COMPARE, &dst_owner);
+	src_owner = dst_owner;
+	src = op == FILL ? dst : compute_span(node, req->src_cid, req->src_offset, req->length, 0, &src_owner);
+	req->result = 0;
+	req->status = dst == NULL || src == NULL ? EACCES : 0;
+	if(!req->status){
+		pthread_rwlock_rdlock(&dst_owner->region_lock);
+		if(src_owner != dst_owner)
+			pthread_rwlock_rdlock(&src_owner->region_lock);
+	}
+	sem_post(&clist_sem);
+	if(req->status){
+		fprintf(log_p, "Client %lu can't use those ranges.\n", node->cid);
+		return req->status;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(op == COPY)
+		memmove(dst, src, req->length);
+	else if(op == FILL)
+		memset(dst, req->pattern & 0xff, req->length);
+	else
+		req->result = first_difference(dst, src, req->length);
+	if(src_owner != dst_owner)
+		pthread_rwlock_unlock(&src_owner->region_lock);
+	pthread_rwlock_unlock(&dst_owner->region_lock);
+	fprintf(log_p, "Client %lu %s %llu bytes (%.1f MB/s).\n", node->cid, names[op - COPY],
+		(unsigned long long)req->length, req->length / 1e6 / elapsed(&start));
+	return 0;
+}
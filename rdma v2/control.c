@@ -0,0 +1,216 @@
+/**
+ * @file control.c
+ * @brief The server's control socket
+ *
+ * With @c -S the server takes commands on a Unix domain socket instead of the menu, one per line,
+ * so it can be run and watched from scripts. Each answer ends with a line starting with "ok" or
+ * "error". Connections are served one at a time by the main thread:
+ *
+ * - @c list prints a line of @c key=value pairs per client
+ * - @c disconnect @c <client id> disconnects a client, or drops its session if it is detached
+ * - @c metrics prints one @c name @c value pair per line, the rates cover the time since the last @c metrics
+ * - @c drain stops accepting connections and exits once every client is gone
+ * - @c shutdown disconnects every client and exits
+ *
+ * The metrics are read from @c stats, which the agents count into with atomics, so asking for them
+ * never waits on the client list.
+ */
+#include "server.h"
+#include <sys/un.h>
+#include <signal.h>
+
+/**
+ * @brief The longest command line
+ */
+#define CTL_LINE	128
+/**
+ * @brief How long a connection may sit idle before it is dropped, so one can't wedge the socket
+ */
+#define CTL_TIMEOUT	30
+
+/**
+ * @brief A copy of the counters in @c stats that change at a rate
+ */
+struct ctl_rates {
+	unsigned long messages;		/**< @c stats.messages */
+	unsigned long calls;		/**< @c stats.calls */
+	unsigned long opens;		/**< @c stats.opens */
+	unsigned long closes;		/**< @c stats.closes */
+	unsigned long accepted;		/**< @c stats.accepted */
+	struct timespec at;			/**< When the copy was taken */
+};
+
+/**
+ * @brief Create the control socket and listen on it
+ *
+ * A socket left at the path by an earlier server is replaced. Only the owner may connect. A script
+ * that hangs up before reading its answer must not kill the server, so @c SIGPIPE is ignored.
+ * @return the socket
+ * @param path where to create the socket
+ */
+int ctl_open(const char *path){
+	struct sockaddr_un addr;
+	int fd;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+		stop_it("ctl_open()", ENAMETOOLONG, log_p);
+	strcpy(addr.sun_path, path);
+	signal(SIGPIPE, SIG_IGN);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		stop_it("socket()", errno, log_p);
+	unlink(path);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		stop_it("bind()", errno, log_p);
+	if(chmod(path, 0600))
+		stop_it("chmod()", errno, log_p);
+	if(listen(fd, 4))
+		stop_it("listen()", errno, log_p);
+	return fd;
+}
+
+/**
+ * @brief Print every client
+ *
+ * @return @c NULL
+ * @param out where to print
+ */
+static void ctl_list(FILE *out){
+	struct cnode *list;
+	size_t count = admin_list(&list), i;
+	for(i = 0; i < count; i++)
+		fprintf(out, "cid=%lu state=%s region=%s length=%llu allocated=%llu quota=%llu\n", list[i].cid,
+			list[i].detached ? "detached" : "connected", list[i].status == OPEN ? "open" : "closed",
+			(unsigned long long)list[i].length, (unsigned long long)list[i].allocated,
+			(unsigned long long)list[i].quota);
+	free(list);
+	fprintf(out, "ok %zu clients\n", count);
+}
+
+/**
+ * @brief Print the metrics
+ *
+ * @return @c NULL
+ * @param out where to print
+ * @param last the counters at the last call, updated
+ */
+static void ctl_metrics(FILE *out, struct ctl_rates *last){
+	struct ctl_rates now;
+	double elapsed;
+	now.messages = atomic_load_explicit(&stats.messages, memory_order_relaxed);
+	now.calls = atomic_load_explicit(&stats.calls, memory_order_relaxed);
+	now.opens = atomic_load_explicit(&stats.opens, memory_order_relaxed);
+	now.closes = atomic_load_explicit(&stats.closes, memory_order_relaxed);
+	now.accepted = atomic_load_explicit(&stats.accepted, memory_order_relaxed);
+	clock_gettime(CLOCK_MONOTONIC, &now.at);
+	elapsed = (now.at.tv_sec - last->at.tv_sec) + (now.at.tv_nsec - last->at.tv_nsec) / 1000000000.0;
+	if(elapsed <= 0)
+		elapsed = 1;
+	fprintf(out, "uptime_seconds %llu\n", (unsigned long long)(time(NULL) - started));
+	fprintf(out, "connections %lu\n", atomic_load_explicit(&stats.connections, memory_order_relaxed));
+	fprintf(out, "connections_total %lu\n", now.accepted);
+	fprintf(out, "disconnects_total %lu\n", atomic_load_explicit(&stats.disconnects, memory_order_relaxed));
+	fprintf(out, "sessions_detached %lu\n", atomic_load_explicit(&stats.detached, memory_order_relaxed));
+	fprintf(out, "regions_open %lu\n", atomic_load_explicit(&stats.regions_open, memory_order_relaxed));
+	fprintf(out, "region_bytes_registered %lu\n", atomic_load_explicit(&stats.registered, memory_order_relaxed));
+	fprintf(out, "messages_total %lu\n", now.messages);
+	fprintf(out, "calls_total %lu\n", now.calls);
+	fprintf(out, "open_mr_total %lu\n", now.opens);
+	fprintf(out, "close_mr_total %lu\n", now.closes);
+	fprintf(out, "connections_per_second %.3f\n", (now.accepted - last->accepted) / elapsed);
+	fprintf(out, "messages_per_second %.3f\n", (now.messages - last->messages) / elapsed);
+	fprintf(out, "calls_per_second %.3f\n", (now.calls - last->calls) / elapsed);
+	fprintf(out, "open_mr_per_second %.3f\n", (now.opens - last->opens) / elapsed);
+	fprintf(out, "close_mr_per_second %.3f\n", (now.closes - last->closes) / elapsed);
+	fprintf(out, "ok\n");
+	*last = now;
+}
+
+/**
+ * @brief Run one command
+ *
+ * @return 1 if the server should stop serving the socket, 0 otherwise
+ * @param line the command
+ * @param out where to print the answer
+ * @param last the counters at the last @c metrics command
+ * @param action where to store what to do once the socket isn't served anymore
+ */
+static int ctl_command(char *line, FILE *out, struct ctl_rates *last, enum ctl_action *action){
+	char *cmd = strtok(line, " \t\r\n"), *arg = strtok(NULL, " \t\r\n"), *end;
+	unsigned long cid;
+	if(cmd == NULL)
+		return 0;
+	if(!strcmp(cmd, "list")){
+		ctl_list(out);
+	} else if(!strcmp(cmd, "metrics")){
+		ctl_metrics(out, last);
+	} else if(!strcmp(cmd, "disconnect")){
+		cid = arg != NULL ? strtoul(arg, &end, 0) : 0;
+		if(arg == NULL || *end != '\0'){
+			fprintf(out, "error usage: disconnect <client id>\n");
+			return 0;
+		}
+		switch(admin_disconnect(cid)){
+			case 0:
+				fprintf(out, "ok disconnected %lu\n", cid);
+				break;
+			case 1:
+				fprintf(out, "ok dropped the session of %lu\n", cid);
+				break;
+			default:
+				fprintf(out, "error no client %lu\n", cid);
+		}
+	} else if(!strcmp(cmd, "drain")){
+		fprintf(out, "ok draining\n");
+		*action = CTL_DRAIN;
+		return 1;
+	} else if(!strcmp(cmd, "shutdown")){
+		fprintf(out, "ok shutting down\n");
+		*action = CTL_SHUTDOWN;
+		return 1;
+	} else if(!strcmp(cmd, "help")){
+		fprintf(out, "list\nmetrics\ndisconnect <client id>\ndrain\nshutdown\nok\n");
+	} else {
+		fprintf(out, "error unknown command '%s'\n", cmd);
+	}
+	return 0;
+}
+
+/**
+ * @brief Serve the control socket until a command stops the server
+ *
+ * @return what to do now
+ * @param fd the socket from ctl_open()
+ */
+enum ctl_action ctl_serve(int fd){
+	struct timeval timeout = {CTL_TIMEOUT, 0};
+	struct ctl_rates last;
+	enum ctl_action action = CTL_SHUTDOWN;
+	char line[CTL_LINE];
+	FILE *in, *out;
+	int conn, stop = 0;
+	memset(&last, 0, sizeof(last));
+	clock_gettime(CLOCK_MONOTONIC, &last.at);
+	while(!stop){
+		conn = accept(fd, NULL, NULL);
+		if(conn < 0){
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			stop_it("accept()", errno, log_p);
+		}
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		in = fdopen(conn, "r");
+		out = fdopen(dup(conn), "w");
+		if(in == NULL || out == NULL)
+			stop_it("fdopen()", errno, log_p);
+		while(!stop && fgets(line, sizeof(line), in) != NULL){
+			stop = ctl_command(line, out, &last, &action);
+			fflush(out);
+		}
+		fclose(out);
+		fclose(in);
+	}
+	fprintf(log_p, "The control socket asked to %s.\n", action == CTL_DRAIN ? "drain" : "shut down");
+	return action;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file crc32c.c
+ * @brief CRC32C (Castagnoli), shared by the server and the clients so digests can be compared
+ *
+ * On x86-64 processors with SSE4.2 the crc32 instruction is used on three interleaved streams, which
+ * hides its latency, and the three results are stitched back together with shift tables. Everything
+ * else gets slicing-by-8.
+ */
+#include "rdma_cs.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/**
+ * @brief The reflected CRC32C polynomial
+ */
+#define CRC32C_POLY		0x82f63b78
+/**
+ * @brief The length of each of the three streams the hardware version works on at once
+ */
+#define CRC32C_LANE		4096
+
+/**
+ * @brief Slicing-by-8 tables
+ */
+static uint32_t slice[8][256];
+/**
+ * @brief Tables for shifting a CRC over @c CRC32C_LANE and 2 * @c CRC32C_LANE zero bytes
+ */
+static uint32_t shift1[4][256], shift2[4][256];
+/**
+ * @brief The implementation picked for this processor
+ */
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t);
+/**
+ * @brief Makes sure the tables are built once
+ */
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Software CRC32C, eight bytes at a time
+ *
+ * @return the updated CRC (not inverted)
+ * @param crc the CRC so far (not inverted)
+ * @param buf the data
+ * @param len the length of @p buf
+ */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len){
+	uint64_t word;
+	while(len && ((uintptr_t)buf & 7)){
+		crc = slice[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while(len >= 8){
+		memcpy(&word, buf, 8);
+		word ^= crc;
+		crc = slice[7][word & 0xff] ^ slice[6][(word >> 8) & 0xff] ^
+			slice[5][(word >> 16) & 0xff] ^ slice[4][(word >> 24) & 0xff] ^
+			slice[3][(word >> 32) & 0xff] ^ slice[2][(word >> 40) & 0xff] ^
+			slice[1][(word >> 48) & 0xff] ^ slice[0][word >> 56];
+		buf += 8;
+		len -= 8;
+	}
+	while(len--)
+		crc = slice[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/**
+ * @brief Apply a shift table to a CRC
+ *
+ * @return the CRC as it would be after that many more zero bytes
+ * @param table the shift table
+ * @param crc the CRC
+ */
+static inline uint32_t crc32c_shift(uint32_t table[4][256], uint32_t crc){
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+		table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief Hardware CRC32C using the SSE4.2 crc32 instruction
+ *
+ * Large buffers are cut into blocks of three lanes that are run at the same time. Since a CRC is
+ * linear, the CRC of a block is the first lane's CRC shifted over the other two lanes, XORed with the
+ * second lane's shifted over the third, XORed with the third lane's (the last two started from 0).
+ * @return the updated CRC (not inverted)
+ * @param crc the CRC so far (not inverted)
+ * @param buf the data
+ * @param len the length of @p buf
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len){
+	uint64_t a, b, c, word;
+	size_t i;
+	while(len && ((uintptr_t)buf & 7)){
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+	while(len >= 3 * CRC32C_LANE){
+		a = crc;
+		b = c = 0;
+		for(i = 0; i < CRC32C_LANE; i += 8){
+			a = _mm_crc32_u64(a, *(const uint64_t *)(buf + i));
+			b = _mm_crc32_u64(b, *(const uint64_t *)(buf + CRC32C_LANE + i));
+			c = _mm_crc32_u64(c, *(const uint64_t *)(buf + 2 * CRC32C_LANE + i));
+		}
+		crc = crc32c_shift(shift2, a) ^ crc32c_shift(shift1, b) ^ (uint32_t)c;
+		buf += 3 * CRC32C_LANE;
+		len -= 3 * CRC32C_LANE;
+	}
+	a = crc;
+	while(len >= 8){
+		memcpy(&word, buf, 8);
+		a = _mm_crc32_u64(a, word);
+		buf += 8;
+		len -= 8;
+	}
+	crc = a;
+	while(len--)
+		crc = _mm_crc32_u8(crc, *buf++);
+	return crc;
+}
+#endif
+
+/**
+ * @brief Build a shift table for a number of zero bytes
+ *
+ * Each entry is what a CRC holding just that byte turns into after @p len zero bytes.
+ * @return @c NULL
+ * @param table the table to fill in
+ * @param len the amount of zero bytes
+ */
+static void crc32c_shift_table(uint32_t table[4][256], size_t len){
+	uint8_t *zeros = calloc(len, 1);
+	int i, j;
+	for(i = 0; i < 4; i++)
+		for(j = 0; j < 256; j++)
+			table[i][j] = crc32c_sw((uint32_t)j << (8 * i), zeros, len);
+	free(zeros);
+}
+
+/**
+ * @brief Build the tables and pick an implementation
+ *
+ * @return @c NULL
+ */
+static void crc32c_init(){
+	uint32_t crc;
+	int i, j;
+	for(i = 0; i < 256; i++){
+		crc = i;
+		for(j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		slice[0][i] = crc;
+	}
+	for(i = 0; i < 256; i++)
+		for(j = 1; j < 8; j++)
+			slice[j][i] = slice[0][slice[j - 1][i] & 0xff] ^ (slice[j - 1][i] >> 8);
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2")){
+		crc32c_shift_table(shift1, CRC32C_LANE);
+		crc32c_shift_table(shift2, 2 * CRC32C_LANE);
+		crc32c_impl = crc32c_hw;
+	}
+#endif
+}
+
+/**
+ * @brief Compute or continue a CRC32C
+ *
+ * @return the CRC32C of everything so far
+ * @param crc 0 to start, or the result of the previous call to continue
+ * @param buf the data
+ * @param len the length of @p buf
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len){
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_impl(~crc, buf, len);
+}
+
+/**
+ * @brief Find out which implementation crc32c() uses
+ *
+ * @return "sse4.2" or "scalar"
+ */
+const char *crc32c_name(){
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl == crc32c_sw ? "scalar" : "sse4.2";
+}
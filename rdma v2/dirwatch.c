@@ -0,0 +1,241 @@
+/**
+ * @file dirwatch.c
+ * @brief File containing the definitions of the functions listed in dirwatch.h
+ */
+#include "dirwatch.h"
+
+/**
+ * @brief Fetch and apply the updates that were missed
+ *
+ * The calls are pipelined, as many at once as can be outstanding. Updates the server no longer
+ * has are skipped with a warning, the directory can only be trusted again after reconnecting.
+ * @return @c NULL
+ * @param w the watcher
+ * @param last the sequence number of the last update to fetch
+ */
+static void dir_recover(struct dir_watch *w, uint64_t last){
+	struct dir_update updates[RPC_MAX_OUTSTANDING];
+	int handles[RPC_MAX_OUTSTANDING];
+	uint64_t first;
+	int i, n, err;
+	while(w->next <= last){
+		first = w->next;
+		n = last - first + 1 < RPC_MAX_OUTSTANDING ? last - first + 1 : RPC_MAX_OUTSTANDING;
+		for(i = 0; i < n; i++){
+			memset(&updates[i], 0, sizeof(updates[i]));
+			updates[i].seq = first + i;
+			handles[i] = rpc_start(w->rpc, DIR_FETCH, &updates[i], sizeof(updates[i]), &updates[i],
+				sizeof(updates[i]));
+		}
+		for(i = 0; i < n; i++){
+			if(handles[i] < 0 || (err = rpc_wait(w->rpc, handles[i]))){
+				fprintf(w->file, "\nMissed directory update %llu, reconnect to be sure the list is right.\n",
+					(unsigned long long)(first + i));
+			} else {
+				w->apply(&updates[i]);
+				w->fetched++;
+			}
+		}
+		w->next = first + n;
+	}
+}
+
+/**
+ * @brief The function for the watcher thread
+ *
+ * @return @c NULL
+ * @param arg the @c struct @c dir_watch
+ */
+static void *dir_thread(void *arg){
+	struct dir_watch *w = arg;
+	struct dir_update *u;
+	struct ibv_wc wc;
+	while(1){
+		if(-1 == rdma_get_recv_comp(w->id, &wc))
+			stop_it("rdma_get_recv_comp()", errno, w->file);
+		if(wc.status)
+			break;
+		u = (struct dir_update *)((uint8_t *)wc.wr_id + DIR_GRH);
+		if(wc.byte_len >= DIR_GRH + sizeof(*u) && u->seq >= w->next){
+			w->received++;
+			if(u->seq > w->next){
+				pthread_mutex_lock(w->send_lock);
+				dir_recover(w, u->seq - 1);
+				pthread_mutex_unlock(w->send_lock);
+			}
+			w->apply(u);
+			w->next = u->seq + 1;
+		}
+		if(rdma_post_recv(w->id, (void *)wc.wr_id, (void *)wc.wr_id, DIR_GRH + sizeof(*u), w->mr))
+			stop_it("rdma_post_recv()", errno, w->file);
+	}
+	return NULL;
+}
+
+/**
+ * @brief The function for the watcher thread when the group couldn't be joined
+ *
+ * Asks the server where the directory stands every @c DIR_POLL_SECONDS and fetches what is new.
+ * @return @c NULL
+ * @param arg the @c struct @c dir_watch
+ */
+static void *dir_poll(void *arg){
+	struct dir_watch *w = arg;
+	struct dir_sync sync;
+	while(1){
+		sleep(DIR_POLL_SECONDS);
+		memset(&sync, 0, sizeof(sync));
+		pthread_mutex_lock(w->send_lock);
+		if(!rpc_call(w->rpc, DIR_FETCH, &sync, sizeof(struct dir_update), &sync, sizeof(sync)))
+			dir_recover(w, sync.current);
+		pthread_mutex_unlock(w->send_lock);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Free whatever dir_join() got to set up
+ *
+ * @return @c NULL
+ * @param w the watcher
+ */
+static void dir_unjoin(struct dir_watch *w){
+	void *buffer = w->mr != NULL ? w->mr->addr : NULL;
+	if(w->mr != NULL)
+		ibv_dereg_mr(w->mr);
+	free(buffer);
+	if(w->id != NULL){
+		if(w->id->qp != NULL)
+			rdma_destroy_qp(w->id);
+		rdma_destroy_id(w->id);
+	}
+	if(w->ec != NULL)
+		rdma_destroy_event_channel(w->ec);
+	w->mr = NULL;
+	w->id = NULL;
+	w->ec = NULL;
+}
+
+/**
+ * @brief Wait for a communication manager event on the watcher's channel
+ *
+ * @return 0 if it was the expected event, -1 if not
+ * @param w the watcher
+ * @param expected the expected event
+ */
+static int dir_event(struct dir_watch *w, enum rdma_cm_event_type expected){
+	struct rdma_cm_event *event;
+	int err;
+	if(rdma_get_cm_event(w->ec, &event))
+		return -1;
+	err = event->event != expected;
+	if(err)
+		fprintf(w->file, "Expected \"%s\" but got \"%s\".\n", rdma_event_str(expected),
+			rdma_event_str(event->event));
+	rdma_ack_cm_event(event);
+	return err ? -1 : 0;
+}
+
+/**
+ * @brief Join the multicast group the same way the server did
+ *
+ * Everything is freed again if it fails.
+ * @return 0 on success, -1 on failure
+ * @param w the watcher
+ * @param conn the connection to the server, the group is joined from its local address
+ * @param name the address of the group
+ */
+static int dir_join(struct dir_watch *w, struct rdma_cm_id *conn, const char *name){
+	struct ibv_qp_init_attr init_attr;
+	struct sockaddr_in src, group;
+	size_t slot = DIR_GRH + sizeof(struct dir_update);
+	void *buffer;
+	int i;
+	memset(&group, 0, sizeof(group));
+	group.sin_family = AF_INET;
+	inet_aton(name, &group.sin_addr);
+	memcpy(&src, rdma_get_local_addr(conn), sizeof(src));
+	src.sin_port = 0;
+	w->ec = rdma_create_event_channel();
+	if(w->ec == NULL)
+		goto fail;
+	if(rdma_create_id(w->ec, &w->id, NULL, RDMA_PS_UDP)){
+		w->id = NULL;
+		goto fail;
+	}
+	if(rdma_resolve_addr(w->id, (struct sockaddr *)&src, (struct sockaddr *)&group, 2000) ||
+		dir_event(w, RDMA_CM_EVENT_ADDR_RESOLVED))
+		goto fail;
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.qp_type = IBV_QPT_UD;
+	init_attr.cap.max_send_wr = 1;
+	init_attr.cap.max_recv_wr = DIR_RECV_WR;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.cap.max_recv_sge = 1;
+	if(rdma_create_qp(w->id, NULL, &init_attr))
+		goto fail;
+	buffer = malloc(DIR_RECV_WR * slot);
+	if(buffer == NULL)
+		goto fail;
+	w->mr = ibv_reg_mr(w->id->qp->pd, buffer, DIR_RECV_WR * slot, IBV_ACCESS_LOCAL_WRITE);
+	if(w->mr == NULL){
+		free(buffer);
+		goto fail;
+	}
+	for(i = 0; i < DIR_RECV_WR; i++)
+		if(rdma_post_recv(w->id, w->mr->addr + i * slot, w->mr->addr + i * slot, slot, w->mr))
+			goto fail;
+	if(rdma_join_multicast(w->id, (struct sockaddr *)&group, NULL) ||
+		dir_event(w, RDMA_CM_EVENT_MULTICAST_JOIN))
+		goto fail;
+	return 0;
+fail:
+	fprintf(w->file, "Couldn't join multicast group %s: %s\n", name, strerror(errno));
+	dir_unjoin(w);
+	return -1;
+}
+
+/**
+ * @brief Start following the directory, over multicast if the server uses it
+ *
+ * Must be called with @p send_lock held, after the client was sent the memory regions that were
+ * already open. Updates that were sent in between are fetched before the watcher thread starts.
+ * If the group can't be joined the watcher thread fetches updates with @c DIR_FETCH instead, since
+ * the server doesn't send them over the connection either way.
+ * @return 0 if the watcher thread is running, -1 if the server sends updates over the connection
+ * @param w the watcher to set up
+ * @param conn the connection to the server
+ * @param rpc the calls to the server
+ * @param send_lock the lock serializing sends on @p conn
+ * @param apply the function applying an update to the directory, called from the watcher thread
+ * @param file the file to print to
+ */
+int dir_watch(struct dir_watch *w, struct rdma_cm_id *conn, struct rpc_client *rpc, pthread_mutex_t *send_lock,
+	void (*apply)(struct dir_update *), FILE *file){
+	struct dir_sync sync;
+	char group[sizeof(sync.group)];
+	int err, joined;
+	memset(w, 0, sizeof(*w));
+	w->rpc = rpc;
+	w->send_lock = send_lock;
+	w->apply = apply;
+	w->file = file;
+	memset(&sync, 0, sizeof(sync));
+	if((err = rpc_call(rpc, DIR_FETCH, &sync, sizeof(struct dir_update), &sync, sizeof(sync))) || !sync.group[0])
+		return -1;
+	w->next = sync.base + 1;
+	memcpy(group, sync.group, sizeof(group));
+	group[sizeof(group) - 1] = '\0';
+	joined = !dir_join(w, conn, group);
+	// Anything sent before the join completed may have been missed
+	memset(&sync, 0, sizeof(sync));
+	if(!rpc_call(rpc, DIR_FETCH, &sync, sizeof(struct dir_update), &sync, sizeof(sync)))
+		dir_recover(w, sync.current);
+	if((err = pthread_create(&w->thread, NULL, joined ? dir_thread : dir_poll, w)))
+		stop_it("pthread_create()", err, file);
+	if(joined)
+		fprintf(file, "Following directory updates on multicast group %s.\n", group);
+	else
+		fprintf(file, "Fetching directory updates every %d seconds.\n", DIR_POLL_SECONDS);
+	return 0;
+}
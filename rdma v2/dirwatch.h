@@ -0,0 +1,46 @@
+/**
+ * @file dirwatch.h
+ * @brief Receiving the directory updates the server multicasts
+ *
+ * Updates are applied in sequence number order. When one is missed, the missing ones are fetched
+ * over the connection to the server with @c DIR_FETCH calls before going on. A client that can't
+ * join the group fetches all of them that way.
+ */
+#ifndef RDMA_CS_DIRWATCH
+#define RDMA_CS_DIRWATCH
+#include "rdma_cs.h"
+#include "rpc.h"
+
+/**
+ * @brief The amount of receive buffers for multicast updates
+ */
+#define DIR_RECV_WR	16
+/**
+ * @brief The space the global routing header takes up in front of every datagram
+ */
+#define DIR_GRH		40
+/**
+ * @brief How often a client that couldn't join the group fetches updates
+ */
+#define DIR_POLL_SECONDS	1
+
+/**
+ * @brief The client side of the multicast directory
+ */
+struct dir_watch {
+	struct rdma_event_channel *ec;			/**< The event channel of @c id */
+	struct rdma_cm_id *id;					/**< The UD connection that joined the group, @c NULL if it couldn't */
+	struct ibv_mr *mr;						/**< @c DIR_RECV_WR receive buffers */
+	struct rpc_client *rpc;					/**< The calls to the server, for fetching missed updates */
+	pthread_mutex_t *send_lock;				/**< Held while making calls from the watcher thread */
+	uint64_t next;							/**< The sequence number of the next update to apply */
+	void (*apply)(struct dir_update *);		/**< Applies an update to the client's directory */
+	unsigned long received;					/**< The amount of updates received over multicast */
+	unsigned long fetched;					/**< The amount of updates fetched because they were missed */
+	pthread_t thread;						/**< The watcher thread */
+	FILE *file;								/**< The file to print to */
+};
+
+int dir_watch(struct dir_watch *, struct rdma_cm_id *, struct rpc_client *, pthread_mutex_t *,
+	void (*)(struct dir_update *), FILE *);
+#endif
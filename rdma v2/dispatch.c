@@ -0,0 +1,404 @@
+/**
+ * @file dispatch.c
+ * @brief The server side of the calls in rpc.h
+ *
+ * Handlers are registered per operation. The agent thread pulls calls out of the client's messages
+ * and hands them to a pool of worker threads, so a slow call doesn't hold up the ones behind it and
+ * the agent can keep receiving. Finished calls are queued on the connection and the agent sends them
+ * back, as many as fit into each message. The agent isn't the only thread sending on the queue pair,
+ * workers bind allocations to it and other agents share memory regions through it, so every send
+ * goes through send_wait().
+ */
+#include "server.h"
+#include "rpc.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+
+/**
+ * @brief The highest operation a handler can be registered for
+ */
+#define RPC_MAX_OPS		64
+
+/**
+ * @brief A registered handler
+ */
+struct rpc_handler_entry {
+	rpc_handler fn;		/**< The handler, @c NULL if none is registered */
+	uint8_t locked;		/**< 1 if the handler is run with the client list semaphore held */
+};
+
+/**
+ * @brief A call waiting for (or being run by) a worker, and later its response
+ */
+struct rpc_job {
+	struct rpc_conn *conn;			/**< The connection the call came in on */
+	struct rpc_header hdr;			/**< The header, the status is filled in by the worker */
+	uint8_t args[RPC_MAX_ARGS];		/**< The arguments, replaced by the results */
+	struct rpc_job *next;			/**< A pointer to the next job in the queue */
+};
+
+/**
+ * @brief The server side of the calls on one connection
+ */
+struct rpc_conn {
+	struct rdma_cm_id *id;		/**< The connection to the client */
+	struct cnode *node;			/**< The client */
+	struct ibv_mr *in;			/**< @c recv_wr receive buffers of @c RPC_MAX_MSG bytes, as granted to the client */
+	struct ibv_mr *out;			/**< The message responses are gathered in */
+	int efd;					/**< Signaled by the workers when a response is queued */
+	pthread_mutex_t lock;		/**< Lock for everything below */
+	pthread_cond_t idle;		/**< Signaled when @c running drops to 0 */
+	struct rpc_job *done;		/**< The responses waiting to be sent */
+	struct rpc_job **done_tail;	/**< The end of @c done */
+	int running;				/**< The amount of calls queued for or being run by workers */
+	unsigned long calls;		/**< The amount of calls answered */
+	unsigned long messages;		/**< The amount of messages the responses went out in */
+};
+
+/**
+ * @brief The registered handlers
+ */
+static struct rpc_handler_entry handlers[RPC_MAX_OPS];
+/**
+ * @brief The calls waiting for a worker
+ */
+static struct rpc_job *queue_head, **queue_tail = &queue_head;
+/**
+ * @brief Lock for the queue
+ */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * @brief Signaled when a call is queued
+ */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Register the handler for an operation
+ *
+ * @return @c NULL
+ * @param op the operation
+ * @param fn the handler
+ * @param locked 1 if the handler has to run with the client list semaphore held
+ */
+void rpc_register(uint16_t op, rpc_handler fn, uint8_t locked){
+	if(op >= RPC_MAX_OPS){
+		fprintf(log_p, "Error: can't register a handler for operation %u\n", (unsigned int)op);
+		exit(-1);
+	}
+	handlers[op].fn = fn;
+	handlers[op].locked = locked;
+}
+
+/**
+ * @brief The function for the worker threads
+ *
+ * @return @c NULL
+ * @param arg unused
+ */
+static void *rpc_worker(void *arg){
+	struct rpc_job *job;
+	struct rpc_handler_entry *h;
+	while(1){
+		pthread_mutex_lock(&queue_lock);
+		while(queue_head == NULL)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		job = queue_head;
+		queue_head = job->next;
+		if(queue_head == NULL)
+			queue_tail = &queue_head;
+		pthread_mutex_unlock(&queue_lock);
+		h = job->hdr.op < RPC_MAX_OPS ? &handlers[job->hdr.op] : NULL;
+		if(h == NULL || h->fn == NULL){
+			job->hdr.status = ENOSYS;
+			job->hdr.len = 0;
+		} else {
+			if(h->locked)
+				sem_wait(&clist_sem);
+			job->hdr.status = h->fn(job->conn->node, job->args, &job->hdr.len);
+			if(h->locked)
+				sem_post(&clist_sem);
+		}
+		// Hand the response to the agent
+		job->next = NULL;
+		pthread_mutex_lock(&job->conn->lock);
+		*job->conn->done_tail = job;
+		job->conn->done_tail = &job->next;
+		if(--job->conn->running == 0)
+			pthread_cond_broadcast(&job->conn->idle);
+		rpc_wake(job->conn);
+		pthread_mutex_unlock(&job->conn->lock);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Start the worker threads
+ *
+ * @return @c NULL
+ * @param count the amount of worker threads
+ */
+void rpc_workers(int count){
+	pthread_t thread;
+	int i, err;
+	for(i = 0; i < count; i++){
+		if((err = pthread_create(&thread, NULL, rpc_worker, NULL)))
+			stop_it("pthread_create()", err, log_p);
+		pthread_detach(thread);
+	}
+	fprintf(log_p, "Running calls on %d worker threads.\n", count);
+}
+
+/**
+ * @brief Have the receive completion queue raise one event for a batch of receives
+ *
+ * Only the events the agent sleeps on are batched, completions are still polled one by one.
+ * Devices that can't moderate keep an event per receive, which is logged once.
+ * @return @c NULL
+ * @param cq the receive completion queue
+ */
+static void rpc_moderate(struct ibv_cq *cq){
+	static atomic_flag warned = ATOMIC_FLAG_INIT;
+	struct ibv_modify_cq_attr attr;
+	int err;
+	if(moderate_count == 0)
+		return;
+	memset(&attr, 0, sizeof(attr));
+	attr.attr_mask = IBV_CQ_ATTR_MODERATE;
+	attr.moderate.cq_count = moderate_count;
+	attr.moderate.cq_period = moderate_usec;
+	if((err = ibv_modify_cq(cq, &attr)) && !atomic_flag_test_and_set(&warned))
+		fprintf(log_p, "Completion moderation isn't supported (%s), every receive raises an event.\n",
+			strerror(err));
+}
+
+/**
+ * @brief Get ready to take calls on a connection
+ *
+ * Registers the buffers, posts every receive buffer and moderates the receive completion queue.
+ * @return the server side of the connection
+ * @param node the client
+ * @param id the connection to the client
+ */
+struct rpc_conn *rpc_open(struct cnode *node, struct rdma_cm_id *id){
+	struct rpc_conn *conn = calloc(1, sizeof(*conn));
+	int i;
+	conn->id = id;
+	conn->node = node;
+	conn->done_tail = &conn->done;
+	pthread_mutex_init(&conn->lock, NULL);
+	pthread_cond_init(&conn->idle, NULL);
+	conn->efd = eventfd(0, EFD_NONBLOCK);
+	if(conn->efd < 0)
+		stop_it("eventfd()", errno, log_p);
+	conn->in = ibv_reg_mr(id->qp->pd, malloc(node->limits.recv_wr * RPC_MAX_MSG), node->limits.recv_wr * RPC_MAX_MSG,
+		IBV_ACCESS_LOCAL_WRITE);
+	conn->out = ibv_reg_mr(id->qp->pd, malloc(RPC_MAX_MSG), RPC_MAX_MSG, 0);
+	if(conn->in == NULL || conn->out == NULL)
+		stop_it("ibv_reg_mr()", errno, log_p);
+	for(i = 0; i < node->limits.recv_wr; i++)
+		rpc_return(conn, conn->in->addr + i * RPC_MAX_MSG);
+	rpc_moderate(id->recv_cq);
+	return conn;
+}
+
+/**
+ * @brief Give a receive buffer back
+ *
+ * @return @c NULL
+ * @param conn the server side of the connection
+ * @param msg the receive buffer returned by rpc_next()
+ */
+void rpc_return(struct rpc_conn *conn, void *msg){
+	if(rdma_post_recv(conn->id, msg, msg, RPC_MAX_MSG, conn->in))
+		stop_it("rdma_post_recv()", errno, log_p);
+	flow_posted(conn->id, 1);
+}
+
+/**
+ * @brief Queue the calls in a message for the workers
+ *
+ * @return @c NULL
+ * @param conn the server side of the connection
+ * @param msg the message
+ * @param len the length of the message
+ */
+static void rpc_dispatch(struct rpc_conn *conn, uint8_t *msg, uint32_t len){
+	struct rpc_batch *batch = (struct rpc_batch *)msg;
+	struct rpc_job *jobs = NULL, **tail = &jobs, *job;
+	struct rpc_header *hdr;
+	uint32_t used = sizeof(*batch), i;
+	int count = 0;
+	for(i = 0; i < batch->count && used + sizeof(*hdr) <= len; i++){
+		hdr = (struct rpc_header *)(msg + used);
+		used += RPC_RECORD_SIZE(hdr->len);
+		if(used > len)
+			break;
+		// Arguments are zero padded, so handlers can take a short request as the whole struct
+		job = calloc(1, sizeof(*job));
+		job->conn = conn;
+		job->hdr = *hdr;
+		if(job->hdr.len > RPC_MAX_ARGS){
+			job->hdr.op = 0;
+			job->hdr.len = 0;
+		}
+		memcpy(job->args, hdr + 1, job->hdr.len);
+		*tail = job;
+		tail = &job->next;
+		count++;
+	}
+	if(count == 0)
+		return;
+	pthread_mutex_lock(&conn->lock);
+	conn->running += count;
+	pthread_mutex_unlock(&conn->lock);
+	pthread_mutex_lock(&queue_lock);
+	*queue_tail = jobs;
+	queue_tail = tail;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * @brief Send the responses that are ready
+ *
+ * Packs as many as fit into each message.
+ * @return @c NULL
+ * @param conn the server side of the connection
+ */
+static void rpc_answer(struct rpc_conn *conn){
+	struct rpc_batch *batch = conn->out->addr;
+	struct rpc_job *job, *next;
+	uint32_t used = sizeof(*batch);
+	pthread_mutex_lock(&conn->lock);
+	job = conn->done;
+	conn->done = NULL;
+	conn->done_tail = &conn->done;
+	pthread_mutex_unlock(&conn->lock);
+	batch->count = 0;
+	batch->reserved = 0;
+	for(; job != NULL; job = next){
+		next = job->next;
+		memcpy(conn->out->addr + used, &job->hdr, sizeof(job->hdr));
+		memcpy(conn->out->addr + used + sizeof(job->hdr), job->args, job->hdr.len);
+		used += RPC_RECORD_SIZE(job->hdr.len);
+		batch->count++;
+		conn->calls++;
+		atomic_fetch_add(&stats.calls, 1);
+		free(job);
+		if(next == NULL || used + RPC_RECORD_SIZE(next->hdr.len) > RPC_MAX_MSG){
+			rpc_send(conn->id, conn->out, used, conn->node->limits.inline_data, log_p);
+			conn->messages++;
+			used = sizeof(*batch);
+			batch->count = 0;
+		}
+	}
+}
+
+/**
+ * @brief Wait for the next message from the client that isn't a call
+ *
+ * Calls are queued for the workers as they come in. Responses are sent whenever there is nothing
+ * left to receive, so the ones that finish close together share a message. While there is nothing
+ * to do, the agent sleeps on both the receive completion channel and the workers' eventfd.
+ * The buffer has to be given back with rpc_return() once the caller is done with it.
+ * @return the immediate data of the message, 0 if there was none or the receive failed
+ * @param conn the server side of the connection
+ * @param msg the location to store the receive buffer the message is in
+ */
+uint32_t rpc_next(struct rpc_conn *conn, void **msg){
+	struct ibv_comp_channel *channel = conn->id->recv_cq_channel;
+	struct pollfd fds[2];
+	struct ibv_cq *cq;
+	struct ibv_wc wc;
+	void *context;
+	uint64_t count;
+	uint32_t op;
+	uint8_t armed = 0;
+	int n;
+	while(1){
+		n = ibv_poll_cq(conn->id->recv_cq, 1, &wc);
+		if(n < 0)
+			stop_it("ibv_poll_cq()", errno, log_p);
+		if(n == 1){
+			*msg = (void *)wc.wr_id;
+			if(wc.status)
+				return 0;
+			op = wc.wc_flags & IBV_WC_WITH_IMM ? ntohl(wc.imm_data) : 0;
+			if(op != RPC)
+				return op;
+			rpc_dispatch(conn, *msg, wc.byte_len);
+			rpc_return(conn, *msg);
+			armed = 0;
+			continue;
+		}
+		if(!armed){
+			rpc_answer(conn);
+			// Poll once more after arming, a completion from before that wouldn't wake us up
+			if(ibv_req_notify_cq(conn->id->recv_cq, 0))
+				stop_it("ibv_req_notify_cq()", errno, log_p);
+			armed = 1;
+			continue;
+		}
+		fds[0].fd = channel->fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = conn->efd;
+		fds[1].events = POLLIN;
+		if(poll(fds, 2, -1) < 0){
+			if(errno == EINTR)
+				continue;
+			stop_it("poll()", errno, log_p);
+		}
+		if(fds[0].revents & POLLIN){
+			if(ibv_get_cq_event(channel, &cq, &context))
+				stop_it("ibv_get_cq_event()", errno, log_p);
+			ibv_ack_cq_events(cq, 1);
+		}
+		if((fds[1].revents & POLLIN) && read(conn->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			stop_it("read()", errno, log_p);
+		armed = 0;
+	}
+}
+
+/**
+ * @brief Wake up the agent sleeping in rpc_next()
+ *
+ * @return @c NULL
+ * @param conn the server side of the connection
+ */
+void rpc_wake(struct rpc_conn *conn){
+	uint64_t one = 1;
+	if(write(conn->efd, &one, sizeof(one)) != sizeof(one))
+		fprintf(log_p, "Couldn't wake up client %lu's agent: %s\n", conn->node->cid, strerror(errno));
+}
+
+/**
+ * @brief Stop taking calls on a connection
+ *
+ * Waits for the calls the workers still have, since they use the client's node. Their responses
+ * are dropped.
+ * @return @c NULL
+ * @param conn the server side of the connection, freed
+ */
+void rpc_close(struct rpc_conn *conn){
+	struct rpc_job *job, *next;
+	void *in = conn->in->addr, *out = conn->out->addr;
+	pthread_mutex_lock(&conn->lock);
+	while(conn->running)
+		pthread_cond_wait(&conn->idle, &conn->lock);
+	pthread_mutex_unlock(&conn->lock);
+	for(job = conn->done; job != NULL; job = next){
+		next = job->next;
+		free(job);
+	}
+	fprintf(log_p, "Client %lu made %lu calls, answered in %lu messages.\n", conn->node->cid, conn->calls,
+		conn->messages);
+	ibv_dereg_mr(conn->in);
+	ibv_dereg_mr(conn->out);
+	free(in);
+	free(out);
+	close(conn->efd);
+	pthread_mutex_destroy(&conn->lock);
+	pthread_cond_destroy(&conn->idle);
+	free(conn);
+}
@@ -0,0 +1,314 @@
+/**
+ * @file dump.c
+ * @brief File containing the definitions of the functions listed in dump.h
+ */
+#include "dump.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief What a buffer is doing
+ */
+enum dump_state {
+	DUMP_IDLE,		/**< Free for the next read */
+	DUMP_READING,	/**< An rdma read into it is in flight */
+	DUMP_WRITING	/**< A write from it is in flight */
+};
+
+/**
+ * @brief Set up an io_uring with its rings mapped
+ *
+ * @return 0 on success, -1 with @c errno set otherwise (@c r->fd is then -1)
+ * @param r the ring
+ * @param entries the amount of submissions it needs room for
+ */
+static int ring_setup(struct dump_ring *r, unsigned int entries){
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(r->fd < 0){
+		r->fd = -1;
+		return -1;
+	}
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(r->cq_map_len > r->sq_map_len)
+			r->sq_map_len = r->cq_map_len;
+		r->cq_map_len = 0;
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+		IORING_OFF_SQ_RING);
+	if(r->sq_map == MAP_FAILED)
+		goto close_fd;
+	r->cq_map = r->sq_map;
+	if(r->cq_map_len){
+		r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+			IORING_OFF_CQ_RING);
+		if(r->cq_map == MAP_FAILED)
+			goto unmap_sq;
+	}
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED)
+		goto unmap_cq;
+	sq = r->sq_map;
+	cq = r->cq_map;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+	unmap_cq:
+	if(r->cq_map_len)
+		munmap(r->cq_map, r->cq_map_len);
+	unmap_sq:
+	munmap(r->sq_map, r->sq_map_len);
+	close_fd:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+/**
+ * @brief Queue a vectored write and submit it
+ *
+ * @return 0 on success, -1 with @c errno set otherwise
+ * @param r the ring
+ * @param fd the file to write to
+ * @param iov the data to write, which has to stay valid until the write completes
+ * @param offset the offset in the file
+ * @param data handed back with the completion
+ */
+static int ring_write(struct dump_ring *r, int fd, struct iovec *iov, uint64_t offset, uint64_t data){
+	unsigned int tail = *r->sq_tail, slot = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->user_data = data;
+	r->sq_array[slot] = slot;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	while(syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0)
+		if(errno != EINTR && errno != EAGAIN)
+			return -1;
+	return 0;
+}
+
+/**
+ * @brief Pull a write completion
+ *
+ * @return 1 if a completion was pulled, 0 if there was none, -1 with @c errno set if waiting failed
+ * @param r the ring
+ * @param wait 1 to block until a completion arrives
+ * @param data where to store what was handed to ring_write()
+ * @param res where to store the amount of bytes written or a negative error number
+ */
+static int ring_reap(struct dump_ring *r, int wait, uint64_t *data, int *res){
+	unsigned int head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+	while(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+		if(!wait)
+			return 0;
+		if(syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+			return -1;
+	}
+	cqe = &r->cqes[head & *r->cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * @brief Allocate the buffers and set up the ring
+ *
+ * The buffers are only registered on their first dump, through the registration cache.
+ * @return @c NULL
+ * @param d the dumper
+ * @param regs the registration cache of the connection dumps go over
+ * @param file the file to print errors to
+ */
+void dump_init(struct dump *d, struct reg_cache *regs, FILE *file){
+	int i;
+	memset(d, 0, sizeof(*d));
+	d->regs = regs;
+	d->file = file;
+	for(i = 0; i < DUMP_BUFFERS; i++)
+		if((errno = posix_memalign(&d->bufs[i], sysconf(_SC_PAGESIZE), DUMP_CHUNK)))
+			stop_it("posix_memalign()", errno, file);
+	if(ring_setup(&d->ring, DUMP_BUFFERS))
+		fprintf(file, "io_uring_setup(): %s, dumps write with pwrite() instead.\n", strerror(errno));
+}
+
+/**
+ * @brief Free the buffers and the ring
+ *
+ * @return @c NULL
+ * @param d the dumper
+ */
+void dump_destroy(struct dump *d){
+	int i;
+	for(i = 0; i < DUMP_BUFFERS; i++)
+		reg_free(d->regs, d->bufs[i]);
+	if(d->ring.fd < 0)
+		return;
+	munmap(d->ring.sqes, d->ring.sqes_len);
+	if(d->ring.cq_map_len)
+		munmap(d->ring.cq_map, d->ring.cq_map_len);
+	munmap(d->ring.sq_map, d->ring.sq_map_len);
+	close(d->ring.fd);
+}
+
+/**
+ * @brief Write a range of a remote memory region to a file, as is
+ *
+ * The function will call exit(-1) if a read fails, like the rest of the client. A failed write stops
+ * further reads, and the function returns once everything in flight is done.
+ * @return 0 on success, -1 with @c errno set if the file couldn't be opened or written
+ * @param d the dumper
+ * @param id the connection to read over
+ * @param remote_addr the address of the remote memory region
+ * @param rkey the rkey of the remote memory region
+ * @param offset the offset to start reading at
+ * @param length the amount of bytes to dump
+ * @param path the file to write, created or truncated
+ * @param direct 1 to write with @c O_DIRECT
+ */
+int dump_range(struct dump *d, struct rdma_cm_id *id, uint64_t remote_addr, uint32_t rkey, uint64_t offset,
+	size_t length, const char *path, int direct){
+	size_t page = sysconf(_SC_PAGESIZE), next = 0, done = 0, len[DUMP_BUFFERS];
+	enum dump_state state[DUMP_BUFFERS];
+	struct ibv_mr *mrs[DUMP_BUFFERS];
+	struct iovec iov[DUMP_BUFFERS];
+	uint64_t pos[DUMP_BUFFERS], data;
+	int fd, i, n, got = 0, res, wait, reads = 0, writes = 0, err = 0;
+	struct ibv_wc wc[DUMP_BUFFERS];
+	ssize_t wrote;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+	if(fd < 0)
+		return -1;
+	for(i = 0; i < DUMP_BUFFERS; i++){
+		mrs[i] = reg_get(d->regs, d->bufs[i], DUMP_CHUNK, IBV_ACCESS_LOCAL_WRITE);
+		if(mrs[i] == NULL){
+			err = errno;
+			while(i--)
+				reg_put(d->regs, mrs[i]);
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		state[i] = DUMP_IDLE;
+	}
+	while(reads || writes || (!err && done < length)){
+		// Every free buffer takes the next chunk
+		for(i = 0; i < DUMP_BUFFERS && !err && next < length; i++){
+			if(state[i] != DUMP_IDLE)
+				continue;
+			pos[i] = next;
+			len[i] = length - next < DUMP_CHUNK ? length - next : DUMP_CHUNK;
+			if(rdma_post_read(id, (void *)(uintptr_t)i, d->bufs[i], len[i], mrs[i], IBV_SEND_SIGNALED,
+				remote_addr + offset + pos[i], rkey))
+				stop_it("rdma_post_read()", errno, d->file);
+			state[i] = DUMP_READING;
+			next += len[i];
+			reads++;
+		}
+		// Chunks that arrived go to the disk
+		n = reads ? ibv_poll_cq(id->send_cq, DUMP_BUFFERS, wc) : 0;
+		if(n < 0)
+			stop_it("ibv_poll_cq()", errno, d->file);
+		for(got = 0; got < n; got++){
+			if(wc[got].status){
+				fprintf(d->file, "Read failed: %s\n", ibv_wc_status_str(wc[got].status));
+				exit(-1);
+			}
+			i = (int)wc[got].wr_id;
+			reads--;
+			state[i] = DUMP_IDLE;
+			if(err)
+				continue;
+			// O_DIRECT writes whole pages, the file is cut back to the range at the end
+			iov[i].iov_base = d->bufs[i];
+			iov[i].iov_len = direct ? (len[i] + page - 1) & ~(page - 1) : len[i];
+			if(d->ring.fd >= 0){
+				if(ring_write(&d->ring, fd, &iov[i], pos[i], i))
+					err = errno;
+				else {
+					state[i] = DUMP_WRITING;
+					writes++;
+				}
+				continue;
+			}
+			// Without io_uring, write now while the other reads are still in flight
+			while(!err && iov[i].iov_len){
+				wrote = pwrite(fd, iov[i].iov_base, iov[i].iov_len,
+					pos[i] + ((uint8_t *)iov[i].iov_base - (uint8_t *)d->bufs[i]));
+				if(wrote < 0 && errno != EINTR)
+					err = errno;
+				else if(wrote == 0)
+					err = ENOSPC;
+				else if(wrote > 0){
+					iov[i].iov_base = (uint8_t *)iov[i].iov_base + wrote;
+					iov[i].iov_len -= wrote;
+				}
+			}
+			if(!err)
+				done += len[i];
+		}
+		// Wait for the disk only when no read can complete in the meantime
+		wait = n == 0 && (reads == 0 || err);
+		while(writes && (got = ring_reap(&d->ring, wait, &data, &res)) == 1){
+			wait = 0;
+			i = (int)data;
+			writes--;
+			state[i] = DUMP_IDLE;
+			if(res == -EINTR || res == -EAGAIN)
+				res = 0;
+			else if(res < 0)
+				err = -res;
+			else if(res == 0)
+				err = ENOSPC;
+			if(err)
+				continue;
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + res;
+			iov[i].iov_len -= res;
+			if(iov[i].iov_len == 0){
+				done += len[i];
+				continue;
+			}
+			// A short write goes out again for the rest
+			if(ring_write(&d->ring, fd, &iov[i], pos[i] + ((uint8_t *)iov[i].iov_base - (uint8_t *)d->bufs[i]), i))
+				err = errno;
+			else {
+				state[i] = DUMP_WRITING;
+				writes++;
+			}
+		}
+		if(writes && got < 0){
+			// Nothing more can be reaped, so the writes in flight are given up on
+			err = errno;
+			writes = 0;
+		}
+	}
+	for(i = 0; i < DUMP_BUFFERS; i++)
+		reg_put(d->regs, mrs[i]);
+	if(!err && direct && ftruncate(fd, length))
+		err = errno;
+	if(close(fd) && !err)
+		err = errno;
+	errno = err;
+	return err ? -1 : 0;
+}
@@ -0,0 +1,60 @@
+/**
+ * @file dump.h
+ * @brief Dumping remote memory to a file in binary
+ *
+ * A range is read in @c DUMP_CHUNK pieces into a few page-aligned buffers that stay registered.
+ * As soon as a read completes its buffer is handed to io_uring to be written at the matching file
+ * offset, and once the write completes the buffer takes the next read, so the network and the disk
+ * are busy at the same time. With @c O_DIRECT the writes skip the page cache; the last piece is
+ * written rounded up to a whole page and the file is truncated to the range afterwards. Kernels
+ * without io_uring get plain pwrite() calls, which still overlap with the reads in flight.
+ */
+#ifndef RDMA_CS_DUMP
+#define RDMA_CS_DUMP
+#include "rdma_cs.h"
+#include "regcache.h"
+
+/**
+ * @brief The size of each read and write
+ */
+#define DUMP_CHUNK		(1024 * 1024)
+/**
+ * @brief The amount of buffers, and so of reads and writes in flight together
+ */
+#define DUMP_BUFFERS	4
+
+/**
+ * @brief The submission and completion rings shared with the kernel
+ */
+struct dump_ring {
+	int fd;						/**< The io_uring, -1 if it couldn't be set up */
+	unsigned int *sq_head;		/**< The first submission the kernel hasn't taken */
+	unsigned int *sq_tail;		/**< The submission after the last one queued */
+	unsigned int *sq_mask;		/**< The mask turning a submission index into a slot */
+	unsigned int *sq_array;		/**< The submission entry each slot points at */
+	unsigned int *cq_head;		/**< The first completion not yet seen */
+	unsigned int *cq_tail;		/**< The completion after the last one posted */
+	unsigned int *cq_mask;		/**< The mask turning a completion index into a slot */
+	struct io_uring_sqe *sqes;	/**< The submission entries */
+	struct io_uring_cqe *cqes;	/**< The completion entries */
+	void *sq_map;				/**< The mapping holding the submission ring */
+	size_t sq_map_len;			/**< The length of that mapping */
+	void *cq_map;				/**< The mapping holding the completion ring, the same as @c sq_map on newer kernels */
+	size_t cq_map_len;			/**< The length of that mapping */
+	size_t sqes_len;			/**< The length of the mapping of submission entries */
+};
+
+/**
+ * @brief The buffers and ring of one connection
+ */
+struct dump {
+	struct reg_cache *regs;				/**< The cache the buffers are registered through */
+	void *bufs[DUMP_BUFFERS];			/**< The buffers */
+	struct dump_ring ring;				/**< The io_uring writes go through */
+	FILE *file;							/**< The file to print errors to */
+};
+
+void dump_init(struct dump *, struct reg_cache *, FILE *);
+void dump_destroy(struct dump *);
+int dump_range(struct dump *, struct rdma_cm_id *, uint64_t, uint32_t, uint64_t, size_t, const char *, int);
+#endif
@@ -0,0 +1,222 @@
+/**
+ * @file grant.c
+ * @brief Sharing slices of client memory regions through memory windows
+ *
+ * Instead of handing out the rkey of a whole memory region, the server binds a type 2 memory window
+ * on the queue pair of each client a region is shared with. The window only covers the slice being
+ * shared, only works through that one queue pair, and can be invalidated at any time, which cuts the
+ * client off even if it held on to the rkey. Devices without memory windows (and on-demand paging
+ * memory regions) fall back to handing out the rkey of the memory region, which can't be taken back.
+ *
+ * Everything in here must be called with the client list semaphore held.
+ */
+#include "server.h"
+
+/**
+ * @brief Linked list node for a slice of a memory region shared with one client
+ */
+struct grant {
+	struct cnode *owner;	/**< The client whose memory region is shared */
+	struct cnode *grantee;	/**< The client the slice is shared with */
+	struct ibv_mw *mw;		/**< The memory window bound on the grantee's queue pair (@c NULL without memory windows) */
+	uint32_t rkey;			/**< The last rkey the memory window was bound with */
+	uint64_t offset;		/**< The start of the slice */
+	uint64_t length;		/**< The length of the slice */
+	uint32_t writable;		/**< 1 if the slice may be written to */
+	uint8_t live;			/**< 1 while the grantee has access */
+	struct grant *next;		/**< A pointer to the next node in the list */
+};
+
+/**
+ * @brief The head of the list of everything that has been shared
+ */
+static struct grant *glist_head = NULL;
+/**
+ * @brief 1 if the device supports type 2 memory windows, -1 if it hasn't been checked yet
+ */
+static int mw_support = -1;
+
+/**
+ * @brief Find out if memory windows can be used
+ *
+ * @return the extra access flags memory regions need to be registered with (@c IBV_ACCESS_MW_BIND or 0)
+ * @param verbs the device
+ */
+int mw_access(struct ibv_context *verbs){
+	struct ibv_device_attr attr;
+	if(mw_support < 0){
+		if(ibv_query_device(verbs, &attr))
+			stop_it("ibv_query_device()", errno, log_p);
+		mw_support = (attr.device_cap_flags &
+			(IBV_DEVICE_MEM_WINDOW_TYPE_2A | IBV_DEVICE_MEM_WINDOW_TYPE_2B)) != 0;
+		fprintf(log_p, "Memory windows %s, shared memory regions %s be revoked.\n",
+			mw_support ? "are supported" : "are not supported", mw_support ? "can" : "can't");
+	}
+	return mw_support ? IBV_ACCESS_MW_BIND : 0;
+}
+
+/**
+ * @brief Share a slice of a client's memory region with another client
+ *
+ * The grantee is sent an @c ADD_CLIENT with an rkey that only covers the slice. If the grantee
+ * already had access to the owner's memory region, its old rkey is invalidated in the same post.
+ * @return 0 on success, -1 on failure
+ * @param owner the client whose memory region is shared
+ * @param grantee the client to share it with
+ * @param offset the start of the slice
+ * @param length the length of the slice
+ * @param writable 1 to allow writes, 0 for read only
+ */
+int grant_region(struct cnode *owner, struct cnode *grantee, uint64_t offset, uint64_t length,
+	uint32_t writable){
+	struct ibv_send_wr inv, bind;
+	struct grant *g;
+	struct client data;
+	if(owner->mr == NULL || grantee->id == NULL || length == 0 || offset + length > owner->length
+		|| offset + length < offset)
+		return -1;
+	for(g = glist_head; g != NULL; g = g->next)
+		if(g->owner == owner && g->grantee == grantee)
+			break;
+	if(g == NULL){
+		g = malloc(sizeof(*g));
+		memset(g, 0, sizeof(*g));
+		g->owner = owner;
+		g->grantee = grantee;
+		g->next = glist_head;
+		glist_head = g;
+	}
+	memset(&data, 0, sizeof(data));
+	data.cid = owner->cid;
+	data.remote_addr = owner->remote_addr + offset;
+	data.length = length;
+	data.writable = writable;
+	if(owner->windows){
+		if(g->mw == NULL){
+			g->mw = ibv_alloc_mw(grantee->id->qp->pd, IBV_MW_TYPE_2);
+			if(g->mw == NULL){
+				fprintf(log_p, "ibv_alloc_mw() failed: %s\n", strerror(errno));
+				return -1;
+			}
+			g->rkey = g->mw->rkey;
+		}
+		memset(&bind, 0, sizeof(bind));
+		bind.opcode = IBV_WR_BIND_MW;
+		bind.send_flags = IBV_SEND_SIGNALED;
+		bind.bind_mw.mw = g->mw;
+		bind.bind_mw.rkey = ibv_inc_rkey(g->rkey);
+		bind.bind_mw.bind_info.mr = owner->mr;
+		bind.bind_mw.bind_info.addr = data.remote_addr;
+		bind.bind_mw.bind_info.length = length;
+		bind.bind_mw.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_READ |
+			(writable ? IBV_ACCESS_REMOTE_WRITE : 0);
+		// A bound window has to be invalidated before it can be bound again
+		if(g->live){
+			memset(&inv, 0, sizeof(inv));
+			inv.opcode = IBV_WR_LOCAL_INV;
+			inv.invalidate_rkey = g->rkey;
+			inv.next = &bind;
+		}
+		if(send_wait(grantee->id, g->live ? &inv : &bind, log_p))
+			return -1;
+		g->rkey = bind.bind_mw.rkey;
+	} else {
+		g->rkey = owner->rkey;
+	}
+	g->offset = offset;
+	g->length = length;
+	g->writable = writable;
+	g->live = 1;
+	data.rkey = g->rkey;
+	send_add(grantee->id, &data);
+	fprintf(log_p, "Client %lu got %s access to [%llu, %llu) of client %lu's memory region (rkey 0x%x).\n",
+		grantee->cid, writable ? "read/write" : "read only", (unsigned long long)offset,
+		(unsigned long long)(offset + length), owner->cid, (unsigned int)g->rkey);
+	return 0;
+}
+
+/**
+ * @brief Take back access to a client's memory region
+ *
+ * The memory windows are invalidated before the grantees are sent a @c REMOVE_CLIENT, so the rkeys
+ * are useless by the time anyone hears about it. A grant whose memory window couldn't be
+ * invalidated stays live and its grantee isn't told, since the rkey may still work.
+ * @return 0 on success, -1 if access couldn't be taken back from a grantee
+ * @param owner the client whose memory region was shared
+ * @param grantee the client to take access away from, @c NULL for everyone
+ */
+int revoke_region(struct cnode *owner, struct cnode *grantee){
+	struct ibv_send_wr inv;
+	struct grant *g;
+	int ret = 0;
+	if(grantee == NULL)
+		dir_withdraw(owner);
+	for(g = glist_head; g != NULL; g = g->next){
+		if(g->owner != owner || (grantee != NULL && g->grantee != grantee) || !g->live)
+			continue;
+		if(g->mw != NULL){
+			memset(&inv, 0, sizeof(inv));
+			inv.opcode = IBV_WR_LOCAL_INV;
+			inv.invalidate_rkey = g->rkey;
+			if(send_wait(g->grantee->id, &inv, log_p)){
+				fprintf(log_p, "Couldn't take client %lu's access to client %lu's memory region back.\n",
+					g->grantee->cid, owner->cid);
+				ret = -1;
+				continue;
+			}
+		} else {
+			fprintf(log_p, "Client %lu keeps working access to client %lu's memory region until it is freed.\n",
+				g->grantee->cid, owner->cid);
+		}
+		g->live = 0;
+		send_remove(g->grantee->id, owner->cid);
+	}
+	return ret;
+}
+
+/**
+ * @brief Check if a client has access to a range of another client's memory region
+ *
+ * Used for operations the server carries out on a client's behalf, which have to respect the same
+ * limits as the client's own one-sided access.
+ * @return 1 if the range is covered by what was shared, 0 if not
+ * @param owner the client whose memory region is accessed
+ * @param grantee the client accessing it
+ * @param offset the start of the range
+ * @param length the length of the range
+ * @param write 1 if the range is written to
+ */
+int grant_covers(struct cnode *owner, struct cnode *grantee, uint64_t offset, uint64_t length, uint8_t write){
+	struct grant *g;
+	// Announced memory regions are open to everyone, without a grant per client
+	if(owner->published)
+		return offset + length <= owner->length && offset + length >= offset;
+	for(g = glist_head; g != NULL; g = g->next)
+		if(g->owner == owner && g->grantee == grantee && g->live)
+			return offset >= g->offset && offset + length <= g->offset + g->length &&
+				offset + length >= offset && (!write || g->writable);
+	return 0;
+}
+
+/**
+ * @brief Forget everything shared with a client (and, optionally, by it)
+ *
+ * Used when a client's queue pair is about to go away, which takes the memory windows bound on it along.
+ * Nobody is told about it, use revoke_region() first for that.
+ * @return @c NULL
+ * @param node the client
+ * @param owned 1 to also forget what was shared from the client's own memory region
+ */
+void drop_grants(struct cnode *node, uint8_t owned){
+	struct grant **gp = &glist_head, *g;
+	while((g = *gp) != NULL){
+		if(g->grantee == node || (owned && g->owner == node)){
+			if(g->mw != NULL && ibv_dealloc_mw(g->mw))
+				fprintf(log_p, "ibv_dealloc_mw() failed: %s\n", strerror(errno));
+			*gp = g->next;
+			free(g);
+		} else {
+			gp = &g->next;
+		}
+	}
+}
@@ -0,0 +1,797 @@
+/**
+ * @file load.c
+ * @brief A load generator for the RDMA server.
+ *
+ * Opens many connections from several processes and issues a mix of writes, reads, memory region
+ * opens/closes and disconnects at a target rate. Arrivals are open loop: they are scheduled at
+ * exponentially distributed intervals no matter how fast the server answers, and every latency is
+ * measured from when the operation was scheduled, so a server falling behind shows up in the tail
+ * instead of quietly slowing the generator down. A disconnect is a full cycle of disconnecting,
+ * connecting again and exchanging memory region information, which measures connection churn.
+ * Opens and closes aren't answered by the server, so each one is followed by a @c PING call in the
+ * same post. The agent handles the open or close before it hands on the call, so the call's answer
+ * is when the server is done with it.
+ */
+#include "rdma_cs.h"
+#include "rpc.h"
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/**
+ * @brief The size of each receive buffer, room for a message of answers
+ */
+#define LOAD_SLOT		RPC_MAX_MSG
+/**
+ * @brief The most completions pulled with one ibv_poll_cq()
+ */
+#define LOAD_POLL_BATCH	16
+/**
+ * @brief The most arrivals that can wait for a free send queue slot
+ */
+#define LOAD_BACKLOG	65536
+/**
+ * @brief The amount of buckets in a latency histogram
+ */
+#define HIST_BUCKETS	1024
+
+/**
+ * @brief The kinds of operations in the mix
+ */
+enum load_kind {
+	LOAD_WRITE,
+	LOAD_READ,
+	LOAD_OPEN,
+	LOAD_CLOSE,
+	LOAD_DISCONNECT,
+	LOAD_KINDS
+};
+
+/**
+ * @brief The names of the kinds of operations, as used with @c -m
+ */
+static const char *kind_names[LOAD_KINDS] = {"write", "read", "open", "close", "disconnect"};
+
+/**
+ * @brief An open or close waiting for the answer to the call that followed it
+ */
+struct load_ack {
+	uint64_t started;	/**< When it was scheduled */
+	uint8_t kind;		/**< @c LOAD_OPEN or @c LOAD_CLOSE */
+	uint8_t busy;		/**< 1 while the answer hasn't come */
+};
+
+/**
+ * @brief One connection to the server
+ */
+struct load_conn {
+	struct rdma_event_channel *ec;		/**< The event channel of @c id */
+	struct rdma_cm_id *id;				/**< The connection */
+	struct ibv_mr *mr;					/**< The rdma buffer, followed by @c recv_wr receive buffers */
+	uint64_t remote_addr;				/**< The address of the server-side memory region */
+	uint32_t rkey;						/**< The rkey of the server-side memory region */
+	size_t remote_len;					/**< The length of the server-side memory region */
+	unsigned int send_wr;				/**< The send queue depth the server granted */
+	unsigned int recv_wr;				/**< The amount of receives the server granted */
+	uint64_t *started;					/**< When the operations in flight were scheduled, oldest first (@c send_wr of them) */
+	uint8_t *kinds;						/**< The kinds of the operations in flight (@c send_wr of them) */
+	unsigned int head;					/**< The index of the oldest operation in flight */
+	unsigned int inflight;				/**< The amount of operations in flight */
+	unsigned int queued;				/**< The amount of send queue slots they take up */
+	struct load_ack acks[RPC_MAX_OUTSTANDING];	/**< The opens and closes waiting for an answer, by call id */
+	uint32_t next_ack;					/**< The call id of the next open or close */
+	unsigned int awaiting;				/**< The amount of answers still to come */
+	int active;							/**< The index in the list of connections with operations in flight, -1 if none */
+};
+
+/**
+ * @brief What a process measured, sent to the parent when it is done
+ */
+struct load_stats {
+	uint64_t hist[LOAD_KINDS][HIST_BUCKETS];	/**< Latency histograms, see hist_index() */
+	unsigned long issued[LOAD_KINDS];			/**< The amount of operations issued */
+	unsigned long done[LOAD_KINDS];				/**< The amount of operations completed */
+	unsigned long notices;						/**< The amount of directory updates received */
+	unsigned long backlog;						/**< The most arrivals that waited for a free send queue slot at once */
+	unsigned long dropped;						/**< Arrivals dropped because the backlog was full */
+	unsigned long connects;						/**< The amount of connections set up before the run */
+	uint64_t connect_ns;						/**< How long setting them up took */
+};
+
+/**
+ * @brief The settings of a run
+ */
+struct load {
+	char *ip;						/**< The address of the server */
+	short port;						/**< The port of the server */
+	unsigned int conns;				/**< The amount of connections of this process */
+	double rate;					/**< The arrivals per second of this process */
+	unsigned int seconds;			/**< How long to generate arrivals for */
+	size_t size;					/**< The size of each read and write */
+	unsigned int mix[LOAD_KINDS];	/**< The weight of each kind of operation */
+	unsigned int total;				/**< The sum of the weights */
+	FILE *quiet;					/**< Where the connection chatter goes */
+};
+
+/**
+ * @brief Get a monotonic timestamp
+ *
+ * @return the current time in nanoseconds
+ */
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Get the histogram bucket of a latency
+ *
+ * Below 16ns each value has its own bucket, above that every power of two is split in 16.
+ * @return the index of the bucket
+ * @param ns the latency in nanoseconds
+ */
+static unsigned int hist_index(uint64_t ns){
+	int msb;
+	if(ns < 16)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - 3) * 16 + ((ns >> (msb - 4)) & 15);
+}
+
+/**
+ * @brief Get the smallest latency of a histogram bucket
+ *
+ * @return the latency in nanoseconds
+ * @param index the index of the bucket
+ */
+static uint64_t hist_value(unsigned int index){
+	if(index < 16)
+		return index;
+	return (uint64_t)(16 + index % 16) << (index / 16 - 1);
+}
+
+/**
+ * @brief Get a percentile of a histogram
+ *
+ * @return the latency in nanoseconds, 0 if the histogram is empty
+ * @param hist the histogram
+ * @param count the amount of samples in it
+ * @param pct the percentile (0 - 100)
+ */
+static uint64_t hist_pct(uint64_t *hist, unsigned long count, double pct){
+	uint64_t want = ceil(count * pct / 100.0), seen = 0;
+	unsigned int i;
+	if(count == 0)
+		return 0;
+	if(want == 0)
+		want = 1;
+	for(i = 0; i < HIST_BUCKETS; i++){
+		seen += hist[i];
+		if(seen >= want)
+			return hist_value(i);
+	}
+	return hist_value(HIST_BUCKETS - 1);
+}
+
+/**
+ * @brief Connect to the server and exchange memory region information
+ *
+ * @return @c NULL
+ * @param l the settings
+ * @param c the connection to set up
+ */
+static void load_connect(struct load *l, struct load_conn *c){
+	size_t local_len = l->size < 64 ? 64 : l->size;
+	struct session session;
+	uint8_t *slot;
+	int i;
+	c->ec = rdma_create_event_channel();
+	if(c->ec == NULL)
+		stop_it("rdma_create_event_channel()", errno, stderr);
+	if(rdma_create_id(c->ec, &c->id, NULL, RDMA_PS_TCP))
+		stop_it("rdma_create_id()", errno, stderr);
+	memset(&session, 0, sizeof(session));
+	tune_ask(&session, &tune);
+	connect_four(c->id, c->ec, l->ip, l->port, &session, sizeof(session));
+	// Later connections ask for no more than this one got
+	tune_take(&tune, &session);
+	c->send_wr = tune.send_wr;
+	c->recv_wr = tune.recv_wr;
+	c->started = malloc(c->send_wr * sizeof(*c->started));
+	c->kinds = malloc(c->send_wr);
+	if(c->started == NULL || c->kinds == NULL)
+		stop_it("malloc()", errno, stderr);
+	c->mr = ibv_reg_mr(c->id->qp->pd, malloc(local_len + c->recv_wr * LOAD_SLOT), local_len + c->recv_wr * LOAD_SLOT,
+	 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+	if(c->mr == NULL)
+		stop_it("ibv_reg_mr()", errno, stderr);
+	swap_info(c->id, c->mr, c->mr, &c->rkey, &c->remote_addr, &c->remote_len, l->quiet);
+	if(l->size > c->remote_len){
+		fprintf(stderr, "Size is larger than the server memory region (%zu bytes).\n", c->remote_len);
+		exit(-1);
+	}
+	for(i = 0; i < c->recv_wr; i++){
+		slot = (uint8_t *)c->mr->addr + local_len + i * LOAD_SLOT;
+		if(rdma_post_recv(c->id, slot, slot, LOAD_SLOT, c->mr))
+			stop_it("rdma_post_recv()", errno, stderr);
+	}
+	if(ibv_req_notify_cq(c->id->recv_cq, 0))
+		stop_it("ibv_req_notify_cq()", errno, stderr);
+	fcntl(c->id->recv_cq_channel->fd, F_SETFL, fcntl(c->id->recv_cq_channel->fd, F_GETFL) | O_NONBLOCK);
+	c->head = c->inflight = c->queued = 0;
+	memset(c->acks, 0, sizeof(c->acks));
+	c->awaiting = 0;
+	c->active = -1;
+}
+
+/**
+ * @brief Free what load_connect() set up, once the connection was torn down
+ *
+ * @return @c NULL
+ * @param c the connection
+ */
+static void load_free(struct load_conn *c){
+	free(c->started);
+	free(c->kinds);
+}
+
+/**
+ * @brief Record the answers to the calls that followed opens and closes
+ *
+ * @return @c NULL
+ * @param c the connection
+ * @param stats where to record the latencies
+ * @param msg the message of answers
+ * @param len the length of the message
+ * @param now the current time
+ */
+static void load_answers(struct load_conn *c, struct load_stats *stats, uint8_t *msg, uint32_t len, uint64_t now){
+	struct rpc_batch *batch = (struct rpc_batch *)msg;
+	struct rpc_header *hdr;
+	struct load_ack *ack;
+	uint32_t used = sizeof(*batch), i;
+	for(i = 0; i < batch->count && used + sizeof(*hdr) <= len; i++){
+		hdr = (struct rpc_header *)(msg + used);
+		used += RPC_RECORD_SIZE(hdr->len);
+		ack = &c->acks[hdr->id % RPC_MAX_OUTSTANDING];
+		if(!ack->busy)
+			continue;
+		stats->hist[ack->kind][hist_index(now - ack->started)]++;
+		stats->done[ack->kind]++;
+		ack->busy = 0;
+		c->awaiting--;
+	}
+}
+
+/**
+ * @brief Pull the messages the server sent a connection and repost their buffers
+ *
+ * @return the opcode of the last message that wasn't a directory update, -1 if there wasn't one
+ * @param c the connection
+ * @param stats where to count directory updates
+ */
+static int load_drain(struct load_conn *c, struct load_stats *stats){
+	struct ibv_wc wc[LOAD_POLL_BATCH];
+	uint32_t op;
+	int n, i, last = -1;
+	while((n = ibv_poll_cq(c->id->recv_cq, LOAD_POLL_BATCH, wc)) > 0){
+		for(i = 0; i < n; i++){
+			if(wc[i].status){
+				fprintf(stderr, "Receive failed: %s\n", ibv_wc_status_str(wc[i].status));
+				exit(-1);
+			}
+			if(wc[i].wc_flags & IBV_WC_WITH_IMM){
+				op = ntohl(wc[i].imm_data);
+				if(op == ADD_CLIENT || op == REMOVE_CLIENT)
+					stats->notices++;
+				else if(op == RPC)
+					load_answers(c, stats, (uint8_t *)wc[i].wr_id, wc[i].byte_len, now_ns());
+				else
+					last = op;
+			}
+			if(rdma_post_recv(c->id, (void *)wc[i].wr_id, (void *)wc[i].wr_id, LOAD_SLOT, c->mr))
+				stop_it("rdma_post_recv()", errno, stderr);
+		}
+	}
+	if(n < 0)
+		stop_it("ibv_poll_cq()", errno, stderr);
+	return last;
+}
+
+/**
+ * @brief Get the amount of send queue slots an operation takes up
+ *
+ * @return the amount of work requests it is posted with
+ * @param kind the kind of operation
+ */
+static unsigned int load_wrs(uint8_t kind){
+	return kind == LOAD_OPEN || kind == LOAD_CLOSE ? 2 : 1;
+}
+
+/**
+ * @brief Check if a connection has room for another operation
+ *
+ * @return 1 if it can be posted right away, 0 if not
+ * @param c the connection
+ * @param kind the kind of operation
+ */
+static int load_room(struct load_conn *c, uint8_t kind){
+	if(c->queued + load_wrs(kind) > c->send_wr)
+		return 0;
+	return load_wrs(kind) == 1 || !c->acks[c->next_ack % RPC_MAX_OUTSTANDING].busy;
+}
+
+/**
+ * @brief Pull the send completions of a connection
+ *
+ * Opens and closes are only recorded once they are answered, see load_answers().
+ * @return the amount of completions pulled
+ * @param c the connection
+ * @param stats where to record the latencies
+ * @param now the current time
+ */
+static int load_complete(struct load_conn *c, struct load_stats *stats, uint64_t now){
+	struct ibv_wc wc[LOAD_POLL_BATCH];
+	uint8_t kind;
+	int n, i;
+	n = ibv_poll_cq(c->id->send_cq, LOAD_POLL_BATCH, wc);
+	if(n < 0)
+		stop_it("ibv_poll_cq()", errno, stderr);
+	for(i = 0; i < n; i++){
+		if(wc[i].status){
+			fprintf(stderr, "Operation failed: %s\n", ibv_wc_status_str(wc[i].status));
+			exit(-1);
+		}
+		// Completions on a queue pair come back in the order the operations were posted
+		kind = c->kinds[c->head];
+		if(load_wrs(kind) == 1){
+			stats->hist[kind][hist_index(now - c->started[c->head])]++;
+			stats->done[kind]++;
+		}
+		c->head = (c->head + 1) % c->send_wr;
+		c->inflight--;
+		c->queued -= load_wrs(kind);
+	}
+	return n;
+}
+
+/**
+ * @brief Post an operation on a connection
+ *
+ * @return @c NULL
+ * @param l the settings
+ * @param c the connection, which must have room for it (see load_room())
+ * @param kind the kind of operation, anything but @c LOAD_DISCONNECT
+ * @param when when the operation was scheduled
+ */
+static void load_post(struct load *l, struct load_conn *c, uint8_t kind, uint64_t when){
+	unsigned int tail = (c->head + c->inflight) % c->send_wr;
+	struct {
+		struct rpc_batch batch;
+		struct rpc_header hdr;
+	} ping;
+	struct ibv_send_wr wr[2], *bad;
+	struct ibv_sge sge;
+	struct load_ack *ack;
+	uint64_t offset;
+	c->started[tail] = when;
+	c->kinds[tail] = kind;
+	c->inflight++;
+	c->queued += load_wrs(kind);
+	if(kind == LOAD_OPEN || kind == LOAD_CLOSE){
+		// The opcode, then a call the server only answers once it is done with it
+		ack = &c->acks[c->next_ack % RPC_MAX_OUTSTANDING];
+		ack->started = when;
+		ack->kind = kind;
+		ack->busy = 1;
+		c->awaiting++;
+		memset(&ping, 0, sizeof(ping));
+		ping.batch.count = 1;
+		ping.hdr.id = c->next_ack++;
+		ping.hdr.op = PING;
+		sge.addr = (uint64_t)&ping;
+		sge.length = sizeof(ping);
+		sge.lkey = 0;
+		memset(wr, 0, sizeof(wr));
+		wr[0].opcode = IBV_WR_SEND_WITH_IMM;
+		wr[0].imm_data = htonl(kind == LOAD_OPEN ? OPEN_MR : CLOSE_MR);
+		wr[0].next = &wr[1];
+		wr[1].sg_list = &sge;
+		wr[1].num_sge = 1;
+		wr[1].opcode = IBV_WR_SEND_WITH_IMM;
+		wr[1].send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+		wr[1].imm_data = htonl(RPC);
+		if(rdma_seterrno(ibv_post_send(c->id->qp, wr, &bad)))
+			stop_it("ibv_post_send()", errno, stderr);
+		return;
+	}
+	offset = lrand48() % (c->remote_len - l->size + 1);
+	if(kind == LOAD_WRITE){
+		if(rdma_post_write(c->id, NULL, c->mr->addr, l->size, c->mr, IBV_SEND_SIGNALED, c->remote_addr + offset, c->rkey))
+			stop_it("rdma_post_write()", errno, stderr);
+	} else {
+		if(rdma_post_read(c->id, NULL, c->mr->addr, l->size, c->mr, IBV_SEND_SIGNALED, c->remote_addr + offset, c->rkey))
+			stop_it("rdma_post_read()", errno, stderr);
+	}
+}
+
+/**
+ * @brief Disconnect a connection and connect it again
+ *
+ * @return @c NULL
+ * @param l the settings
+ * @param c the connection, which must have nothing in flight
+ * @param stats where to count directory updates received while waiting
+ * @param epfd the epoll instance watching the receive completion channels
+ */
+static void load_cycle(struct load *l, struct load_conn *c, struct load_stats *stats, int epfd){
+	struct epoll_event ev;
+	void *buf = c->mr->addr;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->id->recv_cq_channel->fd, NULL);
+	while(c->awaiting)
+		load_drain(c, stats);
+	rdma_send_op(c->id, DISCONNECT, stderr);
+	// The server agrees with a 0
+	while(load_drain(c, stats) != 0);
+	obliterate(c->id, NULL, c->mr, c->ec, l->quiet);
+	free(buf);
+	load_free(c);
+	load_connect(l, c);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, c->id->recv_cq_channel->fd, &ev))
+		stop_it("epoll_ctl()", errno, stderr);
+}
+
+/**
+ * @brief Pick the kind of the next operation according to the mix
+ *
+ * @return the kind
+ * @param l the settings
+ */
+static uint8_t load_pick(struct load *l){
+	unsigned int r = lrand48() % l->total;
+	uint8_t kind;
+	for(kind = 0; r >= l->mix[kind]; kind++)
+		r -= l->mix[kind];
+	return kind;
+}
+
+/**
+ * @brief Set up this process's connections, wait for the others, and generate load
+ *
+ * @return @c NULL
+ * @param l the settings
+ * @param stats what was measured
+ * @param ready where to say the connections are up
+ * @param go where to wait for every other process
+ */
+static void load_run(struct load *l, struct load_stats *stats, int ready, int go){
+	struct load_conn *conns = calloc(l->conns, sizeof(*conns)), *c;
+	struct load_conn **active = calloc(l->conns, sizeof(*active));
+	uint64_t *backlog = malloc(LOAD_BACKLOG * sizeof(*backlog));
+	uint8_t *backlog_kinds = malloc(LOAD_BACKLOG);
+	unsigned long head = 0, tail = 0;
+	unsigned int nactive = 0, i, tries;
+	struct epoll_event ev, events[64];
+	uint64_t start, end, next, now;
+	double mean = 1e9 / l->rate;
+	int epfd, n;
+	char byte = 0;
+	epfd = epoll_create1(0);
+	if(epfd < 0)
+		stop_it("epoll_create1()", errno, stderr);
+	start = now_ns();
+	for(i = 0; i < l->conns; i++){
+		load_connect(l, &conns[i]);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &conns[i];
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].id->recv_cq_channel->fd, &ev))
+			stop_it("epoll_ctl()", errno, stderr);
+	}
+	stats->connect_ns = now_ns() - start;
+	stats->connects = l->conns;
+	if(write(ready, &byte, 1) != 1)
+		stop_it("pipe", errno, stderr);
+	// Once every live process has let go of it, the parent sees the end of the pipe if one died
+	close(ready);
+	if(read(go, &byte, 1) != 1)
+		stop_it("pipe", errno, stderr);
+	close(go);
+	srand48(getpid() ^ now_ns());
+	start = next = now_ns();
+	end = start + l->seconds * 1000000000ull;
+	while(1){
+		now = now_ns();
+		// Everything that arrived by now joins the backlog, whether or not it can be posted
+		for(; next <= now && next < end; next += -log(1.0 - drand48()) * mean){
+			if(tail - head == LOAD_BACKLOG){
+				stats->dropped++;
+				continue;
+			}
+			backlog[tail % LOAD_BACKLOG] = next;
+			backlog_kinds[tail % LOAD_BACKLOG] = load_pick(l);
+			tail++;
+		}
+		if(tail - head > stats->backlog)
+			stats->backlog = tail - head;
+		if(next >= end && head == tail && nactive == 0)
+			break;
+		// Post the backlog in order onto random connections with room
+		while(head != tail){
+			c = &conns[lrand48() % l->conns];
+			if(backlog_kinds[head % LOAD_BACKLOG] == LOAD_DISCONNECT){
+				while(c->inflight)
+					load_complete(c, stats, now_ns());
+				if(c->active >= 0){
+					active[c->active] = active[--nactive];
+					active[c->active]->active = c->active;
+				}
+				load_cycle(l, c, stats, epfd);
+				stats->hist[LOAD_DISCONNECT][hist_index(now_ns() - backlog[head % LOAD_BACKLOG])]++;
+				stats->issued[LOAD_DISCONNECT]++;
+				stats->done[LOAD_DISCONNECT]++;
+				head++;
+				continue;
+			}
+			for(tries = 0; !load_room(c, backlog_kinds[head % LOAD_BACKLOG]) && tries < 4; tries++)
+				c = &conns[lrand48() % l->conns];
+			if(!load_room(c, backlog_kinds[head % LOAD_BACKLOG]))
+				break;
+			load_post(l, c, backlog_kinds[head % LOAD_BACKLOG], backlog[head % LOAD_BACKLOG]);
+			stats->issued[backlog_kinds[head % LOAD_BACKLOG]]++;
+			if(c->active < 0){
+				c->active = nactive;
+				active[nactive++] = c;
+			}
+			head++;
+		}
+		// Only connections with something in flight can have send completions
+		now = now_ns();
+		for(i = 0; i < nactive; i++){
+			c = active[i];
+			load_complete(c, stats, now);
+			if(c->inflight == 0){
+				active[i] = active[--nactive];
+				active[i]->active = i;
+				c->active = -1;
+				i--;
+			}
+		}
+		// And only connections whose channel fired can have messages
+		n = epoll_wait(epfd, events, 64, 0);
+		for(i = 0; i < (unsigned int)(n > 0 ? n : 0); i++){
+			struct ibv_cq *cq;
+			void *ctx;
+			c = events[i].data.ptr;
+			if(ibv_get_cq_event(c->id->recv_cq_channel, &cq, &ctx))
+				continue;
+			ibv_ack_cq_events(cq, 1);
+			if(ibv_req_notify_cq(cq, 0))
+				stop_it("ibv_req_notify_cq()", errno, stderr);
+			load_drain(c, stats);
+		}
+	}
+	for(i = 0; i < l->conns; i++){
+		void *buf = conns[i].mr->addr;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, conns[i].id->recv_cq_channel->fd, NULL);
+		while(conns[i].awaiting)
+			load_drain(&conns[i], stats);
+		rdma_send_op(conns[i].id, DISCONNECT, stderr);
+		while(load_drain(&conns[i], stats) != 0);
+		obliterate(conns[i].id, NULL, conns[i].mr, conns[i].ec, l->quiet);
+		free(buf);
+		load_free(&conns[i]);
+	}
+	close(epfd);
+	free(backlog);
+	free(backlog_kinds);
+	free(active);
+	free(conns);
+}
+
+/**
+ * @brief Parse a mix like @c write=60,read=30,open=4,close=4,disconnect=2
+ *
+ * Kinds that aren't named get a weight of 0.
+ * @return 0 on success, -1 if the mix is invalid
+ * @param l the settings to store the weights in
+ * @param spec the mix
+ */
+static int parse_mix(struct load *l, char *spec){
+	char *item, *value, *save;
+	int kind;
+	memset(l->mix, 0, sizeof(l->mix));
+	l->total = 0;
+	for(item = strtok_r(spec, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)){
+		value = strchr(item, '=');
+		if(value == NULL)
+			return -1;
+		*value++ = '\0';
+		for(kind = 0; kind < LOAD_KINDS && strcmp(kind_names[kind], item); kind++);
+		if(kind == LOAD_KINDS)
+			return -1;
+		l->mix[kind] = atoi(value);
+		l->total += l->mix[kind];
+	}
+	return l->total > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv){
+	struct load l;
+	struct load_stats *stats, *sum;
+	char default_mix[] = "write=60,read=30,open=4,close=4,disconnect=2";
+	unsigned int procs = 1, conns = 64, p, k, i;
+	double rate = 10000;
+	int ready[2], go[2], *results, opt, status, failed = 0;
+	uint64_t setup = 0;
+	unsigned long all = 0;
+	struct rlimit lim;
+	pid_t *pids;
+	char *buf;
+	ssize_t got;
+	size_t off;
+	memset(&l, 0, sizeof(l));
+	l.seconds = 10;
+	l.size = 64;
+	parse_mix(&l, default_mix);
+	// The server's region size unless one is asked for
+	tune.server_mr_size = 0;
+	while((opt = getopt(argc, argv, "c:p:r:t:s:m:o:F:")) != -1){
+		switch(opt){
+			case 'c':
+				conns = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				procs = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				rate = strtod(optarg, NULL);
+				break;
+			case 't':
+				l.seconds = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				l.size = strtoull(optarg, NULL, 0);
+				break;
+			case 'm':
+				if(parse_mix(&l, optarg)){
+					printf("Invalid mix '%s'.\n", optarg);
+					return -1;
+				}
+				break;
+			case 'o':
+				if(tune_set(&tune, optarg)){
+					printf("Invalid setting '%s'.\n", optarg);
+					return -1;
+				}
+				break;
+			case 'F':
+				if(tune_load(&tune, optarg, stdout))
+					return -1;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if(argc - optind != 2)
+		goto usage;
+	if(procs < 1 || conns < procs || rate <= 0 || l.seconds < 1 || l.size < 1){
+		printf("Need at least one connection per process, a positive rate, duration and size.\n");
+		return -1;
+	}
+	l.ip = argv[optind];
+	l.port = atoi(argv[optind + 1]);
+	l.rate = rate / procs;
+	l.quiet = fopen("/dev/null", "w");
+	if(l.quiet == NULL)
+		stop_it("fopen()", errno, stderr);
+	// Every connection takes a few descriptors
+	if(!getrlimit(RLIMIT_NOFILE, &lim)){
+		lim.rlim_cur = lim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &lim);
+	}
+	if(pipe(ready) || pipe(go))
+		stop_it("pipe()", errno, stderr);
+	pids = calloc(procs, sizeof(*pids));
+	results = calloc(procs, sizeof(*results));
+	printf("Opening %u connections from %u processes to %s:%s...\n", conns, procs, l.ip, argv[optind + 1]);
+	fflush(stdout);
+	for(p = 0; p < procs; p++){
+		int fds[2];
+		if(pipe(fds))
+			stop_it("pipe()", errno, stderr);
+		pids[p] = fork();
+		if(pids[p] < 0)
+			stop_it("fork()", errno, stderr);
+		if(pids[p] == 0){
+			close(fds[0]);
+			// Only the parent may hold these, or it never sees a process die and they never see it give up
+			close(ready[0]);
+			close(go[1]);
+			// connect_four() and friends talk on stdout
+			dup2(fileno(l.quiet), STDOUT_FILENO);
+			l.conns = conns / procs + (p < conns % procs);
+			stats = calloc(1, sizeof(*stats));
+			load_run(&l, stats, ready[1], go[0]);
+			for(buf = (char *)stats, off = 0; off < sizeof(*stats); off += got)
+				if((got = write(fds[1], buf + off, sizeof(*stats) - off)) <= 0)
+					exit(-1);
+			exit(0);
+		}
+		close(fds[1]);
+		results[p] = fds[0];
+	}
+	close(ready[1]);
+	close(go[0]);
+	// Start everyone at once, after every connection is up
+	for(p = 0; p < procs; p++){
+		char byte;
+		if(read(ready[0], &byte, 1) != 1){
+			printf("A process failed while connecting.\n");
+			return -1;
+		}
+	}
+	for(p = 0; p < procs; p++)
+		if(write(go[1], "", 1) != 1)
+			stop_it("write()", errno, stderr);
+	printf("Connected, generating %.0f operations/s for %u seconds...\n", rate, l.seconds);
+	fflush(stdout);
+	sum = calloc(1, sizeof(*sum));
+	stats = calloc(1, sizeof(*stats));
+	for(p = 0; p < procs; p++){
+		for(buf = (char *)stats, off = 0; off < sizeof(*stats); off += got)
+			if((got = read(results[p], buf + off, sizeof(*stats) - off)) <= 0)
+				break;
+		waitpid(pids[p], &status, 0);
+		if(off < sizeof(*stats) || !WIFEXITED(status) || WEXITSTATUS(status)){
+			failed++;
+			continue;
+		}
+		for(k = 0; k < LOAD_KINDS; k++){
+			for(i = 0; i < HIST_BUCKETS; i++)
+				sum->hist[k][i] += stats->hist[k][i];
+			sum->issued[k] += stats->issued[k];
+			sum->done[k] += stats->done[k];
+		}
+		sum->notices += stats->notices;
+		if(stats->backlog > sum->backlog)
+			sum->backlog = stats->backlog;
+		sum->dropped += stats->dropped;
+		sum->connects += stats->connects;
+		if(stats->connect_ns > setup)
+			setup = stats->connect_ns;
+	}
+	if(failed)
+		printf("%d of %u processes failed, their numbers are left out.\n", failed, procs);
+	printf("Set up %lu connections in %.2f s (%.0f connects/s)\n", sum->connects, setup / 1e9,
+		setup ? sum->connects * 1e9 / setup : 0.0);
+	printf("%-11s %10s %10s %10s %10s %10s %10s %10s\n", "op", "issued", "done", "ops/s", "p50 us", "p99 us",
+		"p99.9 us", "max us");
+	for(k = 0; k < LOAD_KINDS; k++){
+		if(sum->issued[k] == 0)
+			continue;
+		all += sum->done[k];
+		printf("%-11s %10lu %10lu %10.0f %10.1f %10.1f %10.1f %10.1f\n", kind_names[k], sum->issued[k], sum->done[k],
+			(double)sum->done[k] / l.seconds, hist_pct(sum->hist[k], sum->done[k], 50) / 1000.0,
+			hist_pct(sum->hist[k], sum->done[k], 99) / 1000.0, hist_pct(sum->hist[k], sum->done[k], 99.9) / 1000.0,
+			hist_pct(sum->hist[k], sum->done[k], 100) / 1000.0);
+	}
+	printf("Total: %.0f ops/s, %.0f reconnects/s, %.0f directory updates/s received\n", (double)all / l.seconds,
+		(double)sum->done[LOAD_DISCONNECT] / l.seconds, (double)sum->notices / l.seconds);
+	if(sum->dropped)
+		printf("%lu arrivals were dropped because the backlog was full, the server is saturated.\n", sum->dropped);
+	printf("Up to %lu arrivals waited for a free send queue slot at once.\n", sum->backlog);
+	return failed ? -1 : 0;
+	usage:
+	printf("Usage: %s <address> <port> [-c connections] [-p processes] [-r ops/s] [-t seconds] [-s size] "
+		"[-m mix] [-o key=value] [-F tunables file]\nThe mix weighs %s, %s, %s, %s and %s, e.g. the default %s\n", argv[0], kind_names[0],
+		kind_names[1], kind_names[2], kind_names[3], kind_names[4], "write=60,read=30,open=4,close=4,disconnect=2");
+	return -1;
+}
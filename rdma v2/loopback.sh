@@ -0,0 +1,320 @@
+#!/bin/bash
+#
+# Loopback test of the v2 server, client and bench on one host (make check).
+#
+# Runs against an rdma_rxe or siw device. If there is no RDMA link yet and this runs as root, one is
+# added on top of the interface with the default route and removed again at the end. The server is
+# started with a control socket, several clients are driven through FIFOs, and the results are
+# checked from the clients' output and from the server's metrics:
+#
+#   - WRITE and READ of a client's own region
+#   - OPEN_MR reaching connected clients (ADD_CLIENT), and clients that connect later
+#   - reads and writes to another client's open region
+#   - CLOSE_MR reaching every client (REMOVE_CLIENT)
+#
+# Then bench -t lat and -t bw are run and compared with a baseline file. A p50 latency more than
+# THRESHOLD percent above the baseline, or a throughput more than THRESHOLD percent below it, fails
+# the run. The first run (or UPDATE_BASELINE=1) records the baseline instead, so record it on the
+# machine that runs the checks.
+#
+# Environment:
+#   LOOPBACK_ADDR    the address to use (default: the address of LOOPBACK_NETDEV)
+#   LOOPBACK_NETDEV  the interface to add a device on (default: the one with the default route)
+#   LOOPBACK_DRIVER  rxe or siw (default: rxe)
+#   PORT             the server's port (default: 7471)
+#   BASELINE         the baseline file (default: loopback.baseline next to this script)
+#   THRESHOLD        the allowed regression in percent (default: 20)
+#   RUNS             bench runs per test, the best of them counts (default: 3)
+#   ITERS            bench iterations (default: 10000)
+#   UPDATE_BASELINE  1 to record the baseline from this run
+#
+# Exits with 0 if everything passed, 1 if something failed and 77 if no device could be found.
+
+set -u
+
+here=$(cd "$(dirname "$0")" && pwd)
+port=${PORT:-7471}
+baseline=${BASELINE:-$here/loopback.baseline}
+threshold=${THRESHOLD:-20}
+runs=${RUNS:-3}
+iters=${ITERS:-10000}
+driver=${LOOPBACK_DRIVER:-rxe}
+netdev=${LOOPBACK_NETDEV:-}
+addr=${LOOPBACK_ADDR:-}
+work=$(mktemp -d /tmp/rdma-loopback.XXXXXX)
+ctl_path=$work/ctl
+added_link=
+server_pid=
+client_pids=()
+failures=0
+
+log(){
+	echo "loopback: $*"
+}
+
+fail(){
+	echo "loopback: FAIL: $*"
+	failures=$((failures + 1))
+}
+
+cleanup(){
+	local pid
+	for pid in "${client_pids[@]}"; do
+		kill "$pid" 2>/dev/null
+	done
+	if [ -n "$server_pid" ] && kill -0 "$server_pid" 2>/dev/null; then
+		ctl shutdown >/dev/null 2>&1
+		sleep 1
+		kill "$server_pid" 2>/dev/null
+	fi
+	[ -n "$added_link" ] && rdma link delete "$added_link" 2>/dev/null
+	if [ "$failures" -eq 0 ]; then
+		rm -rf "$work"
+	else
+		log "logs kept in $work"
+	fi
+}
+trap cleanup EXIT
+
+# Find an RDMA link, or add a software one
+setup_device(){
+	if [ -z "$netdev" ]; then
+		netdev=$(ip -o -4 route show default 2>/dev/null | awk '{print $5; exit}')
+	fi
+	if [ -z "$(rdma link show 2>/dev/null)" ]; then
+		if [ "$(id -u)" -ne 0 ] || [ -z "$netdev" ]; then
+			log "no RDMA device, and can't add one (run as root or set up rdma_rxe/siw), skipping"
+			exit 77
+		fi
+		modprobe "rdma_$driver" 2>/dev/null || modprobe "$driver" 2>/dev/null
+		if ! rdma link add "${driver}_loopback" type "$driver" netdev "$netdev"; then
+			log "couldn't add a $driver device on $netdev, skipping"
+			exit 77
+		fi
+		added_link=${driver}_loopback
+		log "added $added_link on $netdev"
+	fi
+	if [ -z "$addr" ]; then
+		addr=$(ip -o -4 addr show dev "$netdev" 2>/dev/null | awk '{split($4, a, "/"); print a[1]; exit}')
+	fi
+	if [ -z "$addr" ]; then
+		log "no address to test on (set LOOPBACK_ADDR), skipping"
+		exit 77
+	fi
+	log "testing on $addr ($(rdma link show 2>/dev/null | awk '{print $2; exit}'))"
+}
+
+# Send one command to the control socket and print the answer
+ctl(){
+	if command -v socat >/dev/null; then
+		printf '%s\n' "$1" | socat -t 5 - "UNIX-CONNECT:$ctl_path"
+	else
+		printf '%s\n' "$1" | nc -U -q 5 "$ctl_path"
+	fi
+}
+
+# Print one value from the server's metrics
+metric(){
+	ctl metrics | awk -v key="$1" '$1 == key {print $2}'
+}
+
+# Wait until a file has at least n lines containing a string
+# $1 the file, $2 the string, $3 n (default 1), $4 seconds (default 10)
+wait_for(){
+	local i n
+	for ((i = 0; i < ${4:-10} * 10; i++)); do
+		n=$(grep -cF -- "$2" "$1" 2>/dev/null)
+		[ "${n:-0}" -ge "${3:-1}" ] && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+# Wait until a metric has a value
+# $1 the metric, $2 the value
+wait_metric(){
+	local i
+	for ((i = 0; i < 50; i++)); do
+		[ "$(metric "$1")" = "$2" ] && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+# Start a client with its input on a FIFO, the FIFO is opened on fd 10 + n
+# $1 n
+start_client(){
+	mkfifo "$work/in.$1"
+	(cd "$work" && exec stdbuf -oL "$here/client" "$addr" "$port" < "in.$1" > "out.$1" 2>&1) &
+	client_pids+=($!)
+	eval "exec $((10 + $1))>\"$work/in.$1\""
+	if ! wait_for "$work/out.$1" "Connected as client"; then
+		fail "client $1 didn't connect"
+		exit 1
+	fi
+}
+
+# Send lines to a client
+# $1 n, the rest the lines
+send(){
+	local fd=$((10 + $1))
+	shift
+	printf '%s\n' "$@" >&"$fd"
+}
+
+# The client id client n was given
+cid(){
+	awk '/^Connected as client/ {sub(",", "", $4); print $4; exit}' "$work/out.$1"
+}
+
+# How a client prints the bytes of a string
+hex(){
+	printf 'Data: %s' "$(printf %s "$1" | od -An -v -tx1 | tr -s ' \n' '  ' | sed 's/^ //')"
+}
+
+# Check that client n read a string
+# $1 n, $2 the string, $3 how many such reads it has made by now
+expect_read(){
+	if ! wait_for "$work/out.$1" "$(hex "$2")" "$3"; then
+		fail "client $1 didn't read '$2'"
+		return 1
+	fi
+}
+
+functional(){
+	local a b c
+	log "functional checks"
+	start_client 1
+	start_client 2
+	a=$(cid 1)
+	b=$(cid 2)
+	wait_metric connections 2 || fail "the server doesn't count 2 connections"
+
+	# WRITE and READ of its own region
+	send 1 3 0 "loopback-A"
+	send 1 4 p 0 10
+	expect_read 1 "loopback-A" 1
+
+	# OPEN_MR reaches the other client
+	send 1 5
+	wait_for "$work/out.2" "A remote memory region has opened." || fail "client 2 wasn't told about the open region"
+	wait_metric open_mr_total 1 || fail "the server didn't count the open"
+	ctl list | grep -q "cid=$a state=connected region=open" || fail "the server doesn't list client $a's region as open"
+
+	# Client 2 reads it, writes to it, and client 1 sees the write
+	send 2 7 3 "$a" p 0 10
+	expect_read 2 "loopback-A" 1
+	send 2 2 "$a" 16 "from-B" 3 "$a" p 16 6 4
+	expect_read 2 "from-B" 1
+	send 1 4 p 16 6
+	expect_read 1 "from-B" 1
+
+	# A client that connects later is told about regions that are already open
+	start_client 3
+	c=$(cid 3)
+	wait_for "$work/out.3" "A remote memory region has opened." || fail "client 3 wasn't told about the open region"
+	send 3 7 3 "$a" p 0 10 4
+	expect_read 3 "loopback-A" 1
+
+	# CLOSE_MR reaches everyone
+	send 1 6
+	wait_for "$work/out.2" "A remote memory region has closed." || fail "client 2 wasn't told about the closed region"
+	wait_for "$work/out.3" "A remote memory region has closed." || fail "client 3 wasn't told about the closed region"
+	wait_metric close_mr_total 1 || fail "the server didn't count the close"
+	ctl list | grep -q "cid=$a state=connected region=closed" || fail "the server doesn't list client $a's region as closed"
+
+	# The control socket can disconnect a client, the rest disconnect themselves
+	ctl "disconnect $c" | grep -q "^ok" || fail "couldn't disconnect client $c"
+	wait_for "$work/out.3" "Server issued a disconnect request." || fail "client 3 wasn't disconnected"
+	send 1 1
+	send 2 1
+	wait_metric connections 0 || fail "the server still counts connections"
+	[ "$(metric disconnects_total)" = 3 ] || fail "the server didn't count 3 disconnects"
+	log "clients $a, $b and $c done"
+}
+
+# Run a bench test RUNS times and append the best result of each row to the results as "key value better"
+# $1 the test, the rest more options
+bench_best(){
+	local test=$1 i
+	shift
+	for ((i = 0; i < runs; i++)); do
+		if ! "$here/bench" "$addr" "$port" -t "$test" -n "$iters" "$@" > "$work/bench.$test.$i" 2>&1; then
+			fail "bench -t $test $* failed"
+			cat "$work/bench.$test.$i"
+			return 1
+		fi
+	done
+	# lat rows: op bytes avg p50 p99 max, bw rows: op bytes depth ops MB/s Mops/s cqe/op
+	awk -v test="$test" '($1 == "write" || $1 == "read") && NF == (test == "lat" ? 6 : 7) {
+		if(test == "lat")
+			print "lat_" $1 "_" $2 "_p50_us", $4, "lower"
+		else
+			print "bw_" $1 "_" $2 "_MBps", $5, "higher"
+	}' "$work/bench.$test."* | awk '{
+		if(!($1 in best) || ($3 == "lower" ? $2 < best[$1] : $2 > best[$1])) best[$1] = $2
+		better[$1] = $3
+	} END {
+		for(k in best) print k, best[k], better[k]
+	}' | sort >> "$work/results"
+}
+
+performance(){
+	log "performance, best of $runs runs of $iters iterations"
+	: > "$work/results"
+	# bench can't go deeper than send_wr, which is 8 unless both sides are told otherwise
+	bench_best lat -s 4096 || return
+	bench_best bw -s 4096 -d 8 || return
+	cat "$work/results"
+	if [ ! -s "$work/results" ]; then
+		fail "bench printed no results"
+		return
+	fi
+	if [ ! -f "$baseline" ] || [ "${UPDATE_BASELINE:-0}" = 1 ]; then
+		{
+			echo "# key value better, recorded $(date -u +%Y-%m-%dT%H:%M:%SZ) on $(uname -n)"
+			cat "$work/results"
+		} > "$baseline"
+		log "recorded the baseline in $baseline"
+		return
+	fi
+	local key value better base
+	while read -r key value better; do
+		base=$(awk -v key="$key" '$1 == key {print $2}' "$baseline")
+		if [ -z "$base" ]; then
+			log "$key has no baseline"
+			continue
+		fi
+		if awk -v v="$value" -v b="$base" -v t="$threshold" -v better="$better" 'BEGIN {
+			exit !(better == "lower" ? v > b * (1 + t / 100) : v < b * (1 - t / 100))
+		}'; then
+			fail "$key is $value against a baseline of $base (more than $threshold% worse)"
+		fi
+	done < "$work/results"
+}
+
+for bin in server client bench; do
+	if [ ! -x "$here/$bin" ]; then
+		log "$bin isn't built, run make first"
+		exit 1
+	fi
+done
+setup_device
+(cd "$work" && exec "$here/server" -p "$port" -a "$addr" -m 1048576 -g 0 -S "$ctl_path" > server.out 2>&1) &
+server_pid=$!
+for ((i = 0; i < 50 && ! -S $ctl_path; i++)); do
+	sleep 0.1
+done
+if [ ! -S "$ctl_path" ]; then
+	fail "the server didn't start"
+	cat "$work/server.out"
+	exit 1
+fi
+functional
+performance
+if [ "$failures" -ne 0 ]; then
+	log "$failures check(s) failed"
+	exit 1
+fi
+log "all checks passed"
+exit 0
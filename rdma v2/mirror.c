@@ -0,0 +1,232 @@
+/**
+ * @file mirror.c
+ * @brief File containing the definitions of the functions listed in mirror.h
+ */
+#include "mirror.h"
+
+/**
+ * @brief Connect to a backup server and get its region ready for writes
+ *
+ * Each backup gets a session of its own. If the primary dies, the client can detach and resume
+ * on a backup with that session's token.
+ * @return 0 on success, -1 if @p spec is invalid or there is no room for another mirror
+ * @param set the mirrors
+ * @param spec the server as address:port
+ * @param buf the buffer writes will be made from
+ * @param len the length of @p buf
+ * @param file the file to print to
+ */
+int mirror_add(struct mirror_set *set, char *spec, void *buf, size_t len, FILE *file){
+	struct mirror *m;
+	char ip[64];
+	char *colon = strrchr(spec, ':');
+	int i;
+	if(set->n == MAX_MIRRORS || colon == NULL || colon - spec >= sizeof(ip)){
+		fprintf(file, "Invalid mirror '%s' (address:port, at most %d of them)\n", spec, MAX_MIRRORS);
+		return -1;
+	}
+	m = &set->m[set->n];
+	memset(m, 0, sizeof(*m));
+	snprintf(m->name, sizeof(m->name), "%s", spec);
+	memcpy(ip, spec, colon - spec);
+	ip[colon - spec] = '\0';
+	m->ec = rdma_create_event_channel();
+	if(m->ec == NULL)
+		stop_it("rdma_create_event_channel()", errno, file);
+	if(rdma_create_id(m->ec, &m->id, NULL, RDMA_PS_TCP))
+		stop_it("rdma_create_id()", errno, file);
+	tune_ask(&m->session, &tune);
+	connect_four(m->id, m->ec, ip, atoi(colon + 1), &m->session, sizeof(m->session));
+	m->ctrl = ibv_reg_mr(m->id->qp->pd, malloc(CTRL_MSG_SIZE), CTRL_MSG_SIZE, IBV_ACCESS_LOCAL_WRITE);
+	if(m->ctrl == NULL)
+		stop_it("ibv_reg_mr()", errno, file);
+	m->mr = ibv_reg_mr(m->id->qp->pd, buf, len, IBV_ACCESS_LOCAL_WRITE);
+	if(m->mr == NULL)
+		stop_it("ibv_reg_mr()", errno, file);
+	swap_info(m->id, m->ctrl, m->ctrl, &m->rkey, &m->remote_addr, &m->length, file);
+	// Nothing the server sends is needed, but it must always have somewhere to land
+	for(i = 0; i < tune.recv_wr; i++)
+		rdma_recv(m->id, m->ctrl, file);
+	m->done = m->signaled = set->posted;
+	set->n++;
+	fprintf(file, "Mirroring to %s as client %lu (%zu byte region, session token %016llx).\n", m->name,
+		(unsigned long)m->session.cid, m->length, (unsigned long long)m->session.token);
+	return 0;
+}
+
+/**
+ * @brief Post a write to every live mirror
+ *
+ * Only every @c MIRROR_SIGNAL_EVERY th write is signaled, plus the ones posted with
+ * @c IBV_SEND_SIGNALED in @p flags, and a completion stands for every write posted before it.
+ * No more than @c tune.send_wr may be outstanding at once.
+ * @return @c NULL
+ * @param set the mirrors
+ * @param offset the offset into the regions
+ * @param src the data, inside the buffer given to mirror_add() unless @p flags has @c IBV_SEND_INLINE
+ * @param length the amount of bytes to write
+ * @param flags extra send flags
+ * @param file the file to print to
+ */
+void mirror_write(struct mirror_set *set, uint64_t offset, void *src, uint32_t length, int flags, FILE *file){
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+	struct mirror *m;
+	unsigned long seq = set->posted + 1;
+	int i;
+	for(i = 0; i < set->n; i++){
+		m = &set->m[i];
+		if(m->dead)
+			continue;
+		if(offset + length > m->length){
+			fprintf(file, "The region on %s is too small, dropping the mirror.\n", m->name);
+			m->dead = 1;
+			continue;
+		}
+		sge.addr = (uint64_t)src;
+		sge.length = length;
+		sge.lkey = m->mr->lkey;
+		memset(&wr, 0, sizeof(wr));
+		wr.wr_id = seq;
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		wr.opcode = IBV_WR_RDMA_WRITE;
+		wr.send_flags = flags;
+		if(seq - m->signaled >= MIRROR_SIGNAL_EVERY)
+			wr.send_flags |= IBV_SEND_SIGNALED;
+		wr.wr.rdma.remote_addr = m->remote_addr + offset;
+		wr.wr.rdma.rkey = m->rkey;
+		if(ibv_post_send(m->id->qp, &wr, &bad)){
+			fprintf(file, "Failed to write to %s, dropping the mirror.\n", m->name);
+			m->dead = 1;
+		} else if(wr.send_flags & IBV_SEND_SIGNALED)
+			m->signaled = seq;
+	}
+	set->posted = seq;
+}
+
+/**
+ * @brief Post an empty signaled write behind the unsignaled ones, so their completion shows up
+ *
+ * @return @c NULL
+ * @param m the mirror
+ * @param seq the sequence number of the last write posted
+ * @param file the file to print to
+ */
+static void mirror_fence(struct mirror *m, unsigned long seq, FILE *file){
+	struct ibv_send_wr wr, *bad;
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = seq;
+	wr.opcode = IBV_WR_RDMA_WRITE;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.wr.rdma.remote_addr = m->remote_addr;
+	wr.wr.rdma.rkey = m->rkey;
+	if(ibv_post_send(m->id->qp, &wr, &bad)){
+		fprintf(file, "Failed to write to %s, dropping the mirror.\n", m->name);
+		m->dead = 1;
+	} else
+		m->signaled = seq;
+}
+
+/**
+ * @brief Pull whatever completions the mirrors have without blocking
+ *
+ * Messages from the servers are thrown away, except for a disconnect, which drops the mirror.
+ * A mirror whose signaled writes have all completed while later ones are still unsignaled gets an
+ * empty signaled write posted behind them, so waiting on it always ends.
+ * @return the amount of writes every live mirror has completed
+ * @param set the mirrors
+ * @param file the file to print to
+ */
+unsigned long mirror_done(struct mirror_set *set, FILE *file){
+	struct ibv_wc wc[16];
+	struct mirror *m;
+	unsigned long min = set->posted;
+	int i, j, n;
+	for(i = 0; i < set->n; i++){
+		m = &set->m[i];
+		if(m->dead)
+			continue;
+		n = ibv_poll_cq(m->id->send_cq, 16, wc);
+		for(j = 0; j < n; j++){
+			if(wc[j].status){
+				fprintf(file, "Write to %s failed (%s), dropping the mirror.\n", m->name,
+					ibv_wc_status_str(wc[j].status));
+				m->dead = 1;
+			}
+			// Writes complete in order, everything up to this one is done
+			if(wc[j].wr_id > m->done)
+				m->done = wc[j].wr_id;
+		}
+		if(!m->dead && m->done == m->signaled && m->signaled < set->posted)
+			mirror_fence(m, set->posted, file);
+		n = ibv_poll_cq(m->id->recv_cq, 16, wc);
+		for(j = 0; j < n; j++){
+			if(wc[j].status)
+				continue;
+			if(wc[j].wc_flags & IBV_WC_WITH_IMM && ntohl(wc[j].imm_data) == DISCONNECT){
+				fprintf(file, "%s disconnected, dropping the mirror.\n", m->name);
+				m->dead = 1;
+			}
+			rdma_recv(m->id, m->ctrl, file);
+		}
+		if(!m->dead && m->done < min)
+			min = m->done;
+	}
+	return min;
+}
+
+/**
+ * @brief Busy poll until every live mirror has completed a given amount of writes
+ *
+ * @return @c NULL
+ * @param set the mirrors
+ * @param upto the amount of writes to wait for
+ * @param file the file to print to
+ */
+void mirror_wait(struct mirror_set *set, unsigned long upto, FILE *file){
+	while(mirror_done(set, file) < upto);
+}
+
+/**
+ * @brief Leave every mirror and free the resources used
+ *
+ * @return @c NULL
+ * @param set the mirrors
+ * @param op either @c DISCONNECT to end the sessions or @c DETACH to keep them on the servers
+ * @param file the file to print to
+ */
+void mirror_close(struct mirror_set *set, uint32_t op, FILE *file){
+	struct ibv_wc wc;
+	struct mirror *m;
+	void *buffer;
+	int i, n;
+	mirror_wait(set, set->posted, file);
+	for(i = 0; i < set->n; i++){
+		m = &set->m[i];
+		buffer = m->ctrl->addr;
+		if(ibv_dereg_mr(m->mr))
+			stop_it("ibv_dereg_mr()", errno, file);
+		if(m->dead){
+			// The connection is already broken, don't wait on the server
+			ibv_dereg_mr(m->ctrl);
+			rdma_disconnect(m->id);
+			rdma_destroy_qp(m->id);
+			rdma_destroy_id(m->id);
+			rdma_destroy_event_channel(m->ec);
+			free(buffer);
+			continue;
+		}
+		rdma_send_op(m->id, op, file);
+		// Wait for the server to agree
+		do {
+			while((n = ibv_poll_cq(m->id->recv_cq, 1, &wc)) == 0);
+		} while(n > 0 && !wc.status && !(wc.wc_flags & IBV_WC_WITH_IMM && wc.imm_data == 0));
+		if(op == DETACH)
+			fprintf(file, "Detached from %s, resume with session token %016llx.\n", m->name,
+				(unsigned long long)m->session.token);
+		obliterate(m->id, NULL, m->ctrl, m->ec, file);
+		free(buffer);
+	}
+	set->n = 0;
+}
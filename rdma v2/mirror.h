@@ -0,0 +1,55 @@
+/**
+ * @file mirror.h
+ * @brief Replicating a client's writes to backup servers
+ *
+ * A client with mirrors posts every write to its region on the primary server and, at the same
+ * time, to its region on each backup server. The writes go out in parallel on separate queue pairs,
+ * so a replicated write costs the slowest of the round trips instead of their sum, and with several
+ * writes in flight every queue pair keeps its own pipeline full.
+ */
+#ifndef RDMA_CS_MIRROR
+#define RDMA_CS_MIRROR
+#include "rdma_cs.h"
+
+/**
+ * @brief The max amount of backup servers a client can write to
+ */
+#define MAX_MIRRORS	4
+/**
+ * @brief How often a write to a mirror is signaled when the caller doesn't ask for it
+ */
+#define MIRROR_SIGNAL_EVERY	(tune.send_wr / 2)
+
+/**
+ * @brief The connection to a single backup server
+ */
+struct mirror {
+	char name[64];					/**< The address:port of the server, for messages */
+	struct rdma_event_channel *ec;	/**< The event channel of the connection */
+	struct rdma_cm_id *id;			/**< The connection to the server */
+	struct ibv_mr *mr;				/**< The client's buffer registered for this connection */
+	struct ibv_mr *ctrl;			/**< The buffer messages from the server land in */
+	struct session session;			/**< The session on the server */
+	uint64_t remote_addr;			/**< The address of the region on the server */
+	uint32_t rkey;					/**< The rkey of the region on the server */
+	size_t length;					/**< The length of the region on the server */
+	unsigned long done;				/**< The amount of writes that have completed */
+	unsigned long signaled;			/**< The sequence number of the last signaled write */
+	uint8_t dead;					/**< 1 once a write failed or the server went away */
+};
+
+/**
+ * @brief All of a client's backup servers
+ */
+struct mirror_set {
+	int n;							/**< The amount of entries used in @c m */
+	struct mirror m[MAX_MIRRORS];	/**< The backup servers */
+	unsigned long posted;			/**< The amount of writes posted to every live mirror */
+};
+
+int mirror_add(struct mirror_set *, char *, void *, size_t, FILE *);
+void mirror_write(struct mirror_set *, uint64_t, void *, uint32_t, int, FILE *);
+unsigned long mirror_done(struct mirror_set *, FILE *);
+void mirror_wait(struct mirror_set *, unsigned long, FILE *);
+void mirror_close(struct mirror_set *, uint32_t, FILE *);
+#endif
@@ -0,0 +1,189 @@
+/**
+ * @file persist.c
+ * @brief File-backed client memory regions
+ *
+ * With a region directory, each client's memory region is a shared mapping of region-<cid> in that
+ * directory, registered directly. What clients write ends up in the file, and survives the client
+ * leaving and the server restarting (client ids start over at 1, so the same client id gets the same
+ * file back). @c FLUSH makes a range durable before it is acknowledged, and @c SNAPSHOT copies the
+ * whole file aside in the background.
+ */
+#include "server.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/**
+ * @brief The size of the chunks snapshots are copied in
+ */
+#define SNAPSHOT_CHUNK	(1 << 20)
+
+/**
+ * @brief Numbers the snapshots taken since the server started, so names taken in the same second differ
+ */
+static atomic_ulong snapshot_seq;
+
+/**
+ * @brief What a snapshot thread needs, it doesn't touch the client's node
+ */
+struct snapshot {
+	int fd;				/**< A duplicate of the region file's descriptor */
+	size_t length;		/**< The amount of bytes to copy */
+	unsigned long cid;	/**< The client the region belongs to */
+	char path[512];		/**< Where the snapshot ends up */
+};
+
+/**
+ * @brief Map a client's region file, creating it if needed
+ *
+ * The file is grown to the region size but never shrunk.
+ * @return the mapping, or @c NULL on failure
+ * @param node the client, its @c fd is set
+ */
+void *persist_map(struct cnode *node){
+	char path[512];
+	struct stat st;
+	void *region;
+	snprintf(path, sizeof(path), "%s/region-%lu", region_dir, node->cid);
+	node->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if(node->fd < 0)
+		return NULL;
+	if(fstat(node->fd, &st) || (st.st_size < node->length && (ftruncate(node->fd, node->length) ||
+		fsync(node->fd)))){
+		close(node->fd);
+		node->fd = -1;
+		return NULL;
+	}
+	region = mmap(NULL, node->length, PROT_READ | PROT_WRITE, MAP_SHARED, node->fd, 0);
+	if(region == MAP_FAILED){
+		close(node->fd);
+		node->fd = -1;
+		return NULL;
+	}
+	fprintf(log_p, "Client %lu's memory region is backed by %s (%s).\n", node->cid, path,
+		st.st_size ? "existing contents" : "new file");
+	return region;
+}
+
+/**
+ * @brief Unmap a client's region file
+ *
+ * @return @c NULL
+ * @param node the client
+ * @param region the mapping
+ */
+void persist_unmap(struct cnode *node, void *region){
+	munmap(region, node->length);
+	close(node->fd);
+	node->fd = -1;
+}
+
+/**
+ * @brief Handle a client's @c FLUSH
+ *
+ * The writes being flushed were posted before the @c FLUSH on the same queue pair, so they have been
+ * placed by the time it arrives. Pages written by the device while pinned aren't marked dirty, so the
+ * range is written over itself first to make the kernel write it back.
+ * @return 0 on success, an errno value otherwise (also stored in @p req)
+ * @param node the client
+ * @param req the range to flush
+ */
+int persist_flush(struct cnode *node, struct flush_request *req){
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t start, end;
+	req->status = 0;
+	if(node->fd < 0)
+		req->status = EOPNOTSUPP;
+	else if(req->length == 0 || req->offset + req->length > node->length || req->offset + req->length < req->offset)
+		req->status = EINVAL;
+	if(req->status)
+		goto done;
+	start = req->offset & ~(uint64_t)(page - 1);
+	end = req->offset + req->length;
+	errno = 0;
+	if(pwrite(node->fd, node->mr->addr + start, end - start, start) != end - start)
+		req->status = errno ? errno : EIO;
+	else if(msync(node->mr->addr + start, end - start, MS_SYNC))
+		req->status = errno;
+	done:
+	fprintf(log_p, "Client %lu flushed [%llu, +%llu): %s\n", node->cid, (unsigned long long)req->offset,
+		(unsigned long long)req->length, req->status ? strerror(req->status) : "ok");
+	return req->status;
+}
+
+/**
+ * @brief The function for snapshot threads
+ *
+ * Copies the region file through the page cache, so one-sided access to the region carries on
+ * while it runs. The copy goes to a temporary file of its own and is only renamed into place once
+ * it is on disk.
+ * @return @c NULL
+ * @param arg the @c struct @c snapshot, freed when done
+ */
+static void *snapshot_thread(void *arg){
+	struct snapshot *s = arg;
+	char tmp[520];
+	char *buf = malloc(SNAPSHOT_CHUNK);
+	size_t done = 0;
+	ssize_t n;
+	int out, ok = 0;
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", s->path);
+	out = mkstemp(tmp);
+	if(out >= 0){
+		while(done < s->length){
+			n = pread(s->fd, buf, s->length - done < SNAPSHOT_CHUNK ? s->length - done : SNAPSHOT_CHUNK, done);
+			if(n <= 0 || write(out, buf, n) != n)
+				break;
+			done += n;
+		}
+		ok = done == s->length && !fsync(out);
+		close(out);
+	}
+	if(ok && !rename(tmp, s->path)){
+		fprintf(log_p, "Snapshot of client %lu's memory region written to %s.\n", s->cid, s->path);
+	} else {
+		fprintf(log_p, "Snapshot of client %lu's memory region failed: %s\n", s->cid, strerror(errno));
+		if(out >= 0)
+			unlink(tmp);
+	}
+	close(s->fd);
+	free(buf);
+	free(s);
+	return NULL;
+}
+
+/**
+ * @brief Handle a client's @c SNAPSHOT
+ *
+ * Answered as soon as the snapshot thread is running; the server log says when it is done.
+ * @return 0 on success, an errno value otherwise (also stored in @p req)
+ * @param node the client
+ * @param req the request (the range is ignored, the whole region is copied)
+ */
+int persist_snapshot(struct cnode *node, struct flush_request *req){
+	struct snapshot *s;
+	pthread_t thread;
+	req->status = 0;
+	if(node->fd < 0){
+		req->status = EOPNOTSUPP;
+		return req->status;
+	}
+	s = malloc(sizeof(*s));
+	s->fd = dup(node->fd);
+	s->length = node->length;
+	s->cid = node->cid;
+	snprintf(s->path, sizeof(s->path), "%s/region-%lu.snap-%ld-%lu", region_dir, node->cid, (long)time(NULL),
+		atomic_fetch_add(&snapshot_seq, 1));
+	if(s->fd < 0)
+		req->status = errno;
+	else
+		req->status = pthread_create(&thread, NULL, snapshot_thread, s);
+	if(req->status){
+		if(s->fd >= 0)
+			close(s->fd);
+		free(s);
+		return req->status;
+	}
+	pthread_detach(thread);
+	fprintf(log_p, "Started a snapshot of client %lu's memory region.\n", node->cid);
+	return 0;
+}
@@ -0,0 +1,241 @@
+/**
+ * @file placement.c
+ * @brief File containing the definitions of the functions listed in placement.h
+ */
+#include "placement.h"
+#include <numa.h>
+
+/**
+ * @brief The max amount of devices decisions are remembered for
+ */
+#define MAX_PLACEMENTS	8
+
+/**
+ * @brief Decisions that have already been made, one per device
+ */
+static struct placement placements[MAX_PLACEMENTS];
+/**
+ * @brief The number of entries used in @c placements
+ */
+static int nplacements = 0;
+/**
+ * @brief Lock for @c placements (a mutex so it can be initialized statically)
+ */
+static pthread_mutex_t placement_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Turn a command line string into a placement policy
+ *
+ * The function will call exit(-1) if the string isn't one of "none", "local" or "remote"
+ * @return the policy
+ * @param str the string to convert
+ */
+enum place_policy place_parse(const char *str){
+	if(!strcmp(str, "none"))
+		return PLACE_NONE;
+	if(!strcmp(str, "local"))
+		return PLACE_LOCAL;
+	if(!strcmp(str, "remote"))
+		return PLACE_REMOTE;
+	fprintf(stderr, "Unknown placement policy '%s' (none, local or remote)\n", str);
+	exit(-1);
+}
+
+/**
+ * @brief Get the string representation of a placement policy
+ *
+ * @return the name of the policy
+ * @param policy the policy
+ */
+const char *place_str(enum place_policy policy){
+	switch(policy){
+		case PLACE_LOCAL:
+			return "local";
+		case PLACE_REMOTE:
+			return "remote";
+		default:
+			return "none";
+	}
+}
+
+/**
+ * @brief Read the NUMA node of a device from sysfs
+ *
+ * @return the node, or -1 if the device doesn't report one
+ * @param verbs the device
+ */
+static int device_node(struct ibv_context *verbs){
+	char path[256];
+	int node = -1;
+	FILE *f;
+	snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node",
+		ibv_get_device_name(verbs->device));
+	f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	if(fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+/**
+ * @brief Write a compact list of cores (e.g. "0-7,16-23") into a string
+ *
+ * @return @c NULL
+ * @param set the cores
+ * @param buf the string to write to
+ * @param len the size of @p buf
+ */
+static void cpus_str(cpu_set_t *set, char *buf, size_t len){
+	int cpu, start = -1, used = 0;
+	buf[0] = '\0';
+	for(cpu = 0; cpu <= CPU_SETSIZE && used < len; cpu++){
+		if(cpu < CPU_SETSIZE && CPU_ISSET(cpu, set)){
+			if(start < 0)
+				start = cpu;
+			continue;
+		}
+		if(start < 0)
+			continue;
+		if(start == cpu - 1)
+			used += snprintf(buf + used, len - used, "%s%d", used ? "," : "", start);
+		else
+			used += snprintf(buf + used, len - used, "%s%d-%d", used ? "," : "", start, cpu - 1);
+		start = -1;
+	}
+}
+
+/**
+ * @brief Decide where memory and threads for a device should go
+ *
+ * The decision is made once per device and logged, later calls return the remembered decision.
+ * When libnuma isn't usable, the device doesn't know its node, or the policy is @c PLACE_NONE,
+ * the decision is to not do anything. Past @c MAX_PLACEMENTS devices there is no decision at all,
+ * which the other functions take as not doing anything either.
+ * @return the placement decision for @p verbs, or @c NULL if too many devices have one already
+ * @param verbs the device the memory will be registered with
+ * @param policy where memory should go relative to the device
+ * @param file the file to report the decision to
+ */
+struct placement *place_lookup(struct ibv_context *verbs, enum place_policy policy, FILE *file){
+	struct placement *p;
+	struct bitmask *mask;
+	char cpus[256];
+	int i, node;
+	pthread_mutex_lock(&placement_lock);
+	for(i = 0; i < nplacements; i++){
+		if(placements[i].verbs == verbs){
+			pthread_mutex_unlock(&placement_lock);
+			return &placements[i];
+		}
+	}
+	// Agents keep using the decisions they got, so none is ever replaced
+	if(nplacements == MAX_PLACEMENTS){
+		fprintf(file, "Placement for %s: none (already placing %d devices)\n",
+			ibv_get_device_name(verbs->device), MAX_PLACEMENTS);
+		pthread_mutex_unlock(&placement_lock);
+		return NULL;
+	}
+	p = &placements[nplacements++];
+	memset(p, 0, sizeof(*p));
+	p->verbs = verbs;
+	p->dev_node = -1;
+	p->mem_node = -1;
+	if(policy == PLACE_NONE || numa_available() < 0){
+		fprintf(file, "Placement for %s: none (%s)\n", ibv_get_device_name(verbs->device),
+			policy == PLACE_NONE ? "disabled" : "libnuma unavailable");
+		pthread_mutex_unlock(&placement_lock);
+		return p;
+	}
+	p->dev_node = device_node(verbs);
+	// Single node machines don't bother reporting a node
+	if(p->dev_node < 0 && numa_max_node() == 0)
+		p->dev_node = 0;
+	if(p->dev_node < 0){
+		fprintf(file, "Placement for %s: none (device has no NUMA node)\n",
+			ibv_get_device_name(verbs->device));
+		pthread_mutex_unlock(&placement_lock);
+		return p;
+	}
+	p->mem_node = p->dev_node;
+	if(policy == PLACE_REMOTE){
+		for(node = 0; node <= numa_max_node(); node++){
+			if(node != p->dev_node && numa_node_size64(node, NULL) > 0){
+				p->mem_node = node;
+				break;
+			}
+		}
+		if(p->mem_node == p->dev_node)
+			fprintf(file, "Placement for %s: no remote node with memory, using the local one\n",
+				ibv_get_device_name(verbs->device));
+	}
+	// Polling threads always stay next to the device
+	mask = numa_allocate_cpumask();
+	if(!numa_node_to_cpus(p->dev_node, mask)){
+		for(i = 0; i < mask->size && i < CPU_SETSIZE; i++){
+			if(numa_bitmask_isbitset(mask, i)){
+				CPU_SET(i, &p->cpus);
+				p->ncpus++;
+			}
+		}
+	}
+	numa_free_cpumask(mask);
+	cpus_str(&p->cpus, cpus, sizeof(cpus));
+	fprintf(file, "Placement for %s (%s): device on node %d, memory on node %d, "
+		"polling threads on cores %s\n", ibv_get_device_name(verbs->device), place_str(policy),
+		p->dev_node, p->mem_node, p->ncpus ? cpus : "(any)");
+	pthread_mutex_unlock(&placement_lock);
+	return p;
+}
+
+/**
+ * @brief Allocate a buffer that is going to be registered
+ *
+ * The buffer is bound to the memory node of the placement decision, so the pages land there when
+ * registration faults them in.
+ * @return the buffer, or @c NULL on failure
+ * @param p the placement decision
+ * @param size the size of the buffer
+ */
+void *place_alloc(struct placement *p, size_t size){
+	if(p == NULL || p->mem_node < 0)
+		return malloc(size);
+	return numa_alloc_onnode(size, p->mem_node);
+}
+
+/**
+ * @brief Free a buffer made by place_alloc()
+ *
+ * @return @c NULL
+ * @param p the placement decision the buffer was allocated with
+ * @param buf the buffer
+ * @param size the size of the buffer
+ */
+void place_free(struct placement *p, void *buf, size_t size){
+	if(p == NULL || p->mem_node < 0)
+		free(buf);
+	else
+		numa_free(buf, size);
+}
+
+/**
+ * @brief Pin the calling thread to the cores next to the device
+ *
+ * The thread's own allocations (completion queues, queue pairs, work request buffers) prefer the device's
+ * node even under @c PLACE_REMOTE, only buffers from place_alloc() go to the memory node.
+ * @return @c NULL
+ * @param p the placement decision
+ * @param who a name for the thread to use in the log
+ * @param file the file to report to
+ */
+void place_thread(struct placement *p, const char *who, FILE *file){
+	if(p == NULL || !p->ncpus)
+		return;
+	if(pthread_setaffinity_np(pthread_self(), sizeof(p->cpus), &p->cpus)){
+		fprintf(file, "Failed to pin %s to node %d.\n", who, p->dev_node);
+		return;
+	}
+	numa_set_preferred(p->dev_node);
+	fprintf(file, "Pinned %s to the %d cores of node %d.\n", who, p->ncpus, p->dev_node);
+}
@@ -0,0 +1,39 @@
+/**
+ * @file placement.h
+ * @brief NUMA placement of server memory regions and agent threads
+ *
+ * The server looks up which NUMA node the RDMA device hangs off of and uses it to decide where
+ * registered buffers are allocated and which cores the agent threads are allowed to run on.
+ */
+#ifndef RDMA_CS_PLACEMENT
+#define RDMA_CS_PLACEMENT
+#include "rdma_cs.h"
+#include <sched.h>
+
+/**
+ * @brief Where registered memory should be placed relative to the device
+ */
+enum place_policy {
+	PLACE_NONE,		/**< Don't do anything special (plain malloc, no pinning) */
+	PLACE_LOCAL,	/**< Memory and threads on the device's node */
+	PLACE_REMOTE	/**< Memory on a node other than the device's, threads on the device's node (for benchmarking) */
+};
+
+/**
+ * @brief The placement decision made for a single device
+ */
+struct placement {
+	struct ibv_context *verbs;	/**< The device the decision was made for */
+	int dev_node;				/**< The NUMA node of the device, -1 if unknown */
+	int mem_node;				/**< The NUMA node memory is allocated on, -1 for no preference */
+	cpu_set_t cpus;				/**< The cores that threads polling the device are pinned to */
+	int ncpus;					/**< The number of cores in @c cpus, 0 means no pinning */
+};
+
+enum place_policy place_parse(const char *);
+const char *place_str(enum place_policy);
+struct placement *place_lookup(struct ibv_context *, enum place_policy, FILE *);
+void *place_alloc(struct placement *, size_t);
+void place_free(struct placement *, void *, size_t);
+void place_thread(struct placement *, const char *, FILE *);
+#endif
@@ -5,6 +5,42 @@
  *
  */
 #include "rdma_cs.h"
+#include <time.h>
+#include <stddef.h>
+#include <ctype.h>
+
+static void flow_send(struct rdma_cm_id *, struct flow *, unsigned int, FILE *);
+
+struct tunables tune = {MAX_SEND_WR, MAX_RECV_WR, MAX_SEND_SGE, MAX_RECV_SGE, MAX_INLINE_DATA, REGION_LENGTH,
+	SERVER_MR_SIZE};
+
+/**
+ * @brief A setting in @c struct @c tunables
+ */
+struct tune_key {
+	const char *name;	/**< The name used with @c -o and in files */
+	size_t offset;		/**< Where it is in @c struct @c tunables */
+	uint8_t wide;		/**< 1 for a @c uint64_t, 0 for a @c uint32_t */
+	uint64_t min;		/**< The smallest value allowed */
+	uint64_t max;		/**< The largest value allowed */
+};
+
+/**
+ * @brief All of the settings
+ *
+ * Granting a slice chains an invalidate in front of its bind and load chains a call behind every
+ * open or close, and rdma_send_msg() always sends inline (48 bytes at most), hence the minimums.
+ */
+static const struct tune_key tune_keys[] = {
+	{"send_wr", offsetof(struct tunables, send_wr), 0, 2, MAX_QUEUE_WR},
+	{"recv_wr", offsetof(struct tunables, recv_wr), 0, 1, MAX_QUEUE_WR},
+	{"send_sge", offsetof(struct tunables, send_sge), 0, 1, 32},
+	{"recv_sge", offsetof(struct tunables, recv_sge), 0, 1, 32},
+	{"inline_data", offsetof(struct tunables, inline_data), 0, CTRL_MSG_SIZE, 4096},
+	{"region_length", offsetof(struct tunables, region_length), 1, 64, 1 << 30},
+	{"server_mr_size", offsetof(struct tunables, server_mr_size), 1, 0, UINT64_MAX},
+	{NULL, 0, 0, 0, 0}
+};
 
  /**
   * @brief Print an error message and exit the application
@@ -22,16 +58,19 @@ void stop_it(char *reason, int error, FILE *file){
 /**
  * @brief Process a communication manager event
  *
- * The function will call exit(-1) if the event found does not match the expected event
+ * The function will call exit(-1) if the event found does not match the expected event.
+ * The queue pair for a connection request has to be created with tune_qp() before it is accepted with welcome_mat().
  * @return the @c struct @c rdma_cm_id of the new connection if the event was @c RDMA_CM_EVENT_CONNECT_REQUEST
  * @param ec the event channel to check
  * @param expected the expected event
+ * @param data where to copy the private data of a connection request or establishment to (may be @c NULL)
+ * @param len the size of @p data, anything the remote host didn't send is zeroed
  * @param file the file to output the connection info of a new connection if the event was @c RDMA_CM_EVENT_CONNECT_REQUEST
  */
 struct rdma_cm_id *cm_event(struct rdma_event_channel *ec,
- enum rdma_cm_event_type expected, FILE *file){
+ enum rdma_cm_event_type expected, void *data, size_t len, FILE *file){
 	struct rdma_cm_event *event;
-	struct rdma_cm_id *id;
+	struct rdma_cm_id *id = NULL;
 	if(rdma_get_cm_event(ec, &event))
 		stop_it("rdma_get_cm_event()", errno, file);
 	if(event->event != expected){
@@ -39,27 +78,15 @@ struct rdma_cm_id *cm_event(struct rdma_event_channel *ec,
 			rdma_event_str(expected), rdma_event_str(event->event));
 		exit(-1);
 	}
+	if(data != NULL){
+		memset(data, 0, len);
+		if(event->param.conn.private_data != NULL)
+			memcpy(data, event->param.conn.private_data,
+				len < event->param.conn.private_data_len ? len : event->param.conn.private_data_len);
+	}
 	if(event->event == RDMA_CM_EVENT_CONNECT_REQUEST){
 		id=event->id;
-		struct ibv_qp_init_attr init_attr;
-		memset(&init_attr, 0, sizeof(init_attr));
-		init_attr.qp_type = IBV_QPT_RC;
-		init_attr.cap.max_send_wr  = MAX_SEND_WR;
-		init_attr.cap.max_recv_wr  = MAX_RECV_WR;
-		init_attr.cap.max_send_sge = MAX_SEND_SGE;
-		init_attr.cap.max_recv_sge = MAX_RECV_SGE;
-		init_attr.cap.max_inline_data = MAX_INLINE_DATA;
-		if(rdma_create_qp(id, NULL, &init_attr))
-			stop_it("rdma_create_qp()", errno, file);
-		struct rdma_conn_param *conn_params = malloc(sizeof(*conn_params));
-		memset(conn_params, 0, sizeof(*conn_params));
-		conn_params->retry_count = 8;
-		conn_params->rnr_retry_count = 8;
-		conn_params->responder_resources = 10;
-		conn_params->initiator_depth = 10;
-		if(rdma_accept(id, conn_params))
-			stop_it("rdma_accept()", errno, file);
-		fprintf(file, "Accepted connection request from remote QP 0x%x.\n",
+		fprintf(file, "Received connection request from remote QP 0x%x.\n",
 			(unsigned int)event->param.conn.qp_num);
 	}
 	if(rdma_ack_cm_event(event))
@@ -67,39 +94,70 @@ struct rdma_cm_id *cm_event(struct rdma_event_channel *ec,
 	return id;
 }
 
+/**
+ * @brief Accept a connection request returned by cm_event()
+ *
+ * @return @c NULL
+ * @param id the id of the new connection
+ * @param data the private data to send back to the client (may be @c NULL)
+ * @param len the size of @p data
+ * @param file the file to print to
+ */
+void welcome_mat(struct rdma_cm_id *id, void *data, uint8_t len, FILE *file){
+	struct rdma_conn_param conn_params;
+	memset(&conn_params, 0, sizeof(conn_params));
+	conn_params.retry_count = 8;
+	conn_params.rnr_retry_count = 8;
+	conn_params.responder_resources = 10;
+	conn_params.initiator_depth = 10;
+	conn_params.private_data = data;
+	conn_params.private_data_len = data != NULL ? len : 0;
+	if(rdma_accept(id, &conn_params))
+		stop_it("rdma_accept()", errno, file);
+	fprintf(file, "Accepted connection request.\n");
+}
+
 /**
  * @brief Exchange the information needed to perform rdma read/write operations
  *
  * The address, rkey, and size of a memory region is sent to and recieved from a remote host.
- * WARNING: this erases the contents of the memory region used
+ * WARNING: this erases the contents of the memory region used for the messages
  * @return @c NULL
  * @param cm_id the id associated with the connection to the remote host
  * @param mr the memory region to send information about
+ * @param msg the memory region to send and receive the information with (can be @p mr), at least 60 bytes
  * @param rkey the location to store the remote host's memory region's rkey
  * @param remote_addr the location to store the remote host's memory region's address
  * @param size the location to store the remote host's memory region's size
  * @param file the file to print the sent and received information to
  */
-void swap_info(struct rdma_cm_id *cm_id, struct ibv_mr *mr, uint32_t *rkey, uint64_t *remote_addr,
-	size_t *size, FILE *file){
-	if(rdma_post_recv(cm_id, "qwerty", mr->addr, 30, mr))
+void swap_info(struct rdma_cm_id *cm_id, struct ibv_mr *mr, struct ibv_mr *msg, uint32_t *rkey,
+	uint64_t *remote_addr, size_t *size, FILE *file){
+	struct ibv_send_wr wr;
+	struct ibv_sge sge;
+	if(rdma_post_recv(cm_id, "qwerty", msg->addr, 30, msg))
 		stop_it("rdma_post_recv()", errno, file);
-	memcpy(mr->addr+30,&mr->addr,sizeof(mr->addr));
-	memcpy(mr->addr+30+sizeof(mr->addr),&mr->rkey,sizeof(mr->rkey));
-	memcpy(mr->addr+30+sizeof(mr->addr)+sizeof(mr->rkey),&mr->length,sizeof(mr->length));
-	if(rdma_post_send(cm_id, "qwerty", mr->addr+30, 30, mr, IBV_SEND_SIGNALED))
-		stop_it("rdma_post_send()", errno, file);
-	get_completion(cm_id, SEND, 1, file);
+	memcpy(msg->addr+30,&mr->addr,sizeof(mr->addr));
+	memcpy(msg->addr+30+sizeof(mr->addr),&mr->rkey,sizeof(mr->rkey));
+	memcpy(msg->addr+30+sizeof(mr->addr)+sizeof(mr->rkey),&mr->length,sizeof(mr->length));
+	sge.addr = (uint64_t)msg->addr + 30;
+	sge.length = 30;
+	sge.lkey = msg->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND;
+	send_wait(cm_id, &wr, file);
 	fprintf(file, "Sent local address: 0x%0llx\nSent local rkey: 0x%0x\n", (unsigned long long)mr->addr, (unsigned int)mr->rkey);
 	get_completion(cm_id, RECV, 1, file);
-	memcpy(remote_addr, mr->addr, sizeof(*remote_addr));
-	memcpy(rkey, mr->addr+sizeof(*remote_addr), sizeof(*rkey));
+	memcpy(remote_addr, msg->addr, sizeof(*remote_addr));
+	memcpy(rkey, msg->addr+sizeof(*remote_addr), sizeof(*rkey));
 	fprintf(file, "Received remote address: 0x%0llx\nReceived remote rkey: 0x%0x\n", (unsigned long long)*remote_addr, (unsigned int)*rkey);
 	if(size != NULL){
-		memcpy(size, mr->addr+sizeof(*remote_addr)+sizeof(*rkey), sizeof(*size));
+		memcpy(size, msg->addr+sizeof(*remote_addr)+sizeof(*rkey), sizeof(*size));
 		fprintf(file, "Received remote memory region length: %u bytes\n", (unsigned int)*size);
 	}
-	memset(mr->addr, 0, mr->length);
+	memset(msg->addr, 0, msg->length);
 }
 
 /**
@@ -186,11 +244,11 @@ int obliterate(struct rdma_cm_id *mine,struct rdma_cm_id *client, struct ibv_mr
 	if(rdma_dereg_mr(mr))
 		stop_it("rdma_dereg_mr()", errno, file);
 	if(client != NULL)
-		cm_event(ec, RDMA_CM_EVENT_DISCONNECTED, file);
+		cm_event(ec, RDMA_CM_EVENT_DISCONNECTED, NULL, 0, file);
 	if(rdma_disconnect(id))
 		stop_it("rdma_disconnect()", errno, file);
 	if(client == NULL)
-		cm_event(ec, RDMA_CM_EVENT_DISCONNECTED, file);
+		cm_event(ec, RDMA_CM_EVENT_DISCONNECTED, NULL, 0, file);
 	rdma_destroy_qp(id);
 	if(client != NULL){
 		if(rdma_destroy_id(client))
@@ -216,25 +274,140 @@ void rdma_recv(struct rdma_cm_id *id, struct ibv_mr *mr, FILE *file){
 		stop_it("rdma_post_recv()", errno, file);
 }
 
+/**
+ * @brief Wait for a send completion on a connection
+ *
+ * With @p f held, what was posted under its lock is the only thing that can complete, apart from
+ * failed unsignaled requests from earlier in the same chain, which are skipped.
+ * @return the completion's status
+ * @param id the connection
+ * @param f the flow control state of @p id, locked (may be @c NULL)
+ * @param tag the @c wr_id to wait for, anything will do without @p f
+ * @param file the file to print errors to
+ */
+static int send_poll(struct rdma_cm_id *id, struct flow *f, uint64_t tag, FILE *file){
+	struct ibv_wc wc;
+	do {
+		if(-1 == rdma_get_send_comp(id, &wc))
+			stop_it("rdma_get_send_comp()", errno, file);
+	} while(f != NULL && wc.wr_id != tag);
+	return wc.status;
+}
+
+/**
+ * @brief Wait for the completion of what send_wait() or bind_wait() posted, then let the next sender in
+ *
+ * @return 0 on success, the failed completion's status otherwise
+ * @param id the connection
+ * @param f the flow control state of @p id, locked (may be @c NULL)
+ * @param tag the @c wr_id to wait for
+ * @param file the file to print errors to
+ */
+static int send_done(struct rdma_cm_id *id, struct flow *f, uint64_t tag, FILE *file){
+	int status = send_poll(id, f, tag, file);
+	if(f != NULL)
+		pthread_mutex_unlock(&f->lock);
+	if(status)
+		fprintf(file, "Work request failed: %s\n", ibv_wc_status_str(status));
+	return status;
+}
+
+/**
+ * @brief Post a chain of send work requests and wait for the last one to complete
+ *
+ * Only the last work request is signaled, and each send in the chain takes a credit first on
+ * connections with flow control. On connections with a @c struct @c flow the post and the wait
+ * happen under its lock and the completion is picked out by its @c wr_id, so any thread can send
+ * on the connection without taking another one's completion.
+ * @return 0 on success, the failed completion's status otherwise
+ * @param id the connection
+ * @param wr the chain of work requests, the last one's @c wr_id is replaced
+ * @param file the file to print errors to
+ */
+int send_wait(struct rdma_cm_id *id, struct ibv_send_wr *wr, FILE *file){
+	struct flow *f = id->context;
+	struct ibv_send_wr *last, *bad;
+	unsigned int sends = 0;
+	for(last = wr; ; last = last->next){
+		if(last->opcode == IBV_WR_SEND || last->opcode == IBV_WR_SEND_WITH_IMM)
+			sends++;
+		if(last->next == NULL)
+			break;
+	}
+	last->send_flags |= IBV_SEND_SIGNALED;
+	if(f != NULL){
+		pthread_mutex_lock(&f->lock);
+		flow_send(id, f, sends, file);
+		last->wr_id = ++f->tag;
+	}
+	if(rdma_seterrno(ibv_post_send(id->qp, wr, &bad)))
+		stop_it("ibv_post_send()", errno, file);
+	return send_done(id, f, last->wr_id, file);
+}
+
+/**
+ * @brief Bind a type 1 memory window and wait for the bind to complete
+ *
+ * The bind goes through the send queue, so it is serialized with the other senders like in send_wait().
+ * @return 0 on success, the failed completion's status otherwise
+ * @param id the connection
+ * @param mw the memory window
+ * @param bind the bind, its @c wr_id is replaced
+ * @param file the file to print errors to
+ */
+int bind_wait(struct rdma_cm_id *id, struct ibv_mw *mw, struct ibv_mw_bind *bind, FILE *file){
+	struct flow *f = id->context;
+	bind->send_flags |= IBV_SEND_SIGNALED;
+	if(f != NULL){
+		pthread_mutex_lock(&f->lock);
+		bind->wr_id = ++f->tag;
+	}
+	if(rdma_seterrno(ibv_bind_mw(id->qp, mw, bind)))
+		stop_it("ibv_bind_mw()", errno, file);
+	return send_done(id, f, bind->wr_id, file);
+}
+
 /**
  * @brief A 0 byte send with immediate data
  *
- * This is used to send opcodes between hosts using the immediate data.
- * @return @c NULL
+ * This is used to send opcodes between hosts using the immediate data. Waits for the send to complete.
+ * @return 0 on success, the failed completion's status otherwise
  * @param id the id associated with the connection to the remote host
  * @param op the opcode (immediate data) to send
  * @param file the file to print to in the event of an error
  */
-void rdma_send_op(struct rdma_cm_id *id, uint8_t op, FILE *file){
-	struct ibv_send_wr wr, *bad;
-	wr.next = NULL;
-	wr.sg_list = NULL;
-	wr.num_sge = 0;
+int rdma_send_op(struct rdma_cm_id *id, uint32_t op, FILE *file){
+	struct ibv_send_wr wr;
+	memset(&wr, 0, sizeof(wr));
 	wr.opcode = IBV_WR_SEND_WITH_IMM;
-	wr.send_flags = IBV_SEND_SIGNALED;
 	wr.imm_data = htonl(op);
-	if(rdma_seterrno(ibv_post_send(id->qp, &wr, &bad)))
-		stop_it("ibv_post_send()", errno, file);
+	return send_wait(id, &wr, file);
+}
+
+/**
+ * @brief An inline send with immediate data
+ *
+ * Like rdma_send_op(), but with a small message attached for opcodes that need more information.
+ * @return 0 on success, the failed completion's status otherwise
+ * @param id the id associated with the connection to the remote host
+ * @param op the opcode (immediate data) to send
+ * @param data the message to send (at most the connection's inline size)
+ * @param len the length of the message
+ * @param file the file to print to in the event of an error
+ */
+int rdma_send_msg(struct rdma_cm_id *id, uint32_t op, void *data, uint32_t len, FILE *file){
+	struct ibv_send_wr wr;
+	struct ibv_sge sge;
+	sge.addr = (uint64_t)data;
+	sge.length = len;
+	sge.lkey = 0;
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND_WITH_IMM;
+	wr.send_flags = IBV_SEND_INLINE;
+	wr.imm_data = htonl(op);
+	return send_wait(id, &wr, file);
 }
 
 /**
@@ -252,3 +425,320 @@ void rdma_write_inline(struct rdma_cm_id *id, void *buffer, uint64_t address, ui
 		IBV_SEND_INLINE | IBV_SEND_SIGNALED, address, key))
 		stop_it("rdma_post_write()", errno, file);
 }
+
+/**
+ * @brief Connect to a server at the given ip and port.
+ *
+ * @return @c NULL
+ * @param cm_id the cm_id associated with this client
+ * @param ec the event channel to use
+ * @param ip the ip to connect to
+ * @param port the port to connect to
+ * @param data the private data to send with the request, replaced by what the server accepted with (may be @c NULL)
+ * @param len the size of @p data
+ */
+void connect_four(struct rdma_cm_id *cm_id, struct rdma_event_channel *ec, char *ip, 
+	short int port, void *data, uint8_t len){
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(struct sockaddr_in));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	inet_aton(ip, &(sin.sin_addr));
+	// Resolve the server's address
+	if(rdma_resolve_addr(cm_id, NULL, (struct sockaddr *)&sin, 10000))
+		stop_it("rdma_resolve_addr()", errno, stderr);
+	// Wait for the address to resolve
+	cm_event(ec, RDMA_CM_EVENT_ADDR_RESOLVED, NULL, 0, stdout);
+	// Create queue pair, as deep as this program's tunables ask for
+	tune_qp(cm_id, &tune, stderr);
+	// Resolve the route to the server
+	if(rdma_resolve_route(cm_id, 10000))
+		stop_it("rdma_resolve_route()", errno, stderr);
+	// Wait for the route to resolve
+	cm_event(ec, RDMA_CM_EVENT_ROUTE_RESOLVED, NULL, 0, stdout);
+	// Send a connection request to the server
+	struct rdma_conn_param *conn_params = malloc(sizeof(*conn_params));
+	printf("Connecting...\n");
+	memset(conn_params, 0, sizeof(*conn_params));
+	conn_params->retry_count = 8;
+	conn_params->rnr_retry_count = 8;
+	conn_params->responder_resources = 10;
+	conn_params->initiator_depth = 10;
+	conn_params->private_data = data;
+	conn_params->private_data_len = data != NULL ? len : 0;
+	if(rdma_connect(cm_id, conn_params))
+		stop_it("rdma_connect()", errno, stderr);
+	// Wait for the server to accept the connection
+	cm_event(ec, RDMA_CM_EVENT_ESTABLISHED, data, data != NULL ? len : 0, stdout);
+}
+
+/**
+ * @brief Change one tunable
+ *
+ * @return 0 on success, -1 if the setting is unknown or the value is out of range
+ * @param t the tunables
+ * @param setting @c key=value, the value in any base strtoull() takes
+ */
+int tune_set(struct tunables *t, const char *setting){
+	const struct tune_key *key;
+	const char *eq = strchr(setting, '=');
+	unsigned long long value;
+	char *end;
+	if(eq == NULL)
+		return -1;
+	for(key = tune_keys; key->name != NULL; key++)
+		if(strlen(key->name) == eq - setting && !strncmp(key->name, setting, eq - setting))
+			break;
+	if(key->name == NULL)
+		return -1;
+	errno = 0;
+	value = strtoull(eq + 1, &end, 0);
+	if(errno || end == eq + 1 || *end != '\0' || value < key->min || value > key->max)
+		return -1;
+	if(key->wide)
+		*(uint64_t *)((uint8_t *)t + key->offset) = value;
+	else
+		*(uint32_t *)((uint8_t *)t + key->offset) = value;
+	return 0;
+}
+
+/**
+ * @brief Change the tunables set in a file
+ *
+ * The file holds one @c key=value per line, blank lines and anything after a @c # are skipped.
+ * @return 0 on success, -1 if the file can't be read or has a bad line
+ * @param t the tunables
+ * @param path the file
+ * @param file the file to print errors to
+ */
+int tune_load(struct tunables *t, const char *path, FILE *file){
+	char line[128], *start, *end;
+	int n = 0;
+	FILE *in = fopen(path, "r");
+	if(in == NULL){
+		fprintf(file, "Can't read %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while(fgets(line, sizeof(line), in) != NULL){
+		n++;
+		if((end = strchr(line, '#')) != NULL)
+			*end = '\0';
+		for(start = line; isspace((unsigned char)*start); start++);
+		for(end = start + strlen(start); end > start && isspace((unsigned char)end[-1]); end--);
+		*end = '\0';
+		if(*start != '\0' && tune_set(t, start)){
+			fprintf(file, "%s:%d: bad setting '%s'\n", path, n, start);
+			fclose(in);
+			return -1;
+		}
+	}
+	fclose(in);
+	return 0;
+}
+
+/**
+ * @brief Print the tunables
+ *
+ * @return @c NULL
+ * @param t the tunables
+ * @param file the file to print to
+ */
+void tune_print(struct tunables *t, FILE *file){
+	fprintf(file, "Queues: %u send (%u sge), %u receive (%u sge), %u bytes inline\n"
+		"Regions: %llu bytes local, %llu bytes on the server\n", t->send_wr, t->send_sge, t->recv_wr,
+		t->recv_sge, t->inline_data, (unsigned long long)t->region_length,
+		(unsigned long long)t->server_mr_size);
+}
+
+/**
+ * @brief Create the queue pair of a connection, after bringing the tunables within what the device can do
+ *
+ * Devices don't report how much they can send inline, so if the queue pair can't be created the
+ * inline size is halved until it can (down to @c CTRL_MSG_SIZE).
+ * The function will call exit(-1) if the queue pair can't be created.
+ * @return @c NULL
+ * @param id the id of the connection, with its device known
+ * @param t the tunables, lowered to what the device allowed
+ * @param file the file to print to
+ */
+void tune_qp(struct rdma_cm_id *id, struct tunables *t, FILE *file){
+	struct ibv_device_attr attr;
+	struct ibv_qp_init_attr init_attr;
+	if(ibv_query_device(id->verbs, &attr))
+		stop_it("ibv_query_device()", errno, file);
+	if(t->send_wr > attr.max_qp_wr || t->recv_wr > attr.max_qp_wr){
+		fprintf(file, "The device allows queues of %d work requests at most.\n", attr.max_qp_wr);
+		t->send_wr = t->send_wr > attr.max_qp_wr ? attr.max_qp_wr : t->send_wr;
+		t->recv_wr = t->recv_wr > attr.max_qp_wr ? attr.max_qp_wr : t->recv_wr;
+	}
+	if(t->send_sge > attr.max_sge || t->recv_sge > attr.max_sge){
+		fprintf(file, "The device allows %d scatter/gather elements at most.\n", attr.max_sge);
+		t->send_sge = t->send_sge > attr.max_sge ? attr.max_sge : t->send_sge;
+		t->recv_sge = t->recv_sge > attr.max_sge ? attr.max_sge : t->recv_sge;
+	}
+	if(t->region_length > attr.max_mr_size || t->server_mr_size > attr.max_mr_size){
+		fprintf(file, "The device registers %llu bytes at most.\n", (unsigned long long)attr.max_mr_size);
+		t->region_length = t->region_length > attr.max_mr_size ? attr.max_mr_size : t->region_length;
+		t->server_mr_size = t->server_mr_size > attr.max_mr_size ? attr.max_mr_size : t->server_mr_size;
+	}
+	while(1){
+		memset(&init_attr, 0, sizeof(init_attr));
+		init_attr.qp_type = IBV_QPT_RC;
+		init_attr.cap.max_send_wr  = t->send_wr;
+		init_attr.cap.max_recv_wr  = t->recv_wr;
+		init_attr.cap.max_send_sge = t->send_sge;
+		init_attr.cap.max_recv_sge = t->recv_sge;
+		init_attr.cap.max_inline_data = t->inline_data;
+		if(!rdma_create_qp(id, NULL, &init_attr))
+			break;
+		if(t->inline_data <= CTRL_MSG_SIZE)
+			stop_it("rdma_create_qp()", errno, file);
+		t->inline_data = t->inline_data / 2 < CTRL_MSG_SIZE ? CTRL_MSG_SIZE : t->inline_data / 2;
+		fprintf(file, "Couldn't create a queue pair, trying %u bytes inline.\n", t->inline_data);
+	}
+}
+
+/**
+ * @brief Put the queue depths and server-side region size into the private data of a connection
+ *
+ * The client asks for its own, the server answers with what it granted.
+ * @return @c NULL
+ * @param s the private data
+ * @param t the tunables
+ */
+void tune_ask(struct session *s, struct tunables *t){
+	s->send_wr = t->send_wr;
+	s->recv_wr = t->recv_wr;
+	s->region_size = t->server_mr_size;
+}
+
+/**
+ * @brief Work out what a connection gets (on the server)
+ *
+ * Each value is what the client asked for, but no more than the server's own. Older clients ask
+ * for nothing and get the server's.
+ * @return @c NULL
+ * @param granted where to store what the connection gets
+ * @param server the server's tunables
+ * @param s the private data the client connected with
+ */
+void tune_grant(struct tunables *granted, struct tunables *server, struct session *s){
+	*granted = *server;
+	if(s->send_wr && s->send_wr < granted->send_wr)
+		granted->send_wr = s->send_wr < 2 ? 2 : s->send_wr;
+	if(s->recv_wr && s->recv_wr < granted->recv_wr)
+		granted->recv_wr = s->recv_wr;
+	if(s->region_size && s->region_size < granted->server_mr_size)
+		granted->server_mr_size = s->region_size < 64 ? 64 : s->region_size;
+}
+
+/**
+ * @brief Take what the server granted (on the client)
+ *
+ * The queue depths only ever go down, since the queue pair was created before the answer came.
+ * Older servers grant nothing and the tunables are left alone.
+ * @return @c NULL
+ * @param t the tunables
+ * @param s the private data the server accepted with
+ */
+void tune_take(struct tunables *t, struct session *s){
+	if(s->send_wr && s->send_wr < t->send_wr)
+		t->send_wr = s->send_wr;
+	if(s->recv_wr && s->recv_wr < t->recv_wr)
+		t->recv_wr = s->recv_wr;
+	if(s->region_size)
+		t->server_mr_size = s->region_size;
+}
+
+/**
+ * @brief Attach flow control to a connection
+ *
+ * Sends aren't held back until flow_peer() is called.
+ * @return @c NULL
+ * @param f the flow control state
+ * @param id the connection
+ * @param mr the memory region holding @p words, the peer must be able to read it
+ * @param words two words for the receive count and the peer's count, zeroed
+ */
+void flow_init(struct flow *f, struct rdma_cm_id *id, struct ibv_mr *mr, uint64_t *words){
+	memset(f, 0, sizeof(*f));
+	f->words = words;
+	f->mr = mr;
+	pthread_mutex_init(&f->lock, NULL);
+	id->context = f;
+}
+
+/**
+ * @brief Start holding sends back until the peer has a receive posted for them
+ *
+ * Must be called before the peer can have received anything counted by flow_send().
+ * @return @c NULL
+ * @param f the flow control state
+ * @param addr the address of the peer's receive count
+ * @param rkey the rkey of the peer's receive count
+ */
+void flow_peer(struct flow *f, uint64_t addr, uint32_t rkey){
+	f->peer_addr = addr;
+	f->peer_rkey = rkey;
+}
+
+/**
+ * @brief Take credits for messages, waiting for the peer to post receives if needed
+ *
+ * Called by send_wait() with the flow control state's lock held. Does nothing until flow_peer()
+ * was called. The peer's count is read again after a wait that doubles every time nothing changed,
+ * from @c FLOW_BACKOFF up to @c FLOW_BACKOFF_MAX, and the lock is let go while waiting so requests
+ * that don't need credits can get through. If the count can't be read the connection is broken,
+ * so flow control is turned off and the sends are left to fail on their own.
+ * @return @c NULL
+ * @param id the connection
+ * @param f the flow control state of @p id
+ * @param n the amount of messages
+ * @param file the file to print errors to
+ */
+static void flow_send(struct rdma_cm_id *id, struct flow *f, unsigned int n, FILE *file){
+	volatile uint64_t *count = &f->words[1];
+	struct timespec wait = {0, 0};
+	while(f->peer_rkey != 0 && f->sent + n > f->limit){
+		if(wait.tv_nsec){
+			pthread_mutex_unlock(&f->lock);
+			nanosleep(&wait, NULL);
+			pthread_mutex_lock(&f->lock);
+			// Someone else may have read it in the meantime
+			if(f->peer_rkey == 0 || f->sent + n <= f->limit)
+				break;
+		}
+		if(rdma_post_read(id, (void *)(uintptr_t)++f->tag, f->words + 1, sizeof(uint64_t), f->mr,
+			IBV_SEND_SIGNALED, f->peer_addr, f->peer_rkey))
+			stop_it("rdma_post_read()", errno, file);
+		if(send_poll(id, f, f->tag, file)){
+			f->peer_rkey = 0;
+			break;
+		}
+		f->reads++;
+		if(*count <= f->limit){
+			f->stalls++;
+			wait.tv_nsec = wait.tv_nsec ? wait.tv_nsec * 2 : FLOW_BACKOFF;
+			if(wait.tv_nsec > FLOW_BACKOFF_MAX)
+				wait.tv_nsec = FLOW_BACKOFF_MAX;
+		} else {
+			wait.tv_nsec = 0;
+		}
+		f->limit = *count > f->limit ? *count : f->limit;
+	}
+	f->sent += n;
+}
+
+/**
+ * @brief Count receives that were posted, handing the peer credits for them
+ *
+ * Does nothing on connections without flow control.
+ * @return @c NULL
+ * @param id the connection
+ * @param n the amount of receives posted
+ */
+void flow_posted(struct rdma_cm_id *id, unsigned int n){
+	struct flow *f = id->context;
+	if(f != NULL && f->words != NULL)
+		__atomic_add_fetch(&f->words[0], n, __ATOMIC_RELEASE);
+}
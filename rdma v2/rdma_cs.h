@@ -23,33 +23,69 @@
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 /**
- * @brief The max amount of send type work requests
+ * @brief The default max amount of send type work requests (@c tune.send_wr)
  */
 #define MAX_SEND_WR		8
 /**
- * @brief The max amount of send type scatter/gather elements
+ * @brief The default max amount of send type scatter/gather elements (@c tune.send_sge)
  */
 #define MAX_SEND_SGE	4
 /**
- * @brief The max amount of receive type work requests
+ * @brief The default max amount of receive type work requests (@c tune.recv_wr)
  */
 #define MAX_RECV_WR		8
 /**
- * @brief The max amount of receive type scatter/gather elements
+ * @brief The default max amount of receive type scatter/gather elements (@c tune.recv_sge)
  */
 #define MAX_RECV_SGE	4
 /**
- * @brief The max amount (in bytes) that can be written inline
+ * @brief The default max amount (in bytes) that can be written inline (@c tune.inline_data)
  */
 #define MAX_INLINE_DATA	256
 /**
- * @brief The default local memory region size
+ * @brief The default local memory region size (@c tune.region_length)
  */
 #define REGION_LENGTH	512
 /**
- * @brief The default memory region size on the server
+ * @brief The most work requests of either kind a queue pair may be asked for
+ */
+#define MAX_QUEUE_WR	4096
+/**
+ * @brief The default memory region size on the server (@c tune.server_mr_size)
  */
 #define SERVER_MR_SIZE	1024
+/**
+ * @brief The default amount of seconds a detached client's session is kept around for
+ */
+#define SESSION_GRACE_PERIOD	30
+/**
+ * @brief The size of the buffer used for control messages
+ */
+#define CTRL_MSG_SIZE	64
+/**
+ * @brief The default size of each arena remote allocations are made from (rounded up to a power of two)
+ */
+#define ARENA_SIZE		(1 << 20)
+/**
+ * @brief The max amount of arenas the server will make
+ */
+#define MAX_ARENAS		8
+/**
+ * @brief The default amount of bytes each client may allocate from the arenas
+ */
+#define CLIENT_QUOTA	(256 * 1024)
+/**
+ * @brief The bytes at the end of a memory region that hold the receive count read for credits
+ */
+#define FLOW_BYTES		(2 * sizeof(uint64_t))
+/**
+ * @brief How long a sender without credits first waits before reading the peer's count again, in nanoseconds
+ */
+#define FLOW_BACKOFF	1000
+/**
+ * @brief The longest it waits, the wait doubles after every read that finds no new receives
+ */
+#define FLOW_BACKOFF_MAX	1000000
 /**
  * @brief The file path to store the server logs to
  */
@@ -73,8 +109,22 @@ enum client_opcodes {
 	READ,			/**< Perform and rdma read */
 	OPEN_MR,		/**< Open a memory region on the server */
 	CLOSE_MR,		/**< Close a memory region on the server */
+	DETACH = 8,		/**< Disconnect, but keep the session (and memory region) on the server for a while */
 	ADD_CLIENT = 10,/**< Used to add an open memory regions to clients' lists */
-	REMOVE_CLIENT	/**< Used to remove open memory regions from clients' lists */
+	REMOVE_CLIENT,	/**< Used to remove open memory regions from clients' lists */
+	GRANT,			/**< Share a slice of this client's memory region with one other client */
+	REVOKE,			/**< Take back everything shared with one other client */
+	ALLOC,			/**< Call: allocate remote memory from the server's arenas */
+	FREE,			/**< Call: give back remote memory allocated with @c ALLOC */
+	FLUSH,			/**< Call: make a range of a file-backed memory region durable (answered once it is) */
+	SNAPSHOT,		/**< Call: copy a file-backed memory region aside in the background (answered once started) */
+	CHECKSUM,		/**< Call: compute the CRC32C of a range of a memory region on the server */
+	COPY,			/**< Call: copy a range between memory regions on the server */
+	FILL,			/**< Call: set a range of a memory region on the server to one byte */
+	COMPARE,		/**< Call: compare two ranges of memory regions on the server */
+	PING,			/**< Call: answered with its own arguments, for measuring the call path */
+	RPC,			/**< A message carrying calls or their responses (see rpc.h) */
+	DIR_FETCH		/**< Call: get a directory update that was multicast, or where the directory stands */
 };
 
 /**
@@ -85,15 +135,185 @@ struct client {
 	uint32_t rkey;			/**< The rkey associated with the memory region */
 	uint64_t remote_addr;	/**< The address on the server of the memory region */
 	size_t length;			/**< The length of the memory region */
+	uint32_t writable;		/**< 1 if the memory region may be written to, 0 if it is read only */
 	struct client *next;	/**< A pointer to the next node in the list */
 };
 
+/**
+ * @brief The message sent along with @c GRANT and @c REVOKE
+ */
+struct grant_request {
+	uint64_t cid;		/**< The client being granted access (or losing it) */
+	uint64_t offset;	/**< The start of the slice, relative to the start of the memory region */
+	uint64_t length;	/**< The length of the slice */
+	uint32_t writable;	/**< 1 to allow writes, 0 for read only */
+};
+
+/**
+ * @brief The message sent along with @c ALLOC and @c FREE, and the server's answer to them
+ *
+ * @c ALLOC only needs the length and @c FREE only needs the address. The server answers with the
+ * whole allocation filled in. The rkey only works through the connection it was handed out on, so
+ * after resuming a session an @c ALLOC with a length of 0 and the address gets a new one.
+ */
+struct allocation {
+	uint64_t remote_addr;	/**< The address of the allocation on the server */
+	uint64_t length;		/**< The length of the allocation */
+	uint32_t rkey;			/**< The rkey to reach the allocation with */
+	int32_t status;			/**< 0 on success, an errno value otherwise (only set by the server) */
+};
+
+/**
+ * @brief The message sent along with @c FLUSH and @c SNAPSHOT, and the server's answer to them
+ */
+struct flush_request {
+	uint64_t offset;	/**< The start of the range, relative to the start of the memory region */
+	uint64_t length;	/**< The length of the range */
+	int32_t status;		/**< 0 on success, an errno value otherwise (only set by the server) */
+};
+
+/**
+ * @brief The message sent along with @c CHECKSUM, and the server's answer to it
+ */
+struct checksum_request {
+	uint64_t cid;		/**< The client whose memory region is checksummed, 0 for the sender's own */
+	uint64_t offset;	/**< The start of the range, relative to the start of the memory region */
+	uint64_t length;	/**< The length of the range */
+	uint32_t crc;		/**< The CRC32C of the range (only set by the server) */
+	int32_t status;		/**< 0 on success, an errno value otherwise (only set by the server) */
+};
+
+/**
+ * @brief The message sent along with @c COPY, @c FILL and @c COMPARE, and the server's answer to them
+ *
+ * A client id of 0 means the sender's own memory region. @c FILL doesn't use the source.
+ */
+struct compute_request {
+	uint64_t dst_cid;		/**< The client whose memory region is written to (or compared) */
+	uint64_t dst_offset;	/**< The start of the destination range */
+	uint64_t src_cid;		/**< The client whose memory region is read from */
+	uint64_t src_offset;	/**< The start of the source range */
+	uint64_t length;		/**< The length of both ranges */
+	uint64_t result;		/**< @c COMPARE: the offset of the first difference, @c length if equal (only set by the server) */
+	uint32_t pattern;		/**< @c FILL: the byte to fill with */
+	int32_t status;			/**< 0 on success, an errno value otherwise (only set by the server) */
+};
+
+/**
+ * @brief A change to the directory of open memory regions, multicast to every client
+ *
+ * Also the arguments and result of a @c DIR_FETCH for a missed update.
+ */
+struct dir_update {
+	uint64_t seq;			/**< The sequence number, updates are numbered from 1 without gaps */
+	uint32_t op;			/**< @c ADD_CLIENT or @c REMOVE_CLIENT */
+	uint32_t writable;		/**< 1 if the memory region may be written to */
+	uint64_t cid;			/**< The client that owns the memory region */
+	uint64_t remote_addr;	/**< The address of the memory region on the server */
+	uint64_t length;		/**< The length of the memory region */
+	uint32_t rkey;			/**< The rkey every client can reach the memory region with */
+	uint32_t reserved;		/**< Keeps the size a multiple of 8 */
+};
+
+/**
+ * @brief The result of a @c DIR_FETCH for sequence number 0
+ */
+struct dir_sync {
+	uint64_t base;		/**< The last update already included in what the client was sent when it connected */
+	uint64_t current;	/**< The last update sent so far */
+	char group[64];		/**< The multicast group updates are sent to, empty if they go over each connection */
+};
+
+/**
+ * @brief Session information exchanged as connection private data
+ *
+ * The client sends the token of the session it wants to resume (0 for a new session) and the server
+ * answers with the token and client id of the session the connection was attached to.
+ */
+struct session {
+	uint64_t token;			/**< The session token */
+	uint64_t cid;			/**< The numerical identification number of the client (only set by the server) */
+	uint8_t resumed;		/**< 1 if an existing session was resumed (only set by the server) */
+	uint8_t credits;		/**< 1 if the last @c FLOW_BYTES of the memory region sent with swap_info() are for flow control */
+	uint32_t credit_rkey;	/**< The rkey of the server's receive count (only set by the server) */
+	uint64_t credit_addr;	/**< The address of the server's receive count (only set by the server) */
+	uint16_t send_wr;		/**< The send queue depth asked for, then granted (0 to take the server's) */
+	uint16_t recv_wr;		/**< The receive queue depth asked for, then granted (0 to take the server's) */
+	uint32_t reserved;		/**< Zero */
+	uint64_t region_size;	/**< The size of the memory region on the server asked for, then granted (0 for the server's) */
+};
+
+/**
+ * @brief The sizes of queues and buffers that can be set at runtime
+ *
+ * Each program starts from the defaults above and changes them with @c -o @c key=value and @c -F
+ * @c file (lines of @c key=value, @c # starts a comment), see tune_set(). Before a queue pair is
+ * created they are checked against what the device can do. The queue depths and the server-side
+ * region size are asked for by the client when it connects, and the server grants each connection
+ * at most its own values, so deep and shallow clients can share one server.
+ */
+struct tunables {
+	uint32_t send_wr;			/**< The max amount of send type work requests */
+	uint32_t recv_wr;			/**< The max amount of receive type work requests (and receives posted) */
+	uint32_t send_sge;			/**< The max amount of send type scatter/gather elements */
+	uint32_t recv_sge;			/**< The max amount of receive type scatter/gather elements */
+	uint32_t inline_data;		/**< The max amount of bytes sent inline */
+	uint64_t region_length;		/**< The size of the client's local memory region */
+	uint64_t server_mr_size;	/**< The size of each client's memory region on the server */
+};
+
+/**
+ * @brief This program's tunables, and the limits granted for its connection once it connected
+ */
+extern struct tunables tune;
+
+/**
+ * @brief Credit based flow control for the messages sent on one connection
+ *
+ * Each side counts the receives it has posted in a word the other side can read. A sender keeps the
+ * last count it read and only sends while it has sent fewer messages than that, so a message
+ * always finds a receive waiting. When it runs out it reads the count again with an rdma read, so
+ * handing out credits costs the receiving side nothing but an increment. Attached to the
+ * connection's @c context, which is @c NULL for connections without flow control. The server
+ * attaches one to every connection, without @c mr where the client doesn't do flow control, since
+ * send_wait() serializes the threads sending on a connection through it.
+ */
+struct flow {
+	uint64_t *words;		/**< The receives posted for the peer, then where the peer's count is read to */
+	struct ibv_mr *mr;		/**< The memory region @c words is in */
+	uint64_t sent;			/**< The amount of messages sent to the peer */
+	uint64_t limit;			/**< The amount of receives the peer had posted when its count was last read */
+	uint64_t peer_addr;		/**< The address of the peer's receive count */
+	uint32_t peer_rkey;		/**< The rkey of the peer's receive count, 0 until it is known */
+	unsigned long reads;	/**< The amount of times the peer's count was read */
+	unsigned long stalls;	/**< The amount of reads that found no new receives */
+	uint64_t tag;			/**< The last @c wr_id send_wait() waited for */
+	pthread_mutex_t lock;	/**< Serializes senders */
+};
+
 uint32_t get_completion(struct rdma_cm_id *, enum completion_type, uint8_t, FILE *);
-struct rdma_cm_id *cm_event(struct rdma_event_channel *, enum rdma_cm_event_type, FILE *);
-void swap_info(struct rdma_cm_id *, struct ibv_mr *, uint32_t *, uint64_t *, size_t *, FILE *);
+struct rdma_cm_id *cm_event(struct rdma_event_channel *, enum rdma_cm_event_type, void *, size_t, FILE *);
+void welcome_mat(struct rdma_cm_id *, void *, uint8_t, FILE *);
+void swap_info(struct rdma_cm_id *, struct ibv_mr *, struct ibv_mr *, uint32_t *, uint64_t *, size_t *, FILE *);
 int obliterate(struct rdma_cm_id *,struct rdma_cm_id *, struct ibv_mr *, struct rdma_event_channel *, FILE *);
 void stop_it(char *, int, FILE *);
 void rdma_recv(struct rdma_cm_id *, struct ibv_mr *, FILE *);
-void rdma_send_op(struct rdma_cm_id *, uint8_t, FILE *);
+int send_wait(struct rdma_cm_id *, struct ibv_send_wr *, FILE *);
+int bind_wait(struct rdma_cm_id *, struct ibv_mw *, struct ibv_mw_bind *, FILE *);
+int rdma_send_op(struct rdma_cm_id *, uint32_t, FILE *);
+int rdma_send_msg(struct rdma_cm_id *, uint32_t, void *, uint32_t, FILE *);
 void rdma_write_inline(struct rdma_cm_id *, void *, uint64_t, uint32_t, FILE *);
+void connect_four(struct rdma_cm_id *, struct rdma_event_channel *, char *, short int, void *, uint8_t);
+int tune_set(struct tunables *, const char *);
+int tune_load(struct tunables *, const char *, FILE *);
+void tune_print(struct tunables *, FILE *);
+void tune_qp(struct rdma_cm_id *, struct tunables *, FILE *);
+void tune_ask(struct session *, struct tunables *);
+void tune_grant(struct tunables *, struct tunables *, struct session *);
+void tune_take(struct tunables *, struct session *);
+void flow_init(struct flow *, struct rdma_cm_id *, struct ibv_mr *, uint64_t *);
+void flow_peer(struct flow *, uint64_t, uint32_t);
+void flow_posted(struct rdma_cm_id *, unsigned int);
+uint32_t crc32c(uint32_t, const void *, size_t);
+const char *crc32c_name();
 #endif
\ No newline at end of file
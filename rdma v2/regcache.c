@@ -0,0 +1,236 @@
+/**
+ * @file regcache.c
+ * @brief File containing the definitions of the functions listed in regcache.h
+ */
+#include "regcache.h"
+#include <malloc.h>
+#include <sys/mman.h>
+
+/**
+ * @brief Take an entry out of the recently used list
+ *
+ * @return @c NULL
+ * @param c the cache
+ * @param e the entry
+ */
+static void reg_unlink(struct reg_cache *c, struct reg_entry *e){
+	if(e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if(e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+	c->pinned -= e->end - e->start;
+	c->entries--;
+}
+
+/**
+ * @brief Put an entry in front of the recently used list
+ *
+ * @return @c NULL
+ * @param c the cache
+ * @param e the entry
+ */
+static void reg_push(struct reg_cache *c, struct reg_entry *e){
+	e->prev = NULL;
+	e->next = c->head;
+	if(c->head != NULL)
+		c->head->prev = e;
+	else
+		c->tail = e;
+	c->head = e;
+	c->pinned += e->end - e->start;
+	c->entries++;
+}
+
+/**
+ * @brief Deregister an entry and forget about it
+ *
+ * @return @c NULL
+ * @param c the cache
+ * @param e the entry, which must not be in use
+ */
+static void reg_drop(struct reg_cache *c, struct reg_entry *e){
+	reg_unlink(c, e);
+	if(ibv_dereg_mr(e->mr))
+		fprintf(c->file, "ibv_dereg_mr(): %s\n", strerror(errno));
+	free(e);
+}
+
+/**
+ * @brief Set up an empty cache
+ *
+ * @return @c NULL
+ * @param c the cache
+ * @param pd the protection domain to register in
+ * @param budget the most bytes to keep registered (0 for @c REG_CACHE_BUDGET)
+ * @param file the file to print errors to
+ */
+void reg_cache_init(struct reg_cache *c, struct ibv_pd *pd, size_t budget, FILE *file){
+	memset(c, 0, sizeof(*c));
+	c->pd = pd;
+	c->budget = budget ? budget : REG_CACHE_BUDGET;
+	c->rereg = 1;
+	c->file = file;
+	pthread_mutex_init(&c->lock, NULL);
+}
+
+/**
+ * @brief Deregister everything, nothing may be in use
+ *
+ * @return @c NULL
+ * @param c the cache
+ */
+void reg_cache_destroy(struct reg_cache *c){
+	while(c->head != NULL)
+		reg_drop(c, c->head);
+	pthread_mutex_destroy(&c->lock);
+}
+
+/**
+ * @brief Get a memory region covering a buffer, registering it if no cached one does
+ *
+ * Whole pages are registered, so buffers sharing pages share a registration. Making room takes
+ * the least recently used registrations that are not in use; the first of them is re-registered
+ * for the new buffer with ibv_rereg_mr() where the device allows it, which skips tearing down and
+ * setting up the memory region object.
+ * @return the memory region, which has to be given back with reg_put(), @c NULL with @c errno
+ * set if it couldn't be registered (@c ENOMEM if everything pinned is in use)
+ * @param c the cache
+ * @param addr the buffer
+ * @param len the length of the buffer
+ * @param access the access flags the memory region needs
+ */
+struct ibv_mr *reg_get(struct reg_cache *c, void *addr, size_t len, int access){
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page - 1), end = ((uintptr_t)addr + len + page - 1) & ~(page - 1);
+	struct reg_entry *e, *prev, *victim = NULL;
+	pthread_mutex_lock(&c->lock);
+	for(e = c->head; e != NULL; e = e->next)
+		if(!e->stale && e->start <= start && e->end >= end && (e->access & access) == access)
+			break;
+	if(e != NULL){
+		c->hits++;
+		e->refs++;
+		reg_unlink(c, e);
+		reg_push(c, e);
+		pthread_mutex_unlock(&c->lock);
+		return e->mr;
+	}
+	c->misses++;
+	for(e = c->tail; e != NULL && (c->pinned + (end - start) > c->budget || c->entries >= REG_CACHE_ENTRIES); e = prev){
+		prev = e->prev;
+		if(e->refs)
+			continue;
+		c->evictions++;
+		if(victim == NULL && c->rereg){
+			reg_unlink(c, e);
+			victim = e;
+		} else
+			reg_drop(c, e);
+	}
+	if(c->pinned + (end - start) > c->budget || c->entries >= REG_CACHE_ENTRIES){
+		if(victim != NULL){
+			ibv_dereg_mr(victim->mr);
+			free(victim);
+		}
+		pthread_mutex_unlock(&c->lock);
+		errno = ENOMEM;
+		return NULL;
+	}
+	e = victim;
+	if(e != NULL && ibv_rereg_mr(e->mr, IBV_REREG_MR_CHANGE_TRANSLATION | IBV_REREG_MR_CHANGE_ACCESS, NULL,
+		(void *)start, end - start, access)){
+		fprintf(c->file, "ibv_rereg_mr() isn't usable here, evicted registrations are dropped from now on.\n");
+		c->rereg = 0;
+		ibv_dereg_mr(e->mr);
+		e->mr = NULL;
+	}
+	if(e == NULL)
+		e = calloc(1, sizeof(*e));
+	if(e->mr == NULL)
+		e->mr = ibv_reg_mr(c->pd, (void *)start, end - start, access);
+	if(e->mr == NULL){
+		free(e);
+		pthread_mutex_unlock(&c->lock);
+		return NULL;
+	}
+	e->start = start;
+	e->end = end;
+	e->access = access;
+	e->refs = 1;
+	e->stale = 0;
+	reg_push(c, e);
+	pthread_mutex_unlock(&c->lock);
+	return e->mr;
+}
+
+/**
+ * @brief Give back a memory region returned by reg_get()
+ *
+ * @return @c NULL
+ * @param c the cache
+ * @param mr the memory region
+ */
+void reg_put(struct reg_cache *c, struct ibv_mr *mr){
+	struct reg_entry *e;
+	pthread_mutex_lock(&c->lock);
+	for(e = c->head; e != NULL && e->mr != mr; e = e->next);
+	if(e != NULL && --e->refs == 0 && e->stale)
+		reg_drop(c, e);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief Drop the registrations of a range that is about to go away
+ *
+ * Registrations still in use are dropped once they are put back, and are never handed out again.
+ * @return @c NULL
+ * @param c the cache
+ * @param addr the start of the range
+ * @param len the length of the range
+ */
+void reg_invalidate(struct reg_cache *c, void *addr, size_t len){
+	struct reg_entry *e, *next;
+	uintptr_t start = (uintptr_t)addr, end = start + len;
+	pthread_mutex_lock(&c->lock);
+	for(e = c->head; e != NULL; e = next){
+		next = e->next;
+		if(e->start >= end || e->end <= start)
+			continue;
+		if(e->refs)
+			e->stale = 1;
+		else
+			reg_drop(c, e);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * @brief free() a buffer that may have cached registrations
+ *
+ * @return @c NULL
+ * @param c the cache
+ * @param ptr the buffer, from malloc() and friends
+ */
+void reg_free(struct reg_cache *c, void *ptr){
+	if(ptr == NULL)
+		return;
+	reg_invalidate(c, ptr, malloc_usable_size(ptr));
+	free(ptr);
+}
+
+/**
+ * @brief munmap() a range that may have cached registrations
+ *
+ * @return the return value of munmap()
+ * @param c the cache
+ * @param addr the start of the range
+ * @param len the length of the range
+ */
+int reg_munmap(struct reg_cache *c, void *addr, size_t len){
+	reg_invalidate(c, addr, len);
+	return munmap(addr, len);
+}
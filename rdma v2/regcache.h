@@ -0,0 +1,66 @@
+/**
+ * @file regcache.h
+ * @brief Reusing memory registrations of transient buffers
+ *
+ * Registering a buffer pins its pages and sets up a translation on the device, which costs far
+ * more than moving a few kilobytes. The cache keeps registrations around after they are used,
+ * keyed by page range, so the next transfer from the same buffer finds its memory region ready.
+ * The pages of every cached registration stay pinned, up to a budget; the least recently used
+ * registrations that are not in use are dropped (or re-registered in place with ibv_rereg_mr())
+ * to stay under it. A freed buffer can come back from malloc() at the same address backed by
+ * different pages, so buffers have to be released with reg_free() or reg_munmap(), which drop
+ * their registrations first.
+ */
+#ifndef RDMA_CS_REGCACHE
+#define RDMA_CS_REGCACHE
+#include "rdma_cs.h"
+
+/**
+ * @brief The default amount of bytes the cache may keep pinned
+ */
+#define REG_CACHE_BUDGET	(64 * 1024 * 1024)
+/**
+ * @brief The most registrations the cache keeps
+ */
+#define REG_CACHE_ENTRIES	64
+
+/**
+ * @brief A cached registration
+ */
+struct reg_entry {
+	uintptr_t start;			/**< The first byte of the first page registered */
+	uintptr_t end;				/**< The byte after the last page registered */
+	struct ibv_mr *mr;			/**< The memory region */
+	int access;					/**< The access flags it was registered with */
+	unsigned int refs;			/**< The amount of users that got it from reg_get() and haven't put it back */
+	uint8_t stale;				/**< 1 if the buffer went away while in use, it is dropped once put back */
+	struct reg_entry *prev;		/**< The next more recently used entry */
+	struct reg_entry *next;		/**< The next less recently used entry */
+};
+
+/**
+ * @brief The registration cache of one protection domain
+ */
+struct reg_cache {
+	struct ibv_pd *pd;			/**< The protection domain registrations are made in */
+	struct reg_entry *head;		/**< The most recently used entry */
+	struct reg_entry *tail;		/**< The least recently used entry */
+	unsigned int entries;		/**< The amount of entries */
+	size_t pinned;				/**< The amount of bytes registered */
+	size_t budget;				/**< The most bytes to keep registered */
+	uint8_t rereg;				/**< 0 once ibv_rereg_mr() failed, evictions deregister from then on */
+	unsigned long hits;			/**< The amount of lookups that found a registration */
+	unsigned long misses;		/**< The amount of lookups that had to register */
+	unsigned long evictions;	/**< The amount of registrations dropped to stay under the budget */
+	pthread_mutex_t lock;		/**< Serializes the cache */
+	FILE *file;					/**< The file to print errors to */
+};
+
+void reg_cache_init(struct reg_cache *, struct ibv_pd *, size_t, FILE *);
+void reg_cache_destroy(struct reg_cache *);
+struct ibv_mr *reg_get(struct reg_cache *, void *, size_t, int);
+void reg_put(struct reg_cache *, struct ibv_mr *);
+void reg_invalidate(struct reg_cache *, void *, size_t);
+void reg_free(struct reg_cache *, void *);
+int reg_munmap(struct reg_cache *, void *, size_t);
+#endif
@@ -0,0 +1,123 @@
+/**
+ * @file region.c
+ * @brief Registration of the clients' server-side memory regions
+ *
+ * Regions are pinned by default, which means the server can never hand out more memory than it is
+ * willing to lock. With on-demand paging the device faults pages in as clients touch them instead,
+ * so a huge, mostly empty region only costs what has actually been used. Implicit on-demand paging
+ * isn't offered: its rkey covers the server's whole address space, so any client handed it could
+ * read and write everything, and memory windows can't be bound to on-demand memory regions to
+ * narrow it down.
+ */
+#include "server.h"
+#include <time.h>
+
+/**
+ * @brief The registration mode actually in use, -1 until the device has been checked
+ */
+static int reg_effective = -1;
+/**
+ * @brief Lock for the device check
+ */
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Turn a command line string into a registration mode
+ *
+ * The function will call exit(-1) if the string isn't "pinned" or "odp"
+ * @return the mode
+ * @param str the string to convert
+ */
+enum reg_mode reg_parse(const char *str){
+	if(!strcmp(str, "pinned"))
+		return REG_PINNED;
+	if(!strcmp(str, "odp"))
+		return REG_ODP;
+	if(!strcmp(str, "implicit"))
+		fprintf(stderr, "Implicit on-demand paging would give every client an rkey for the whole server, "
+			"use odp instead.\n");
+	else
+		fprintf(stderr, "Unknown registration mode '%s' (pinned or odp)\n", str);
+	exit(-1);
+}
+
+/**
+ * @brief Get the string representation of a registration mode
+ *
+ * @return the name of the mode
+ * @param mode the mode
+ */
+const char *reg_str(enum reg_mode mode){
+	switch(mode){
+		case REG_ODP:
+			return "odp";
+		default:
+			return "pinned";
+	}
+}
+
+/**
+ * @brief Check what the device can do and settle on the mode that will be used
+ *
+ * Falls back from on-demand paging to pinning.
+ * Must be called with @c reg_lock held.
+ * @return @c NULL
+ * @param verbs the device
+ */
+static void reg_check(struct ibv_context *verbs){
+	struct ibv_device_attr_ex attr;
+	uint32_t needed = IBV_ODP_SUPPORT_READ | IBV_ODP_SUPPORT_WRITE;
+	reg_effective = registration;
+	if(registration == REG_PINNED)
+		return;
+	memset(&attr, 0, sizeof(attr));
+	if(ibv_query_device_ex(verbs, NULL, &attr) ||
+		!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT) ||
+		(attr.odp_caps.per_transport_caps.rc_odp_caps & needed) != needed){
+		fprintf(log_p, "%s does not support on-demand paging, regions will be pinned.\n",
+			ibv_get_device_name(verbs->device));
+		reg_effective = REG_PINNED;
+		return;
+	}
+	fprintf(log_p, "Registering regions in %s mode.\n", reg_str(reg_effective));
+}
+
+/**
+ * @brief Register a client's server-side memory region
+ *
+ * Memory windows can't be bound to on-demand memory regions, so @c IBV_ACCESS_MW_BIND is taken out
+ * of @p access when on-demand paging is used. The memory region only covers the region, since its
+ * rkey is handed to clients.
+ * @return the memory region, or @c NULL on failure
+ * @param pd the protection domain to register with
+ * @param addr the start of the region
+ * @param length the length of the region
+ * @param access the access flags, updated to the ones actually used
+ */
+struct ibv_mr *reg_region(struct ibv_pd *pd, void *addr, size_t length, int *access){
+	struct ibv_mr *mr;
+	struct timespec start, end;
+	pthread_mutex_lock(&reg_lock);
+	if(reg_effective < 0)
+		reg_check(pd->context);
+	if(reg_effective != REG_PINNED)
+		*access = (*access & ~IBV_ACCESS_MW_BIND) | IBV_ACCESS_ON_DEMAND;
+	pthread_mutex_unlock(&reg_lock);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mr = ibv_reg_mr(pd, addr, length, *access);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if(mr != NULL)
+		fprintf(log_p, "Registered %llu bytes (%s) in %.3f ms.\n", (unsigned long long)length,
+			reg_str(reg_effective), (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	return mr;
+}
+
+/**
+ * @brief Deregister a memory region made by reg_region()
+ *
+ * @return 0 on success, -1 on failure
+ * @param mr the memory region
+ */
+int reg_release(struct ibv_mr *mr){
+	return rdma_dereg_mr(mr);
+}
@@ -0,0 +1,259 @@
+/**
+ * @file rpc.c
+ * @brief File containing the definitions of the functions listed in rpc.h
+ */
+#include "rpc.h"
+
+/**
+ * @brief Get ready to make calls on a connection
+ *
+ * Registers the buffers and posts every receive buffer.
+ * @return @c NULL
+ * @param rpc the client side to set up
+ * @param id the connection to the server
+ * @param threaded 1 if another thread will be calling rpc_recv(), 0 if rpc_wait() has to
+ * @param file the file to print errors to
+ */
+void rpc_client_init(struct rpc_client *rpc, struct rdma_cm_id *id, uint8_t threaded, FILE *file){
+	int i;
+	memset(rpc, 0, sizeof(*rpc));
+	rpc->id = id;
+	rpc->threaded = threaded;
+	rpc->file = file;
+	rpc->next_id = 1;
+	// The queue pair was just created with this, later connections can only lower the global
+	rpc->inline_data = tune.inline_data;
+	rpc->out_len = sizeof(struct rpc_batch);
+	pthread_mutex_init(&rpc->lock, NULL);
+	pthread_cond_init(&rpc->cond, NULL);
+	rpc->in = ibv_reg_mr(id->qp->pd, malloc(tune.recv_wr * RPC_MAX_MSG), tune.recv_wr * RPC_MAX_MSG,
+		IBV_ACCESS_LOCAL_WRITE);
+	rpc->out = ibv_reg_mr(id->qp->pd, malloc(RPC_MAX_MSG), RPC_MAX_MSG, 0);
+	if(rpc->in == NULL || rpc->out == NULL)
+		stop_it("ibv_reg_mr()", errno, file);
+	for(i = 0; i < tune.recv_wr; i++)
+		rpc_repost(rpc, rpc->in->addr + i * RPC_MAX_MSG);
+}
+
+/**
+ * @brief Free the buffers of the client side
+ *
+ * @return @c NULL
+ * @param rpc the client side
+ */
+void rpc_client_free(struct rpc_client *rpc){
+	void *in = rpc->in->addr, *out = rpc->out->addr;
+	ibv_dereg_mr(rpc->in);
+	ibv_dereg_mr(rpc->out);
+	free(in);
+	free(out);
+}
+
+/**
+ * @brief Hand the responses in a message to the calls waiting on them
+ *
+ * @return @c NULL
+ * @param rpc the client side
+ * @param msg the message
+ * @param len the length of the message
+ */
+static void rpc_deliver(struct rpc_client *rpc, uint8_t *msg, uint32_t len){
+	struct rpc_batch *batch = (struct rpc_batch *)msg;
+	struct rpc_header *hdr;
+	uint32_t used = sizeof(*batch), i;
+	int slot;
+	pthread_mutex_lock(&rpc->lock);
+	for(i = 0; i < batch->count && used + sizeof(*hdr) <= len; i++){
+		hdr = (struct rpc_header *)(msg + used);
+		used += RPC_RECORD_SIZE(hdr->len);
+		for(slot = 0; slot < RPC_MAX_OUTSTANDING; slot++)
+			if(rpc->calls[slot].busy && rpc->calls[slot].id == hdr->id)
+				break;
+		if(slot == RPC_MAX_OUTSTANDING || used > len)
+			continue;
+		memcpy(rpc->calls[slot].result, hdr + 1, hdr->len < rpc->calls[slot].cap ? hdr->len : rpc->calls[slot].cap);
+		rpc->calls[slot].status = hdr->status;
+		rpc->calls[slot].done = 1;
+	}
+	pthread_cond_broadcast(&rpc->cond);
+	pthread_mutex_unlock(&rpc->lock);
+}
+
+/**
+ * @brief Wait for the next message from the server
+ *
+ * Responses to calls are delivered before this returns. The buffer has to be given back with
+ * rpc_repost() once the caller is done with it, its length is left in @c rpc->len.
+ * @return the immediate data of the message, 0 if there was none or the receive failed
+ * @param rpc the client side
+ * @param msg the location to store the receive buffer the message is in
+ */
+uint32_t rpc_recv(struct rpc_client *rpc, void **msg){
+	struct ibv_wc wc;
+	uint32_t op = 0;
+	if(-1 == rdma_get_recv_comp(rpc->id, &wc))
+		stop_it("rdma_get_recv_comp()", errno, rpc->file);
+	*msg = (void *)wc.wr_id;
+	rpc->len = wc.status ? 0 : wc.byte_len;
+	if(wc.status){
+		// Wake up anyone waiting on a call, it isn't coming
+		pthread_mutex_lock(&rpc->lock);
+		rpc->failed = 1;
+		pthread_cond_broadcast(&rpc->cond);
+		pthread_mutex_unlock(&rpc->lock);
+		return 0;
+	}
+	if(wc.wc_flags & IBV_WC_WITH_IMM)
+		op = ntohl(wc.imm_data);
+	// A batch always has a header, anything shorter isn't one
+	if(op == RPC && wc.byte_len >= sizeof(struct rpc_batch))
+		rpc_deliver(rpc, *msg, wc.byte_len);
+	return op;
+}
+
+/**
+ * @brief Give a receive buffer back
+ *
+ * @return @c NULL
+ * @param rpc the client side
+ * @param msg the receive buffer returned by rpc_recv()
+ */
+void rpc_repost(struct rpc_client *rpc, void *msg){
+	if(rdma_post_recv(rpc->id, msg, msg, RPC_MAX_MSG, rpc->in))
+		stop_it("rdma_post_recv()", errno, rpc->file);
+	flow_posted(rpc->id, 1);
+}
+
+/**
+ * @brief Queue a call
+ *
+ * The call is only sent by rpc_flush() (or once the message is full), so several calls can go out
+ * in one message.
+ * @return a handle for rpc_wait(), or -1 if too many calls are outstanding or the arguments are too long
+ * @param rpc the client side
+ * @param op the operation
+ * @param args the arguments
+ * @param len the length of @p args
+ * @param result where to copy the results to
+ * @param cap the size of @p result
+ */
+int rpc_start(struct rpc_client *rpc, uint16_t op, void *args, uint16_t len, void *result, uint16_t cap){
+	struct rpc_header *hdr;
+	int slot;
+	if(len > RPC_MAX_ARGS)
+		return -1;
+	pthread_mutex_lock(&rpc->lock);
+	for(slot = 0; slot < RPC_MAX_OUTSTANDING && rpc->calls[slot].busy; slot++);
+	if(slot == RPC_MAX_OUTSTANDING){
+		pthread_mutex_unlock(&rpc->lock);
+		return -1;
+	}
+	memset(&rpc->calls[slot], 0, sizeof(rpc->calls[slot]));
+	rpc->calls[slot].busy = 1;
+	rpc->calls[slot].id = rpc->next_id++;
+	rpc->calls[slot].result = result;
+	rpc->calls[slot].cap = cap;
+	pthread_mutex_unlock(&rpc->lock);
+	if(rpc->out_len + RPC_RECORD_SIZE(len) > RPC_MAX_MSG)
+		rpc_flush(rpc);
+	hdr = rpc->out->addr + rpc->out_len;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->id = rpc->calls[slot].id;
+	hdr->op = op;
+	hdr->len = len;
+	memcpy(hdr + 1, args, len);
+	rpc->out_len += RPC_RECORD_SIZE(len);
+	rpc->out_count++;
+	return slot;
+}
+
+/**
+ * @brief Send a message of calls or responses
+ *
+ * Short messages are sent inline. Blocks until the send completes, so the buffer can be reused.
+ * @return @c NULL
+ * @param id the connection
+ * @param mr the memory region holding the message, starting at its first byte
+ * @param len the length of the message
+ * @param inline_data the most bytes the connection's queue pair was created to send inline
+ * @param file the file to print errors to
+ */
+void rpc_send(struct rdma_cm_id *id, struct ibv_mr *mr, uint32_t len, uint32_t inline_data, FILE *file){
+	struct ibv_send_wr wr;
+	struct ibv_sge sge;
+	sge.addr = (uint64_t)mr->addr;
+	sge.length = len;
+	sge.lkey = mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND_WITH_IMM;
+	wr.send_flags = len <= inline_data ? IBV_SEND_INLINE : 0;
+	wr.imm_data = htonl(RPC);
+	send_wait(id, &wr, file);
+}
+
+/**
+ * @brief Send the calls queued so far as one message
+ *
+ * @return @c NULL
+ * @param rpc the client side
+ */
+void rpc_flush(struct rpc_client *rpc){
+	struct rpc_batch *batch = rpc->out->addr;
+	if(rpc->out_count == 0)
+		return;
+	batch->count = rpc->out_count;
+	batch->reserved = 0;
+	rpc_send(rpc->id, rpc->out, rpc->out_len, rpc->inline_data, rpc->file);
+	rpc->out_len = sizeof(*batch);
+	rpc->out_count = 0;
+}
+
+/**
+ * @brief Wait for a call to complete
+ *
+ * Sends the queued calls first, in case the one being waited on is among them.
+ * @return the status of the call (@c ECONNRESET if the connection was lost)
+ * @param rpc the client side
+ * @param slot the handle returned by rpc_start()
+ */
+int rpc_wait(struct rpc_client *rpc, int slot){
+	int status;
+	void *msg;
+	rpc_flush(rpc);
+	pthread_mutex_lock(&rpc->lock);
+	while(!rpc->calls[slot].done && !rpc->failed){
+		if(rpc->threaded){
+			pthread_cond_wait(&rpc->cond, &rpc->lock);
+		} else {
+			// Nobody else is receiving, so pull messages until the response shows up
+			pthread_mutex_unlock(&rpc->lock);
+			rpc_recv(rpc, &msg);
+			rpc_repost(rpc, msg);
+			pthread_mutex_lock(&rpc->lock);
+		}
+	}
+	status = rpc->calls[slot].done ? rpc->calls[slot].status : ECONNRESET;
+	rpc->calls[slot].busy = 0;
+	pthread_mutex_unlock(&rpc->lock);
+	return status;
+}
+
+/**
+ * @brief Make a single call and wait for it
+ *
+ * @return the status of the call, or -1 if it couldn't be made
+ * @param rpc the client side
+ * @param op the operation
+ * @param args the arguments
+ * @param len the length of @p args
+ * @param result where to copy the results to (may be @p args)
+ * @param cap the size of @p result
+ */
+int rpc_call(struct rpc_client *rpc, uint16_t op, void *args, uint16_t len, void *result, uint16_t cap){
+	int slot = rpc_start(rpc, op, args, len, result, cap);
+	if(slot < 0)
+		return -1;
+	return rpc_wait(rpc, slot);
+}
@@ -0,0 +1,106 @@
+/**
+ * @file rpc.h
+ * @brief Pipelined request/response calls over the connection's sends and receives
+ *
+ * A call is a record made of a @c struct @c rpc_header followed by up to @c RPC_MAX_ARGS bytes of
+ * arguments. Records are packed into messages (a @c struct @c rpc_batch followed by the records)
+ * that are sent with @c RPC as the immediate data. Both sides put as many records into a message as
+ * are ready, and the id in each header ties a response to its request, so many calls can be
+ * outstanding on a connection and complete in any order.
+ */
+#ifndef RDMA_CS_RPC
+#define RDMA_CS_RPC
+#include "rdma_cs.h"
+
+/**
+ * @brief The max size of a message, which is also the size of each receive buffer
+ */
+#define RPC_MAX_MSG			1024
+/**
+ * @brief The max size of the arguments (and results) of a single call
+ */
+#define RPC_MAX_ARGS		128
+/**
+ * @brief The max amount of calls a client can have outstanding at once
+ */
+#define RPC_MAX_OUTSTANDING	32
+/**
+ * @brief The default amount of worker threads the server runs calls on
+ */
+#define RPC_WORKERS			4
+/**
+ * @brief The default amount of receives the server's completion queues gather before raising an event
+ */
+#define RPC_MODERATE_COUNT	4
+/**
+ * @brief The default longest a completion waits for the rest of its batch, in microseconds
+ */
+#define RPC_MODERATE_USEC	16
+/**
+ * @brief The space a record with @p len bytes of arguments takes up in a message (8 byte aligned)
+ */
+#define RPC_RECORD_SIZE(len)	(sizeof(struct rpc_header) + (((len) + 7) & ~7))
+
+/**
+ * @brief The start of every message
+ */
+struct rpc_batch {
+	uint32_t count;		/**< The amount of records in the message */
+	uint32_t reserved;	/**< Keeps the records 8 byte aligned */
+};
+
+/**
+ * @brief The start of every record
+ */
+struct rpc_header {
+	uint32_t id;		/**< The id of the call, chosen by the client and echoed by the server */
+	uint16_t op;		/**< The operation (one of @c enum @c client_opcodes) */
+	uint16_t len;		/**< The length of the arguments (or results) that follow */
+	int32_t status;		/**< 0 on success, an errno value otherwise (only set by the server) */
+	uint32_t reserved;	/**< Keeps the arguments 8 byte aligned */
+};
+
+/**
+ * @brief A call a client is waiting on
+ */
+struct rpc_call {
+	uint32_t id;		/**< The id the call was sent with */
+	uint8_t busy;		/**< 1 while the slot is in use */
+	uint8_t done;		/**< 1 once the response arrived */
+	int32_t status;		/**< The status of the response */
+	void *result;		/**< Where to copy the results to */
+	uint16_t cap;		/**< The size of @c result */
+};
+
+/**
+ * @brief The client side of the calls on a connection
+ *
+ * Also owns the connection's receive buffers, so everything the server sends goes through rpc_recv().
+ */
+struct rpc_client {
+	struct rdma_cm_id *id;						/**< The connection to the server */
+	struct ibv_mr *in;							/**< @c tune.recv_wr receive buffers of @c RPC_MAX_MSG bytes */
+	struct ibv_mr *out;							/**< The message requests are gathered in */
+	uint32_t out_len;							/**< The amount of bytes used in @c out */
+	uint32_t out_count;							/**< The amount of records in @c out */
+	uint32_t next_id;							/**< The id of the next call */
+	uint32_t inline_data;						/**< The most bytes the connection sends inline */
+	uint32_t len;								/**< The length of the message rpc_recv() returned last */
+	uint8_t threaded;							/**< 1 if another thread is calling rpc_recv() */
+	uint8_t failed;								/**< 1 once a receive failed */
+	pthread_mutex_t lock;						/**< Lock for @c calls */
+	pthread_cond_t cond;						/**< Signaled when a response arrives */
+	struct rpc_call calls[RPC_MAX_OUTSTANDING];	/**< The calls being waited on */
+	FILE *file;									/**< The file to print errors to */
+};
+
+void rpc_send(struct rdma_cm_id *, struct ibv_mr *, uint32_t, uint32_t, FILE *);
+void rpc_client_init(struct rpc_client *, struct rdma_cm_id *, uint8_t, FILE *);
+void rpc_client_free(struct rpc_client *);
+uint32_t rpc_recv(struct rpc_client *, void **);
+void rpc_repost(struct rpc_client *, void *);
+int rpc_start(struct rpc_client *, uint16_t, void *, uint16_t, void *, uint16_t);
+void rpc_flush(struct rpc_client *);
+int rpc_wait(struct rpc_client *, int);
+int rpc_call(struct rpc_client *, uint16_t, void *, uint16_t, void *, uint16_t);
+#endif
@@ -4,70 +4,39 @@
  * @brief A RDMA server
  * This server uses pthreads for each client conection, as well as a listener thread and the main thread for server administration.
  */
- #include "rdma_cs.h"
+ #include "server.h"
+ #include "rpc.h"
+ #include <sys/random.h>
 
-/**
- *@brief Determines if a client's memory region is open or closed to other clients
- */
-enum client_status{
-	OPEN,	/**< Memory region is open for other clients to use */
-	CLOSED	/**< Memory region is closed to other clients */
-};
-
-/**
- *@brief Linked list node containing information on all running threads
- */
-struct pnode {
-	pthread_t id;			/**< The thread id */
-	unsigned short type;	/**< The purpose of the thread */
-	struct pnode *next;		/**< A pointer to the next node in the list */
-} *tlist_head;
-
-/**
- *@brief Linked list node containing information on all connected clients
- */
-struct cnode {
-	struct rdma_cm_id *id;		/**< The communication manager id */
-	pthread_t tid;				/**< The thread id */
-	unsigned long cid;			/**< The numerical id */
-	uint32_t rkey;				/**< The rkey of the server-side memory region */
-	uint64_t remote_addr;		/**< The address of the server-side memory region */
-	size_t length;				/**< The length of the server-side memory region */
-	enum client_status status;	/**< The status of the server-side memory region */
-	struct cnode *next;			/**< A pointer to the next node in the list */
-} *clist_head;
-
-/**
- * @brief Semaphore for synchronizing the manipulation of the client list
- */
+struct pnode *tlist_head;
+struct cnode *clist_head;
 sem_t clist_sem;
-/**
- * @brief Semaphore for synchronizing the manipulation of the thread list
- */
 sem_t tlist_sem;
-/**
- * @brief The port number that the server will be bound to
- */
 short port;
-/**
- * @brief The current number of connected clients
- */
 unsigned long clients = 0, idnum = 0;
-/**
- * @brief The file pointer of the log file
- */
 FILE *log_p;
+char *bind_ip = NULL;
+int grace_period = SESSION_GRACE_PERIOD;
+enum place_policy placement = PLACE_LOCAL;
+enum reg_mode registration = REG_PINNED;
+size_t arena_size = ARENA_SIZE;
+size_t client_quota = CLIENT_QUOTA;
+char *region_dir = NULL;
+int rpc_threads = RPC_WORKERS;
+int moderate_count = RPC_MODERATE_COUNT, moderate_usec = RPC_MODERATE_USEC;
+char *dir_group = NULL;
+struct server_stats stats;
+time_t started;
 
-void binding_of_isaac(struct rdma_cm_id *, short);
-void *hey_listen(void *);
-void *secret_agent(void *);
-void add_thread(struct pnode);
-void add_client(struct cnode);
-void remove_thread(pthread_t);
-void remove_client(pthread_t);
-void set_status(pthread_t, enum client_status);
-void remote_remove(pthread_t);
-void remote_add(pthread_t);
+static int call_alloc(struct cnode *, void *, uint16_t *);
+static int call_free(struct cnode *, void *, uint16_t *);
+static int call_flush(struct cnode *, void *, uint16_t *);
+static int call_snapshot(struct cnode *, void *, uint16_t *);
+static int call_checksum(struct cnode *, void *, uint16_t *);
+static int call_copy(struct cnode *, void *, uint16_t *);
+static int call_fill(struct cnode *, void *, uint16_t *);
+static int call_compare(struct cnode *, void *, uint16_t *);
+static int call_ping(struct cnode *, void *, uint16_t *);
 
 int main(int argc, char **argv){
 	// Create log directory
@@ -82,22 +51,114 @@ int main(int argc, char **argv){
 	time(&rawtime);
 	timeinfo = localtime(&rawtime);
 	strcat(filename, asctime(timeinfo));
-	sprintf(filename,"%s%d-%d-%d-%d:%d.log", SERVER_LOG_PATH, timeinfo->tm_year + 1900,timeinfo->tm_mon + 1,timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min);
+	// The pid keeps several servers on one host (primary and backups) from sharing a log
+	sprintf(filename,"%s%d-%d-%d-%d:%d-%d.log", SERVER_LOG_PATH, timeinfo->tm_year + 1900,timeinfo->tm_mon + 1,timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, (int)getpid());
 	int i;
+	char *ctl_path = NULL;
+	started = rawtime;
 	log_p = fopen(filename , "w");
 	fprintf(log_p, "Server started on: %s\n", asctime(timeinfo));
-	// Get port from arguments
-	if(argc == 2)
-		port = atoi(argv[1]);
-	else
-		port = 0;
+	// Get the options from arguments
+	port = 0;
+	while((i = getopt(argc, argv, "p:a:P:m:g:O:A:q:f:w:M:C:S:o:F:")) != -1){
+		switch(i){
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'a':
+				bind_ip = optarg;
+				break;
+			case 'P':
+				placement = place_parse(optarg);
+				break;
+			case 'm':
+				tune.server_mr_size = strtoull(optarg, NULL, 0);
+				break;
+			case 'g':
+				grace_period = atoi(optarg);
+				break;
+			case 'O':
+				registration = reg_parse(optarg);
+				break;
+			case 'A':
+				arena_size = strtoull(optarg, NULL, 0);
+				break;
+			case 'q':
+				client_quota = strtoull(optarg, NULL, 0);
+				break;
+			case 'f':
+				region_dir = optarg;
+				break;
+			case 'w':
+				rpc_threads = atoi(optarg);
+				break;
+			case 'M':
+				dir_group = optarg;
+				break;
+			case 'C':
+				moderate_usec = 0;
+				if(sscanf(optarg, "%d:%d", &moderate_count, &moderate_usec) < 1)
+					moderate_count = -1;
+				break;
+			case 'S':
+				ctl_path = optarg;
+				break;
+			case 'o':
+				if(tune_set(&tune, optarg)){
+					printf("Invalid setting '%s'.\n", optarg);
+					return -1;
+				}
+				break;
+			case 'F':
+				if(tune_load(&tune, optarg, stdout))
+					return -1;
+				break;
+			default:
+				printf("Usage: %s [-p port] [-a address] [-P none|local|remote] [-m region size] "
+					"[-g session grace period] [-O pinned|odp] [-A arena size] "
+					"[-q allocation quota] [-f region directory] [-w worker threads] [-M multicast group] "
+					"[-C moderation count:usec] [-S control socket] [-o key=value] [-F tunables file] [port]\n", argv[0]);
+				return -1;
+		}
+	}
+	// The port can still be given the old way
+	if(optind < argc)
+		port = atoi(argv[optind]);
+	if(tune.server_mr_size < 64){
+		printf("Invalid region size.\n");
+		return -1;
+	}
+	if(arena_size < 64){
+		printf("Invalid arena size.\n");
+		return -1;
+	}
+	if(rpc_threads < 1){
+		printf("Invalid amount of worker threads.\n");
+		return -1;
+	}
+	if(moderate_count < 0 || moderate_count > 65535 || moderate_usec < 0 || moderate_usec > 65535){
+		printf("Invalid completion moderation.\n");
+		return -1;
+	}
+	if(region_dir != NULL && stat(region_dir, &st) == -1 && mkdir(region_dir, 0700)){
+		printf("Can't create %s: %s\n", region_dir, strerror(errno));
+		return -1;
+	}
+	fprintf(log_p, "Placement policy: %s\nRegion size: %llu bytes\nSession grace period: %d seconds\n"
+		"Registration: %s\nArena size: %llu bytes\nAllocation quota: %llu bytes\n", place_str(placement),
+		(unsigned long long)tune.server_mr_size, grace_period, reg_str(registration),
+		(unsigned long long)arena_size, (unsigned long long)client_quota);
+	fprintf(log_p, "Region files: %s\n", region_dir != NULL ? region_dir : "none (anonymous memory)");
+	fprintf(log_p, "Completion moderation: %d receives or %d us\n", moderate_count, moderate_usec);
+	fprintf(log_p, "Most any connection is granted:\n");
+	tune_print(&tune, log_p);
 	// Create event channel
 	struct rdma_event_channel *event_channel = rdma_create_event_channel();
 	if(event_channel == NULL)
 		stop_it("rdma_create_event_channel()", errno, log_p);
 	// Create the ID
 	struct rdma_cm_id *cm_id;
-	if(rdma_create_id(event_channel, &cm_id, "qwerty", RDMA_PS_TCP))
+	if(rdma_create_id(event_channel, &cm_id, NULL, RDMA_PS_TCP))
 		stop_it("rdma_create_id()", errno, log_p);
 	// Bind to the port
 	binding_of_isaac(cm_id, port);
@@ -108,13 +169,43 @@ int main(int argc, char **argv){
 	// Initialize the client and thread list access semaphores
 	sem_init(&clist_sem, 0, 1);
 	sem_init(&tlist_sem, 0, 1);
+	// Calls that touch the arenas or the client list run with the client list semaphore held, the
+	// ones working on memory regions only take it to pin them (see compute.c)
+	rpc_register(ALLOC, call_alloc, 1);
+	rpc_register(FREE, call_free, 1);
+	rpc_register(FLUSH, call_flush, 0);
+	rpc_register(SNAPSHOT, call_snapshot, 0);
+	rpc_register(CHECKSUM, call_checksum, 0);
+	rpc_register(COPY, call_copy, 0);
+	rpc_register(FILL, call_fill, 0);
+	rpc_register(COMPARE, call_compare, 0);
+	rpc_register(PING, call_ping, 0);
+	rpc_register(DIR_FETCH, dir_fetch, 1);
+	rpc_workers(rpc_threads);
 	// Spawn listener thread
 	if(pthread_create(&tlist_head->id, NULL, hey_listen, cm_id))
 		stop_it("pthread_create()", errno, log_p);
+	// Spawn the thread that cleans up expired sessions
+	pthread_t reaper;
+	if(grace_period > 0 && pthread_create(&reaper, NULL, grim_reaper, NULL))
+		stop_it("pthread_create()", errno, log_p);
+	// With a control socket there is no menu, the socket is served until it asks to stop
+	if(ctl_path != NULL){
+		int ctl = ctl_open(ctl_path);
+		fprintf(log_p, "Serving the control socket at %s.\n", ctl_path);
+		if(ctl_serve(ctl) == CTL_DRAIN)
+			admin_drain(log_p);
+		else
+			admin_shutdown(log_p);
+		close(ctl);
+		unlink(ctl_path);
+		fclose(log_p);
+		return 0;
+	}
 	int opcode;
 	int num;
+	size_t count;
 	struct cnode *client_list;
-	struct pnode *threads;
 	// Handle server side operations
 	while(1){
 		// Print the menu
@@ -130,37 +221,26 @@ int main(int argc, char **argv){
 		if(opcode==1){
 			// Disconnect all clients and shut down
 			printf("Shutting down server...\n");
-			client_list = clist_head;
-			sem_wait(&tlist_sem);
-			pthread_cancel(tlist_head->id);
-			while(client_list != NULL){
-				rdma_send_op(client_list->id, DISCONNECT, log_p);
-				get_completion(client_list->id, SEND, 1, log_p);
-				printf("Client %lu has been successfully disconnected.\n", client_list->cid);
-				sem_wait(&clist_sem);
-				pthread_cancel(client_list->tid);
-				client_list = client_list->next;
-				sem_post(&clist_sem);
-			}
+			admin_shutdown(stdout);
 			break;
 		} else if (opcode==2){
-			// Print a list of the connected clients
-			if(clients > 0){
-				sem_wait(&clist_sem);
-				client_list = clist_head;
-				for(i=0;i<clients; i++){
-					printf("---Client id: %lu\n"
-						"Client MR length: %llu bytes\n"
-						"Client MR status: %s\n",
-						client_list->cid,
-						(unsigned long long)client_list->length,
-						client_list->status == OPEN ? "open" : "closed");
-					client_list = client_list->next;
-				}
-				sem_post(&clist_sem);
-			} else {
-				printf("There are curently no connected clients :(\n");
+			// Print a list of the connected clients, from a copy so the list isn't held while printing
+			count = admin_list(&client_list);
+			for(i = 0; i < count; i++){
+				printf("---Client id: %lu%s\n"
+					"Client MR length: %llu bytes\n"
+					"Client MR status: %s\n"
+					"Client allocations: %llu of %llu bytes\n",
+					client_list[i].cid,
+					client_list[i].detached ? " (detached)" : "",
+					(unsigned long long)client_list[i].length,
+					client_list[i].status == OPEN ? "open" : "closed",
+					(unsigned long long)client_list[i].allocated,
+					(unsigned long long)client_list[i].quota);
 			}
+			if(count == 0)
+				printf("There are curently no connected clients :(\n");
+			free(client_list);
 		} else if (opcode == 0){
 			// Print a list of all open threads
 			struct pnode * threads;
@@ -172,36 +252,22 @@ int main(int argc, char **argv){
 			sem_post(&tlist_sem);
 		} else if (opcode == 3) {
 			// Disconnect a single connected client
-			sem_wait(&clist_sem);
-			client_list = clist_head;
 			printf("Enter client ID: ");
 			scanf("%d", &num);
-			while(1){
-				if (client_list == NULL){
-					printf("Client not found.\n");
-					break;
-				} else if (client_list->cid == num){
-					rdma_send_op(client_list->id, DISCONNECT, log_p);
-					get_completion(client_list->id, SEND, 1, log_p);
+			switch(admin_disconnect(num)){
+				case 0:
 					printf("Client has been successfully disconnected.\n");
 					break;
-				} else {
-					client_list=client_list->next;
-				}
+				case 1:
+					printf("The client's session has been dropped.\n");
+					break;
+				default:
+					printf("Client not found.\n");
 			}
-			sem_post(&clist_sem);
 		} else if (opcode == 4){
 			// Wait for all clients to disconnect before shutting down
 			printf("Waiting for clients to disconnect...\n");
-			sem_wait(&tlist_sem);
-			threads = tlist_head;
-			pthread_cancel(threads->id);
-			threads = threads->next;
-			sem_post(&tlist_sem);
-			while(threads != NULL){
-				pthread_join(threads->id, NULL);
-				threads = threads->next;
-			}
+			admin_drain(stdout);
 			break;
 		}
 	}
@@ -222,11 +288,131 @@ void binding_of_isaac(struct rdma_cm_id *cm_id, short port){
 	memset(&sin, 0, sizeof(struct sockaddr_in));
 	sin.sin_family = AF_INET;
 	sin.sin_port = htons(port);
+	if(bind_ip != NULL)
+		inet_aton(bind_ip, &sin.sin_addr);
 	if(rdma_bind_addr(cm_id, (struct sockaddr *)&sin))
 		stop_it("rdma_bind_addr()", errno, log_p);
 	fprintf(log_p, "RDMA device bound to port %u.\n", ntohs(rdma_get_src_port(cm_id)));
 }
 
+/**
+ * @brief Copy the client list
+ *
+ * Only the copy is looked at afterwards, so printing it doesn't hold up the agents. The pointers in
+ * the copies must not be followed.
+ * @return the amount of clients
+ * @param list where to store the copy, to be freed by the caller
+ */
+size_t admin_list(struct cnode **list){
+	struct cnode *node;
+	size_t count = 0;
+	sem_wait(&clist_sem);
+	*list = malloc((clients ? clients : 1) * sizeof(**list));
+	if(*list == NULL)
+		stop_it("malloc()", errno, log_p);
+	for(node = clist_head; node != NULL && count < clients; node = node->next)
+		(*list)[count++] = *node;
+	sem_post(&clist_sem);
+	return count;
+}
+
+/**
+ * @brief Drop a detached client's session
+ *
+ * Must be called with the client list semaphore held.
+ * @return @c NULL
+ * @param node the client, freed
+ */
+static void drop_session(struct cnode *node){
+	revoke_region(node, NULL);
+	drop_grants(node, 1);
+	arena_release(node);
+	release_region(node);
+	unlink_client(node);
+}
+
+/**
+ * @brief Disconnect a client, or drop its session if it is detached
+ *
+ * A connected client is told to disconnect and its connection is torn down, which fails the agent's
+ * receives. The agent is woken up and leaves the way it does for a lost connection, except that the
+ * session isn't kept. A detached session has no agent and is dropped right away.
+ * @return 0 if the client was disconnected, 1 if its session was dropped, -1 if there is no such client
+ * @param cid the id of the client
+ */
+int admin_disconnect(unsigned long cid){
+	struct cnode *node;
+	int ret = -1;
+	sem_wait(&clist_sem);
+	for(node = clist_head; node != NULL; node = node->next){
+		if(node->cid != cid)
+			continue;
+		if(node->detached){
+			atomic_fetch_sub(&stats.detached, 1);
+			drop_session(node);
+			ret = 1;
+		} else {
+			node->evicted = 1;
+			rdma_send_op(node->id, DISCONNECT, log_p);
+			if(rdma_disconnect(node->id))
+				fprintf(log_p, "Couldn't disconnect client %lu: %s\n", cid, strerror(errno));
+			if(node->conn != NULL)
+				rpc_wake(node->conn);
+			ret = 0;
+		}
+		break;
+	}
+	sem_post(&clist_sem);
+	if(ret >= 0)
+		fprintf(log_p, "Client %lu was %s by the administrator.\n", cid, ret ? "dropped" : "disconnected");
+	return ret;
+}
+
+/**
+ * @brief Stop listening, disconnect every client and stop their agents
+ *
+ * @return @c NULL
+ * @param file the file to report each disconnect to
+ */
+void admin_shutdown(FILE *file){
+	struct cnode *client_list = clist_head;
+	sem_wait(&tlist_sem);
+	pthread_cancel(tlist_head->id);
+	while(client_list != NULL){
+		if(client_list->id == NULL){
+			client_list = client_list->next;
+			continue;
+		}
+		rdma_send_op(client_list->id, DISCONNECT, log_p);
+		fprintf(file, "Client %lu has been successfully disconnected.\n", client_list->cid);
+		sem_wait(&clist_sem);
+		pthread_cancel(client_list->tid);
+		client_list = client_list->next;
+		sem_post(&clist_sem);
+	}
+}
+
+/**
+ * @brief Stop listening and wait for every connected client to disconnect
+ *
+ * @return @c NULL
+ * @param file the file to report to
+ */
+void admin_drain(FILE *file){
+	struct pnode *threads;
+	sem_wait(&tlist_sem);
+	threads = tlist_head;
+	pthread_cancel(threads->id);
+	threads = threads->next;
+	sem_post(&tlist_sem);
+	fprintf(file, "No longer accepting connections, waiting for %lu clients.\n",
+		atomic_load(&stats.connections));
+	while(threads != NULL){
+		pthread_join(threads->id, NULL);
+		threads = threads->next;
+	}
+}
+
 /**
  * @brief The funtion for the listener thread.
  *
@@ -239,34 +425,99 @@ void *hey_listen(void *cmid){
 	struct rdma_cm_id *cm_id = cmid;
 	struct rdma_event_channel *ec = cm_id->channel;
 	struct pnode tlist;
-	struct cnode clist;
+	struct cnode clist, *node;
+	struct rdma_cm_id *id;
+	struct session session;
+	struct tunables limits;
+	// When bound to a specific address the device is already known, so the queues
+	// created for new connections can start out on the right node
+	uint8_t pinned = 0;
+	if(cm_id->verbs != NULL){
+		place_thread(place_lookup(cm_id->verbs, placement, log_p), "listener thread", log_p);
+		pinned = 1;
+	}
 	while(1){
 		// Listen for connection requests
 		fprintf(log_p, "Listening for connection requests...\n");
 		if(rdma_listen(cm_id, 1))
 			stop_it("rdma_listen()", errno, log_p);
 		// Make an ID specific to the client that connected
-		clist.id = cm_event(ec, RDMA_CM_EVENT_CONNECT_REQUEST, log_p);
-		clist.length = SERVER_MR_SIZE;
-		clist.status = CLOSED;
-		idnum++;
-		clist.cid = idnum;
-		cm_event(ec, RDMA_CM_EVENT_ESTABLISHED, log_p);
+		id = cm_event(ec, RDMA_CM_EVENT_CONNECT_REQUEST, &session, sizeof(session), log_p);
+		// Size the queue pair as the client asked, within the server's own limits and the device's
+		tune_grant(&limits, &tune, &session);
+		// Pin before the first queue pair so its memory is already next to the device
+		if(!pinned){
+			place_thread(place_lookup(id->verbs, placement, log_p), "listener thread", log_p);
+			pinned = 1;
+		}
+		// The inline size it ends up with stays with the connection (node->limits)
+		tune_qp(id, &limits, log_p);
+		// Join the multicast group on the clients' device (only once)
+		dir_open(id);
+		// Reattach to a detached session if the client has a token for one
+		node = NULL;
+		if(session.token != 0 && grace_period > 0)
+			node = resume_client(session.token, id);
+		if(node == NULL){
+			if(session.token != 0)
+				fprintf(log_p, "No detached session with token %016llx, starting a new one.\n",
+					(unsigned long long)session.token);
+			memset(&clist, 0, sizeof(clist));
+			clist.id = id;
+			clist.length = limits.server_mr_size;
+			clist.status = CLOSED;
+			clist.quota = client_quota;
+			clist.fd = -1;
+			idnum++;
+			clist.cid = idnum;
+			while(clist.token == 0)
+				if(getrandom(&clist.token, sizeof(clist.token), 0) != sizeof(clist.token))
+					stop_it("getrandom()", errno, log_p);
+			node = add_client(clist);
+			session.resumed = 0;
+		} else {
+			fprintf(log_p, "Client %lu is resuming its session.\n", node->cid);
+			session.resumed = 1;
+		}
+		session.token = node->token;
+		session.cid = node->cid;
+		// A resumed session keeps the region it had
+		limits.server_mr_size = node->length;
+		node->limits = limits;
+		tune_ask(&session, &limits);
+		// Other agents and the workers send on the connection too, they take turns through its flow
+		struct flow *flow = malloc(sizeof(*flow));
+		if(flow == NULL)
+			stop_it("malloc()", errno, log_p);
+		flow_init(flow, id, NULL, NULL);
+		// The client reads how many receives are posted for it from here
+		if(session.credits){
+			struct ibv_mr *words = ibv_reg_mr(id->pd, calloc(1, FLOW_BYTES), FLOW_BYTES,
+			 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+			if(words == NULL)
+				stop_it("ibv_reg_mr()", errno, log_p);
+			flow->words = words->addr;
+			flow->mr = words;
+			session.credit_addr = (uint64_t)words->addr;
+			session.credit_rkey = words->rkey;
+		}
+		welcome_mat(id, &session, sizeof(session), log_p);
+		cm_event(ec, RDMA_CM_EVENT_ESTABLISHED, NULL, 0, log_p);
+		atomic_fetch_add(&stats.accepted, 1);
+		atomic_fetch_add(&stats.connections, 1);
 		// Spawn an agent thread for the new conenction
 		sem_wait(&tlist_sem);
 		tlist.type = 1;
-		if(pthread_create(&tlist.id, NULL, secret_agent, clist.id)){
+		if(pthread_create(&tlist.id, NULL, secret_agent, node)){
 			stop_it("pthread_create()", errno, log_p);
 		}
 		sem_post(&tlist_sem);
 		add_thread(tlist);
-		clist.tid = tlist.id;
-		add_client(clist);
 		// Remake the cm_id
 		if(rdma_destroy_id(cm_id))
 			stop_it("rdma_destroy_id()", errno, log_p);
 		ec = rdma_create_event_channel();
-		if(rdma_create_id(ec, &cm_id, "qwerty", RDMA_PS_TCP))
+		if(rdma_create_id(ec, &cm_id, NULL, RDMA_PS_TCP))
 			stop_it("rdma_create_id()", errno, log_p);
 		// Bind to the port
 		binding_of_isaac(cm_id, port);
@@ -278,56 +529,292 @@ void *hey_listen(void *cmid){
 /**
  * @brief The function for the agent threads.
  *
- * Handles a single client connection
+ * Handles a single client connection. When the client detaches (or the connection is lost) the
+ * memory region is kept registered so the client can resume its session within the grace period.
  * @return @c NULL
- * @param id the @c struct @c rdma_cm_id of the connection to the client cast to be a @c void @c *
+ * @param arg the @c struct @c cnode of the client cast to be a @c void @c *
  */
-void *secret_agent(void *id){
-	struct rdma_cm_id *cm_id = id;
-	struct ibv_mr *mr = ibv_reg_mr(cm_id->qp->pd, malloc(SERVER_MR_SIZE),SERVER_MR_SIZE,
-	 IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
-	if(mr == NULL)
-		stop_it("ibv_reg_mr()", errno, log_p);
+void *secret_agent(void *arg){
+	struct cnode *node = arg;
+	struct rdma_cm_id *cm_id = node->id;
 	sem_wait(&clist_sem);
-	struct cnode * node = clist_head;
-	while(node != NULL){
-		if(node->tid == pthread_self()){
-			node->rkey = mr->rkey;
-			node->remote_addr = (uint64_t)mr->addr;
-			break;
-		}
-		node = node->next;
-	}
+	node->tid = pthread_self();
 	sem_post(&clist_sem);
+	// Keep the region and the polling next to the device
+	struct placement *place = place_lookup(cm_id->verbs, placement, log_p);
+	place_thread(place, "agent thread", log_p);
+	// Control messages get their own buffer so they never touch the client's memory region
+	struct ibv_mr *ctrl = ibv_reg_mr(cm_id->qp->pd, malloc(CTRL_MSG_SIZE), CTRL_MSG_SIZE,
+	 IBV_ACCESS_LOCAL_WRITE);
+	if(ctrl == NULL)
+		stop_it("ibv_reg_mr()", errno, log_p);
+	if(node->mr == NULL){
+		void *region = region_dir != NULL ? persist_map(node) : place_alloc(place, node->length);
+		if(region == NULL)
+			stop_it(region_dir != NULL ? "persist_map()" : "place_alloc()", errno, log_p);
+		int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE |
+		 mw_access(cm_id->verbs);
+		struct ibv_mr *mr = reg_region(cm_id->qp->pd, region, node->length, &access);
+		if(mr == NULL)
+			stop_it("reg_region()", errno, log_p);
+		atomic_fetch_add(&stats.registered, node->length);
+		sem_wait(&clist_sem);
+		node->mr = mr;
+		node->place = place;
+		node->windows = (access & IBV_ACCESS_MW_BIND) != 0;
+		node->rkey = mr->rkey;
+		node->remote_addr = (uint64_t)mr->addr;
+		sem_post(&clist_sem);
+	} else {
+		fprintf(log_p, "Client %lu reattached to its memory region (rkey 0x%x).\n",
+			node->cid, (unsigned int)node->rkey);
+	}
 	// Exchange addresses and rkeys with the client
 	uint32_t rkey;
 	uint64_t remote_addr;
-	swap_info(cm_id, mr, &rkey, &remote_addr, NULL, log_p);
-	// The real good
+	size_t remote_len;
+	swap_info(cm_id, node->mr, ctrl, &rkey, &remote_addr, &remote_len, log_p);
+	// Clients doing flow control count their receives at the end of what they sent
+	struct flow *flow = cm_id->context;
+	if(flow->mr != NULL)
+		flow_peer(flow, remote_addr + remote_len - FLOW_BYTES, rkey);
+	// Tell the client about the memory regions that are already open
+	remote_sync(node);
+	// The real good, calls are taken care of by rpc_next() and the workers
+	struct rpc_conn *conn = rpc_open(node, cm_id);
+	sem_wait(&clist_sem);
+	node->conn = conn;
+	sem_post(&clist_sem);
 	uint32_t opcode;
+	uint8_t release = 1, evicted;
+	void *msg;
 	while(1){
-		rdma_recv(cm_id, mr, log_p);
-		opcode = get_completion(cm_id, RECV, 1, log_p);
+		opcode = rpc_next(conn, &msg);
+		if(opcode != 0)
+			atomic_fetch_add(&stats.messages, 1);
 		if(opcode == DISCONNECT){
 			fprintf(log_p, "Client issued a disconnect.\n");
 			rdma_send_op(cm_id, 0, log_p);
-			get_completion(cm_id, SEND, 1, log_p);
+			break;
+		} else if(opcode == DETACH){
+			fprintf(log_p, "Client %lu detached.\n", node->cid);
+			rdma_send_op(cm_id, 0, log_p);
+			release = grace_period <= 0;
+			break;
+		} else if(opcode == 0){
+			// Clients never send a 0, so this is a failed receive
+			sem_wait(&clist_sem);
+			evicted = node->evicted;
+			sem_post(&clist_sem);
+			if(evicted)
+				fprintf(log_p, "Dropping the session of client %lu, the administrator disconnected it.\n", node->cid);
+			else
+				fprintf(log_p, "Lost the connection to client %lu.\n", node->cid);
+			release = grace_period <= 0 || evicted;
 			break;
 		} else if (opcode == OPEN_MR){
+			atomic_fetch_add(&stats.opens, 1);
 			remote_add(pthread_self());
 			set_status(pthread_self(), OPEN);
 		} else if (opcode == CLOSE_MR){
-			remote_remove(pthread_self());
-			set_status(pthread_self(), CLOSED);
-		} 
+			atomic_fetch_add(&stats.closes, 1);
+			// The memory region stays open while anyone still has access, closing again retries
+			if(!remote_remove(pthread_self()))
+				set_status(pthread_self(), CLOSED);
+		} else if (opcode == GRANT || opcode == REVOKE){
+			share_region(pthread_self(), opcode, msg);
+		}
+		rpc_return(conn, msg);
 	}
-	// Disconnect and remove client from lists
+	// The workers may still be using the node
+	sem_wait(&clist_sem);
+	node->conn = NULL;
+	sem_post(&clist_sem);
+	rpc_close(conn);
 	remove_thread(pthread_self());
-	remote_remove(pthread_self());
-	remove_client(pthread_self());
-	obliterate(NULL, cm_id, mr, cm_id->channel, log_p);
+	atomic_fetch_sub(&stats.connections, 1);
+	atomic_fetch_add(&stats.disconnects, 1);
+	if(release){
+		// Disconnect and remove client from lists
+		remote_remove(pthread_self());
+		sem_wait(&clist_sem);
+		drop_grants(node, 1);
+		arena_release(node);
+		release_region(node);
+		unlink_client(node);
+		sem_post(&clist_sem);
+	} else {
+		// Park the session, other clients keep seeing the memory region as it was. What was
+		// shared with this client was bound to its queue pair, so that has to go.
+		sem_wait(&clist_sem);
+		drop_grants(node, 0);
+		arena_detach(node);
+		node->id = NULL;
+		memset(&node->tid, 0, sizeof(node->tid));
+		node->detached = time(NULL);
+		atomic_fetch_add(&stats.detached, 1);
+		sem_post(&clist_sem);
+		fprintf(log_p, "Keeping the session of client %lu for %d seconds.\n", node->cid, grace_period);
+	}
+	if(flow->stalls)
+		fprintf(log_p, "Client %lu ran out of receives %lu times, its count was read %lu times.\n",
+			node->cid, flow->stalls, flow->reads);
+	cm_id->context = NULL;
+	if(flow->mr != NULL)
+		ibv_dereg_mr(flow->mr);
+	free(flow->words);
+	pthread_mutex_destroy(&flow->lock);
+	free(flow);
+	void *buffer = ctrl->addr;
+	obliterate(NULL, cm_id, ctrl, cm_id->channel, log_p);
+	free(buffer);
 	return 0;
 }
+
+/**
+ * @brief Handle an @c ALLOC call
+ *
+ * @return 0 on success, an errno value otherwise
+ * @param node the client
+ * @param args the @c struct @c allocation
+ * @param len the length of the arguments and results
+ */
+static int call_alloc(struct cnode *node, void *args, uint16_t *len){
+	*len = sizeof(struct allocation);
+	return arena_alloc(node, node->id->qp->pd, args);
+}
+
+/**
+ * @brief Handle a @c FREE call
+ *
+ * @return 0 on success, an errno value otherwise
+ * @param node the client
+ * @param args the @c struct @c allocation
+ * @param len the length of the arguments and results
+ */
+static int call_free(struct cnode *node, void *args, uint16_t *len){
+	*len = sizeof(struct allocation);
+	return arena_free(node, args);
+}
+
+/**
+ * @brief Handle a @c FLUSH call
+ *
+ * Only touches the client's own node, which nobody else frees while it is connected.
+ * @return 0 on success, an errno value otherwise
+ * @param node the client
+ * @param args the @c struct @c flush_request
+ * @param len the length of the arguments and results
+ */
+static int call_flush(struct cnode *node, void *args, uint16_t *len){
+	*len = sizeof(struct flush_request);
+	return persist_flush(node, args);
+}
+
+/**
+ * @brief Handle a @c SNAPSHOT call
+ *
+ * @return 0 on success, an errno value otherwise
+ * @param node the client
+ * @param args the @c struct @c flush_request
+ * @param len the length of the arguments and results
+ */
+static int call_snapshot(struct cnode *node, void *args, uint16_t *len){
+	*len = sizeof(struct flush_request);
+	return persist_snapshot(node, args);
+}
+
+/**
+ * @brief Handle a @c CHECKSUM call
+ *
+ * @return 0 on success, an errno value otherwise
+ * @param node the client
+ * @param args the @c struct @c checksum_request
+ * @param len the length of the arguments and results
+ */
+static int call_checksum(struct cnode *node, void *args, uint16_t *len){
+	*len = sizeof(struct checksum_request);
+	return compute_checksum(node, args);
+}
+
+/**
+ * @brief Handle a @c COPY call
+ *
+ * @return 0 on success, an errno value otherwise
+ * @param node the client
+ * @param args the @c struct @c compute_request
+ * @param len the length of the arguments and results
+ */
+static int call_copy(struct cnode *node, void *args, uint16_t *len){
+	*len = sizeof(struct compute_request);
+	return compute_op(node, COPY, args);
+}
+
+/**
+ * @brief Handle a @c FILL call
+ *
+ * @return 0 on success, an errno value otherwise
+ * @param node the client
+ * @param args the @c struct @c compute_request
+ * @param len the length of the arguments and results
+ */
+static int call_fill(struct cnode *node, void *args, uint16_t *len){
+	*len = sizeof(struct compute_request);
+	return compute_op(node, FILL, args);
+}
+
+/**
+ * @brief Handle a @c COMPARE call
+ *
+ * @return 0 on success, an errno value otherwise
+ * @param node the client
+ * @param args the @c struct @c compute_request
+ * @param len the length of the arguments and results
+ */
+static int call_compare(struct cnode *node, void *args, uint16_t *len){
+	*len = sizeof(struct compute_request);
+	return compute_op(node, COMPARE, args);
+}
+
+/**
+ * @brief Handle a @c PING call
+ *
+ * @return 0
+ * @param node the client
+ * @param args the arguments, sent back as they are
+ * @param len the length of the arguments and results
+ */
+static int call_ping(struct cnode *node, void *args, uint16_t *len){
+	return 0;
+}
+
+/**
+ * @brief The function for the reaper thread.
+ *
+ * Once a second, drops the sessions of clients that have been detached for longer than the grace period.
+ * @return @c NULL
+ * @param arg unused
+ */
+void *grim_reaper(void *arg){
+	struct cnode *node, *next;
+	time_t now;
+	while(1){
+		sleep(1);
+		now = time(NULL);
+		sem_wait(&clist_sem);
+		for(node = clist_head; node != NULL; node = next){
+			next = node->next;
+			if(!node->detached || now - node->detached < grace_period)
+				continue;
+			fprintf(log_p, "The session of client %lu expired.\n", node->cid);
+			atomic_fetch_sub(&stats.detached, 1);
+			drop_session(node);
+		}
+		sem_post(&clist_sem);
+	}
+	return NULL;
+}
+
 /**
  * @brief Add a node to the thread list.
  *
@@ -350,10 +837,10 @@ void add_thread(struct pnode node){
 /**
  * @brief Add a node to the client list.
  *
- * @return @c NULL
+ * @return the node in the list
  * @param node the node to add to the list
  */
-void add_client(struct cnode node){
+struct cnode *add_client(struct cnode node){
 	struct cnode *current;
 	sem_wait(&clist_sem);
 	clients++;
@@ -367,16 +854,32 @@ void add_client(struct cnode node){
 		current->next = malloc(sizeof(struct cnode));
 		current = current->next;
 	}
-	memset(current, 0, sizeof(*current));
-	current->id = node.id;
-	current->tid = node.tid;
-	current->cid = node.cid;
-	current->rkey = node.rkey;
-	current->remote_addr = node.remote_addr;
-	current->status = node.status;
-	current->length = node.length;
+	*current = node;
 	current->next = NULL;
+	pthread_rwlock_init(&current->region_lock, NULL);
 	sem_post(&clist_sem);
+	return current;
+}
+/**
+ * @brief Reattach a new connection to a detached session.
+ *
+ * @return the node of the session, or @c NULL if there is no detached session with the token
+ * @param token the session token the client sent
+ * @param id the id of the new connection
+ */
+struct cnode *resume_client(uint64_t token, struct rdma_cm_id *id){
+	struct cnode *node;
+	sem_wait(&clist_sem);
+	for(node = clist_head; node != NULL; node = node->next){
+		if(node->token == token && node->detached){
+			node->id = id;
+			node->detached = 0;
+			atomic_fetch_sub(&stats.detached, 1);
+			break;
+		}
+	}
+	sem_post(&clist_sem);
+	return node;
 }
 /**
  * @brief Remove a node from the thread list.
@@ -403,39 +906,50 @@ void remove_thread(pthread_t id){
 	sem_post(&tlist_sem);
 }
 /**
- * @brief Remove a node from the client list.
+ * @brief Remove a node from the client list and free it.
  *
+ * The client list semaphore must be held by the caller.
  * @return @c NULL
- * @param id the thread id of the node to remove from the list
+ * @param node the node to remove from the list
  */
-void remove_client(pthread_t id){
+void unlink_client(struct cnode *node){
 	struct cnode *ichi;
-	struct cnode *ni;
-	sem_wait(&clist_sem);
-	ichi = clist_head;
-	if(clist_head->tid == id){
-		if(clist_head->next == NULL){
-			free(clist_head);
-			clist_head = NULL;
-		} else {
-			clist_head = clist_head->next;
-			free(ichi);
-		}
+	if(clist_head == node){
+		clist_head = node->next;
 	} else {
-		ni = ichi->next;
-		while(ni != NULL){
-			if(ni->tid == id){
-				ichi->next = ni->next;
-				free(ni);
-				break;
-			} else {
-				ichi = ni;
-				ni = ni->next;
-			}
-		}
+		for(ichi = clist_head; ichi != NULL && ichi->next != node; ichi = ichi->next);
+		if(ichi == NULL)
+			return;
+		ichi->next = node->next;
 	}
+	if(node->status == OPEN)
+		atomic_fetch_sub(&stats.regions_open, 1);
+	pthread_rwlock_destroy(&node->region_lock);
+	free(node);
 	clients--;
-	sem_post(&clist_sem);
+}
+/**
+ * @brief Deregister and free a client's server-side memory region.
+ *
+ * Waits for the operations the server is carrying out on the memory region to finish first.
+ * The client list semaphore must be held by the caller.
+ * @return @c NULL
+ * @param node the client
+ */
+void release_region(struct cnode *node){
+	if(node->mr == NULL)
+		return;
+	pthread_rwlock_wrlock(&node->region_lock);
+	void *region = node->mr->addr;
+	if(reg_release(node->mr))
+		stop_it("reg_release()", errno, log_p);
+	atomic_fetch_sub(&stats.registered, node->length);
+	if(node->fd >= 0)
+		persist_unmap(node, region);
+	else
+		place_free(node->place, region, node->length);
+	node->mr = NULL;
+	pthread_rwlock_unlock(&node->region_lock);
 }
 /**
  * @brief Change the status of a client's memory region
@@ -449,7 +963,9 @@ void set_status(pthread_t id, enum client_status status){
 	sem_wait(&clist_sem);
 	node = clist_head;
 	while(node != NULL){
-		if(node->tid == id){
+		if(node->id != NULL && node->tid == id){
+			if(node->status != status)
+				atomic_fetch_add(&stats.regions_open, status == OPEN ? 1 : -1);
 			node->status = status;
 			sem_post(&clist_sem);
 			return;
@@ -460,79 +976,120 @@ void set_status(pthread_t id, enum client_status status){
 }
 
 /**
- * @brief Inform all clients when another client's memory region closes(but only if it was previously open).
+ * @brief Take back all access to a client's memory region and inform the clients that had it.
  *
- * @return @c NULL
+ * @return 0 on success, -1 if some client kept its access
  * @param id the thread ID of the client that closed their memory region
  */
-void remote_remove(pthread_t id){
-	struct cnode *node = clist_head;
-	struct cnode *client;
+int remote_remove(pthread_t id){
+	struct cnode *node;
+	int ret = 0;
 	sem_wait(&clist_sem);
-	while(node != NULL){
-		if(node->tid == id){
-			client = node;
+	for(node = clist_head; node != NULL; node = node->next){
+		if(node->id != NULL && node->tid == id){
+			ret = revoke_region(node, NULL);
 			break;
 		}
-		node = node->next;
-	}
-	if (client->status == CLOSED){
-		sem_post(&clist_sem);
-		return;
-	}
-	node = clist_head;
-	while(node != NULL){
-		if(node->tid == id){
-			node = node->next;
-			continue;
-		} else {
-			rdma_send_op(node->id, REMOVE_CLIENT, log_p);
-			get_completion(node->id, SEND, 1, log_p);
-			rdma_send_op(node->id, client->cid, log_p);
-			get_completion(node->id, SEND, 1, log_p);
-		}
-		node = node->next;
 	}
 	sem_post(&clist_sem);
+	return ret;
 }
 /**
- * @brief Inform all clients when another client's memory region opens.
+ * @brief Share a client's whole memory region with all other clients when it opens.
  *
  * @return @c NULL
  * @param id the thread ID of the client that opened their memory region
  */
 void remote_add(pthread_t id){
-	struct cnode *node = clist_head;
-	struct cnode *client;
-	struct client client_data;
+	struct cnode *node;
+	struct cnode *client = NULL;
 	sem_wait(&clist_sem);
-	while(node != NULL){
-		if(node->tid == id){
+	for(node = clist_head; node != NULL; node = node->next){
+		if(node->id != NULL && node->tid == id){
 			client = node;
 			break;
 		}
-		node = node->next;
 	}
-	if (client->status == OPEN){
+	if (client == NULL || client->status == OPEN){
 		sem_post(&clist_sem);
 		return;
 	}
-	node = clist_head;
-	while(node != NULL){
-		if(node->tid == id){
-			node = node->next;
-			continue;
-		} else {
-			client_data.rkey = client->rkey;
-			client_data.remote_addr = client->remote_addr;
-			client_data.cid = client->cid;
-			client_data.length = client->length;
-			rdma_send_op(node->id, ADD_CLIENT, log_p);
-			get_completion(node->id, SEND, 1, log_p);
-			rdma_post_send(node->id," ", &client_data, sizeof(client_data), 0, IBV_SEND_INLINE | IBV_SEND_SIGNALED);
-			get_completion(node->id, SEND, 1, log_p);
-		}
-		node = node->next;
+	// One multicast datagram covers everyone, if there is a group
+	if(!dir_publish(client)){
+		sem_post(&clist_sem);
+		return;
+	}
+	for(node = clist_head; node != NULL; node = node->next){
+		if(node != client && node->id != NULL)
+			grant_region(client, node, 0, client->length, 1);
+	}
+	sem_post(&clist_sem);
+}
+/**
+ * @brief Share all memory regions that are already open with a newly connected client.
+ *
+ * @return @c NULL
+ * @param client the client that just connected
+ */
+void remote_sync(struct cnode *client){
+	struct cnode *node;
+	sem_wait(&clist_sem);
+	for(node = clist_head; node != NULL; node = node->next){
+		if(node != client && node->status == OPEN && dir_resend(node, client))
+			grant_region(node, client, 0, node->length, 1);
+	}
+	// Multicast updates from here on are news to the client
+	client->dir_seq = dir_current();
+	sem_post(&clist_sem);
+}
+/**
+ * @brief Handle a client sharing a slice of its memory region with one other client, or taking it back.
+ *
+ * @return @c NULL
+ * @param id the thread ID of the client doing the sharing
+ * @param op either @c GRANT or @c REVOKE
+ * @param req the details sent along with the opcode
+ */
+void share_region(pthread_t id, uint32_t op, struct grant_request *req){
+	struct cnode *node, *owner = NULL, *grantee = NULL;
+	sem_wait(&clist_sem);
+	for(node = clist_head; node != NULL; node = node->next){
+		if(node->id != NULL && node->tid == id)
+			owner = node;
+		else if(node->id != NULL && node->cid == req->cid)
+			grantee = node;
+	}
+	if(owner == NULL || grantee == NULL){
+		fprintf(log_p, "Client %llu isn't connected, nothing to share with.\n", (unsigned long long)req->cid);
+	} else if(op == REVOKE){
+		revoke_region(owner, grantee);
+	} else if(grant_region(owner, grantee, req->offset, req->length, req->writable)){
+		fprintf(log_p, "Client %lu failed to share [%llu, +%llu) with client %lu.\n", owner->cid,
+			(unsigned long long)req->offset, (unsigned long long)req->length, grantee->cid);
 	}
 	sem_post(&clist_sem);
-}
\ No newline at end of file
+}
+/**
+ * @brief Send information about an accessible memory region to a single client.
+ *
+ * The opcode and the @c struct @c client go in one message, so nothing the client receives can
+ * come between them.
+ * @return @c NULL
+ * @param id the id of the connection to the client being informed
+ * @param data the memory region
+ */
+void send_add(struct rdma_cm_id *id, struct client *data){
+	rdma_send_msg(id, ADD_CLIENT, data, sizeof(*data), log_p);
+}
+/**
+ * @brief Inform a single client that it lost access to a memory region.
+ *
+ * The message carries the owner's client id as a @c uint64_t.
+ * @return @c NULL
+ * @param id the id of the connection to the client being informed
+ * @param cid the client id of the memory region's owner
+ */
+void send_remove(struct rdma_cm_id *id, unsigned long cid){
+	uint64_t owner = cid;
+	rdma_send_msg(id, REMOVE_CLIENT, &owner, sizeof(owner), log_p);
+}
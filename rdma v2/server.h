@@ -0,0 +1,240 @@
+/**
+ * @file server.h
+ * @brief The header file containing resources shared by the server's source files
+ */
+#ifndef RDMA_CS_SERVER
+#define RDMA_CS_SERVER
+#include "rdma_cs.h"
+#include "placement.h"
+#include <stdatomic.h>
+
+/**
+ *@brief Determines if a client's memory region is open or closed to other clients
+ */
+enum client_status{
+	OPEN,	/**< Memory region is open for other clients to use */
+	CLOSED	/**< Memory region is closed to other clients */
+};
+
+/**
+ * @brief How the clients' server-side memory regions are registered
+ */
+enum reg_mode {
+	REG_PINNED,		/**< Pin every page of every region */
+	REG_ODP			/**< One on-demand paging memory region per region */
+};
+
+/**
+ *@brief Linked list node containing information on all running threads
+ */
+struct pnode {
+	pthread_t id;			/**< The thread id */
+	unsigned short type;	/**< The purpose of the thread */
+	struct pnode *next;		/**< A pointer to the next node in the list */
+};
+
+/**
+ *@brief Linked list node containing information on all connected clients
+ */
+struct cnode {
+	struct rdma_cm_id *id;		/**< The communication manager id (@c NULL while detached) */
+	pthread_t tid;				/**< The thread id (0 while detached) */
+	unsigned long cid;			/**< The numerical id */
+	uint64_t token;				/**< The token the client can resume its session with */
+	uint32_t rkey;				/**< The rkey of the server-side memory region */
+	uint64_t remote_addr;		/**< The address of the server-side memory region */
+	size_t length;				/**< The length of the server-side memory region */
+	struct ibv_mr *mr;			/**< The server-side memory region (kept while detached) */
+	struct placement *place;	/**< Where the server-side memory region was allocated */
+	uint8_t windows;			/**< 1 if memory windows can be bound to the server-side memory region */
+	size_t quota;				/**< The amount of bytes the client may allocate from the arenas */
+	size_t allocated;			/**< The amount of bytes the client currently holds in the arenas */
+	int fd;						/**< The file backing the server-side memory region, -1 if there is none */
+	uint8_t published;			/**< 1 if the open memory region was announced to the multicast group */
+	struct ibv_mw *open_mw;		/**< The type 1 memory window everyone reaches the open memory region through */
+	uint32_t open_rkey;			/**< The rkey that was announced */
+	uint64_t dir_seq;			/**< The last directory update included in what the client was sent when it connected */
+	time_t detached;			/**< When the client detached, 0 while it is connected */
+	struct rpc_conn *conn;		/**< The agent's side of the calls, @c NULL while it isn't taking any */
+	uint8_t evicted;			/**< 1 once the administrator disconnected the client, its session isn't kept */
+	struct tunables limits;		/**< What its connection was granted, including the inline size its queue pair got */
+	enum client_status status;	/**< The status of the server-side memory region */
+	pthread_rwlock_t region_lock;	/**< Read locked while the server works on the memory region, write locked to free it */
+	struct cnode *next;			/**< A pointer to the next node in the list */
+};
+
+/**
+ * @brief What the server is doing, counted as it happens so the control socket can read it without locks
+ */
+struct server_stats {
+	atomic_ulong connections;	/**< The amount of clients connected right now */
+	atomic_ulong accepted;		/**< The amount of connections accepted */
+	atomic_ulong detached;		/**< The amount of sessions kept for clients that detached */
+	atomic_ulong regions_open;	/**< The amount of memory regions open to other clients */
+	atomic_ulong registered;	/**< The amount of bytes registered for clients' memory regions */
+	atomic_ulong messages;		/**< The amount of messages from clients the agents handled */
+	atomic_ulong calls;			/**< The amount of calls answered */
+	atomic_ulong opens;			/**< The amount of @c OPEN_MR requests */
+	atomic_ulong closes;		/**< The amount of @c CLOSE_MR requests */
+	atomic_ulong disconnects;	/**< The amount of connections that ended */
+};
+
+/**
+ * @brief What the control socket asked the main thread to do once it stops serving
+ */
+enum ctl_action {
+	CTL_SHUTDOWN,	/**< Disconnect everyone and exit */
+	CTL_DRAIN		/**< Stop accepting connections and exit once every client is gone */
+};
+
+/**
+ * @brief A handler for an @c RPC call
+ *
+ * Gets the client and a buffer of @c RPC_MAX_ARGS bytes holding the (zero padded) arguments, which
+ * it overwrites with the results. The length starts as the length of the arguments and is set to
+ * the length of the results. Returns 0 on success, an errno value otherwise.
+ */
+typedef int (*rpc_handler)(struct cnode *, void *, uint16_t *);
+
+/**
+ * @brief The server side of the calls on a connection (see dispatch.c)
+ */
+struct rpc_conn;
+
+/**
+ * @brief The head of the list of running threads
+ */
+extern struct pnode *tlist_head;
+/**
+ * @brief The head of the list of connected (and detached) clients
+ */
+extern struct cnode *clist_head;
+/**
+ * @brief Semaphore for synchronizing the manipulation of the client list
+ */
+extern sem_t clist_sem;
+/**
+ * @brief Semaphore for synchronizing the manipulation of the thread list
+ */
+extern sem_t tlist_sem;
+/**
+ * @brief The port number that the server will be bound to
+ */
+extern short port;
+/**
+ * @brief The current number of connected clients
+ */
+extern unsigned long clients, idnum;
+/**
+ * @brief The file pointer of the log file
+ */
+extern FILE *log_p;
+/**
+ * @brief The address the server will be bound to (@c NULL for all addresses)
+ */
+extern char *bind_ip;
+/**
+ * @brief How many seconds a detached client's session is kept for (0 to not keep sessions)
+ */
+extern int grace_period;
+/**
+ * @brief Where client memory regions and agent threads are placed relative to the device
+ */
+extern enum place_policy placement;
+/**
+ * @brief How the clients' memory regions are registered
+ */
+extern enum reg_mode registration;
+/**
+ * @brief The size of each arena remote allocations are made from
+ */
+extern size_t arena_size;
+/**
+ * @brief The amount of bytes each new client may allocate from the arenas
+ */
+extern size_t client_quota;
+/**
+ * @brief The directory memory region files are kept in (@c NULL for anonymous memory regions)
+ */
+extern char *region_dir;
+/**
+ * @brief The amount of worker threads calls are run on
+ */
+extern int rpc_threads;
+/**
+ * @brief How many receives raise a completion event at most (0 for an event per receive)
+ */
+extern int moderate_count;
+/**
+ * @brief How long a receive waits for the rest of @c moderate_count before raising an event anyway
+ */
+extern int moderate_usec;
+/**
+ * @brief The multicast group directory updates are sent to (@c NULL to send them over each connection)
+ */
+extern char *dir_group;
+/**
+ * @brief The counters behind the control socket's metrics
+ */
+extern struct server_stats stats;
+/**
+ * @brief When the server started
+ */
+extern time_t started;
+
+void binding_of_isaac(struct rdma_cm_id *, short);
+size_t admin_list(struct cnode **);
+int admin_disconnect(unsigned long);
+void admin_shutdown(FILE *);
+void admin_drain(FILE *);
+int ctl_open(const char *);
+enum ctl_action ctl_serve(int);
+void *hey_listen(void *);
+void *secret_agent(void *);
+void *grim_reaper(void *);
+void add_thread(struct pnode);
+struct cnode *add_client(struct cnode);
+struct cnode *resume_client(uint64_t, struct rdma_cm_id *);
+void remove_thread(pthread_t);
+void unlink_client(struct cnode *);
+void release_region(struct cnode *);
+void set_status(pthread_t, enum client_status);
+int remote_remove(pthread_t);
+void remote_add(pthread_t);
+void remote_sync(struct cnode *);
+void share_region(pthread_t, uint32_t, struct grant_request *);
+void send_add(struct rdma_cm_id *, struct client *);
+void send_remove(struct rdma_cm_id *, unsigned long);
+int mw_access(struct ibv_context *);
+int grant_region(struct cnode *, struct cnode *, uint64_t, uint64_t, uint32_t);
+int revoke_region(struct cnode *, struct cnode *);
+void drop_grants(struct cnode *, uint8_t);
+int grant_covers(struct cnode *, struct cnode *, uint64_t, uint64_t, uint8_t);
+enum reg_mode reg_parse(const char *);
+const char *reg_str(enum reg_mode);
+struct ibv_mr *reg_region(struct ibv_pd *, void *, size_t, int *);
+int reg_release(struct ibv_mr *);
+int arena_alloc(struct cnode *, struct ibv_pd *, struct allocation *);
+int arena_free(struct cnode *, struct allocation *);
+void arena_release(struct cnode *);
+void arena_detach(struct cnode *);
+void *persist_map(struct cnode *);
+void persist_unmap(struct cnode *, void *);
+int persist_flush(struct cnode *, struct flush_request *);
+int persist_snapshot(struct cnode *, struct flush_request *);
+int compute_checksum(struct cnode *, struct checksum_request *);
+int compute_op(struct cnode *, uint32_t, struct compute_request *);
+void rpc_register(uint16_t, rpc_handler, uint8_t);
+void rpc_workers(int);
+struct rpc_conn *rpc_open(struct cnode *, struct rdma_cm_id *);
+uint32_t rpc_next(struct rpc_conn *, void **);
+void rpc_return(struct rpc_conn *, void *);
+void rpc_close(struct rpc_conn *);
+void rpc_wake(struct rpc_conn *);
+void dir_open(struct rdma_cm_id *);
+int dir_publish(struct cnode *);
+void dir_withdraw(struct cnode *);
+int dir_resend(struct cnode *, struct cnode *);
+uint64_t dir_current();
+int dir_fetch(struct cnode *, void *, uint16_t *);
+#endif
@@ -0,0 +1,207 @@
+/**
+ * @file submit.c
+ * @brief File containing the definitions of the functions listed in submit.h
+ */
+#include "submit.h"
+#include <sched.h>
+
+/**
+ * @brief The most completions pulled with one ibv_poll_cq()
+ */
+#define SQ_POLL_BATCH	16
+
+/**
+ * @brief Post as many pending operations as the send queue has room for, in one chain
+ *
+ * Only the last operation of the chain is signaled, its completion means the whole chain is done.
+ * @return the amount of operations posted
+ * @param sq the submission queue
+ * @param pending the operations waiting to be posted, advanced past the ones that were
+ * @param flight the tail of the operations in flight, the posted ones are moved there
+ * @param room the amount of free send queue slots
+ */
+static int sq_flush(struct submit_queue *sq, struct sq_op **pending, struct sq_op ***flight, int room){
+	struct ibv_send_wr *wr = sq->wr, *bad;
+	struct ibv_sge *sge = sq->sge;
+	struct sq_op *op, *last = NULL;
+	int n = 0;
+	for(op = *pending; op != NULL && n < room; last = op, op = op->next, n++){
+		sge[n].addr = (uint64_t)op->local;
+		sge[n].length = op->length;
+		sge[n].lkey = op->lkey;
+		memset(&wr[n], 0, sizeof(wr[n]));
+		wr[n].wr_id = (uint64_t)op;
+		wr[n].sg_list = &sge[n];
+		wr[n].num_sge = 1;
+		wr[n].opcode = op->opcode;
+		wr[n].wr.rdma.remote_addr = op->remote_addr;
+		wr[n].wr.rdma.rkey = op->rkey;
+		if(n > 0)
+			wr[n - 1].next = &wr[n];
+	}
+	if(n == 0)
+		return 0;
+	wr[n - 1].send_flags = IBV_SEND_SIGNALED;
+	if(rdma_seterrno(ibv_post_send(sq->id->qp, wr, &bad)))
+		stop_it("ibv_post_send()", errno, sq->file);
+	sq->posts++;
+	sq->ops += n;
+	**flight = *pending;
+	last->next = NULL;
+	*flight = &last->next;
+	*pending = op;
+	return n;
+}
+
+/**
+ * @brief The function for the dispatcher thread
+ *
+ * Busy polls while operations are in flight, and sleeps on @c kick otherwise.
+ * @return @c NULL
+ * @param arg the @c struct @c submit_queue
+ */
+static void *sq_dispatch(void *arg){
+	struct submit_queue *sq = arg;
+	struct sq_op *pending = NULL, **tail = &pending, *flight = NULL, **flight_tail = &flight;
+	struct sq_op *grabbed, *rev, *next, *op, *signaled;
+	struct ibv_wc wc[SQ_POLL_BATCH];
+	int inflight = 0, n, i;
+	while(!atomic_load(&sq->stop) || inflight || pending != NULL){
+		// Take everything pushed so far, the stack is newest first
+		grabbed = atomic_exchange(&sq->head, NULL);
+		for(rev = NULL; grabbed != NULL; grabbed = next){
+			next = grabbed->next;
+			grabbed->next = rev;
+			rev = grabbed;
+		}
+		if(rev != NULL){
+			*tail = rev;
+			while(*tail != NULL)
+				tail = &(*tail)->next;
+		}
+		inflight += sq_flush(sq, &pending, &flight_tail, sq->depth - inflight);
+		if(pending == NULL)
+			tail = &pending;
+		if(inflight == 0){
+			if(!atomic_load(&sq->stop) && atomic_load(&sq->head) == NULL)
+				sem_wait(&sq->kick);
+			continue;
+		}
+		n = ibv_poll_cq(sq->id->send_cq, SQ_POLL_BATCH, wc);
+		if(n < 0)
+			stop_it("ibv_poll_cq()", errno, sq->file);
+		sq->completions += n;
+		for(i = 0; i < n; i++){
+			// Completions come in order, so everything posted in front of this one is done too
+			signaled = (struct sq_op *)wc[i].wr_id;
+			do {
+				op = flight;
+				flight = op->next;
+				op->status = op == signaled ? wc[i].status : IBV_WC_SUCCESS;
+				sem_post(&op->done);
+				inflight--;
+			} while(op != signaled && flight != NULL);
+		}
+		if(flight == NULL)
+			flight_tail = &flight;
+		if(n == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+/**
+ * @brief Start the dispatcher thread of a connection
+ *
+ * @return @c NULL
+ * @param sq the submission queue to set up
+ * @param id the connection, no sends may be in flight on it
+ * @param file the file to print errors to
+ */
+void sq_start(struct submit_queue *sq, struct rdma_cm_id *id, FILE *file){
+	int err;
+	memset(sq, 0, sizeof(*sq));
+	sq->id = id;
+	sq->file = file;
+	sq->depth = tune.send_wr;
+	sq->wr = calloc(sq->depth, sizeof(*sq->wr));
+	sq->sge = calloc(sq->depth, sizeof(*sq->sge));
+	if(sq->wr == NULL || sq->sge == NULL)
+		stop_it("calloc()", errno, file);
+	atomic_init(&sq->head, NULL);
+	atomic_init(&sq->stop, 0);
+	sem_init(&sq->kick, 0, 0);
+	if((err = pthread_create(&sq->thread, NULL, sq_dispatch, sq)))
+		stop_it("pthread_create()", err, file);
+}
+
+/**
+ * @brief Stop the dispatcher thread once everything submitted has completed
+ *
+ * @return @c NULL
+ * @param sq the submission queue
+ */
+void sq_stop(struct submit_queue *sq){
+	atomic_store(&sq->stop, 1);
+	sem_post(&sq->kick);
+	pthread_join(sq->thread, NULL);
+	sem_destroy(&sq->kick);
+	free(sq->wr);
+	free(sq->sge);
+}
+
+/**
+ * @brief Submit an operation without waiting for it
+ *
+ * Safe to call from any amount of threads at once.
+ * @return @c NULL
+ * @param sq the submission queue
+ * @param op the operation, which must stay around until sq_wait() returns
+ */
+void sq_post(struct submit_queue *sq, struct sq_op *op){
+	struct sq_op *old = atomic_load(&sq->head);
+	sem_init(&op->done, 0, 0);
+	do {
+		op->next = old;
+	} while(!atomic_compare_exchange_weak(&sq->head, &old, op));
+	// Only the first push can find the dispatcher asleep
+	if(old == NULL)
+		sem_post(&sq->kick);
+}
+
+/**
+ * @brief Wait for a submitted operation to complete
+ *
+ * @return the status of the completion (@c IBV_WC_SUCCESS is 0)
+ * @param op the operation
+ */
+int sq_wait(struct sq_op *op){
+	while(sem_wait(&op->done) && errno == EINTR);
+	sem_destroy(&op->done);
+	return op->status;
+}
+
+/**
+ * @brief Submit an operation and wait for it
+ *
+ * @return the status of the completion (@c IBV_WC_SUCCESS is 0)
+ * @param sq the submission queue
+ * @param opcode @c IBV_WR_RDMA_WRITE or @c IBV_WR_RDMA_READ
+ * @param local the local buffer
+ * @param lkey the lkey of the local buffer
+ * @param length the amount of bytes to transfer
+ * @param remote_addr the remote address
+ * @param rkey the remote key
+ */
+int sq_rdma(struct submit_queue *sq, enum ibv_wr_opcode opcode, void *local, uint32_t lkey, uint32_t length,
+	uint64_t remote_addr, uint32_t rkey){
+	struct sq_op op;
+	op.opcode = opcode;
+	op.local = local;
+	op.lkey = lkey;
+	op.length = length;
+	op.remote_addr = remote_addr;
+	op.rkey = rkey;
+	sq_post(sq, &op);
+	return sq_wait(&op);
+}
@@ -0,0 +1,57 @@
+/**
+ * @file submit.h
+ * @brief Letting many threads issue rdma operations on one connection
+ *
+ * Threads push operations onto a lock-free stack, and a dispatcher thread takes everything that
+ * was pushed at once, posts it with a single ibv_post_send() (as far as the send queue has room)
+ * and hands each completion back to the thread that issued the operation. Only the last operation
+ * of every chain is signaled. While the dispatcher runs it owns the connection's send queue and
+ * completion queue, so nothing else may post sends on the connection.
+ *
+ * The benchmark's multi-threaded test (@c bench @c -t @c mt) is the only user for now. The
+ * interactive client issues one operation at a time from its main thread and posts directly.
+ */
+#ifndef RDMA_CS_SUBMIT
+#define RDMA_CS_SUBMIT
+#include "rdma_cs.h"
+#include <stdatomic.h>
+
+/**
+ * @brief A single rdma operation
+ */
+struct sq_op {
+	enum ibv_wr_opcode opcode;	/**< @c IBV_WR_RDMA_WRITE or @c IBV_WR_RDMA_READ */
+	void *local;				/**< The local buffer */
+	uint32_t lkey;				/**< The lkey of the local buffer */
+	uint32_t length;			/**< The amount of bytes to transfer */
+	uint64_t remote_addr;		/**< The remote address */
+	uint32_t rkey;				/**< The remote key */
+	enum ibv_wc_status status;	/**< The status of the completion */
+	sem_t done;					/**< Posted when the operation completed */
+	struct sq_op *next;			/**< A pointer to the next operation on the stack */
+};
+
+/**
+ * @brief The submission queue in front of a connection
+ */
+struct submit_queue {
+	struct rdma_cm_id *id;				/**< The connection */
+	_Atomic(struct sq_op *) head;		/**< The operations pushed since the dispatcher last looked */
+	sem_t kick;							/**< Posted when an operation is pushed onto an empty stack */
+	pthread_t thread;					/**< The dispatcher thread */
+	atomic_int stop;					/**< Set to make the dispatcher thread exit */
+	unsigned int depth;					/**< The most operations in flight, @c tune.send_wr when started */
+	struct ibv_send_wr *wr;				/**< @c depth work requests to chain operations in */
+	struct ibv_sge *sge;				/**< @c depth scatter/gather elements for them */
+	unsigned long posts;				/**< The amount of ibv_post_send() calls made */
+	unsigned long ops;					/**< The amount of operations posted */
+	unsigned long completions;			/**< The amount of completions polled */
+	FILE *file;							/**< The file to print errors to */
+};
+
+void sq_start(struct submit_queue *, struct rdma_cm_id *, FILE *);
+void sq_stop(struct submit_queue *);
+void sq_post(struct submit_queue *, struct sq_op *);
+int sq_wait(struct sq_op *);
+int sq_rdma(struct submit_queue *, enum ibv_wr_opcode, void *, uint32_t, uint32_t, uint64_t, uint32_t);
+#endif